@@ -1,550 +1,12281 @@
 #include <iostream>
 #include <vector>
+#include <deque>
 #include <algorithm>
+#include <numeric>
+#include <functional>
+#include <utility>
 #include <fstream>
+#include <sstream>
 #include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <ctime>
+#include <cmath>
 #include <stdint.h>
 
-// Grayscale image, each pixel is 8-bit unsigned value:
-// 0 means black, 255 means white, values between are shades of gray.
-// Binary image: pixel values equal to one of: 0, 255.
-// 4-connectivity is assumed i.e. for pixel its neighbors are up, down,
-// left and right from it.
-// Pixels outside the image i.e. with x < 0, y < 0, x >= width, y >= height
-// are assumed to have value 0 (zero)
-// Image pixels have x coordinate in range [0, width-1], x grows from left to right
-// y coordinate in range [0, height-1], y grows from top to bottom
-// Thus (0, 0) is upper left corner of the image.
-class GrayImage
-{
-public:
-  typedef uint8_t pixel_t;
-
-  // creates empty image
-  GrayImage();
-
-  // creates image of given size filled with black pixels
-  GrayImage(int height, int width);
-
-  // creates binary image from flat string of 'x's and 'o's
-  GrayImage(int height, int width, const std::string& data);
-
-  // prints image with zeros shown as 'o's, 255 as 'x's, all other as '?'
-  // useful for debugging binary image algorithms
-  void print() const;
-
-  pixel_t& operator()(int y, int x);
-  const pixel_t& operator()(int y, int x) const;
-
-  // content is lost, resulting image has all pixels black (0)
-  void resize(int height, int width);
-
-  void fill(pixel_t value);
+// SIMD kernels are compiled for x86 (SSE2, AVX2) and ARM (NEON) and chosen
+// at runtime, define GRAYIMAGE_NO_SIMD to build scalar code only
+#ifndef GRAYIMAGE_NO_SIMD
+#if defined(__x86_64__)  ||  defined(_M_X64)  ||  defined(__i386__)  ||  defined(_M_IX86)
+#define GRAYIMAGE_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+#if defined(__ARM_NEON)  ||  defined(__ARM_NEON__)
+#define GRAYIMAGE_NEON
+#include <arm_neon.h>
+#endif
+#endif
 
-  int getHeight() const;
-  int getWidth() const;
+// lets gcc and clang compile function for instruction set not enabled
+// by command line options
+#if defined(__GNUC__)  ||  defined(__clang__)
+#define GRAYIMAGE_TARGET(isa) __attribute__((target(isa)))
+#else
+#define GRAYIMAGE_TARGET(isa)
+#endif
 
-  // only binary PGM with max value 255 is supported
-  int loadFromPGM(const std::string& pathToPGMFile);
+// inlines function regardless of its size, for kernels unrolled by templates
+#if defined(__GNUC__)  ||  defined(__clang__)
+#define GRAYIMAGE_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define GRAYIMAGE_FORCE_INLINE __forceinline
+#else
+#define GRAYIMAGE_FORCE_INLINE inline
+#endif
 
-  // save as binary PGM with max value of 255
-  int saveToPGM(const std::string& pathToPGMFile);
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+// POSIX builds need -pthread
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-  friend bool operator==(const GrayImage& one, const GrayImage& two);
-  friend bool operator!=(const GrayImage& one, const GrayImage& two);
+// Monotonic clock reading in nanoseconds, for measuring intervals
+uint64_t monotonicNanoseconds()
+{
+#ifdef _WIN32
+  static LARGE_INTEGER frequency;
+  if (!frequency.QuadPart)
+    QueryPerformanceFrequency(&frequency);
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return static_cast<uint64_t>(now.QuadPart / frequency.QuadPart) * 1000000000u
+      + static_cast<uint64_t>(now.QuadPart % frequency.QuadPart) * 1000000000u / frequency.QuadPart;
+#else
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000u + now.tv_nsec;
+#endif
+}
 
-  // Rotate image clockwise 90 degrees around image's center.
-  // If original image has dimensions height * width, resulting image
-  // will have dimensions width * height.
-  // Rotating 4 times should result in image equal to original.
-  // Note: implementation shall use O(1) additional memory i.e.
-  // one can't just create temporary image, write data to it and then
-  // copy them to image.
-  void rotateCw90();
+// Read-only memory mapping of the whole file.
+// Pages are faulted in lazily by the OS on first access.
+class MappedFile
+{
+public:
+  MappedFile();
+  ~MappedFile();
 
-  // Rotate image counter clockwise 90 degrees around image's center.
-  // If original image has dimensions height * width, resulting image
-  // will have dimensions width * height.
-  // Rotating 4 times should result in image equal to original.
-  // Note: implementation shall use O(1) additional memory i.e.
-  // one can't just create temporary image, write data to it and then
-  // copy them to image.
-  void rotateCcw90();
+  int open(const std::string& path);
+  void close();
 
-  // Move each point (y,x) on source image to (y+dy, x+dx) on result image.
-  // Result image has the same size, as source one.
-  // dy and dx may be positive or negative.
-  // Points translated from outside of the image has black color (zero value).
-  // Note: implementation shall use O(1) additional memory i.e.
-  // one can't just create temporary image, write data to it and then
-  // copy them to image.
-  void translateInplace(int dy, int dx);
+  const char* data() const;
+  size_t size() const;
 
 private:
-  int height_;
-  int width_;
-  std::vector<pixel_t> data_;
+  // not copyable
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+
+  const char* data_;
+  size_t size_;
 };
 
-GrayImage::GrayImage()
-  : height_(0)
-  , width_(0)
+MappedFile::MappedFile()
+  : data_(0)
+  , size_(0)
 {
 }
 
-GrayImage::GrayImage(int height, int width)
-  : height_(height)
-  , width_(width)
-  , data_(height * width)
+MappedFile::~MappedFile()
 {
-  assert(height > 0  &&  width > 0);
+  close();
 }
 
-GrayImage::GrayImage(int height, int width, const std::string& data)
-  : height_(height)
-  , width_(width)
-  , data_(height * width)
+int MappedFile::open(const std::string& path)
 {
-  assert(height > 0  &&  width > 0  &&  data.length() == height * width);
+  close();
 
-  for (size_t i = 0; i < data.length(); ++i)
-    data_[i] = data[i] == 'o' ? 0 : 255;
-}
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE)
+    return -1;
 
-void GrayImage::print() const
-{
-  for (int y = 0; y < height_; ++y)
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
     {
-      for (int x = 0; x < width_; ++x)
-        {
-          uint8_t p = (*this)(y, x);
-          // char ch = p == 255 ? 'x' : (p == 0 ? 'o' : '?');
-          std::cout << p;
-        }
-      std::cout << std::endl;
+      CloseHandle(file);
+      return -1;
+    }
+
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(file);
+  if (mapping == NULL)
+    return -1;
+
+  // view keeps mapping alive after its handle is closed
+  void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (view == NULL)
+    return -1;
+
+  data_ = static_cast<const char*>(view);
+  size_ = static_cast<size_t>(fileSize.QuadPart);
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+      ::close(fd);
+      return -1;
     }
+
+  void* view = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (view == MAP_FAILED)
+    return -1;
+
+  data_ = static_cast<const char*>(view);
+  size_ = static_cast<size_t>(st.st_size);
+#endif
+
+  return 0;
 }
 
-GrayImage::pixel_t& GrayImage::operator()(int y, int x)
+void MappedFile::close()
 {
-  assert(y >= 0  &&  y < height_);
-  assert(x >= 0  &&  x < width_);
-  int offset = y * width_ + x;
-  return data_[offset];
+  if (!data_)
+    return;
+
+#ifdef _WIN32
+  UnmapViewOfFile(data_);
+#else
+  munmap(const_cast<char*>(data_), size_);
+#endif
+
+  data_ = 0;
+  size_ = 0;
 }
 
-const GrayImage::pixel_t& GrayImage::operator()(int y, int x) const
+const char* MappedFile::data() const
 {
-  assert(y >= 0  &&  y < height_);
-  assert(x >= 0  &&  x < width_);
-  int offset = y * width_ + x;
-  return data_[offset];
+  return data_;
 }
 
-void GrayImage::resize(int height, int width)
+size_t MappedFile::size() const
 {
-  assert (height > 0  &&  width > 0);
-  height_ = height;
-  width_ = width;
-  std::vector<pixel_t> data(height * width);
-  data_.swap(data);
+  return size_;
 }
 
-void GrayImage::fill(GrayImage::pixel_t value)
+// Mutex and condition variable over pthreads or Win32 (Vista and later)
+class Mutex
 {
-  std::fill(data_.begin(), data_.end(), value);
-}
+public:
+  Mutex()
+  {
+#ifdef _WIN32
+    InitializeCriticalSection(&mutex_);
+#else
+    pthread_mutex_init(&mutex_, NULL);
+#endif
+  }
 
-int GrayImage::getHeight() const
+  ~Mutex()
+  {
+#ifdef _WIN32
+    DeleteCriticalSection(&mutex_);
+#else
+    pthread_mutex_destroy(&mutex_);
+#endif
+  }
+
+  void lock()
+  {
+#ifdef _WIN32
+    EnterCriticalSection(&mutex_);
+#else
+    pthread_mutex_lock(&mutex_);
+#endif
+  }
+
+  void unlock()
+  {
+#ifdef _WIN32
+    LeaveCriticalSection(&mutex_);
+#else
+    pthread_mutex_unlock(&mutex_);
+#endif
+  }
+
+private:
+  friend class Condition;
+
+  // not copyable
+  Mutex(const Mutex&);
+  Mutex& operator=(const Mutex&);
+
+#ifdef _WIN32
+  CRITICAL_SECTION mutex_;
+#else
+  pthread_mutex_t mutex_;
+#endif
+};
+
+// Locks mutex for lifetime of the object
+class MutexLock
 {
-  return height_;
-}
+public:
+  explicit MutexLock(Mutex& mutex)
+    : mutex_(mutex)
+  {
+    mutex_.lock();
+  }
 
-int GrayImage::getWidth() const
+  ~MutexLock()
+  {
+    mutex_.unlock();
+  }
+
+private:
+  MutexLock(const MutexLock&);
+  MutexLock& operator=(const MutexLock&);
+
+  Mutex& mutex_;
+};
+
+class Condition
 {
-  return width_;
-}
+public:
+  Condition()
+  {
+#ifdef _WIN32
+    InitializeConditionVariable(&condition_);
+#else
+    pthread_cond_init(&condition_, NULL);
+#endif
+  }
 
-int GrayImage::loadFromPGM(const std::string& pathToPGMFile)
+  ~Condition()
+  {
+#ifndef _WIN32
+    pthread_cond_destroy(&condition_);
+#endif
+  }
+
+  // mutex must be locked by caller
+  void wait(Mutex& mutex)
+  {
+#ifdef _WIN32
+    SleepConditionVariableCS(&condition_, &mutex.mutex_, INFINITE);
+#else
+    pthread_cond_wait(&condition_, &mutex.mutex_);
+#endif
+  }
+
+  void notifyAll()
+  {
+#ifdef _WIN32
+    WakeAllConditionVariable(&condition_);
+#else
+    pthread_cond_broadcast(&condition_);
+#endif
+  }
+
+private:
+  Condition(const Condition&);
+  Condition& operator=(const Condition&);
+
+#ifdef _WIN32
+  CONDITION_VARIABLE condition_;
+#else
+  pthread_cond_t condition_;
+#endif
+};
+
+// Work item of ThreadPool::parallelFor(): range [begin, end) of indices
+class ParallelTask
 {
-  std::ifstream ifs(pathToPGMFile.c_str());
+public:
+  virtual ~ParallelTask() {}
+  virtual void run(int begin, int end) = 0;
+};
 
-  if (!ifs.is_open())
-    {
-      std::cerr << "Failed to open file for reading: " << pathToPGMFile << std::endl;
-      return -1;
-    }
+// Fixed set of worker threads running ParallelTask on chunks of index range.
+// Each thread starts with its own contiguous share of chunks and takes them
+// from the front, threads that run out of work steal chunks from the back of
+// other threads' shares, so uneven chunks are balanced without central queue.
+class ThreadPool
+{
+public:
+  // threads <= 0 means one thread per CPU, calling thread counts as one
+  explicit ThreadPool(int threads = 0);
+  ~ThreadPool();
 
-  std::string magic;
-  ifs >> magic;
+  // number of threads running tasks, including calling thread
+  int getThreadCount() const;
 
-  if (magic != "P5")
-    {
-      std::cerr << "Unrecognized magic: " + magic << std::endl;
-      return -1;
-    }
+  // Runs task on chunks of chunkSize indices covering [0, count) and returns
+  // when all of them are done. Calling thread takes part in work.
+  void parallelFor(int count, int chunkSize, ParallelTask& task);
 
-  int width;
-  ifs >> width;
+  static int cpuCount();
 
-  if (width <= 0)
-    {
-      std::cerr << "Invalid width: " << width << std::endl;
-      return -1;
-    }
+private:
+  // chunks [begin, end) owned by one thread, generation tells which
+  // parallelFor() call they belong to
+  struct WorkQueue
+  {
+    Mutex mutex;
+    int begin;
+    int end;
+    unsigned generation;
+  };
 
-  int height;
-  ifs >> height;
+  ThreadPool(const ThreadPool&);
+  ThreadPool& operator=(const ThreadPool&);
 
-  if (height <= 0)
-    {
-      std::cerr << "Invalid height: " << height << std::endl;
-      return -1;
-    }
+#ifdef _WIN32
+  static DWORD WINAPI threadMain(LPVOID arg);
+#else
+  static void* threadMain(void* arg);
+#endif
 
-  int maxValue;
-  ifs >> maxValue;
+  void workerLoop(int index);
 
-  if (maxValue != 255)
-    {
-      std::cerr << "Only max value of 255 is supported, got " << maxValue << std::endl;
-      return -1;
-    }
+  // runs chunks of own queue, then steals from others
+  void work(int index, unsigned generation, ParallelTask* task);
 
-  ifs.ignore();
+  // takes chunk from front of own queue or from back of other one
+  bool takeChunk(int queue, bool steal, unsigned generation, int& chunk);
 
-  resize(height, width);
-  ifs.read((char*)&data_[0], width * height);
+  struct WorkerStart
+  {
+    ThreadPool* pool;
+    int index;
+  };
 
-  if (!ifs)
-    {
-      std::cerr << "Error reading pixel data" << std::endl;
-      return -1;
-    }
+  std::vector<WorkQueue*> queues_;
+  std::vector<WorkerStart> starts_;
+#ifdef _WIN32
+  std::vector<HANDLE> threads_;
+#else
+  std::vector<pthread_t> threads_;
+#endif
 
-  return 0;
-}
+  Mutex mutex_;
+  Condition wakeUp_;
+  Condition done_;
+  ParallelTask* task_;
+  unsigned generation_;
+  int count_;
+  int chunkSize_;
+  int remainingChunks_;
+  int activeWorkers_;
+  bool stop_;
+};
 
-int GrayImage::saveToPGM(const std::string& pathToPGMFile)
+ThreadPool::ThreadPool(int threads)
+  : task_(0)
+  , generation_(0)
+  , count_(0)
+  , chunkSize_(1)
+  , remainingChunks_(0)
+  , activeWorkers_(0)
+  , stop_(false)
 {
-  std::ofstream ofs(pathToPGMFile.c_str());
+  if (threads <= 0)
+    threads = cpuCount();
 
-  if (!ofs.is_open())
+  for (int i = 0; i < threads; ++i)
     {
-      std::cerr << "Failed to open file for writing: " << pathToPGMFile << std::endl;
-      return -1;
+      queues_.push_back(new WorkQueue);
+      queues_.back()->begin = 0;
+      queues_.back()->end = 0;
+      queues_.back()->generation = 0;
     }
 
-  ofs << "P5" << '\n' << width_ << ' ' << height_ << '\n' << 255 << '\n';
-  ofs.write((const char*)&data_[0], width_ * height_);
-
-  if (!ofs)
+  // thread 0 is the one calling parallelFor()
+  starts_.resize(threads);
+  for (int i = 1; i < threads; ++i)
     {
-      std::cerr << "Error writing pixel data" << std::endl;
-      return -1;
+      starts_[i].pool = this;
+      starts_[i].index = i;
+#ifdef _WIN32
+      HANDLE thread = CreateThread(NULL, 0, threadMain, &starts_[i], 0, NULL);
+      if (thread != NULL)
+        threads_.push_back(thread);
+#else
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, threadMain, &starts_[i]) == 0)
+        threads_.push_back(thread);
+#endif
     }
-
-  return 0;
 }
 
-template <typename iter>
-void doTranslateInplace(int& move_offset, int& dy, int& width_,
-                        iter iter_begin, iter iter_end)
+ThreadPool::~ThreadPool()
 {
-  for (iter dest_it = iter_begin; dest_it < iter_end; ++dest_it)
-    {
-      int dest = std::distance(iter_begin, dest_it);
-      int dest_y = dest / width_;
-      int source = dest + std::abs(move_offset);
-      int source_y = source / width_;
+  {
+    MutexLock lock(mutex_);
+    stop_ = true;
+    wakeUp_.notifyAll();
+  }
 
-      if (std::abs(dest_y - source_y) > std::abs(dy) || source < 0 || source >= iter_end - iter_begin)
-        {
-          *dest_it = 0;
-          continue;
-        }
-      else
-        {
-          iter source_it = dest_it + std::abs(move_offset);
-          *dest_it = *source_it;
-        }
+  for (size_t i = 0; i < threads_.size(); ++i)
+    {
+#ifdef _WIN32
+      WaitForSingleObject(threads_[i], INFINITE);
+      CloseHandle(threads_[i]);
+#else
+      pthread_join(threads_[i], NULL);
+#endif
     }
+
+  for (size_t i = 0; i < queues_.size(); ++i)
+    delete queues_[i];
 }
 
-void GrayImage::translateInplace(int dy, int dx)
+int ThreadPool::getThreadCount() const
 {
-  int move_offset = dy*width_ + dx;
-  if (move_offset < 0)
-    doTranslateInplace(move_offset, dy, width_, data_.begin(), data_.end());
-  else if (move_offset > 0)
-    doTranslateInplace(move_offset, dy, width_, data_.rbegin(), data_.rend());
-  else
-    return;
+  return static_cast<int>(threads_.size()) + 1;
 }
 
-inline bool operator==(const GrayImage& one, const GrayImage& two)
+int ThreadPool::cpuCount()
 {
-  return one.height_ == two.height_
-      &&  one.width_ == two.width_
-      &&  one.data_ == two.data_;
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return std::max(1, static_cast<int>(info.dwNumberOfProcessors));
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? static_cast<int>(count) : 1;
+#endif
 }
 
-inline bool operator!=(const GrayImage& one, const GrayImage& two)
+#ifdef _WIN32
+DWORD WINAPI ThreadPool::threadMain(LPVOID arg)
+#else
+void* ThreadPool::threadMain(void* arg)
+#endif
 {
-  return !(one == two);
+  WorkerStart* start = static_cast<WorkerStart*>(arg);
+  start->pool->workerLoop(start->index);
+  return 0;
 }
 
-// You have to implement only function(s) you are asked to implement
+void ThreadPool::workerLoop(int index)
+{
+  unsigned seen = 0;
+  for (;;)
+    {
+      ParallelTask* task;
+      unsigned generation;
+      {
+        MutexLock lock(mutex_);
+        while (!stop_  &&  generation_ == seen)
+          wakeUp_.wait(mutex_);
+        if (stop_)
+          return;
 
-// Move each point (y,x) on source image to (y+dy, x+dx) on result image.
-// Result image has the same size, as source one.
-// dy and dx may be positive or negative.
-// Points translated from outside of the image has black color (zero value).
-GrayImage translate(const GrayImage& image, int dy, int dx)
+        seen = generation_;
+        generation = generation_;
+        task = task_;
+        ++activeWorkers_;
+      }
+
+      work(index, generation, task);
+
+      MutexLock lock(mutex_);
+      --activeWorkers_;
+      if (!remainingChunks_  &&  !activeWorkers_)
+        done_.notifyAll();
+    }
+}
+
+bool ThreadPool::takeChunk(int queue, bool steal, unsigned generation, int& chunk)
 {
-  if(dy == 0 && dx == 0)
-    return image;
+  WorkQueue& q = *queues_[queue];
+  MutexLock lock(q.mutex);
+  if (q.generation != generation  ||  q.begin == q.end)
+    return false;
 
-  int width = image.getWidth();
-  int height = image.getHeight();
-  if(std::abs(dx) >= width || std::abs(dy) >= height)
-    return GrayImage(height, width, std::string(width*height, 'o'));
+  chunk = steal ? --q.end : q.begin++;
+  return true;
+}
 
-  GrayImage result(height, width, std::string(width*height, 'o'));
-  for(int cur_height = 0; cur_height < height; ++cur_height)
+void ThreadPool::work(int index, unsigned generation, ParallelTask* task)
+{
+  int queues = static_cast<int>(queues_.size());
+  for (int i = 0; i < queues; ++i)
     {
-      int cur_y = cur_height + dy;
-      if (cur_y >= 0 && cur_y < height)
+      int queue = (index + i) % queues;
+      int chunk;
+      while (takeChunk(queue, i != 0, generation, chunk))
         {
-          for (int cur_width = 0; cur_width < width; ++cur_width)
+          int begin = chunk * chunkSize_;
+          task->run(begin, std::min(count_, begin + chunkSize_));
+
+          MutexLock lock(mutex_);
+          --remainingChunks_;
+        }
+    }
+}
+
+void ThreadPool::parallelFor(int count, int chunkSize, ParallelTask& task)
+{
+  if (count <= 0)
+    return;
+
+  chunkSize = std::max(1, chunkSize);
+  int chunks = (count + chunkSize - 1) / chunkSize;
+  if (threads_.empty()  ||  chunks == 1)
+    {
+      for (int begin = 0; begin < count; begin += chunkSize)
+        task.run(begin, std::min(count, begin + chunkSize));
+      return;
+    }
+
+  unsigned generation;
+  {
+    MutexLock lock(mutex_);
+    generation = ++generation_;
+    task_ = &task;
+    count_ = count;
+    chunkSize_ = chunkSize;
+    remainingChunks_ = chunks;
+
+    int queues = static_cast<int>(queues_.size());
+    for (int i = 0; i < queues; ++i)
+      {
+        WorkQueue& q = *queues_[i];
+        MutexLock queueLock(q.mutex);
+        q.begin = static_cast<int>(static_cast<int64_t>(chunks) * i / queues);
+        q.end = static_cast<int>(static_cast<int64_t>(chunks) * (i + 1) / queues);
+        q.generation = generation;
+      }
+    wakeUp_.notifyAll();
+  }
+
+  work(0, generation, &task);
+
+  MutexLock lock(mutex_);
+  while (remainingChunks_  ||  activeWorkers_)
+    done_.wait(mutex_);
+}
+
+// Work item of parallelForRows(): rows [yBegin, yEnd)
+class RowTask
+{
+public:
+  virtual ~RowTask() {}
+  virtual void run(int yBegin, int yEnd) = 0;
+};
+
+// Rectangle of image
+struct Tile
+{
+  int y;
+  int x;
+  int height;
+  int width;
+};
+
+// Work item of parallelForTiles()
+class TileTask
+{
+public:
+  virtual ~TileTask() {}
+  virtual void run(const Tile& tile) = 0;
+};
+
+namespace
+{
+  class RowChunks : public ParallelTask
+  {
+  public:
+    explicit RowChunks(RowTask& task)
+      : task_(task) {}
+
+    void run(int begin, int end)
+    {
+      task_.run(begin, end);
+    }
+
+  private:
+    RowTask& task_;
+  };
+
+  class TileChunks : public ParallelTask
+  {
+  public:
+    TileChunks(TileTask& task, int height, int width, int tileHeight, int tileWidth)
+      : task_(task), height_(height), width_(width), tileHeight_(tileHeight), tileWidth_(tileWidth)
+      , tilesPerRow_((width + tileWidth - 1) / tileWidth) {}
+
+    void run(int begin, int end)
+    {
+      for (int i = begin; i < end; ++i)
+        {
+          Tile tile;
+          tile.y = i / tilesPerRow_ * tileHeight_;
+          tile.x = i % tilesPerRow_ * tileWidth_;
+          tile.height = std::min(tileHeight_, height_ - tile.y);
+          tile.width = std::min(tileWidth_, width_ - tile.x);
+          task_.run(tile);
+        }
+    }
+
+  private:
+    TileTask& task_;
+    int height_;
+    int width_;
+    int tileHeight_;
+    int tileWidth_;
+    int tilesPerRow_;
+  };
+}
+
+// Runs task on bands of rows covering [0, height), rowsPerChunk <= 0 means
+// that bands are chosen so that each thread gets several of them.
+// Task writing into GrayImage must not use its mutable accessors, but
+// GrayImage::RowWriter made before the call.
+void parallelForRows(ThreadPool& pool, int height, RowTask& task, int rowsPerChunk = 0)
+{
+  if (rowsPerChunk <= 0)
+    rowsPerChunk = std::max(1, height / (pool.getThreadCount() * 8));
+
+  RowChunks chunks(task);
+  pool.parallelFor(height, rowsPerChunk, chunks);
+}
+
+// Runs task on tiles of given size covering height * width image,
+// tiles on right and bottom border may be smaller. Same as for
+// parallelForRows(), task must not write through mutable accessors.
+void parallelForTiles(ThreadPool& pool, int height, int width, int tileHeight, int tileWidth,
+                      TileTask& task)
+{
+  assert(tileHeight > 0  &&  tileWidth > 0);
+  if (height <= 0  ||  width <= 0)
+    return;
+
+  int tiles = ((height + tileHeight - 1) / tileHeight) * ((width + tileWidth - 1) / tileWidth);
+  TileChunks chunks(task, height, width, tileHeight, tileWidth);
+  pool.parallelFor(tiles, 1, chunks);
+}
+
+// Instrumentation of hot operations, compiled in only when GRAYIMAGE_INSTRUMENT
+// is defined. Each instrumented call adds its pixels, bytes read and written
+// and time to counters of calling thread, reports sum counters of all
+// threads. Total time includes instrumented operations called from inside,
+// self time excludes them.
+enum InstrumentedOperation
+{
+  OP_LOAD_PGM,
+  OP_SAVE_PGM,
+  OP_APPLY_LUT,
+  OP_THRESHOLD,
+  OP_ADAPTIVE_THRESHOLD,
+  OP_TRANSLATE,
+  OP_TRANSLATE_SUBPIXEL,
+  OP_WARP_AFFINE,
+  OP_FILL_HOLES,
+  OP_BACKGROUND,
+  OP_MORPHOLOGY,
+  OP_LABEL_COMPONENTS,
+  OP_HISTOGRAM,
+  OP_COUNT
+};
+
+const char* operationName(InstrumentedOperation operation)
+{
+  static const char* const names[OP_COUNT] = {
+    "loadFromPGM", "saveToPGM", "applyLut", "threshold", "adaptiveThreshold", "translate",
+    "translateSubpixel", "warpAffine", "binaryFillHoles", "binaryBackground", "morphology",
+    "labelComponents", "histogram"
+  };
+  return names[operation];
+}
+
+struct OperationStats
+{
+  uint64_t calls;
+  uint64_t pixels;
+  uint64_t bytes;
+  uint64_t nanoseconds;
+  uint64_t selfNanoseconds;
+};
+
+#ifdef GRAYIMAGE_INSTRUMENT
+#ifdef _MSC_VER
+#define GRAYIMAGE_THREAD_LOCAL __declspec(thread)
+#else
+#define GRAYIMAGE_THREAD_LOCAL __thread
+#endif
+
+class ScopedTimer;
+
+namespace
+{
+  // counters of one thread, their mutex is contended only by readers
+  struct ThreadCounters
+  {
+    Mutex mutex;
+    OperationStats stats[OP_COUNT];
+  };
+
+  // Counters of all threads that ran instrumented operations, they are kept
+  // after thread exits so that its counts are not lost
+  class CounterRegistry
+  {
+  public:
+    CounterRegistry() {}
+
+    ~CounterRegistry()
+    {
+      for (size_t i = 0; i < counters_.size(); ++i)
+        delete counters_[i];
+    }
+
+    ThreadCounters* add()
+    {
+      ThreadCounters* counters = new ThreadCounters;
+      std::memset(counters->stats, 0, sizeof(counters->stats));
+      MutexLock lock(mutex_);
+      counters_.push_back(counters);
+      return counters;
+    }
+
+    void sum(OperationStats stats[OP_COUNT])
+    {
+      std::memset(stats, 0, sizeof(OperationStats) * OP_COUNT);
+      MutexLock lock(mutex_);
+      for (size_t i = 0; i < counters_.size(); ++i)
+        {
+          MutexLock threadLock(counters_[i]->mutex);
+          for (int op = 0; op < OP_COUNT; ++op)
             {
-              int cur_x = cur_width + dx;
-              if(cur_x >= 0 && cur_x < width)
-                result(cur_y, cur_x) = image(cur_height, cur_width);
+              const OperationStats& s = counters_[i]->stats[op];
+              stats[op].calls += s.calls;
+              stats[op].pixels += s.pixels;
+              stats[op].bytes += s.bytes;
+              stats[op].nanoseconds += s.nanoseconds;
+              stats[op].selfNanoseconds += s.selfNanoseconds;
             }
         }
     }
-  return result;
+
+    void reset()
+    {
+      MutexLock lock(mutex_);
+      for (size_t i = 0; i < counters_.size(); ++i)
+        {
+          MutexLock threadLock(counters_[i]->mutex);
+          std::memset(counters_[i]->stats, 0, sizeof(counters_[i]->stats));
+        }
+    }
+
+  private:
+    CounterRegistry(const CounterRegistry&);
+    CounterRegistry& operator=(const CounterRegistry&);
+
+    Mutex mutex_;
+    std::vector<ThreadCounters*> counters_;
+  };
+
+  CounterRegistry counterRegistry;
+  GRAYIMAGE_THREAD_LOCAL ThreadCounters* threadCounters = 0;
+  // innermost running timer of thread
+  GRAYIMAGE_THREAD_LOCAL ScopedTimer* currentTimer = 0;
+}
+
+// Records operation running for lifetime of the object, created by
+// GRAYIMAGE_TIMED(). Operation called from inside itself is counted once.
+class ScopedTimer
+{
+public:
+  ScopedTimer(InstrumentedOperation operation, int height, int width, double bytesPerPixel)
+    : operation_(operation), parent_(currentTimer)
+    , nested_(parent_  &&  parent_->operation_ == operation), childNs_(0)
+  {
+    setSize(height, width, bytesPerPixel);
+    currentTimer = this;
+    start_ = monotonicNanoseconds();
+  }
+
+  ~ScopedTimer()
+  {
+    uint64_t elapsed = monotonicNanoseconds() - start_;
+    currentTimer = parent_;
+    if (nested_)
+      return;
+    if (parent_)
+      parent_->childNs_ += elapsed;
+
+    if (!threadCounters)
+      threadCounters = counterRegistry.add();
+    MutexLock lock(threadCounters->mutex);
+    OperationStats& stats = threadCounters->stats[operation_];
+    ++stats.calls;
+    stats.pixels += pixels_;
+    stats.bytes += bytes_;
+    stats.nanoseconds += elapsed;
+    stats.selfNanoseconds += elapsed - std::min(childNs_, elapsed);
+  }
+
+  // for operations, which learn image size while running
+  void setSize(int height, int width, double bytesPerPixel)
+  {
+    pixels_ = static_cast<uint64_t>(std::max(height, 0)) * std::max(width, 0);
+    bytes_ = static_cast<uint64_t>(pixels_ * bytesPerPixel);
+  }
+
+private:
+  ScopedTimer(const ScopedTimer&);
+  ScopedTimer& operator=(const ScopedTimer&);
+
+  InstrumentedOperation operation_;
+  ScopedTimer* parent_;
+  bool nested_;
+  uint64_t childNs_;
+  uint64_t pixels_;
+  uint64_t bytes_;
+  uint64_t start_;
+};
+
+// Times rest of enclosing block as operation on height * width image, which
+// reads and writes given number of bytes per pixel
+#define GRAYIMAGE_TIMED(operation, height, width, bytesPerPixel) \
+  ScopedTimer scopedTimer((operation), (height), (width), (bytesPerPixel))
+#define GRAYIMAGE_TIMED_SIZE(height, width, bytesPerPixel) \
+  scopedTimer.setSize((height), (width), (bytesPerPixel))
+#else
+#define GRAYIMAGE_TIMED(operation, height, width, bytesPerPixel) ((void)0)
+#define GRAYIMAGE_TIMED_SIZE(height, width, bytesPerPixel) ((void)0)
+#endif
+
+bool instrumentationEnabled()
+{
+#ifdef GRAYIMAGE_INSTRUMENT
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Sums counters of all threads, they are zero without GRAYIMAGE_INSTRUMENT
+void getInstrumentation(OperationStats stats[OP_COUNT])
+{
+#ifdef GRAYIMAGE_INSTRUMENT
+  counterRegistry.sum(stats);
+#else
+  std::memset(stats, 0, sizeof(OperationStats) * OP_COUNT);
+#endif
+}
+
+void resetInstrumentation()
+{
+#ifdef GRAYIMAGE_INSTRUMENT
+  counterRegistry.reset();
+#endif
+}
+
+// Table of operations that were called, with total and self time
+void writeInstrumentationText(std::ostream& os)
+{
+  OperationStats stats[OP_COUNT];
+  getInstrumentation(stats);
+  os << "operation                 calls        pixels    total ms     self ms  ns/pixel      GB/s"
+     << std::endl;
+  for (int op = 0; op < OP_COUNT; ++op)
+    {
+      const OperationStats& s = stats[op];
+      if (!s.calls)
+        continue;
+
+      std::string name = operationName(static_cast<InstrumentedOperation>(op));
+      std::ostringstream line;
+      line << name << std::string(std::max<size_t>(1, 20 - name.size()), ' ');
+      line.width(11);
+      line << s.calls;
+      line.width(14);
+      line << s.pixels;
+      line << std::fixed;
+      line.precision(3);
+      line.width(12);
+      line << s.nanoseconds / 1000000.0;
+      line.width(12);
+      line << s.selfNanoseconds / 1000000.0;
+      line.width(10);
+      line << (s.pixels ? static_cast<double>(s.nanoseconds) / s.pixels : 0.0);
+      line.width(10);
+      line << (s.nanoseconds ? static_cast<double>(s.bytes) / s.nanoseconds : 0.0);
+      os << line.str() << std::endl;
+    }
+}
+
+// Same counters as JSON object with array of called operations
+void writeInstrumentationJson(std::ostream& os)
+{
+  OperationStats stats[OP_COUNT];
+  getInstrumentation(stats);
+  os << "{\n  \"operations\": [";
+  bool first = true;
+  for (int op = 0; op < OP_COUNT; ++op)
+    {
+      const OperationStats& s = stats[op];
+      if (!s.calls)
+        continue;
+
+      os << (first ? "" : ",") << "\n    {\"name\": \""
+         << operationName(static_cast<InstrumentedOperation>(op)) << "\", \"calls\": " << s.calls
+         << ", \"pixels\": " << s.pixels << ", \"bytes\": " << s.bytes
+         << ", \"ns\": " << s.nanoseconds << ", \"self_ns\": " << s.selfNanoseconds << "}";
+      first = false;
+    }
+  os << "\n  ]\n}\n";
+}
+
+// Header of PGM file: "P5 <width> <height> <maxValue>" followed by single
+// whitespace and raw pixel data, one byte per pixel for maxValue < 256 and
+// two big-endian bytes otherwise. "P2" files have decimal pixel values
+// separated by whitespace instead. Comments from '#' to end of line may
+// appear between fields of header.
+struct PGMHeader
+{
+  int width;
+  int height;
+  int maxValue;
+  bool ascii;
+  size_t dataOffset;
+
+  // bytes per pixel of binary data
+  int getSampleSize() const
+  {
+    return maxValue > 255 ? 2 : 1;
+  }
+
+  // bytes of binary pixel data
+  size_t getDataSize() const
+  {
+    return static_cast<size_t>(width) * height * getSampleSize();
+  }
+
+  // binary data that are GrayImage pixels as they are
+  bool isPlain() const
+  {
+    return !ascii  &&  maxValue == 255;
+  }
+};
+
+namespace
+{
+  bool isPGMSpace(char ch)
+  {
+    return ch == ' '  ||  ch == '\t'  ||  ch == '\n'  ||  ch == '\r'
+        ||  ch == '\v'  ||  ch == '\f';
+  }
+
+  // parses optionally signed decimal number after leading whitespace and
+  // comments, returns false if there are no digits
+  bool parsePGMNumber(const char* buf, size_t size, size_t& pos, int& value)
+  {
+    for (;;)
+      {
+        while (pos < size  &&  isPGMSpace(buf[pos]))
+          ++pos;
+        if (pos == size  ||  buf[pos] != '#')
+          break;
+        while (pos < size  &&  buf[pos] != '\n'  &&  buf[pos] != '\r')
+          ++pos;
+      }
+
+    bool negative = pos < size  &&  buf[pos] == '-';
+    if (negative)
+      ++pos;
+
+    size_t start = pos;
+    int64_t result = 0;
+    while (pos < size  &&  buf[pos] >= '0'  &&  buf[pos] <= '9')
+      {
+        if (result <= INT_MAX)
+          result = result * 10 + (buf[pos] - '0');
+        ++pos;
+      }
+
+    if (pos == start)
+      return false;
+
+    if (result > INT_MAX)
+      result = INT_MAX;
+    value = static_cast<int>(negative ? -result : result);
+    return true;
+  }
+}
+
+// Parses header from first size bytes of file of fileSize bytes, prints
+// error and returns -1 if header is invalid or pixel data are truncated.
+int parsePGMHeader(const char* buf, size_t size, size_t fileSize, PGMHeader& header)
+{
+  if (size < 2  ||  buf[0] != 'P'  ||  (buf[1] != '5'  &&  buf[1] != '2'))
+    {
+      std::cerr << "Unrecognized magic: " << std::string(buf, std::min<size_t>(size, 2)) << std::endl;
+      return -1;
+    }
+
+  size_t pos = 2;
+  header.width = 0;
+  header.height = 0;
+  header.maxValue = 0;
+  header.ascii = buf[1] == '2';
+
+  if (!parsePGMNumber(buf, size, pos, header.width)  ||  header.width <= 0)
+    {
+      std::cerr << "Invalid width: " << header.width << std::endl;
+      return -1;
+    }
+
+  if (!parsePGMNumber(buf, size, pos, header.height)  ||  header.height <= 0)
+    {
+      std::cerr << "Invalid height: " << header.height << std::endl;
+      return -1;
+    }
+
+  if (!parsePGMNumber(buf, size, pos, header.maxValue)
+      ||  header.maxValue <= 0  ||  header.maxValue > 65535)
+    {
+      std::cerr << "Invalid max value: " << header.maxValue << std::endl;
+      return -1;
+    }
+
+  // text pixel data are checked while they are parsed
+  size_t dataSize = header.ascii ? 0 : header.getDataSize();
+
+  // single whitespace separates header from pixel data, but files written
+  // in text mode on Windows have "\r\n" there
+  if (pos + 2 + dataSize == fileSize  &&  pos + 1 < size
+      &&  buf[pos] == '\r'  &&  buf[pos + 1] == '\n')
+    ++pos;
+  ++pos;
+
+  if (pos > fileSize  ||  fileSize - pos < dataSize)
+    {
+      std::cerr << "Error reading pixel data" << std::endl;
+      return -1;
+    }
+
+  header.dataOffset = pos;
+  return 0;
 }
 
-bool isBinary(const GrayImage& image)
-{
-  int height = image.getHeight();
-  int width = image.getWidth();
-  //! is empty image binary? - I think not
-  if(!height || !width)
-    return false;
+// Converts count pixels of data described by header, which are size bytes
+// at dataOffset, to 8-bit pixels, values 0..maxValue are scaled to 0..255.
+// Prints error and returns -1 if text data are invalid or too short.
+int decodePGMPixels(const char* data, size_t size, const PGMHeader& header, size_t count,
+                    uint8_t* pixels);
+
+class GrayImageView;
+
+// Image of given pixel type with size known at runtime. The generic template
+// (16-bit, float pixels) only stores pixels, 8-bit image below is the
+// specialization that all other operations work on.
+template <typename Pixel>
+class Image;
+typedef Image<uint8_t> GrayImage;
+
+// Grayscale image, each pixel is 8-bit unsigned value:
+// 0 means black, 255 means white, values between are shades of gray.
+// Binary image: pixel values equal to one of: 0, 255.
+// 4-connectivity is assumed i.e. for pixel its neighbors are up, down,
+// left and right from it.
+// Pixels outside the image i.e. with x < 0, y < 0, x >= width, y >= height
+// are assumed to have value 0 (zero)
+// Image pixels have x coordinate in range [0, width-1], x grows from left to right
+// y coordinate in range [0, height-1], y grows from top to bottom
+// Thus (0, 0) is upper left corner of the image.
+template <>
+class Image<uint8_t>
+{
+public:
+  typedef uint8_t pixel_t;
+
+  // creates empty image
+  Image();
+
+  // creates image of given size filled with black pixels
+  Image(int height, int width);
+
+  // creates binary image from flat string of 'x's and 'o's
+  Image(int height, int width, const std::string& data);
+
+  // creates image with copy of pixels seen through view
+  explicit Image(const GrayImageView& view);
+
+#if __cplusplus >= 201103L
+  Image(const GrayImage& other) = default;
+  GrayImage& operator=(const GrayImage& other) = default;
+
+  // moved from image becomes empty
+  Image(GrayImage&& other) noexcept;
+  GrayImage& operator=(GrayImage&& other) noexcept;
+#endif
+
+  // exchanges content with other image without copying pixels,
+  // use it to hand image over in C++03
+  void swap(GrayImage& other);
+
+  // prints pixels as raw bytes, row per line
+  void print() const;
+
+  // prints image with zeros shown as 'o's, 255 as 'x's, all other as '?'
+  // useful for debugging binary image algorithms
+  void printBinary() const;
+
+  // mutable access forgets that image is known to be binary, references
+  // obtained from it must not be used for writing after isBinary() call.
+  // Mutable access updates such state of the image, so it must not be
+  // called from several threads at once, even for different pixels: tasks
+  // run by ThreadPool write through RowWriter.
+  pixel_t& operator()(int y, int x);
+  const pixel_t& operator()(int y, int x) const;
+
+  // Unchecked access for hot loops. Rows are contiguous, row(y + 1) is
+  // row(y) + getWidth(), data() is row(0) or null for empty image.
+  // Mutable pointers forget that image is binary and its hash as operator()
+  // does, writes through them after isBinary() or hash() must be followed
+  // by markDirty() for what was written.
+  // When changes are tracked, pointer from row(y) must be used for row y
+  // only, use data() to write whole image.
+  pixel_t* row(int y);
+  const pixel_t* row(int y) const;
+  pixel_t* data();
+  const pixel_t* data() const;
+
+  // Write access to pixels for tasks run by ThreadPool. It is made on
+  // calling thread before tasks start and updates state of image as data()
+  // does, its accessors only compute addresses, so tasks may use them at
+  // once. Same as for data(), writes after isBinary() or hash() must be
+  // followed by markDirty().
+  class RowWriter
+  {
+  public:
+    explicit RowWriter(GrayImage& image);
+
+    pixel_t* row(int y) const;
+    pixel_t& operator()(int y, int x) const;
+
+  private:
+    pixel_t* data_;
+    int height_;
+    int width_;
+  };
+
+  // iterators over pixels of row y
+  typedef pixel_t* iterator;
+  typedef const pixel_t* const_iterator;
+  iterator rowBegin(int y);
+  iterator rowEnd(int y);
+  const_iterator rowBegin(int y) const;
+  const_iterator rowEnd(int y) const;
+
+  // content is lost, resulting image has all pixels black (0)
+  void resize(int height, int width);
+
+  // Changes size, but keeps pixel buffer if it is large enough, content is
+  // unspecified afterwards. Unlike resize() doesn't allocate in loops over
+  // same-sized images. Zero height and width make image empty.
+  void reshape(int height, int width);
+
+  void fill(pixel_t value);
+
+  int getHeight() const;
+  int getWidth() const;
+
+  // Change tracking, off by default. Image is divided into square tiles of
+  // tileSize pixels (power of two) and dirty tiles mark what was written:
+  // row(y) marks all tiles of row y, data(), RowWriter and operations
+  // changing whole image mark every tile. operator() stays cheap for hot
+  // loops and marks nothing, writers through it call markDirty() for the
+  // region they have written. Tracking starts with all tiles dirty, zero
+  // tileSize turns it off.
+  // Tiles are marked when pointer is fetched, not when it is written
+  // through: after clearDirty(), e.g. by updateThreshold(), writes through
+  // pointer fetched earlier are not seen. Fetch pointers again after each
+  // update or call markDirty() for what was written.
+  void trackChanges(int tileSize);
+  int getDirtyTileSize() const;
+  bool isDirty() const;
+
+  // dirty tiles clipped to image, row by row
+  void getDirtyTiles(std::vector<Tile>& tiles) const;
+
+  // Tells image that region (or whole image) was written through pointer
+  // or reference fetched earlier: marks tiles covering region as dirty, if
+  // changes are tracked, and forgets that image is binary and its hash.
+  // Region is clipped to image.
+  void markDirty(const Tile& region);
+  void markDirty();
+  void clearDirty();
+
+  // binary (P5, 8 or 16 bits) and text (P2) PGM is supported, values are
+  // scaled to 0..255 if max value isn't 255.
+  // File is memory-mapped and its pixel data are copied once into image,
+  // use MappedGrayImage to access pixels without copying
+  int loadFromPGM(const std::string& pathToPGMFile);
+
+  // save as binary PGM with max value of 255
+  int saveToPGM(const std::string& pathToPGMFile);
+
+  // Images with different cached hashes are unequal without comparing
+  // pixels, hash() is cached only when called.
+  friend bool operator==(const GrayImage& one, const GrayImage& two);
+  friend bool operator!=(const GrayImage& one, const GrayImage& two);
+
+  // Same as operator==, but hashes are computed if not cached, so it pays
+  // off when image is compared many times.
+  friend bool hashEquals(const GrayImage& one, const GrayImage& two);
+
+  // 64-bit hash of size and pixels, computed once and kept until pixels are
+  // accessed for writing. Same on all SIMD levels, but not meant to be
+  // stored in files: it depends on byte order.
+  // Writes through pointers from row() and data() fetched before hash()
+  // must be followed by markDirty(), or the cached hash is stale. Not
+  // thread-safe: it caches hash in const image, so the same image must not
+  // be hashed or compared with hashEquals() from several threads at once.
+  uint64_t hash() const;
+
+  // Rotate image clockwise 90 degrees around image's center.
+  // If original image has dimensions height * width, resulting image
+  // will have dimensions width * height.
+  // Rotating 4 times should result in image equal to original.
+  // Note: implementation shall use O(1) additional memory i.e.
+  // one can't just create temporary image, write data to it and then
+  // copy them to image.
+  void rotateCw90();
+
+  // Rotate image counter clockwise 90 degrees around image's center.
+  // If original image has dimensions height * width, resulting image
+  // will have dimensions width * height.
+  // Rotating 4 times should result in image equal to original.
+  // Note: implementation shall use O(1) additional memory i.e.
+  // one can't just create temporary image, write data to it and then
+  // copy them to image.
+  void rotateCcw90();
+
+  // Move each point (y,x) on source image to (y+dy, x+dx) on result image.
+  // Result image has the same size, as source one.
+  // dy and dx may be positive or negative.
+  // Points translated from outside of the image has black color (zero value).
+  // Note: implementation shall use O(1) additional memory i.e.
+  // one can't just create temporary image, write data to it and then
+  // copy them to image.
+  void translateInplace(int dy, int dx);
+
+private:
+  friend class GrayImageView;
+  friend class GrayImagePool;
+  friend class GrayImagePipeline;
+  friend class BinaryImage;
+  friend class RleImage;
+  friend bool isBinary(const GrayImage& image);
+  friend void applyLut(const GrayImageView& image, const uint8_t lut[256], GrayImage& result);
+  friend void applyLut(const GrayImageView& image, const uint8_t lut[256], GrayImage& result,
+                       ThreadPool& pool);
+  friend void binaryFillHoles(const GrayImageView& image, GrayImage& result);
+  friend void binaryBackground(const GrayImageView& image, GrayImage& result);
+  friend void updateThreshold(GrayImage& frame, uint8_t thr, GrayImage& result);
+  friend class FillHolesUpdater;
+
+  void markDirtyPixel(int y, int x);
+  void markDirtyAll();
+
+  int height_;
+  int width_;
+  std::vector<pixel_t> data_;
+
+  // true if all pixels are known to be 0 or 255, set by operations producing
+  // binary images, cleared by mutable pixel access
+  mutable bool binary_;
+
+  // content hash, valid until pixels are accessed for writing
+  mutable uint64_t hash_;
+  mutable bool hashValid_;
+
+  // log2 of dirty tile size or -1 if changes aren't tracked, dirtyTiles_ has
+  // one flag per tile, dirtyColumns_ tiles per row
+  int dirtyShift_;
+  int dirtyColumns_;
+  std::vector<char> dirtyTiles_;
+};
+
+GrayImage::Image()
+  : height_(0)
+  , width_(0)
+  , binary_(false)
+  , hash_(0)
+  , hashValid_(false)
+  , dirtyShift_(-1)
+  , dirtyColumns_(0)
+{
+}
+
+GrayImage::Image(int height, int width)
+  : height_(height)
+  , width_(width)
+  , data_(height * width)
+  , binary_(true)
+  , hash_(0)
+  , hashValid_(false)
+  , dirtyShift_(-1)
+  , dirtyColumns_(0)
+{
+  assert(height > 0  &&  width > 0);
+}
+
+GrayImage::Image(int height, int width, const std::string& data)
+  : height_(height)
+  , width_(width)
+  , data_(height * width)
+  , binary_(true)
+  , hash_(0)
+  , hashValid_(false)
+  , dirtyShift_(-1)
+  , dirtyColumns_(0)
+{
+  assert(height > 0  &&  width > 0  &&  data.length() == height * width);
+
+  for (size_t i = 0; i < data.length(); ++i)
+    data_[i] = data[i] == 'o' ? 0 : 255;
+}
+
+void GrayImage::print() const
+{
+  for (int y = 0; y < height_; ++y)
+    {
+      std::cout.write(reinterpret_cast<const char*>(row(y)), width_);
+      std::cout << std::endl;
+    }
+}
+
+void GrayImage::printBinary() const
+{
+  for (int y = 0; y < height_; ++y)
+    {
+      std::string line(width_, '?');
+      const pixel_t* p = row(y);
+      for (int x = 0; x < width_; ++x)
+        if (p[x] == 0)
+          line[x] = 'o';
+        else if (p[x] == 255)
+          line[x] = 'x';
+      std::cout << line << std::endl;
+    }
+}
+
+GrayImage::pixel_t* GrayImage::row(int y)
+{
+  assert(y >= 0  &&  y < height_);
+  binary_ = false;
+  hashValid_ = false;
+  if (dirtyShift_ >= 0)
+    {
+      char* tiles = &dirtyTiles_[(y >> dirtyShift_) * dirtyColumns_];
+      std::fill(tiles, tiles + dirtyColumns_, 1);
+    }
+  return &data_[0] + static_cast<size_t>(y) * width_;
+}
+
+const GrayImage::pixel_t* GrayImage::row(int y) const
+{
+  assert(y >= 0  &&  y < height_);
+  return &data_[0] + static_cast<size_t>(y) * width_;
+}
+
+GrayImage::pixel_t* GrayImage::data()
+{
+  binary_ = false;
+  hashValid_ = false;
+  markDirtyAll();
+  return data_.empty() ? 0 : &data_[0];
+}
+
+const GrayImage::pixel_t* GrayImage::data() const
+{
+  return data_.empty() ? 0 : &data_[0];
+}
+
+GrayImage::iterator GrayImage::rowBegin(int y)
+{
+  return row(y);
+}
+
+GrayImage::iterator GrayImage::rowEnd(int y)
+{
+  return row(y) + width_;
+}
+
+GrayImage::const_iterator GrayImage::rowBegin(int y) const
+{
+  return row(y);
+}
+
+GrayImage::const_iterator GrayImage::rowEnd(int y) const
+{
+  return row(y) + width_;
+}
+
+GrayImage::RowWriter::RowWriter(GrayImage& image)
+  : data_(image.data()), height_(image.getHeight()), width_(image.getWidth())
+{
+}
+
+GrayImage::pixel_t* GrayImage::RowWriter::row(int y) const
+{
+  assert(y >= 0  &&  y < height_);
+  return data_ + static_cast<size_t>(y) * width_;
+}
+
+GrayImage::pixel_t& GrayImage::RowWriter::operator()(int y, int x) const
+{
+  assert(x >= 0  &&  x < width_);
+  return row(y)[x];
+}
+
+GrayImage::pixel_t& GrayImage::operator()(int y, int x)
+{
+  assert(y >= 0  &&  y < height_);
+  assert(x >= 0  &&  x < width_);
+  binary_ = false;
+  hashValid_ = false;
+  int offset = y * width_ + x;
+  return data_[offset];
+}
+
+const GrayImage::pixel_t& GrayImage::operator()(int y, int x) const
+{
+  assert(y >= 0  &&  y < height_);
+  assert(x >= 0  &&  x < width_);
+  int offset = y * width_ + x;
+  return data_[offset];
+}
+
+void GrayImage::resize(int height, int width)
+{
+  assert (height > 0  &&  width > 0);
+  height_ = height;
+  width_ = width;
+  std::vector<pixel_t> data(height * width);
+  data_.swap(data);
+  binary_ = true;
+  hashValid_ = false;
+  markDirtyAll();
+}
+
+void GrayImage::reshape(int height, int width)
+{
+  assert(height >= 0  &&  width >= 0  &&  (height == 0) == (width == 0));
+  height_ = height;
+  width_ = width;
+  data_.resize(static_cast<size_t>(height) * width);
+  binary_ = false;
+  hashValid_ = false;
+  markDirtyAll();
+}
+
+void GrayImage::fill(GrayImage::pixel_t value)
+{
+  std::fill(data_.begin(), data_.end(), value);
+  binary_ = value == 0  ||  value == 255;
+  hashValid_ = false;
+  markDirtyAll();
+}
+
+int GrayImage::getHeight() const
+{
+  return height_;
+}
+
+int GrayImage::getWidth() const
+{
+  return width_;
+}
+
+void GrayImage::trackChanges(int tileSize)
+{
+  assert(tileSize >= 0  &&  (tileSize & (tileSize - 1)) == 0);
+  dirtyShift_ = -1;
+  dirtyColumns_ = 0;
+  std::vector<char>().swap(dirtyTiles_);
+  if (tileSize == 0)
+    return;
+
+  dirtyShift_ = 0;
+  while ((1 << dirtyShift_) < tileSize)
+    ++dirtyShift_;
+  markDirtyAll();
+}
+
+int GrayImage::getDirtyTileSize() const
+{
+  return dirtyShift_ < 0 ? 0 : 1 << dirtyShift_;
+}
+
+bool GrayImage::isDirty() const
+{
+  return std::find(dirtyTiles_.begin(), dirtyTiles_.end(), 1) != dirtyTiles_.end();
+}
+
+void GrayImage::getDirtyTiles(std::vector<Tile>& tiles) const
+{
+  tiles.clear();
+  if (dirtyShift_ < 0)
+    return;
+
+  int size = 1 << dirtyShift_;
+  for (size_t i = 0; i < dirtyTiles_.size(); ++i)
+    if (dirtyTiles_[i])
+      {
+        Tile tile;
+        tile.y = static_cast<int>(i / dirtyColumns_) * size;
+        tile.x = static_cast<int>(i % dirtyColumns_) * size;
+        tile.height = std::min(size, height_ - tile.y);
+        tile.width = std::min(size, width_ - tile.x);
+        tiles.push_back(tile);
+      }
+}
+
+void GrayImage::markDirty(const Tile& region)
+{
+  binary_ = false;
+  hashValid_ = false;
+  if (dirtyShift_ < 0)
+    return;
+
+  int y1 = std::max(region.y, 0);
+  int x1 = std::max(region.x, 0);
+  int y2 = std::min(region.y + region.height, height_);
+  int x2 = std::min(region.x + region.width, width_);
+  if (y1 >= y2  ||  x1 >= x2)
+    return;
+
+  for (int ty = y1 >> dirtyShift_; ty <= (y2 - 1) >> dirtyShift_; ++ty)
+    {
+      char* tiles = &dirtyTiles_[ty * dirtyColumns_];
+      std::fill(tiles + (x1 >> dirtyShift_), tiles + ((x2 - 1) >> dirtyShift_) + 1, 1);
+    }
+}
+
+void GrayImage::markDirty()
+{
+  binary_ = false;
+  hashValid_ = false;
+  markDirtyAll();
+}
+
+void GrayImage::clearDirty()
+{
+  std::fill(dirtyTiles_.begin(), dirtyTiles_.end(), 0);
+}
+
+void GrayImage::markDirtyPixel(int y, int x)
+{
+  if (dirtyShift_ >= 0)
+    dirtyTiles_[(y >> dirtyShift_) * dirtyColumns_ + (x >> dirtyShift_)] = 1;
+}
+
+// also fits tile grid to current size
+void GrayImage::markDirtyAll()
+{
+  if (dirtyShift_ < 0)
+    return;
+
+  int size = 1 << dirtyShift_;
+  int rows = (height_ + size - 1) / size;
+  dirtyColumns_ = (width_ + size - 1) / size;
+  dirtyTiles_.assign(static_cast<size_t>(rows) * dirtyColumns_, 1);
+}
+
+#if __cplusplus >= 201103L
+GrayImage::Image(GrayImage&& other) noexcept
+  : height_(other.height_)
+  , width_(other.width_)
+  , data_(std::move(other.data_))
+  , binary_(other.binary_)
+  , hash_(other.hash_)
+  , hashValid_(other.hashValid_)
+  , dirtyShift_(other.dirtyShift_)
+  , dirtyColumns_(other.dirtyColumns_)
+  , dirtyTiles_(std::move(other.dirtyTiles_))
+{
+  other.height_ = 0;
+  other.width_ = 0;
+  other.data_.clear();
+  other.binary_ = false;
+  other.hashValid_ = false;
+  other.dirtyShift_ = -1;
+  other.dirtyColumns_ = 0;
+  other.dirtyTiles_.clear();
+}
+
+GrayImage& GrayImage::operator=(GrayImage&& other) noexcept
+{
+  GrayImage moved(std::move(other));
+  swap(moved);
+  return *this;
+}
+#endif
+
+void GrayImage::swap(GrayImage& other)
+{
+  std::swap(height_, other.height_);
+  std::swap(width_, other.width_);
+  data_.swap(other.data_);
+  std::swap(binary_, other.binary_);
+  std::swap(hash_, other.hash_);
+  std::swap(hashValid_, other.hashValid_);
+  std::swap(dirtyShift_, other.dirtyShift_);
+  std::swap(dirtyColumns_, other.dirtyColumns_);
+  dirtyTiles_.swap(other.dirtyTiles_);
+}
+
+int GrayImage::loadFromPGM(const std::string& pathToPGMFile)
+{
+  GRAYIMAGE_TIMED(OP_LOAD_PGM, 0, 0, 0);
+  MappedFile file;
+
+  if (file.open(pathToPGMFile) != 0)
+    {
+      std::cerr << "Failed to open file for reading: " << pathToPGMFile << std::endl;
+      return -1;
+    }
+
+  PGMHeader header;
+  if (parsePGMHeader(file.data(), file.size(), file.size(), header) != 0)
+    return -1;
+
+  GRAYIMAGE_TIMED_SIZE(header.height, header.width, 1 + (header.ascii ? 4 : header.getSampleSize()));
+  size_t count = static_cast<size_t>(header.width) * header.height;
+  if (!header.isPlain())
+    {
+      // decoded aside, so that image is kept if pixel data are invalid
+      std::vector<pixel_t> decoded(count);
+      if (decodePGMPixels(file.data() + header.dataOffset, file.size() - header.dataOffset,
+                          header, count, &decoded[0]) != 0)
+        return -1;
+      data_.swap(decoded);
+    }
+  else
+    {
+      // assign() copies straight from mapped pages, without zero-filling
+      // buffer first as resize() does
+      const pixel_t* pixels = reinterpret_cast<const pixel_t*>(file.data() + header.dataOffset);
+      data_.assign(pixels, pixels + count);
+    }
+
+  height_ = header.height;
+  width_ = header.width;
+  binary_ = false;
+  hashValid_ = false;
+  markDirtyAll();
+
+  return 0;
+}
+
+int GrayImage::saveToPGM(const std::string& pathToPGMFile)
+{
+  GRAYIMAGE_TIMED(OP_SAVE_PGM, height_, width_, 2);
+  std::ofstream ofs(pathToPGMFile.c_str());
+
+  if (!ofs.is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << pathToPGMFile << std::endl;
+      return -1;
+    }
+
+  ofs << "P5" << '\n' << width_ << ' ' << height_ << '\n' << 255 << '\n';
+  ofs.write((const char*)&data_[0], width_ * height_);
+
+  if (!ofs)
+    {
+      std::cerr << "Error writing pixel data" << std::endl;
+      return -1;
+    }
+
+  return 0;
+}
+
+namespace
+{
+  // side of square tile processed at once by in-place rotation,
+  // one cache line of pixels
+  const int rotationTileSize = 64;
+
+  // In-place transpose of height * width matrix by cycle following:
+  // element with index k moves to index k * height mod (n - 1).
+  // Cycle is moved only starting from its smallest index, which is found by
+  // walking cycle, so no memory is needed to remember visited cycles.
+  void transposeInplace(uint8_t* data, int height, int width)
+  {
+    uint64_t n = static_cast<uint64_t>(height) * width;
+    if (height == 1  ||  width == 1)
+      return;
+
+    uint64_t modulus = n - 1;
+    for (uint64_t start = 1; start < modulus; ++start)
+      {
+        uint64_t next = start * height % modulus;
+        while (next > start)
+          next = next * height % modulus;
+        if (next != start)
+          continue;
+
+        uint8_t carry = data[start];
+        uint64_t k = start;
+        do
+          {
+            k = k * height % modulus;
+            std::swap(carry, data[k]);
+          }
+        while (k != start);
+      }
+  }
+
+  // Rotates square size * size matrix by 4-way swaps of pixels symmetric
+  // around center. Quarter of matrix is walked tile by tile, so all four
+  // tiles touched at once stay in cache.
+  void rotateSquareInplace(uint8_t* data, int size, bool clockwise)
+  {
+    int rows = size / 2;
+    int cols = (size + 1) / 2;
+    int last = size - 1;
+
+    for (int i0 = 0; i0 < rows; i0 += rotationTileSize)
+      for (int j0 = 0; j0 < cols; j0 += rotationTileSize)
+        {
+          int i1 = std::min(rows, i0 + rotationTileSize);
+          int j1 = std::min(cols, j0 + rotationTileSize);
+          for (int i = i0; i < i1; ++i)
+            for (int j = j0; j < j1; ++j)
+              {
+                uint8_t& a = data[i * size + j];
+                uint8_t& b = data[j * size + last - i];
+                uint8_t& c = data[(last - i) * size + last - j];
+                uint8_t& d = data[(last - j) * size + i];
+                uint8_t tmp = a;
+                if (clockwise)
+                  {
+                    a = d;
+                    d = c;
+                    c = b;
+                    b = tmp;
+                  }
+                else
+                  {
+                    a = b;
+                    b = c;
+                    c = d;
+                    d = tmp;
+                  }
+              }
+        }
+  }
+}
+
+void GrayImage::rotateCw90()
+{
+  if (data_.empty())
+    return;
+
+  if (height_ == width_)
+    {
+      rotateSquareInplace(&data_[0], width_, true);
+      hashValid_ = false;
+      markDirtyAll();
+      return;
+    }
+
+  // clockwise rotation is transpose followed by mirroring of each row
+  transposeInplace(&data_[0], height_, width_);
+  std::swap(height_, width_);
+  hashValid_ = false;
+  markDirtyAll();
+  for (int y = 0; y < height_; ++y)
+    std::reverse(data_.begin() + y * width_, data_.begin() + (y + 1) * width_);
+}
+
+void GrayImage::rotateCcw90()
+{
+  if (data_.empty())
+    return;
+
+  if (height_ == width_)
+    {
+      rotateSquareInplace(&data_[0], width_, false);
+      hashValid_ = false;
+      markDirtyAll();
+      return;
+    }
+
+  // counter clockwise rotation is transpose followed by reversing order of rows
+  transposeInplace(&data_[0], height_, width_);
+  std::swap(height_, width_);
+  hashValid_ = false;
+  markDirtyAll();
+  for (int y = 0; y < height_ / 2; ++y)
+    std::swap_ranges(data_.begin() + y * width_, data_.begin() + (y + 1) * width_,
+                     data_.begin() + (height_ - 1 - y) * width_);
+}
+
+void GrayImage::translateInplace(int dy, int dx)
+{
+  GRAYIMAGE_TIMED(OP_TRANSLATE, height_, width_, 2);
+  if ((dy == 0  &&  dx == 0)  ||  data_.empty())
+    return;
+
+  hashValid_ = false;
+  markDirtyAll();
+  if (std::abs(dy) >= height_  ||  std::abs(dx) >= width_)
+    {
+      std::fill(data_.begin(), data_.end(), 0);
+      return;
+    }
+
+  // each row is moved with one memmove of its overlapping span, rows are
+  // visited in direction that never overwrites source rows not moved yet
+  size_t span = width_ - std::abs(dx);
+  size_t gap = std::abs(dx);
+  int srcX = dx < 0 ? -dx : 0;
+  int dstX = dx > 0 ? dx : 0;
+  int gapX = dx > 0 ? 0 : width_ + dx;
+  pixel_t* data = &data_[0];
+
+  int first = dy > 0 ? height_ - 1 : 0;
+  int last = dy > 0 ? dy : height_ - 1 + dy;
+  int step = dy > 0 ? -1 : 1;
+  for (int y = first; y != last + step; y += step)
+    {
+      pixel_t* dst = data + y * width_;
+      std::memmove(dst + dstX, data + (y - dy) * width_ + srcX, span);
+      std::memset(dst + gapX, 0, gap);
+    }
+
+  // rows moved from outside of image
+  int clearBegin = dy > 0 ? 0 : height_ + dy;
+  std::memset(data + clearBegin * width_, 0, std::abs(dy) * width_);
+}
+
+inline bool operator==(const GrayImage& one, const GrayImage& two)
+{
+  if (one.height_ != two.height_  ||  one.width_ != two.width_)
+    return false;
+  if (one.hashValid_  &&  two.hashValid_  &&  one.hash_ != two.hash_)
+    return false;
+  return &one == &two  ||  one.data_ == two.data_;
+}
+
+inline bool operator!=(const GrayImage& one, const GrayImage& two)
+{
+  return !(one == two);
+}
+
+inline void swap(GrayImage& one, GrayImage& two)
+{
+  one.swap(two);
+}
+
+// lets std::sort and other algorithms exchange images without copying
+namespace std
+{
+  template <>
+  inline void swap<GrayImage>(GrayImage& one, GrayImage& two)
+  {
+    one.swap(two);
+  }
+}
+
+// Read-only image backed by memory-mapped binary PGM file.
+// Pixel data are not copied, pages are faulted in lazily on first access,
+// so opening takes the same time regardless of image size.
+class MappedGrayImage
+{
+public:
+  typedef GrayImage::pixel_t pixel_t;
+
+  // creates empty image
+  MappedGrayImage();
+
+  // only binary PGM with max value of 255 is supported, other formats need
+  // conversion by GrayImage::loadFromPGM
+  int open(const std::string& pathToPGMFile);
+
+  void close();
+
+  const pixel_t& operator()(int y, int x) const;
+
+  // pixels stored row by row without padding
+  const pixel_t* data() const;
+
+  int getHeight() const;
+  int getWidth() const;
+
+private:
+  MappedFile file_;
+  int height_;
+  int width_;
+  const pixel_t* pixels_;
+};
+
+MappedGrayImage::MappedGrayImage()
+  : height_(0)
+  , width_(0)
+  , pixels_(0)
+{
+}
+
+int MappedGrayImage::open(const std::string& pathToPGMFile)
+{
+  close();
+
+  if (file_.open(pathToPGMFile) != 0)
+    {
+      std::cerr << "Failed to open file for reading: " << pathToPGMFile << std::endl;
+      return -1;
+    }
+
+  PGMHeader header;
+  if (parsePGMHeader(file_.data(), file_.size(), file_.size(), header) != 0)
+    {
+      file_.close();
+      return -1;
+    }
+
+  // pixels are used in place, so they must not need conversion
+  if (!header.isPlain())
+    {
+      std::cerr << "Only binary PGM with max value of 255 can be mapped: " << pathToPGMFile << std::endl;
+      file_.close();
+      return -1;
+    }
+
+  height_ = header.height;
+  width_ = header.width;
+  pixels_ = reinterpret_cast<const pixel_t*>(file_.data() + header.dataOffset);
+  return 0;
+}
+
+void MappedGrayImage::close()
+{
+  file_.close();
+  height_ = 0;
+  width_ = 0;
+  pixels_ = 0;
+}
+
+const MappedGrayImage::pixel_t& MappedGrayImage::operator()(int y, int x) const
+{
+  assert(y >= 0  &&  y < height_);
+  assert(x >= 0  &&  x < width_);
+  return pixels_[y * width_ + x];
+}
+
+const MappedGrayImage::pixel_t* MappedGrayImage::data() const
+{
+  return pixels_;
+}
+
+int MappedGrayImage::getHeight() const
+{
+  return height_;
+}
+
+int MappedGrayImage::getWidth() const
+{
+  return width_;
+}
+
+// Non-owning read-only view of image or of rectangular region inside it.
+// Consecutive rows are stride pixels apart.
+// View is valid as long as viewed image is alive and not resized.
+class GrayImageView
+{
+public:
+  typedef GrayImage::pixel_t pixel_t;
+
+  // creates empty view
+  GrayImageView();
+
+  // whole image, implicit so that image can be passed where view is expected
+  GrayImageView(const GrayImage& image);
+  GrayImageView(const MappedGrayImage& image);
+
+  // region with upper left corner (y, x) and given size inside image
+  GrayImageView(const GrayImage& image, int y, int x, int height, int width);
+
+  GrayImageView(const pixel_t* data, int height, int width, int stride);
+
+  // region with upper left corner (y, x) and given size inside this view
+  GrayImageView subView(int y, int x, int height, int width) const;
+
+  const pixel_t& operator()(int y, int x) const;
+
+  // pointer to first pixel of row y
+  const pixel_t* row(int y) const;
+
+  int getHeight() const;
+  int getWidth() const;
+  int getStride() const;
+
+  // true if rows follow each other without gaps
+  bool isContiguous() const;
+
+  // image seen through view if view covers all of it, otherwise null
+  const GrayImage* getImage() const;
+
+private:
+  const pixel_t* data_;
+  int height_;
+  int width_;
+  int stride_;
+  const GrayImage* image_;
+};
+
+GrayImageView::GrayImageView()
+  : data_(0)
+  , height_(0)
+  , width_(0)
+  , stride_(0)
+  , image_(0)
+{
+}
+
+GrayImageView::GrayImageView(const GrayImage& image)
+  : data_(image.data())
+  , height_(image.height_)
+  , width_(image.width_)
+  , stride_(image.width_)
+  , image_(&image)
+{
+}
+
+GrayImageView::GrayImageView(const MappedGrayImage& image)
+  : data_(image.data())
+  , height_(image.getHeight())
+  , width_(image.getWidth())
+  , stride_(image.getWidth())
+  , image_(0)
+{
+}
+
+GrayImageView::GrayImageView(const GrayImage& image, int y, int x, int height, int width)
+  : data_(0)
+  , height_(0)
+  , width_(0)
+  , stride_(0)
+  , image_(0)
+{
+  *this = GrayImageView(image).subView(y, x, height, width);
+}
+
+GrayImageView::GrayImageView(const pixel_t* data, int height, int width, int stride)
+  : data_(data)
+  , height_(height)
+  , width_(width)
+  , stride_(stride)
+  , image_(0)
+{
+  assert(height >= 0  &&  width >= 0  &&  stride >= width);
+}
+
+GrayImageView GrayImageView::subView(int y, int x, int height, int width) const
+{
+  assert(y >= 0  &&  x >= 0  &&  height >= 0  &&  width >= 0);
+  assert(y + height <= height_  &&  x + width <= width_);
+
+  if (!height  ||  !width)
+    return GrayImageView();
+
+  return GrayImageView(data_ + y * stride_ + x, height, width, stride_);
+}
+
+const GrayImageView::pixel_t& GrayImageView::operator()(int y, int x) const
+{
+  assert(y >= 0  &&  y < height_);
+  assert(x >= 0  &&  x < width_);
+  return data_[y * stride_ + x];
+}
+
+const GrayImageView::pixel_t* GrayImageView::row(int y) const
+{
+  assert(y >= 0  &&  y < height_);
+  return data_ + y * stride_;
+}
+
+int GrayImageView::getHeight() const
+{
+  return height_;
+}
+
+int GrayImageView::getWidth() const
+{
+  return width_;
+}
+
+int GrayImageView::getStride() const
+{
+  return stride_;
+}
+
+bool GrayImageView::isContiguous() const
+{
+  return stride_ == width_;
+}
+
+const GrayImage* GrayImageView::getImage() const
+{
+  return image_;
+}
+
+GrayImage::Image(const GrayImageView& view)
+  : height_(view.getHeight())
+  , width_(view.getWidth())
+  , data_(view.getHeight() * view.getWidth())
+  , binary_(false)
+  , hash_(0)
+  , hashValid_(false)
+  , dirtyShift_(-1)
+  , dirtyColumns_(0)
+{
+  for (int y = 0; y < height_; ++y)
+    std::copy(view.row(y), view.row(y) + width_, data_.begin() + y * width_);
+}
+
+// Pool of pixel buffers, so images of similar size can be processed in a loop
+// without allocating each time. Thread safe.
+class GrayImagePool
+{
+public:
+  // at most maxBuffers released buffers are kept, others are freed
+  explicit GrayImagePool(size_t maxBuffers = 16);
+
+  // Image gets size height x width and a pooled buffer, preferably one that
+  // fits exactly. Previous buffer of image is returned to the pool.
+  // Content is unspecified.
+  void acquire(GrayImage& image, int height, int width);
+
+  // Buffer of image is taken by the pool, image becomes empty
+  void release(GrayImage& image);
+
+  // number of buffers kept
+  size_t getBufferCount() const;
+
+private:
+  GrayImagePool(const GrayImagePool&);
+  GrayImagePool& operator=(const GrayImagePool&);
+
+  void keep(std::vector<GrayImage::pixel_t>& buffer);
+
+  mutable Mutex mutex_;
+  size_t maxBuffers_;
+  // reserved up front: growing would copy every buffer
+  std::vector<std::vector<GrayImage::pixel_t> > buffers_;
+};
+
+GrayImagePool::GrayImagePool(size_t maxBuffers)
+  : maxBuffers_(maxBuffers)
+{
+  buffers_.reserve(maxBuffers);
+}
+
+void GrayImagePool::acquire(GrayImage& image, int height, int width)
+{
+  assert(height >= 0  &&  width >= 0  &&  (height == 0) == (width == 0));
+  size_t count = static_cast<size_t>(height) * width;
+  std::vector<GrayImage::pixel_t> buffer;
+  {
+    MutexLock lock(mutex_);
+    // exact size first, otherwise the smallest buffer that is large enough
+    size_t best = buffers_.size();
+    for (size_t i = 0; i < buffers_.size(); ++i)
+      {
+        size_t capacity = buffers_[i].capacity();
+        if (capacity < count)
+          continue;
+        if (buffers_[i].size() == count)
+          {
+            best = i;
+            break;
+          }
+        if (best == buffers_.size()  ||  capacity < buffers_[best].capacity())
+          best = i;
+      }
+
+    if (best != buffers_.size())
+      {
+        buffer.swap(buffers_[best]);
+        buffers_[best].swap(buffers_.back());
+        buffers_.pop_back();
+      }
+    if (image.data_.capacity() > 0)
+      keep(image.data_);
+  }
+
+  image.data_.swap(buffer);
+  image.reshape(height, width);
+}
+
+void GrayImagePool::release(GrayImage& image)
+{
+  {
+    MutexLock lock(mutex_);
+    if (image.data_.capacity() > 0)
+      keep(image.data_);
+  }
+  std::vector<GrayImage::pixel_t>().swap(image.data_);
+  image.reshape(0, 0);
+}
+
+size_t GrayImagePool::getBufferCount() const
+{
+  MutexLock lock(mutex_);
+  return buffers_.size();
+}
+
+// mutex_ must be held
+void GrayImagePool::keep(std::vector<GrayImage::pixel_t>& buffer)
+{
+  if (buffers_.size() >= maxBuffers_)
+    return;
+  buffers_.push_back(std::vector<GrayImage::pixel_t>());
+  buffers_.back().swap(buffer);
+}
+
+// Instruction set used by pixel kernels
+enum SimdLevel
+{
+  SIMD_SCALAR,
+  SIMD_SSE2,
+  SIMD_AVX2,
+  SIMD_NEON
+};
+
+namespace
+{
+  SimdLevel detectSimdLevel()
+  {
+#if defined(GRAYIMAGE_X86)
+#if defined(_MSC_VER)  &&  !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool sse2 = (info[3] & (1 << 26)) != 0;
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    bool avx2 = false;
+    if (maxLeaf >= 7  &&  osxsave  &&  avx  &&  (_xgetbv(0) & 6) == 6)
+      {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & (1 << 5)) != 0;
+      }
+#else
+    __builtin_cpu_init();
+    bool sse2 = __builtin_cpu_supports("sse2");
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    if (avx2)
+      return SIMD_AVX2;
+    if (sse2)
+      return SIMD_SSE2;
+    return SIMD_SCALAR;
+#elif defined(GRAYIMAGE_NEON)
+    return SIMD_NEON;
+#else
+    return SIMD_SCALAR;
+#endif
+  }
+
+  // Detected before main() rather than on first use, local statics are
+  // not initialized thread-safely in C++03 and kernels run on pool threads
+  const SimdLevel supportedLevel = detectSimdLevel();
+  SimdLevel activeLevel = supportedLevel;
+}
+
+// Best instruction set supported by CPU
+SimdLevel supportedSimdLevel()
+{
+  return supportedLevel;
+}
+
+// Instruction set currently used by pixel kernels
+SimdLevel simdLevel()
+{
+  return activeLevel;
+}
+
+// Restricts kernels to given instruction set, e.g. to compare results of
+// vectorized and scalar code. Levels not supported by CPU are ignored,
+// returns level actually set. Must not be called while threads run kernels.
+SimdLevel setSimdLevel(SimdLevel level)
+{
+  SimdLevel supported = supportedSimdLevel();
+  bool ok = level == SIMD_SCALAR  ||  level == supported
+      ||  (level == SIMD_SSE2  &&  supported == SIMD_AVX2);
+  activeLevel = ok ? level : supported;
+  return activeLevel;
+}
+
+namespace
+{
+  void thresholdScalar(const uint8_t* src, uint8_t* dst, size_t count, uint8_t thr)
+  {
+    for (size_t i = 0; i < count; ++i)
+      dst[i] = src[i] < thr ? 0 : 255;
+  }
+
+#ifdef GRAYIMAGE_X86
+  // max(v, thr) == v iff v >= thr, compare gives 0xff or 0 per byte
+  GRAYIMAGE_TARGET("sse2")
+  void thresholdSse2(const uint8_t* src, uint8_t* dst, size_t count, uint8_t thr)
+  {
+    const __m128i t = _mm_set1_epi8(static_cast<char>(thr));
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+      {
+        __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_cmpeq_epi8(_mm_max_epu8(v0, t), v0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + 16), _mm_cmpeq_epi8(_mm_max_epu8(v1, t), v1));
+      }
+    for (; i + 16 <= count; i += 16)
+      {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_cmpeq_epi8(_mm_max_epu8(v, t), v));
+      }
+    thresholdScalar(src + i, dst + i, count - i, thr);
+  }
+
+  GRAYIMAGE_TARGET("avx2")
+  void thresholdAvx2(const uint8_t* src, uint8_t* dst, size_t count, uint8_t thr)
+  {
+    const __m256i t = _mm256_set1_epi8(static_cast<char>(thr));
+    size_t i = 0;
+    for (; i + 64 <= count; i += 64)
+      {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + 32));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_cmpeq_epi8(_mm256_max_epu8(v0, t), v0));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + 32), _mm256_cmpeq_epi8(_mm256_max_epu8(v1, t), v1));
+      }
+    for (; i + 32 <= count; i += 32)
+      {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_cmpeq_epi8(_mm256_max_epu8(v, t), v));
+      }
+    thresholdSse2(src + i, dst + i, count - i, thr);
+  }
+#endif
+
+#ifdef GRAYIMAGE_NEON
+  void thresholdNeon(const uint8_t* src, uint8_t* dst, size_t count, uint8_t thr)
+  {
+    const uint8x16_t t = vdupq_n_u8(thr);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      vst1q_u8(dst + i, vcgeq_u8(vld1q_u8(src + i), t));
+    thresholdScalar(src + i, dst + i, count - i, thr);
+  }
+#endif
+
+  bool isBinaryScalar(const uint8_t* p, size_t count)
+  {
+    for (size_t i = 0; i < count; ++i)
+      if (p[i] != 0  &&  p[i] != 255)
+        return false;
+    return true;
+  }
+
+#ifdef GRAYIMAGE_X86
+  // pixel is binary iff it equals its sign broadcast to all bits:
+  // 0 for values below 128 and 255 for others.
+  // Blocks of 64 pixels are checked with one movemask.
+  GRAYIMAGE_TARGET("sse2")
+  bool isBinarySse2(const uint8_t* p, size_t count)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 64 <= count; i += 64)
+      {
+        __m128i ok = _mm_set1_epi8(-1);
+        for (int k = 0; k < 64; k += 16)
+          {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + k));
+            ok = _mm_and_si128(ok, _mm_cmpeq_epi8(v, _mm_cmpgt_epi8(zero, v)));
+          }
+        if (_mm_movemask_epi8(ok) != 0xffff)
+          return false;
+      }
+    for (; i + 16 <= count; i += 16)
+      {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_cmpgt_epi8(zero, v))) != 0xffff)
+          return false;
+      }
+    return isBinaryScalar(p + i, count - i);
+  }
+
+  GRAYIMAGE_TARGET("avx2")
+  bool isBinaryAvx2(const uint8_t* p, size_t count)
+  {
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 128 <= count; i += 128)
+      {
+        __m256i ok = _mm256_set1_epi8(-1);
+        for (int k = 0; k < 128; k += 32)
+          {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + k));
+            ok = _mm256_and_si256(ok, _mm256_cmpeq_epi8(v, _mm256_cmpgt_epi8(zero, v)));
+          }
+        if (_mm256_movemask_epi8(ok) != -1)
+          return false;
+      }
+    return isBinarySse2(p + i, count - i);
+  }
+#endif
+
+#ifdef GRAYIMAGE_NEON
+  bool isBinaryNeon(const uint8_t* p, size_t count)
+  {
+    size_t i = 0;
+    for (; i + 64 <= count; i += 64)
+      {
+        uint8x16_t ok = vdupq_n_u8(255);
+        for (int k = 0; k < 64; k += 16)
+          {
+            uint8x16_t v = vld1q_u8(p + i + k);
+            uint8x16_t sign = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(v), 7));
+            ok = vandq_u8(ok, vceqq_u8(v, sign));
+          }
+        uint8x8_t half = vpmin_u8(vget_low_u8(ok), vget_high_u8(ok));
+        half = vpmin_u8(half, half);
+        half = vpmin_u8(half, half);
+        half = vpmin_u8(half, half);
+        if (vget_lane_u8(half, 0) != 255)
+          return false;
+      }
+    return isBinaryScalar(p + i, count - i);
+  }
+#endif
+
+  // true if all pixels are 0 or 255, stops at first block with other value
+  bool isBinaryRow(const uint8_t* p, size_t count)
+  {
+    switch (simdLevel())
+      {
+#ifdef GRAYIMAGE_X86
+      case SIMD_AVX2:
+        return isBinaryAvx2(p, count);
+      case SIMD_SSE2:
+        return isBinarySse2(p, count);
+#endif
+#ifdef GRAYIMAGE_NEON
+      case SIMD_NEON:
+        return isBinaryNeon(p, count);
+#endif
+      default:
+        return isBinaryScalar(p, count);
+      }
+  }
+
+  // dst[i] = src[i] < thr ? 0 : 255
+  void thresholdRow(const uint8_t* src, uint8_t* dst, size_t count, uint8_t thr)
+  {
+    switch (simdLevel())
+      {
+#ifdef GRAYIMAGE_X86
+      case SIMD_AVX2:
+        thresholdAvx2(src, dst, count, thr);
+        return;
+      case SIMD_SSE2:
+        thresholdSse2(src, dst, count, thr);
+        return;
+#endif
+#ifdef GRAYIMAGE_NEON
+      case SIMD_NEON:
+        thresholdNeon(src, dst, count, thr);
+        return;
+#endif
+      default:
+        thresholdScalar(src, dst, count, thr);
+      }
+  }
+}
+
+namespace
+{
+  void applyLutScalar(const uint8_t* src, uint8_t* dst, size_t count, const uint8_t* lut)
+  {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+      {
+        uint8_t v0 = lut[src[i]];
+        uint8_t v1 = lut[src[i + 1]];
+        uint8_t v2 = lut[src[i + 2]];
+        uint8_t v3 = lut[src[i + 3]];
+        dst[i] = v0;
+        dst[i + 1] = v1;
+        dst[i + 2] = v2;
+        dst[i + 3] = v3;
+      }
+    for (; i < count; ++i)
+      dst[i] = lut[src[i]];
+  }
+
+#ifdef GRAYIMAGE_X86
+  // Table is split in 16 parts of 16 entries, one per high nibble of pixel.
+  // Each part is looked up by low nibble with a byte shuffle and kept only
+  // for pixels with matching high nibble.
+  GRAYIMAGE_TARGET("avx2")
+  void applyLutAvx2(const uint8_t* src, uint8_t* dst, size_t count, const uint8_t* lut)
+  {
+    __m256i parts[16];
+    for (int k = 0; k < 16; ++k)
+      parts[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lut + 16 * k)));
+    const __m256i lowMask = _mm256_set1_epi8(0x0f);
+    const __m256i nibble = _mm256_set1_epi8(0x10);
+
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+      {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i low = _mm256_and_si256(v, lowMask);
+        __m256i high = _mm256_andnot_si256(lowMask, v);
+        __m256i key = _mm256_setzero_si256();
+        __m256i result = _mm256_setzero_si256();
+        for (int k = 0; k < 16; ++k)
+          {
+            __m256i match = _mm256_cmpeq_epi8(high, key);
+            result = _mm256_or_si256(result, _mm256_and_si256(match, _mm256_shuffle_epi8(parts[k], low)));
+            key = _mm256_add_epi8(key, nibble);
+          }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), result);
+      }
+    applyLutScalar(src + i, dst + i, count - i, lut);
+  }
+#endif
+
+#if defined(GRAYIMAGE_NEON)  &&  defined(__aarch64__)
+  // four table lookups of 64 entries each, indices out of range of
+  // a lookup leave result unchanged
+  void applyLutNeon(const uint8_t* src, uint8_t* dst, size_t count, const uint8_t* lut)
+  {
+    uint8x16x4_t parts[4];
+    for (int k = 0; k < 4; ++k)
+      for (int j = 0; j < 4; ++j)
+        parts[k].val[j] = vld1q_u8(lut + 64 * k + 16 * j);
+    const uint8x16_t step = vdupq_n_u8(64);
+
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      {
+        uint8x16_t index = vld1q_u8(src + i);
+        uint8x16_t result = vqtbl4q_u8(parts[0], index);
+        index = vsubq_u8(index, step);
+        result = vqtbx4q_u8(result, parts[1], index);
+        index = vsubq_u8(index, step);
+        result = vqtbx4q_u8(result, parts[2], index);
+        index = vsubq_u8(index, step);
+        result = vqtbx4q_u8(result, parts[3], index);
+        vst1q_u8(dst + i, result);
+      }
+    applyLutScalar(src + i, dst + i, count - i, lut);
+  }
+#endif
+
+  // dst[i] = lut[src[i]], dst may be src
+  void applyLutRow(const uint8_t* src, uint8_t* dst, size_t count, const uint8_t* lut)
+  {
+    switch (simdLevel())
+      {
+#ifdef GRAYIMAGE_X86
+      case SIMD_AVX2:
+        applyLutAvx2(src, dst, count, lut);
+        return;
+#endif
+#if defined(GRAYIMAGE_NEON)  &&  defined(__aarch64__)
+      case SIMD_NEON:
+        applyLutNeon(src, dst, count, lut);
+        return;
+#endif
+      default:
+        applyLutScalar(src, dst, count, lut);
+      }
+  }
+
+  // Table looked at once before a pass, so tables that are just a threshold
+  // or identity use faster kernels than generic lookup
+  class LutKernel
+  {
+  public:
+    explicit LutKernel(const uint8_t* lut)
+      : lut_(lut), kind_(GENERIC), thr_(0), binary_(true)
+    {
+      bool identity = true;
+      int steps = 0;
+      for (int v = 0; v < 256; ++v)
+        {
+          identity = identity  &&  lut[v] == v;
+          binary_ = binary_  &&  (lut[v] == 0  ||  lut[v] == 255);
+          if (v > 0  &&  lut[v] != lut[v - 1])
+            {
+              ++steps;
+              thr_ = static_cast<uint8_t>(v);
+            }
+        }
+
+      if (identity)
+        kind_ = IDENTITY;
+      else if (binary_  &&  steps == 0  &&  lut[0] == 255)
+        kind_ = THRESHOLD;
+      else if (binary_  &&  steps == 1  &&  lut[0] == 0)
+        kind_ = THRESHOLD;
+    }
+
+    void run(const uint8_t* src, uint8_t* dst, size_t count) const
+    {
+      switch (kind_)
+        {
+        case IDENTITY:
+          if (src != dst)
+            std::memmove(dst, src, count);
+          break;
+        case THRESHOLD:
+          thresholdRow(src, dst, count, thr_);
+          break;
+        default:
+          applyLutRow(src, dst, count, lut_);
+        }
+    }
+
+    // true if table maps every value to 0 or 255
+    bool isBinary() const
+    {
+      return binary_;
+    }
+
+  private:
+    enum Kind
+    {
+      GENERIC,
+      IDENTITY,
+      THRESHOLD
+    };
+
+    const uint8_t* lut_;
+    Kind kind_;
+    uint8_t thr_;
+    bool binary_;
+  };
+
+  // true if pixels seen by view are in pixel buffer of image
+  bool sharesPixels(const GrayImageView& view, const GrayImage& image)
+  {
+    if (!view.getHeight()  ||  !view.getWidth()  ||  !image.getHeight()  ||  !image.getWidth())
+      return false;
+
+    const GrayImage::pixel_t* first = view.row(0);
+    const GrayImage::pixel_t* last = view.row(view.getHeight() - 1) + view.getWidth();
+    const GrayImage::pixel_t* begin = image.data();
+    const GrayImage::pixel_t* end = begin + static_cast<size_t>(image.getHeight()) * image.getWidth();
+    std::less<const GrayImage::pixel_t*> less;
+    return less(first, end)  &&  less(begin, last);
+  }
+}
+
+// You have to implement only function(s) you are asked to implement
+
+// Move each point (y,x) on source image to (y+dy, x+dx) on result image.
+// Result image has the same size, as source one.
+// dy and dx may be positive or negative.
+// Points translated from outside of the image has black color (zero value).
+void translate(const GrayImageView& image, int dy, int dx, GrayImage& result);
+GrayImage translate(const GrayImageView& image, int dy, int dx)
+{
+  GrayImage result;
+  translate(image, dy, dx, result);
+  return result;
+}
+
+// Same as above, but result is written to given image, whose pixel buffer
+// is reused if it is large enough. Result must not share pixels with
+// source, e.g. be the image seen by view.
+void translate(const GrayImageView& image, int dy, int dx, GrayImage& result)
+{
+  GRAYIMAGE_TIMED(OP_TRANSLATE, image.getHeight(), image.getWidth(), 2);
+  // rows are copied forward, so overlapping source would be overwritten
+  // before read
+  assert(!sharesPixels(image, result));
+  int width = image.getWidth();
+  int height = image.getHeight();
+  result.reshape(height, width);
+  if (!height  ||  !width)
+    return;
+
+  if(std::abs(dx) >= width || std::abs(dy) >= height)
+    {
+      result.fill(0);
+      return;
+    }
+
+  // overlapping span of each row is copied, the rest is cleared
+  size_t span = width - std::abs(dx);
+  size_t gap = std::abs(dx);
+  int srcX = dx < 0 ? -dx : 0;
+  int dstX = dx > 0 ? dx : 0;
+  int gapX = dx > 0 ? 0 : width + dx;
+  int yBegin = std::max(0, dy);
+  int yEnd = std::min(height, height + dy);
+  GrayImage::pixel_t* data = result.data();
+
+  std::memset(data, 0, static_cast<size_t>(yBegin) * width);
+  for (int y = yBegin; y < yEnd; ++y)
+    {
+      GrayImage::pixel_t* dst = data + y * width;
+      std::memcpy(dst + dstX, image.row(y - dy) + srcX, span);
+      std::memset(dst + gapX, 0, gap);
+    }
+  std::memset(data + yEnd * width, 0, static_cast<size_t>(height - yEnd) * width);
+}
+
+bool isBinary(const GrayImageView& image)
+{
+  int height = image.getHeight();
+  int width = image.getWidth();
+  //! is empty image binary? - I think not
+  if(!height || !width)
+    return false;
+
+  if (image.isContiguous())
+    return isBinaryRow(image.row(0), static_cast<size_t>(height) * width);
+
+  for (int y = 0; y < height; ++y)
+    if (!isBinaryRow(image.row(y), width))
+      return false;
+  return true;
+}
+
+// Result is remembered by image until it is modified,
+// so repeated checks are free
+bool isBinary(const GrayImage& image)
+{
+  if (!image.binary_)
+    image.binary_ = isBinary(GrayImageView(image));
+  return image.binary_;
+}
+
+// Map each pixel value v to lut[v]
+void applyLut(const GrayImageView& image, const uint8_t lut[256], GrayImage& result);
+GrayImage applyLut(const GrayImageView& image, const uint8_t lut[256])
+{
+  GrayImage result;
+  applyLut(image, lut, result);
+  return result;
+}
+
+// Same as above, but result is written to given image, whose pixel buffer
+// is reused if it is large enough. Result may be the image seen through view.
+void applyLut(const GrayImageView& image, const uint8_t lut[256], GrayImage& result)
+{
+  GRAYIMAGE_TIMED(OP_APPLY_LUT, image.getHeight(), image.getWidth(), 2);
+  int height = image.getHeight();
+  int width = image.getWidth();
+  LutKernel kernel(lut);
+  result.reshape(height, width);
+  if (!height  ||  !width)
+    return;
+
+  if (image.isContiguous())
+    kernel.run(image.row(0), result.data(), static_cast<size_t>(height) * width);
+  else
+    for (int y = 0; y < height; ++y)
+      kernel.run(image.row(y), result.row(y), width);
+
+  result.binary_ = kernel.isBinary();
+}
+
+void applyLutInplace(GrayImage& image, const uint8_t lut[256])
+{
+  applyLut(GrayImageView(image), lut, image);
+}
+
+// Lookup tables for applyLut()
+
+// lut[v] = v < thr ? 0 : 255
+void makeThresholdLut(uint8_t thr, uint8_t lut[256])
+{
+  for (int v = 0; v < 256; ++v)
+    lut[v] = v < thr ? 0 : 255;
+}
+
+// lut[v] = 255 - v
+void makeInvertLut(uint8_t lut[256])
+{
+  for (int v = 0; v < 256; ++v)
+    lut[v] = static_cast<uint8_t>(255 - v);
+}
+
+// lut[v] = 255 * (v / 255) ^ gamma, rounded to nearest
+void makeGammaLut(double gamma, uint8_t lut[256])
+{
+  assert(gamma > 0);
+  for (int v = 0; v < 256; ++v)
+    lut[v] = static_cast<uint8_t>(255 * std::pow(v / 255.0, gamma) + 0.5);
+}
+
+// Stretches range [low, high] linearly to [0, 255], values outside
+// of range become 0 or 255
+void makeContrastLut(uint8_t low, uint8_t high, uint8_t lut[256])
+{
+  assert(low < high);
+  int range = high - low;
+  for (int v = 0; v < 256; ++v)
+    {
+      int x = std::min(std::max(v, static_cast<int>(low)), static_cast<int>(high)) - low;
+      lut[v] = static_cast<uint8_t>((x * 255 + range / 2) / range);
+    }
+}
+
+// Reduces image to given number of gray levels evenly spaced from 0 to 255,
+// 2 <= levels <= 256
+void makePosterizeLut(int levels, uint8_t lut[256])
+{
+  assert(levels >= 2  &&  levels <= 256);
+  for (int v = 0; v < 256; ++v)
+    lut[v] = static_cast<uint8_t>(v * levels / 256 * 255 / (levels - 1));
+}
+
+// result[v] = second[first[v]], so that applying result does both mappings
+// in one pass. Result may be one of the tables.
+void composeLut(const uint8_t first[256], const uint8_t second[256], uint8_t result[256])
+{
+  uint8_t composed[256];
+  for (int v = 0; v < 256; ++v)
+    composed[v] = second[first[v]];
+  std::memcpy(result, composed, sizeof(composed));
+}
+
+// Set pixels that are less than thr to zero, others to 255
+void threshold(const GrayImageView& image, uint8_t thr, GrayImage& result);
+GrayImage threshold(const GrayImageView& image, uint8_t thr)
+{
+  GrayImage result;
+  threshold(image, thr, result);
+  return result;
+}
+
+// Same as above, but result is written to given image, whose pixel buffer
+// is reused if it is large enough
+void threshold(const GrayImageView& image, uint8_t thr, GrayImage& result)
+{
+  GRAYIMAGE_TIMED(OP_THRESHOLD, image.getHeight(), image.getWidth(), 2);
+  uint8_t lut[256];
+  makeThresholdLut(thr, lut);
+  applyLut(image, lut, result);
+}
+
+// Should be applied only to binary image
+// Background is black (0), foreground is white (255).
+// Foreground, consisting of one or more connected components, may have one or more holes:
+// connected components of black, that doesn't touch image border (4-connectivity
+// is assumed).
+// The resulting image should have all holes filled with white.
+GrayImage binaryFillHoles(const GrayImageView& image);
+void binaryFillHoles(const GrayImageView& image, GrayImage& result);
+
+// Let's call this image src and resulting image dst. src(y, x) - pixels of source
+// image with coordinates (y, x).
+// dst(y,x) = 255, iff src(y, x) = 0 and path exists in source image (4-connectivity
+// is assumed) from (y, x) to image border such that all pixels on this path are 0.
+GrayImage binaryBackground(const GrayImageView& image);
+void binaryBackground(const GrayImageView& image, GrayImage& result);
+
+namespace
+{
+  // Row span [x1, x2] to be checked by flood fill, found below (dy = 1) or
+  // above (dy = -1) of filled run of previous row
+  struct FillSpan
+  {
+    int y;
+    int x1;
+    int x2;
+    int dy;
+  };
+
+  // Scanline flood fill of pixels connected to image border, for any grid
+  // with methods: findFree(y, from, to) - first fillable x in [from, to] or
+  // more than to if there is none, runBegin(y, x) and runEnd(y, x) - ends of
+  // run of fillable pixels containing x, fill(y, x1, x2).
+  // Each run is filled at once. The row it was found from is searched
+  // again only where run sticks out beyond parent run, so a span is pushed
+  // for the next row and at most two for the turn back. Border pixels are
+  // seeded one at a time, so stack holds spans of a single front, about
+  // one per row or column it crosses, not one per filled run. Returns
+  // largest number of spans held on stack.
+  template <typename Grid>
+  size_t fillFromBorder(Grid& grid, int height, int width)
+  {
+    std::vector<FillSpan> stack;
+    stack.reserve(2 * (height + width));
+    size_t peak = 0;
+    for (int i = 0; i < 2 * (height + width); ++i)
+      {
+        // top and bottom rows, then left and right columns
+        int y, x;
+        if (i < 2 * width)
+          {
+            y = i % 2 ? height - 1 : 0;
+            x = i / 2;
+          }
+        else
+          {
+            y = (i - 2 * width) / 2;
+            x = i % 2 ? width - 1 : 0;
+          }
+        if (grid.findFree(y, x, x) != x)
+          continue;
+
+        int left = grid.runBegin(y, x);
+        int right = grid.runEnd(y, x);
+        grid.fill(y, left, right);
+        if (y + 1 < height)
+          {
+            FillSpan down = { y + 1, left, right, 1 };
+            stack.push_back(down);
+          }
+        if (y > 0)
+          {
+            FillSpan up = { y - 1, left, right, -1 };
+            stack.push_back(up);
+          }
+
+        while (!stack.empty())
+          {
+            peak = std::max(peak, stack.size());
+            FillSpan span = stack.back();
+            stack.pop_back();
+
+            for (int x = grid.findFree(span.y, span.x1, span.x2); x <= span.x2;
+                 x = grid.findFree(span.y, x, span.x2))
+              {
+                int left = grid.runBegin(span.y, x);
+                int right = grid.runEnd(span.y, x);
+                grid.fill(span.y, left, right);
+
+                // span ahead is pushed last, so that dead end is dropped
+                // at once instead of waiting under the turns
+                int back = span.y - span.dy;
+                if (left < span.x1)
+                  {
+                    FillSpan turn = { back, left, span.x1 - 1, -span.dy };
+                    stack.push_back(turn);
+                  }
+                if (right > span.x2)
+                  {
+                    FillSpan turn = { back, span.x2 + 1, right, -span.dy };
+                    stack.push_back(turn);
+                  }
+                int next = span.y + span.dy;
+                if (next >= 0  &&  next < height)
+                  {
+                    FillSpan ahead = { next, left, right, span.dy };
+                    stack.push_back(ahead);
+                  }
+                x = right + 1;
+              }
+          }
+      }
+    return peak;
+  }
+
+  // 8-bit pixels of image are fillable if they are 0 in image and in mark
+  class ByteFillGrid
+  {
+  public:
+    ByteFillGrid(const GrayImageView& image, GrayImage::pixel_t* mark, GrayImage::pixel_t marker)
+      : image_(image), mark_(mark), width_(image.getWidth()), marker_(marker) {}
+
+    int findFree(int y, int from, int to) const
+    {
+      const GrayImage::pixel_t* src = image_.row(y);
+      const GrayImage::pixel_t* dst = mark_ + static_cast<size_t>(y) * width_;
+      int x = from;
+      while (x <= to  &&  (src[x]  ||  dst[x]))
+        ++x;
+      return x;
+    }
+
+    int runBegin(int y, int x) const
+    {
+      const GrayImage::pixel_t* src = image_.row(y);
+      const GrayImage::pixel_t* dst = mark_ + static_cast<size_t>(y) * width_;
+      while (x > 0  &&  !src[x - 1]  &&  !dst[x - 1])
+        --x;
+      return x;
+    }
+
+    int runEnd(int y, int x) const
+    {
+      const GrayImage::pixel_t* src = image_.row(y);
+      const GrayImage::pixel_t* dst = mark_ + static_cast<size_t>(y) * width_;
+      while (x + 1 < width_  &&  !src[x + 1]  &&  !dst[x + 1])
+        ++x;
+      return x;
+    }
+
+    void fill(int y, int x1, int x2)
+    {
+      std::memset(mark_ + static_cast<size_t>(y) * width_ + x1, marker_, x2 - x1 + 1);
+    }
+
+  private:
+    const GrayImageView& image_;
+    GrayImage::pixel_t* mark_;
+    int width_;
+    GrayImage::pixel_t marker_;
+  };
+
+  // Sets to marker pixels of mark, which are 0 in image and connected to
+  // image border through 0 pixels. Mark has rows of image width, it must be
+  // black initially or be the image itself, then marker must not be 0.
+  // Returns largest number of spans held on stack.
+  size_t fillBackground(const GrayImageView& image, GrayImage::pixel_t* mark,
+                        GrayImage::pixel_t marker = 255)
+  {
+    if (!image.getHeight()  ||  !image.getWidth())
+      return 0;
+
+    ByteFillGrid grid(image, mark, marker);
+    return fillFromBorder(grid, image.getHeight(), image.getWidth());
+  }
+
+  // isBinary() for checks in debug builds, uses flag remembered by image
+  // when view is the whole image
+  bool isKnownBinary(const GrayImageView& image)
+  {
+    return image.getImage() ? isBinary(*image.getImage()) : isBinary(image);
+  }
+}
+
+GrayImage binaryFillHoles(const GrayImageView& image)
+{
+  GrayImage result;
+  binaryFillHoles(image, result);
+  return result;
+}
+
+// Same as above, but result is written to given image, whose pixel buffer
+// is reused if it is large enough. Result must not share pixels with
+// source.
+void binaryFillHoles(const GrayImageView& image, GrayImage& result)
+{
+  GRAYIMAGE_TIMED(OP_FILL_HOLES, image.getHeight(), image.getWidth(), 2);
+  binaryBackground(image, result);
+
+  // everything that is not background is either foreground or hole
+  size_t count = static_cast<size_t>(image.getHeight()) * image.getWidth();
+  GrayImage::pixel_t* data = result.data();
+  for (size_t i = 0; i < count; ++i)
+    data[i] = ~data[i];
+
+  result.binary_ = true;
+}
+
+GrayImage binaryBackground(const GrayImageView& image)
+{
+  GrayImage result;
+  binaryBackground(image, result);
+  return result;
+}
+
+// Same as above, but result is written to given image, whose pixel buffer
+// is reused if it is large enough. Result must not share pixels with
+// source.
+void binaryBackground(const GrayImageView& image, GrayImage& result)
+{
+  GRAYIMAGE_TIMED(OP_BACKGROUND, image.getHeight(), image.getWidth(), 2);
+  assert(isKnownBinary(image));
+  if (!image.getHeight()  ||  !image.getWidth())
+    {
+      result.reshape(0, 0);
+      return;
+    }
+
+  // result is cleared before source is read
+  assert(!sharesPixels(image, result));
+  result.reshape(image.getHeight(), image.getWidth());
+
+  result.fill(0);
+  fillBackground(image, result.data());
+  result.binary_ = true;
+}
+
+// Binary image packed 64 pixels per word, set bit means white (255) pixel.
+// Pixel x of row is bit x % 64 of word x / 64, bits past image width are
+// always zero, so words can be compared and combined directly.
+class BinaryImage
+{
+public:
+  typedef uint64_t word_t;
+
+  // creates empty image
+  BinaryImage();
+
+  // creates image of given size filled with black pixels
+  BinaryImage(int height, int width);
+
+  // packs image, pixels not equal to 0 become white
+  explicit BinaryImage(const GrayImageView& image);
+
+  // unpacks to image with pixels 0 and 255
+  GrayImage toGrayImage() const;
+
+  bool get(int y, int x) const;
+  void set(int y, int x, bool white);
+
+  // content is lost, resulting image has all pixels black
+  void resize(int height, int width);
+
+  void fill(bool white);
+
+  int getHeight() const;
+  int getWidth() const;
+  int getWordsPerRow() const;
+
+  word_t* row(int y);
+  const word_t* row(int y) const;
+
+  // number of white pixels
+  size_t count() const;
+
+  void invert();
+
+  BinaryImage& operator&=(const BinaryImage& other);
+  BinaryImage& operator|=(const BinaryImage& other);
+  BinaryImage& operator^=(const BinaryImage& other);
+
+  friend bool operator==(const BinaryImage& one, const BinaryImage& two);
+  friend bool operator!=(const BinaryImage& one, const BinaryImage& two);
+
+private:
+  // zeroes bits past image width
+  void clearTail();
+
+  int height_;
+  int width_;
+  int wordsPerRow_;
+  std::vector<word_t> words_;
+};
+
+namespace
+{
+  int countTrailingZeros(uint64_t word)
+  {
+    assert(word != 0);
+#if defined(__GNUC__)  ||  defined(__clang__)
+    return __builtin_ctzll(word);
+#elif defined(_MSC_VER)  &&  defined(_M_X64)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return static_cast<int>(index);
+#else
+    int count = 0;
+    while (!(word & 1))
+      {
+        word >>= 1;
+        ++count;
+      }
+    return count;
+#endif
+  }
+
+  int countLeadingZeros(uint64_t word)
+  {
+    assert(word != 0);
+#if defined(__GNUC__)  ||  defined(__clang__)
+    return __builtin_clzll(word);
+#elif defined(_MSC_VER)  &&  defined(_M_X64)
+    unsigned long index;
+    _BitScanReverse64(&index, word);
+    return 63 - static_cast<int>(index);
+#else
+    int count = 0;
+    while (!(word >> 63))
+      {
+        word <<= 1;
+        ++count;
+      }
+    return count;
+#endif
+  }
+
+  int popCount(uint64_t word)
+  {
+#if defined(__GNUC__)  ||  defined(__clang__)
+    return __builtin_popcountll(word);
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ull);
+    word = (word & 0x3333333333333333ull) + ((word >> 2) & 0x3333333333333333ull);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0full;
+    return static_cast<int>((word * 0x0101010101010101ull) >> 56);
+#endif
+  }
+
+  // word with bits [from, 63] set
+  uint64_t bitsFrom(int from)
+  {
+    return ~uint64_t(0) << from;
+  }
+
+  // word with bits [0, to] set
+  uint64_t bitsTo(int to)
+  {
+    return ~uint64_t(0) >> (63 - to);
+  }
+
+  void packScalar(const uint8_t* src, uint64_t* dst, int width, uint8_t thr)
+  {
+    for (int w = 0; w * 64 < width; ++w)
+      {
+        int count = std::min(64, width - w * 64);
+        uint64_t word = 0;
+        for (int i = 0; i < count; ++i)
+          word |= uint64_t(src[w * 64 + i] >= thr) << i;
+        dst[w] = word;
+      }
+  }
+
+#ifdef GRAYIMAGE_X86
+  GRAYIMAGE_TARGET("sse2")
+  void packSse2(const uint8_t* src, uint64_t* dst, int width, uint8_t thr)
+  {
+    const __m128i t = _mm_set1_epi8(static_cast<char>(thr));
+    int w = 0;
+    for (; (w + 1) * 64 <= width; ++w)
+      {
+        uint64_t word = 0;
+        for (int k = 0; k < 4; ++k)
+          {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + w * 64 + k * 16));
+            uint64_t bits = static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v)));
+            word |= bits << (k * 16);
+          }
+        dst[w] = word;
+      }
+    packScalar(src + w * 64, dst + w, width - w * 64, thr);
+  }
+
+  GRAYIMAGE_TARGET("avx2")
+  void packAvx2(const uint8_t* src, uint64_t* dst, int width, uint8_t thr)
+  {
+    const __m256i t = _mm256_set1_epi8(static_cast<char>(thr));
+    int w = 0;
+    for (; (w + 1) * 64 <= width; ++w)
+      {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + w * 64));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + w * 64 + 32));
+        uint64_t low = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v0, t), v0)));
+        uint64_t high = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(v1, t), v1)));
+        dst[w] = low | (high << 32);
+      }
+    packScalar(src + w * 64, dst + w, width - w * 64, thr);
+  }
+#endif
+
+  // bit x of dst is set iff src[x] >= thr
+  void packRow(const uint8_t* src, uint64_t* dst, int width, uint8_t thr)
+  {
+    switch (simdLevel())
+      {
+#ifdef GRAYIMAGE_X86
+      case SIMD_AVX2:
+        packAvx2(src, dst, width, thr);
+        return;
+      case SIMD_SSE2:
+        packSse2(src, dst, width, thr);
+        return;
+#endif
+      default:
+        packScalar(src, dst, width, thr);
+      }
+  }
+
+  // 8 pixels for each value of byte of packed row
+  struct UnpackTable
+  {
+    UnpackTable()
+    {
+      for (int b = 0; b < 256; ++b)
+        for (int i = 0; i < 8; ++i)
+          pixels[b][i] = (b >> i) & 1 ? 255 : 0;
+    }
+
+    uint8_t pixels[256][8];
+  };
+
+  void unpackRow(const uint64_t* src, uint8_t* dst, int width)
+  {
+    static const UnpackTable table;
+    int x = 0;
+    for (; x + 8 <= width; x += 8)
+      std::memcpy(dst + x, table.pixels[(src[x / 64] >> (x % 64)) & 0xff], 8);
+    for (; x < width; ++x)
+      dst[x] = (src[x / 64] >> (x % 64)) & 1 ? 255 : 0;
+  }
+}
+
+BinaryImage::BinaryImage()
+  : height_(0)
+  , width_(0)
+  , wordsPerRow_(0)
+{
+}
+
+BinaryImage::BinaryImage(int height, int width)
+  : height_(height)
+  , width_(width)
+  , wordsPerRow_((width + 63) / 64)
+  , words_(static_cast<size_t>(height) * ((width + 63) / 64))
+{
+  assert(height > 0  &&  width > 0);
+}
+
+BinaryImage::BinaryImage(const GrayImageView& image)
+  : height_(0)
+  , width_(0)
+  , wordsPerRow_(0)
+{
+  if (image.getHeight()  &&  image.getWidth())
+    {
+      resize(image.getHeight(), image.getWidth());
+      for (int y = 0; y < height_; ++y)
+        packRow(image.row(y), row(y), width_, 1);
+    }
+}
+
+GrayImage BinaryImage::toGrayImage() const
+{
+  // single named result for return value optimization
+  GrayImage result;
+  if (!height_)
+    return result;
+
+  result.reshape(height_, width_);
+  for (int y = 0; y < height_; ++y)
+    unpackRow(row(y), result.row(y), width_);
+
+  // unpacked pixels are 0 and 255, let isBinary() know it without scan
+  result.binary_ = true;
+  return result;
+}
+
+bool BinaryImage::get(int y, int x) const
+{
+  assert(y >= 0  &&  y < height_);
+  assert(x >= 0  &&  x < width_);
+  return (words_[y * wordsPerRow_ + x / 64] >> (x % 64)) & 1;
+}
+
+void BinaryImage::set(int y, int x, bool white)
+{
+  assert(y >= 0  &&  y < height_);
+  assert(x >= 0  &&  x < width_);
+  word_t& word = words_[y * wordsPerRow_ + x / 64];
+  word_t bit = word_t(1) << (x % 64);
+  word = white ? word | bit : word & ~bit;
+}
+
+void BinaryImage::resize(int height, int width)
+{
+  assert(height > 0  &&  width > 0);
+  height_ = height;
+  width_ = width;
+  wordsPerRow_ = (width + 63) / 64;
+  std::vector<word_t> words(static_cast<size_t>(height) * wordsPerRow_);
+  words_.swap(words);
+}
+
+void BinaryImage::fill(bool white)
+{
+  std::fill(words_.begin(), words_.end(), white ? ~word_t(0) : 0);
+  clearTail();
+}
+
+int BinaryImage::getHeight() const
+{
+  return height_;
+}
+
+int BinaryImage::getWidth() const
+{
+  return width_;
+}
+
+int BinaryImage::getWordsPerRow() const
+{
+  return wordsPerRow_;
+}
+
+BinaryImage::word_t* BinaryImage::row(int y)
+{
+  assert(y >= 0  &&  y < height_);
+  return &words_[y * wordsPerRow_];
+}
+
+const BinaryImage::word_t* BinaryImage::row(int y) const
+{
+  assert(y >= 0  &&  y < height_);
+  return &words_[y * wordsPerRow_];
+}
+
+size_t BinaryImage::count() const
+{
+  size_t result = 0;
+  for (size_t i = 0; i < words_.size(); ++i)
+    result += popCount(words_[i]);
+  return result;
+}
+
+void BinaryImage::invert()
+{
+  for (size_t i = 0; i < words_.size(); ++i)
+    words_[i] = ~words_[i];
+  clearTail();
+}
+
+BinaryImage& BinaryImage::operator&=(const BinaryImage& other)
+{
+  assert(height_ == other.height_  &&  width_ == other.width_);
+  for (size_t i = 0; i < words_.size(); ++i)
+    words_[i] &= other.words_[i];
+  return *this;
+}
+
+BinaryImage& BinaryImage::operator|=(const BinaryImage& other)
+{
+  assert(height_ == other.height_  &&  width_ == other.width_);
+  for (size_t i = 0; i < words_.size(); ++i)
+    words_[i] |= other.words_[i];
+  return *this;
+}
+
+BinaryImage& BinaryImage::operator^=(const BinaryImage& other)
+{
+  assert(height_ == other.height_  &&  width_ == other.width_);
+  for (size_t i = 0; i < words_.size(); ++i)
+    words_[i] ^= other.words_[i];
+  return *this;
+}
+
+void BinaryImage::clearTail()
+{
+  if (width_ % 64 == 0)
+    return;
+
+  word_t mask = bitsTo(width_ % 64 - 1);
+  for (int y = 0; y < height_; ++y)
+    words_[y * wordsPerRow_ + wordsPerRow_ - 1] &= mask;
+}
+
+inline bool operator==(const BinaryImage& one, const BinaryImage& two)
+{
+  return one.height_ == two.height_
+      &&  one.width_ == two.width_
+      &&  one.words_ == two.words_;
+}
+
+inline bool operator!=(const BinaryImage& one, const BinaryImage& two)
+{
+  return !(one == two);
+}
+
+inline BinaryImage operator&(BinaryImage one, const BinaryImage& two)
+{
+  return one &= two;
+}
+
+inline BinaryImage operator|(BinaryImage one, const BinaryImage& two)
+{
+  return one |= two;
+}
+
+inline BinaryImage operator^(BinaryImage one, const BinaryImage& two)
+{
+  return one ^= two;
+}
+
+// Same as threshold(), but writes packed result: pixels less than thr become
+// black, others white
+void threshold(const GrayImageView& image, uint8_t thr, BinaryImage& result)
+{
+  GRAYIMAGE_TIMED(OP_THRESHOLD, image.getHeight(), image.getWidth(), 1.125);
+  if (!image.getHeight()  ||  !image.getWidth())
+    {
+      result = BinaryImage();
+      return;
+    }
+
+  if (result.getHeight() != image.getHeight()  ||  result.getWidth() != image.getWidth())
+    result.resize(image.getHeight(), image.getWidth());
+
+  for (int y = 0; y < image.getHeight(); ++y)
+    packRow(image.row(y), result.row(y), image.getWidth(), thr);
+}
+
+namespace
+{
+  // Packed row of pixels not fillable by flood fill: white in source or
+  // already marked. Runs are found 64 pixels at a time with bit scans.
+  class BlockedRow
+  {
+  public:
+    BlockedRow(const uint64_t* src, const uint64_t* mark, int width)
+      : src_(src), mark_(mark), width_(width) {}
+
+    // first x in [from, to] that is not blocked, to + 1 if none
+    int findFree(int from, int to) const
+    {
+      for (int w = from / 64; w * 64 <= to; ++w)
+        {
+          uint64_t free = ~word(w) & (w == from / 64 ? bitsFrom(from % 64) : ~uint64_t(0));
+          if (free)
+            return std::min(to + 1, w * 64 + countTrailingZeros(free));
+        }
+      return to + 1;
+    }
+
+    // first blocked x >= from, width if none
+    int findBlocked(int from) const
+    {
+      for (int w = from / 64; w * 64 < width_; ++w)
+        {
+          uint64_t blocked = word(w) & (w == from / 64 ? bitsFrom(from % 64) : ~uint64_t(0));
+          if (blocked)
+            return std::min(width_, w * 64 + countTrailingZeros(blocked));
+        }
+      return width_;
+    }
+
+    // last blocked x <= from, -1 if none
+    int findBlockedBackward(int from) const
+    {
+      for (int w = from / 64; w >= 0; --w)
+        {
+          uint64_t blocked = word(w) & (w == from / 64 ? bitsTo(from % 64) : ~uint64_t(0));
+          if (blocked)
+            return w * 64 + 63 - countLeadingZeros(blocked);
+        }
+      return -1;
+    }
+
+  private:
+    uint64_t word(int w) const
+    {
+      return src_[w] | mark_[w];
+    }
+
+    const uint64_t* src_;
+    const uint64_t* mark_;
+    int width_;
+  };
+
+  // sets bits [from, to] of packed row
+  void setBits(uint64_t* row, int from, int to)
+  {
+    int first = from / 64;
+    int last = to / 64;
+    if (first == last)
+      {
+        row[first] |= bitsFrom(from % 64) & bitsTo(to % 64);
+        return;
+      }
+
+    row[first] |= bitsFrom(from % 64);
+    for (int w = first + 1; w < last; ++w)
+      row[w] = ~uint64_t(0);
+    row[last] |= bitsTo(to % 64);
+  }
+
+  // Pixels not set in image and mark are fillable, runs are found and
+  // filled word by word
+  class BitFillGrid
+  {
+  public:
+    BitFillGrid(const BinaryImage& image, BinaryImage& mark)
+      : image_(image), mark_(mark), width_(image.getWidth()) {}
+
+    int findFree(int y, int from, int to) const
+    {
+      return BlockedRow(image_.row(y), mark_.row(y), width_).findFree(from, to);
+    }
+
+    int runBegin(int y, int x) const
+    {
+      return x > 0 ? BlockedRow(image_.row(y), mark_.row(y), width_).findBlockedBackward(x - 1) + 1 : 0;
+    }
+
+    int runEnd(int y, int x) const
+    {
+      return BlockedRow(image_.row(y), mark_.row(y), width_).findBlocked(x) - 1;
+    }
+
+    void fill(int y, int x1, int x2)
+    {
+      setBits(mark_.row(y), x1, x2);
+    }
+
+  private:
+    const BinaryImage& image_;
+    BinaryImage& mark_;
+    int width_;
+  };
+
+  // Same scanline flood fill as for GrayImage, mark must be black initially
+  void fillBackground(const BinaryImage& image, BinaryImage& mark)
+  {
+    BitFillGrid grid(image, mark);
+    fillFromBorder(grid, image.getHeight(), image.getWidth());
+  }
+}
+
+// Same as binaryFillHoles() for GrayImage
+BinaryImage binaryFillHoles(const BinaryImage& image)
+{
+  GRAYIMAGE_TIMED(OP_FILL_HOLES, image.getHeight(), image.getWidth(), 0.25);
+  if (!image.getHeight())
+    return BinaryImage();
+
+  BinaryImage result(image.getHeight(), image.getWidth());
+  fillBackground(image, result);
+  result.invert();
+  return result;
+}
+
+// Same as binaryBackground() for GrayImage
+BinaryImage binaryBackground(const BinaryImage& image)
+{
+  GRAYIMAGE_TIMED(OP_BACKGROUND, image.getHeight(), image.getWidth(), 0.25);
+  if (!image.getHeight())
+    return BinaryImage();
+
+  BinaryImage result(image.getHeight(), image.getWidth());
+  fillBackground(image, result);
+  return result;
+}
+
+// Morphology with rectangular structuring element of seHeight * seWidth pixels.
+// Erosion takes minimum of window of rows [y - (seHeight - 1) / 2, y + seHeight / 2]
+// and columns [x - (seWidth - 1) / 2, x + seWidth / 2], dilation takes maximum
+// of reflected window, so that opening and closing are exact for even sizes too.
+// Pixels outside of image are 0 as everywhere else, so erosion clears pixels
+// near border. Van Herk / Gil-Werman algorithm makes cost per pixel
+// independent of window size.
+
+namespace
+{
+#ifdef GRAYIMAGE_X86
+  GRAYIMAGE_TARGET("sse2")
+  void combineSse2(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count, bool maximum)
+  {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         maximum ? _mm_max_epu8(va, vb) : _mm_min_epu8(va, vb));
+      }
+    for (; i < count; ++i)
+      dst[i] = maximum ? std::max(a[i], b[i]) : std::min(a[i], b[i]);
+  }
+
+  GRAYIMAGE_TARGET("avx2")
+  void combineAvx2(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count, bool maximum)
+  {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+      {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+                            maximum ? _mm256_max_epu8(va, vb) : _mm256_min_epu8(va, vb));
+      }
+    combineSse2(a + i, b + i, dst + i, count - i, maximum);
+  }
+#endif
+
+#ifdef GRAYIMAGE_NEON
+  void combineNeon(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count, bool maximum)
+  {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      {
+        uint8x16_t va = vld1q_u8(a + i);
+        uint8x16_t vb = vld1q_u8(b + i);
+        vst1q_u8(dst + i, maximum ? vmaxq_u8(va, vb) : vminq_u8(va, vb));
+      }
+    for (; i < count; ++i)
+      dst[i] = maximum ? std::max(a[i], b[i]) : std::min(a[i], b[i]);
+  }
+#endif
+
+  // dst[i] = max(a[i], b[i]) or min(a[i], b[i]), dst may be a or b
+  void combineRows(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count, bool maximum)
+  {
+    switch (simdLevel())
+      {
+#ifdef GRAYIMAGE_X86
+      case SIMD_AVX2:
+        combineAvx2(a, b, dst, count, maximum);
+        return;
+      case SIMD_SSE2:
+        combineSse2(a, b, dst, count, maximum);
+        return;
+#endif
+#ifdef GRAYIMAGE_NEON
+      case SIMD_NEON:
+        combineNeon(a, b, dst, count, maximum);
+        return;
+#endif
+      default:
+        for (size_t i = 0; i < count; ++i)
+          dst[i] = maximum ? std::max(a[i], b[i]) : std::min(a[i], b[i]);
+      }
+  }
+
+  struct CombinePixels
+  {
+    explicit CombinePixels(bool maximum) : maximum(maximum) {}
+
+    void operator()(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count) const
+    {
+      combineRows(a, b, dst, count, maximum);
+    }
+
+    bool maximum;
+  };
+
+  // AND of words for erosion, OR for dilation
+  struct CombineWords
+  {
+    explicit CombineWords(bool any) : any(any) {}
+
+    void operator()(const uint64_t* a, const uint64_t* b, uint64_t* dst, size_t count) const
+    {
+      if (any)
+        for (size_t i = 0; i < count; ++i)
+          dst[i] = a[i] | b[i];
+      else
+        for (size_t i = 0; i < count; ++i)
+          dst[i] = a[i] & b[i];
+    }
+
+    bool any;
+  };
+
+  // Van Herk / Gil-Werman over rows: padded rows, where image row r is
+  // padded row r + before and others are 0, are split in blocks of k rows.
+  // Prefix g and suffix h are combined inside of each block, then window of
+  // padded rows [y, y + k - 1] is h[y] combined with g[y + k - 1].
+  // Whole rows are combined at once, only two blocks are kept.
+  template <typename T, typename Combine>
+  void combineWindowRows(const T* src, size_t srcStride, T* dst, size_t dstStride,
+                         int height, size_t rowSize, int k, int before, Combine combine)
+  {
+    std::vector<T> zero(rowSize);
+    std::vector<T> g(k * rowSize);
+    std::vector<T> h(k * rowSize);
+
+    for (int block = 0; block * k < height; ++block)
+      {
+        // image row of padded row p, or zero row
+        int first = block * k - before;
+        const T* row = first + k - 1 >= 0  &&  first + k - 1 < height
+          ? src + (first + k - 1) * srcStride : &zero[0];
+        std::copy(row, row + rowSize, &h[(k - 1) * rowSize]);
+        for (int j = k - 2; j >= 0; --j)
+          {
+            row = first + j >= 0  &&  first + j < height ? src + (first + j) * srcStride : &zero[0];
+            combine(row, &h[(j + 1) * rowSize], &h[j * rowSize], rowSize);
+          }
+
+        int next = first + k;
+        row = next >= 0  &&  next < height ? src + next * srcStride : &zero[0];
+        std::copy(row, row + rowSize, &g[0]);
+        for (int j = 1; j < k - 1; ++j)
+          {
+            row = next + j >= 0  &&  next + j < height ? src + (next + j) * srcStride : &zero[0];
+            combine(&g[(j - 1) * rowSize], row, &g[j * rowSize], rowSize);
+          }
+
+        for (int j = 0; j < k  &&  block * k + j < height; ++j)
+          {
+            T* out = dst + (block * k + j) * dstStride;
+            if (j == 0)
+              std::copy(&h[0], &h[0] + rowSize, out);
+            else
+              combine(&h[j * rowSize], &g[(j - 1) * rowSize], out, rowSize);
+          }
+      }
+  }
+
+  struct MinPixel
+  {
+    uint8_t operator()(uint8_t a, uint8_t b) const
+    {
+      return std::min(a, b);
+    }
+  };
+
+  struct MaxPixel
+  {
+    uint8_t operator()(uint8_t a, uint8_t b) const
+    {
+      return std::max(a, b);
+    }
+  };
+
+  // Same as above along a row, g and h are scratch buffers. Running values
+  // are kept in registers, last step combines whole arrays.
+  template <typename Combine>
+  void combineWindowPixels(const uint8_t* src, uint8_t* dst, int width, int k, int before, Combine combine,
+                           bool maximum, std::vector<uint8_t>& g, std::vector<uint8_t>& h)
+  {
+    int padded = (width + k - 1 + k - 1) / k * k;
+    h.assign(padded, 0);
+    std::memcpy(&h[before], src, width);
+    g.resize(padded);
+
+    for (int block = 0; block < padded; block += k)
+      {
+        uint8_t value = h[block];
+        g[block] = value;
+        for (int p = block + 1; p < block + k; ++p)
+          {
+            value = combine(value, h[p]);
+            g[p] = value;
+          }
+        value = h[block + k - 1];
+        for (int p = block + k - 2; p >= block; --p)
+          {
+            value = combine(value, h[p]);
+            h[p] = value;
+          }
+      }
+
+    // at block start h alone covers window, g there is combined over the
+    // same block
+    combineRows(&h[0], &g[k - 1], dst, width, maximum);
+  }
+
+  void morphology(const GrayImageView& image, int seHeight, int seWidth, bool dilation, GrayImage& result)
+  {
+    GRAYIMAGE_TIMED(OP_MORPHOLOGY, image.getHeight(), image.getWidth(), 2);
+    assert(seHeight > 0  &&  seWidth > 0);
+    int height = image.getHeight();
+    int width = image.getWidth();
+    if (!height  ||  !width)
+      {
+        result.reshape(height, width);
+        return;
+      }
+
+    // window of dilation is reflected
+    int top = dilation ? seHeight / 2 : (seHeight - 1) / 2;
+    int left = dilation ? seWidth / 2 : (seWidth - 1) / 2;
+
+    GrayImage rows;
+    const uint8_t* src = image.row(0);
+    size_t stride = image.getStride();
+    if (seWidth > 1)
+      {
+        rows.reshape(height, width);
+        std::vector<uint8_t> g, h;
+        for (int y = 0; y < height; ++y)
+          if (dilation)
+            combineWindowPixels(image.row(y), rows.row(y), width, seWidth, left, MaxPixel(), true, g, h);
+          else
+            combineWindowPixels(image.row(y), rows.row(y), width, seWidth, left, MinPixel(), false, g, h);
+        src = rows.row(0);
+        stride = width;
+      }
+
+    if (seHeight == 1  &&  seWidth > 1)
+      {
+        result.swap(rows);
+        return;
+      }
+
+    result.reshape(height, width);
+    if (seHeight == 1)
+      for (int y = 0; y < height; ++y)
+        std::memcpy(result.row(y), image.row(y), width);
+    else
+      combineWindowRows(src, stride, result.data(), width, height, width, seHeight, top,
+                        CombinePixels(dilation));
+  }
+
+  // out bit x = in bit x + shift, bits past end of row are 0
+  void shiftWordsDown(const uint64_t* in, uint64_t* out, int words, int shift)
+  {
+    int q = shift / 64;
+    int r = shift % 64;
+    for (int w = 0; w < words; ++w)
+      {
+        uint64_t low = w + q < words ? in[w + q] : 0;
+        uint64_t high = w + q + 1 < words ? in[w + q + 1] : 0;
+        out[w] = r ? (low >> r) | (high << (64 - r)) : low;
+      }
+  }
+
+  // out bit x = in bit x - shift, bits before start of row are 0
+  void shiftWordsUp(const uint64_t* in, uint64_t* out, int words, int shift)
+  {
+    int q = shift / 64;
+    int r = shift % 64;
+    for (int w = words - 1; w >= 0; --w)
+      {
+        uint64_t high = w - q >= 0 ? in[w - q] : 0;
+        uint64_t low = w - q - 1 >= 0 ? in[w - q - 1] : 0;
+        out[w] = r ? (high << r) | (low >> (64 - r)) : high;
+      }
+  }
+
+  // Window [x - before, x - before + k - 1] of packed row: row is shifted
+  // into padded row, so that window starts at x, then windows of doubling
+  // length are combined with shifted copies of themselves
+  void combineWindowBits(const uint64_t* src, uint64_t* dst, int width, int k, int before, bool any,
+                         std::vector<uint64_t>& padded, std::vector<uint64_t>& shifted)
+  {
+    int words = (width + 63) / 64;
+    int paddedWords = (width + k - 1 + 63) / 64;
+    padded.assign(paddedWords, 0);
+    shifted.resize(paddedWords);
+    CombineWords combine(any);
+    std::copy(src, src + words, shifted.begin());
+    std::fill(shifted.begin() + words, shifted.end(), 0);
+    shiftWordsUp(&shifted[0], &padded[0], paddedWords, before);
+
+    int length = 1;
+    for (; 2 * length <= k; length *= 2)
+      {
+        shiftWordsDown(&padded[0], &shifted[0], paddedWords, length);
+        combine(&padded[0], &shifted[0], &padded[0], paddedWords);
+      }
+    if (length < k)
+      {
+        shiftWordsDown(&padded[0], &shifted[0], paddedWords, k - length);
+        combine(&padded[0], &shifted[0], &padded[0], paddedWords);
+      }
+
+    std::copy(padded.begin(), padded.begin() + words, dst);
+    if (width % 64)
+      dst[words - 1] &= bitsTo(width % 64 - 1);
+  }
+
+  void morphology(const BinaryImage& image, int seHeight, int seWidth, bool dilation, BinaryImage& result)
+  {
+    GRAYIMAGE_TIMED(OP_MORPHOLOGY, image.getHeight(), image.getWidth(), 0.25);
+    assert(seHeight > 0  &&  seWidth > 0);
+    int height = image.getHeight();
+    int width = image.getWidth();
+    if (!height  ||  !width)
+      {
+        result = BinaryImage();
+        return;
+      }
+
+    result.resize(height, width);
+    int top = dilation ? seHeight / 2 : (seHeight - 1) / 2;
+    int left = dilation ? seWidth / 2 : (seWidth - 1) / 2;
+    int words = image.getWordsPerRow();
+
+    BinaryImage rows(height, width);
+    std::vector<uint64_t> padded, shifted;
+    for (int y = 0; y < height; ++y)
+      combineWindowBits(image.row(y), rows.row(y), width, seWidth, left, dilation, padded, shifted);
+    combineWindowRows(rows.row(0), words, result.row(0), words, height, words, seHeight, top,
+                      CombineWords(dilation));
+  }
+}
+
+GrayImage erode(const GrayImageView& image, int seHeight, int seWidth)
+{
+  GrayImage result;
+  morphology(image, seHeight, seWidth, false, result);
+  return result;
+}
+
+// Same as above, result must not be the source image
+void erode(const GrayImageView& image, int seHeight, int seWidth, GrayImage& result)
+{
+  morphology(image, seHeight, seWidth, false, result);
+}
+
+GrayImage dilate(const GrayImageView& image, int seHeight, int seWidth)
+{
+  GrayImage result;
+  morphology(image, seHeight, seWidth, true, result);
+  return result;
+}
+
+void dilate(const GrayImageView& image, int seHeight, int seWidth, GrayImage& result)
+{
+  morphology(image, seHeight, seWidth, true, result);
+}
+
+// erosion followed by dilation
+GrayImage opening(const GrayImageView& image, int seHeight, int seWidth)
+{
+  GrayImage eroded;
+  morphology(image, seHeight, seWidth, false, eroded);
+  GrayImage result;
+  morphology(eroded, seHeight, seWidth, true, result);
+  return result;
+}
+
+// dilation followed by erosion
+GrayImage closing(const GrayImageView& image, int seHeight, int seWidth)
+{
+  GrayImage dilated;
+  morphology(image, seHeight, seWidth, true, dilated);
+  GrayImage result;
+  morphology(dilated, seHeight, seWidth, false, result);
+  return result;
+}
+
+BinaryImage erode(const BinaryImage& image, int seHeight, int seWidth)
+{
+  BinaryImage result;
+  morphology(image, seHeight, seWidth, false, result);
+  return result;
+}
+
+BinaryImage dilate(const BinaryImage& image, int seHeight, int seWidth)
+{
+  BinaryImage result;
+  morphology(image, seHeight, seWidth, true, result);
+  return result;
+}
+
+// erosion followed by dilation
+BinaryImage opening(const BinaryImage& image, int seHeight, int seWidth)
+{
+  return dilate(erode(image, seHeight, seWidth), seHeight, seWidth);
+}
+
+// dilation followed by erosion
+BinaryImage closing(const BinaryImage& image, int seHeight, int seWidth)
+{
+  return erode(dilate(image, seHeight, seWidth), seHeight, seWidth);
+}
+
+// Summed-area table: entry (y, x) holds sum of pixels above and left of
+// (y, x), table has one more row and column than image, so sum over any
+// rectangle takes four lookups. Entries are 32-bit when sum of whole image
+// fits, 64-bit otherwise. Table of squares of pixels is built on request.
+class IntegralImage
+{
+public:
+  // creates empty table
+  IntegralImage();
+
+  explicit IntegralImage(const GrayImageView& image, bool squares = false);
+
+  // table is rebuilt, buffers are reused
+  void build(const GrayImageView& image, bool squares = false);
+
+  int getHeight() const;
+  int getWidth() const;
+
+  // box must be inside of image
+  uint64_t sum(const Tile& box) const;
+  double mean(const Tile& box) const;
+
+  // only if table was built with squares
+  uint64_t sumOfSquares(const Tile& box) const;
+  double variance(const Tile& box) const;
+
+private:
+  template <typename T>
+  static void buildTable(const GrayImageView& image, bool squares, std::vector<T>& table);
+
+  template <typename T>
+  uint64_t lookup(const std::vector<T>& table, const Tile& box) const;
+
+  int height_;
+  int width_;
+  bool squares_;
+  // one of each pair is used
+  std::vector<uint32_t> sums32_;
+  std::vector<uint64_t> sums64_;
+  std::vector<uint32_t> squares32_;
+  std::vector<uint64_t> squares64_;
+};
+
+IntegralImage::IntegralImage()
+  : height_(0)
+  , width_(0)
+  , squares_(false)
+{
+}
+
+IntegralImage::IntegralImage(const GrayImageView& image, bool squares)
+  : height_(0)
+  , width_(0)
+  , squares_(false)
+{
+  build(image, squares);
+}
+
+void IntegralImage::build(const GrayImageView& image, bool squares)
+{
+  height_ = image.getHeight();
+  width_ = image.getWidth();
+  squares_ = squares;
+
+  // sums are exact in unsigned arithmetic modulo 2^32 as long as result
+  // fits, table entries may wrap around
+  uint64_t pixels = static_cast<uint64_t>(height_) * width_;
+  sums32_.clear();
+  sums64_.clear();
+  squares32_.clear();
+  squares64_.clear();
+  if (pixels * 255 <= 0xffffffffu)
+    buildTable(image, false, sums32_);
+  else
+    buildTable(image, false, sums64_);
+
+  if (!squares)
+    return;
+  if (pixels * 255 * 255 <= 0xffffffffu)
+    buildTable(image, true, squares32_);
+  else
+    buildTable(image, true, squares64_);
+}
+
+template <typename T>
+void IntegralImage::buildTable(const GrayImageView& image, bool squares, std::vector<T>& table)
+{
+  int height = image.getHeight();
+  int width = image.getWidth();
+  size_t stride = width + 1;
+  table.assign((height + 1) * stride, 0);
+  for (int y = 0; y < height; ++y)
+    {
+      const GrayImage::pixel_t* src = image.row(y);
+      const T* above = &table[y * stride];
+      T* row = &table[(y + 1) * stride];
+      T rowSum = 0;
+      for (int x = 0; x < width; ++x)
+        {
+          rowSum += squares ? T(src[x]) * src[x] : T(src[x]);
+          row[x + 1] = above[x + 1] + rowSum;
+        }
+    }
+}
+
+template <typename T>
+uint64_t IntegralImage::lookup(const std::vector<T>& table, const Tile& box) const
+{
+  assert(box.y >= 0  &&  box.x >= 0  &&  box.height >= 0  &&  box.width >= 0);
+  assert(box.y + box.height <= height_  &&  box.x + box.width <= width_);
+  size_t stride = width_ + 1;
+  size_t top = box.y * stride;
+  size_t bottom = (box.y + box.height) * stride;
+  T sum = table[bottom + box.x + box.width] - table[bottom + box.x]
+    - table[top + box.x + box.width] + table[top + box.x];
+  return sum;
+}
+
+int IntegralImage::getHeight() const
+{
+  return height_;
+}
+
+int IntegralImage::getWidth() const
+{
+  return width_;
+}
+
+uint64_t IntegralImage::sum(const Tile& box) const
+{
+  return sums64_.empty() ? lookup(sums32_, box) : lookup(sums64_, box);
+}
+
+double IntegralImage::mean(const Tile& box) const
+{
+  assert(box.height > 0  &&  box.width > 0);
+  return static_cast<double>(sum(box)) / (static_cast<double>(box.height) * box.width);
+}
+
+uint64_t IntegralImage::sumOfSquares(const Tile& box) const
+{
+  assert(squares_);
+  return squares64_.empty() ? lookup(squares32_, box) : lookup(squares64_, box);
+}
+
+double IntegralImage::variance(const Tile& box) const
+{
+  double area = static_cast<double>(box.height) * box.width;
+  double m = mean(box);
+  return std::max(0.0, static_cast<double>(sumOfSquares(box)) / area - m * m);
+}
+
+namespace
+{
+  // window of windowSize * windowSize pixels centered at (y, x), clipped
+  // to image
+  Tile centeredWindow(int y, int x, int windowSize, int height, int width)
+  {
+    int y1 = std::max(0, y - windowSize / 2);
+    int x1 = std::max(0, x - windowSize / 2);
+    int y2 = std::min(height, y - windowSize / 2 + windowSize);
+    int x2 = std::min(width, x - windowSize / 2 + windowSize);
+    Tile box = { y1, x1, y2 - y1, x2 - x1 };
+    return box;
+  }
+}
+
+// Adaptive thresholds: threshold of each pixel is found from mean (and
+// deviation) of window of windowSize * windowSize pixels centered at it.
+// Windows are clipped to image rather than padded with black, which would
+// darken borders. Pixels below threshold become 0, others 255.
+// Each pixel takes constant time thanks to integral image.
+
+// Bradley: threshold is mean lowered by given percent
+void thresholdBradley(const GrayImageView& image, int windowSize, int percent, GrayImage& result)
+{
+  GRAYIMAGE_TIMED(OP_ADAPTIVE_THRESHOLD, image.getHeight(), image.getWidth(), 2);
+  assert(windowSize > 0  &&  percent >= 0  &&  percent <= 100);
+  int height = image.getHeight();
+  int width = image.getWidth();
+  result.reshape(height, width);
+  if (!height  ||  !width)
+    return;
+
+  IntegralImage integral(image);
+  for (int y = 0; y < height; ++y)
+    {
+      const GrayImage::pixel_t* src = image.row(y);
+      GrayImage::pixel_t* dst = result.row(y);
+      for (int x = 0; x < width; ++x)
+        {
+          // v < mean * (100 - percent) / 100 in integers
+          Tile box = centeredWindow(y, x, windowSize, height, width);
+          uint64_t area = static_cast<uint64_t>(box.height) * box.width;
+          dst[x] = src[x] * area * 100 < integral.sum(box) * (100 - percent) ? 0 : 255;
+        }
+    }
+}
+
+GrayImage thresholdBradley(const GrayImageView& image, int windowSize, int percent = 15)
+{
+  GrayImage result;
+  thresholdBradley(image, windowSize, percent, result);
+  return result;
+}
+
+// Sauvola: threshold is mean * (1 + k * (deviation / range - 1)), so that
+// flat regions get threshold below their mean
+void thresholdSauvola(const GrayImageView& image, int windowSize, double k, double range, GrayImage& result)
+{
+  GRAYIMAGE_TIMED(OP_ADAPTIVE_THRESHOLD, image.getHeight(), image.getWidth(), 2);
+  assert(windowSize > 0  &&  range > 0);
+  int height = image.getHeight();
+  int width = image.getWidth();
+  result.reshape(height, width);
+  if (!height  ||  !width)
+    return;
+
+  // area changes only near borders, so its reciprocal is cached
+  IntegralImage integral(image, true);
+  int area = 0;
+  double scale = 0;
+  for (int y = 0; y < height; ++y)
+    {
+      const GrayImage::pixel_t* src = image.row(y);
+      GrayImage::pixel_t* dst = result.row(y);
+      for (int x = 0; x < width; ++x)
+        {
+          Tile box = centeredWindow(y, x, windowSize, height, width);
+          if (box.height * box.width != area)
+            {
+              area = box.height * box.width;
+              scale = 1.0 / area;
+            }
+          double mean = static_cast<double>(integral.sum(box)) * scale;
+          double variance = std::max(0.0, static_cast<double>(integral.sumOfSquares(box)) * scale - mean * mean);
+          dst[x] = src[x] < mean * (1 + k * (std::sqrt(variance) / range - 1)) ? 0 : 255;
+        }
+    }
+}
+
+GrayImage thresholdSauvola(const GrayImageView& image, int windowSize, double k = 0.5, double range = 128)
+{
+  GrayImage result;
+  thresholdSauvola(image, windowSize, k, range, result);
+  return result;
+}
+
+// Parallel versions of pixel operations: rows are split into bands
+// processed by threads of pool, results are the same as of serial versions.
+
+namespace
+{
+  class LutRows : public RowTask
+  {
+  public:
+    LutRows(const GrayImageView& image, const LutKernel& kernel, GrayImage::pixel_t* result)
+      : image_(image), kernel_(kernel), result_(result) {}
+
+    void run(int yBegin, int yEnd)
+    {
+      int width = image_.getWidth();
+      if (image_.isContiguous())
+        kernel_.run(image_.row(yBegin), result_ + yBegin * width,
+                    static_cast<size_t>(yEnd - yBegin) * width);
+      else
+        for (int y = yBegin; y < yEnd; ++y)
+          kernel_.run(image_.row(y), result_ + y * width, width);
+    }
+
+  private:
+    const GrayImageView& image_;
+    const LutKernel& kernel_;
+    GrayImage::pixel_t* result_;
+  };
+
+  class IsBinaryRows : public RowTask
+  {
+  public:
+    explicit IsBinaryRows(const GrayImageView& image)
+      : image_(image), binary_(true) {}
+
+    void run(int yBegin, int yEnd)
+    {
+      // bands after first non-binary one are skipped
+      if (!result())
+        return;
+
+      if (!::isBinary(image_.subView(yBegin, 0, yEnd - yBegin, image_.getWidth())))
+        {
+          MutexLock lock(mutex_);
+          binary_ = false;
+        }
+    }
+
+    bool result()
+    {
+      MutexLock lock(mutex_);
+      return binary_;
+    }
+
+  private:
+    const GrayImageView& image_;
+    Mutex mutex_;
+    bool binary_;
+  };
+
+  class TranslateRows : public RowTask
+  {
+  public:
+    TranslateRows(const GrayImageView& image, int dy, int dx, GrayImage::pixel_t* result)
+      : image_(image), dy_(dy), dx_(dx), result_(result) {}
+
+    void run(int yBegin, int yEnd)
+    {
+      int width = image_.getWidth();
+      int height = image_.getHeight();
+      size_t span = width - std::abs(dx_);
+      int srcX = dx_ < 0 ? -dx_ : 0;
+      int dstX = dx_ > 0 ? dx_ : 0;
+      yBegin = std::max(yBegin, dy_);
+      yEnd = std::min(yEnd, height + dy_);
+      for (int y = yBegin; y < yEnd; ++y)
+        std::memcpy(result_ + y * width + dstX, image_.row(y - dy_) + srcX, span);
+    }
+
+  private:
+    const GrayImageView& image_;
+    int dy_;
+    int dx_;
+    GrayImage::pixel_t* result_;
+  };
+}
+
+void threshold(const GrayImageView& image, uint8_t thr, GrayImage& result, ThreadPool& pool);
+GrayImage threshold(const GrayImageView& image, uint8_t thr, ThreadPool& pool)
+{
+  GrayImage result;
+  threshold(image, thr, result, pool);
+  return result;
+}
+
+void applyLut(const GrayImageView& image, const uint8_t lut[256], GrayImage& result, ThreadPool& pool);
+void threshold(const GrayImageView& image, uint8_t thr, GrayImage& result, ThreadPool& pool)
+{
+  GRAYIMAGE_TIMED(OP_THRESHOLD, image.getHeight(), image.getWidth(), 2);
+  uint8_t lut[256];
+  makeThresholdLut(thr, lut);
+  applyLut(image, lut, result, pool);
+}
+
+GrayImage applyLut(const GrayImageView& image, const uint8_t lut[256], ThreadPool& pool)
+{
+  GrayImage result;
+  applyLut(image, lut, result, pool);
+  return result;
+}
+
+void applyLut(const GrayImageView& image, const uint8_t lut[256], GrayImage& result, ThreadPool& pool)
+{
+  GRAYIMAGE_TIMED(OP_APPLY_LUT, image.getHeight(), image.getWidth(), 2);
+  LutKernel kernel(lut);
+  result.reshape(image.getHeight(), image.getWidth());
+  if (!image.getHeight()  ||  !image.getWidth())
+    return;
+
+  LutRows task(image, kernel, result.data());
+  parallelForRows(pool, image.getHeight(), task);
+  result.binary_ = kernel.isBinary();
+}
+
+bool isBinary(const GrayImageView& image, ThreadPool& pool)
+{
+  if (!image.getHeight()  ||  !image.getWidth())
+    return false;
+
+  IsBinaryRows task(image);
+  parallelForRows(pool, image.getHeight(), task);
+  return task.result();
+}
+
+void translate(const GrayImageView& image, int dy, int dx, GrayImage& result, ThreadPool& pool);
+GrayImage translate(const GrayImageView& image, int dy, int dx, ThreadPool& pool)
+{
+  GrayImage result;
+  translate(image, dy, dx, result, pool);
+  return result;
+}
+
+void translate(const GrayImageView& image, int dy, int dx, GrayImage& result, ThreadPool& pool)
+{
+  GRAYIMAGE_TIMED(OP_TRANSLATE, image.getHeight(), image.getWidth(), 2);
+  assert(!sharesPixels(image, result));
+  int width = image.getWidth();
+  int height = image.getHeight();
+  if ((dy == 0  &&  dx == 0)  ||  !height  ||  !width)
+    {
+      translate(image, dy, dx, result);
+      return;
+    }
+
+  result.reshape(height, width);
+  result.fill(0);
+  if (std::abs(dx) >= width  ||  std::abs(dy) >= height)
+    return;
+
+  TranslateRows task(image, dy, dx, result.data());
+  parallelForRows(pool, height, task);
+}
+
+// Value of pixels sampled outside of image by subpixel translate
+enum BorderMode
+{
+  BORDER_CONSTANT,   // given border value
+  BORDER_REPLICATE,  // nearest pixel on image border
+  BORDER_WRAP        // image repeats periodically
+};
+
+namespace
+{
+  // dst[i] = (a[i] * (256 - f) + b[i] * f + 128) >> 8, 0 < f < 256.
+  // Sum fits in 16 bits, so SIMD versions multiply 16-bit lanes and give
+  // the same result.
+  void blendRowScalar(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count, int f)
+  {
+    int g = 256 - f;
+    for (size_t i = 0; i < count; ++i)
+      dst[i] = static_cast<uint8_t>((a[i] * g + b[i] * f + 128) >> 8);
+  }
+
+#ifdef GRAYIMAGE_X86
+  GRAYIMAGE_TARGET("sse2")
+  void blendRowSse2(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count, int f)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16(static_cast<short>(256 - f));
+    const __m128i wb = _mm_set1_epi16(static_cast<short>(f));
+    const __m128i half = _mm_set1_epi16(128);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                                    _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+        __m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                                     _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+        low = _mm_srli_epi16(_mm_add_epi16(low, half), 8);
+        high = _mm_srli_epi16(_mm_add_epi16(high, half), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(low, high));
+      }
+    blendRowScalar(a + i, b + i, dst + i, count - i, f);
+  }
+
+  GRAYIMAGE_TARGET("avx2")
+  void blendRowAvx2(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count, int f)
+  {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i wa = _mm256_set1_epi16(static_cast<short>(256 - f));
+    const __m256i wb = _mm256_set1_epi16(static_cast<short>(f));
+    const __m256i half = _mm256_set1_epi16(128);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+      {
+        // unpack and pack work within 128-bit lanes, so order is kept
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i low = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), wa),
+                                       _mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), wb));
+        __m256i high = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), wa),
+                                        _mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), wb));
+        low = _mm256_srli_epi16(_mm256_add_epi16(low, half), 8);
+        high = _mm256_srli_epi16(_mm256_add_epi16(high, half), 8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_packus_epi16(low, high));
+      }
+    blendRowSse2(a + i, b + i, dst + i, count - i, f);
+  }
+#endif
+
+#ifdef GRAYIMAGE_NEON
+  void blendRowNeon(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count, int f)
+  {
+    const uint8x8_t wa = vdup_n_u8(static_cast<uint8_t>(256 - f));
+    const uint8x8_t wb = vdup_n_u8(static_cast<uint8_t>(f));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+      {
+        uint16x8_t sum = vmlal_u8(vmull_u8(vld1_u8(a + i), wa), vld1_u8(b + i), wb);
+        vst1_u8(dst + i, vrshrn_n_u16(sum, 8));
+      }
+    blendRowScalar(a + i, b + i, dst + i, count - i, f);
+  }
+#endif
+
+  void blendRow(const uint8_t* a, const uint8_t* b, uint8_t* dst, size_t count, int f)
+  {
+    assert(f > 0  &&  f < 256);
+    switch (simdLevel())
+      {
+#ifdef GRAYIMAGE_X86
+      case SIMD_AVX2:
+        blendRowAvx2(a, b, dst, count, f);
+        break;
+      case SIMD_SSE2:
+        blendRowSse2(a, b, dst, count, f);
+        break;
+#endif
+#ifdef GRAYIMAGE_NEON
+      case SIMD_NEON:
+        blendRowNeon(a, b, dst, count, f);
+        break;
+#endif
+      default:
+        blendRowScalar(a, b, dst, count, f);
+      }
+  }
+
+  // Shift in 1/256 of pixel split into integral part and fraction 0..255.
+  // Shifts past image end give the same result as shift by size + 1, except
+  // for wrap, where shift is taken modulo size.
+  void splitShift(double shift, int size, BorderMode mode, int& whole, int& fraction)
+  {
+    if (mode == BORDER_WRAP)
+      shift = std::fmod(shift, static_cast<double>(size));
+    else
+      shift = std::max(-size - 1.0, std::min(size + 1.0, shift));
+
+    int fixed = static_cast<int>(std::floor(shift * 256 + 0.5));
+    whole = fixed >= 0 ? fixed / 256 : -((255 - fixed) / 256);
+    fraction = fixed - whole * 256;
+  }
+
+  // index i mapped inside [0, size) by border mode, -1 for constant border
+  int borderIndex(int i, int size, BorderMode mode)
+  {
+    if (i >= 0  &&  i < size)
+      return i;
+    if (mode == BORDER_REPLICATE)
+      return i < 0 ? 0 : size - 1;
+    if (mode == BORDER_WRAP)
+      return (i % size + size) % size;
+    return -1;
+  }
+
+  // Rows of result shifted by fractions of pixel: result(y, x) samples
+  // image at (y + oy + fy / 256, x + ox + fx / 256). Each row blends two
+  // source rows vertically, extends blended row by border mode to
+  // width + 1 pixels starting at column ox and blends neighbors of that.
+  class SubpixelRows : public RowTask
+  {
+  public:
+    SubpixelRows(const GrayImageView& image, int oy, int fy, int ox, int fx, BorderMode mode,
+                 uint8_t border, GrayImage::pixel_t* result)
+      : image_(image), oy_(oy), fy_(fy), ox_(ox), fx_(fx), mode_(mode), border_(border)
+      , result_(result) {}
+
+    void run(int yBegin, int yEnd)
+    {
+      int width = image_.getWidth();
+      int height = image_.getHeight();
+      std::vector<uint8_t> borderRow(width, border_);
+      std::vector<uint8_t> blended(width);
+      std::vector<uint8_t> extended(width + 1);
+
+      for (int y = yBegin; y < yEnd; ++y)
+        {
+          int r0 = borderIndex(y + oy_, height, mode_);
+          int r1 = borderIndex(y + oy_ + 1, height, mode_);
+          const uint8_t* row0 = r0 < 0 ? &borderRow[0] : image_.row(r0);
+          const uint8_t* row1 = r1 < 0 ? &borderRow[0] : image_.row(r1);
+          const uint8_t* source = row0;
+          if (fy_  &&  row0 != row1)
+            {
+              blendRow(row0, row1, &blended[0], width, fy_);
+              source = &blended[0];
+            }
+
+          GrayImage::pixel_t* dst = result_ + static_cast<size_t>(y) * width;
+          if (fx_ == 0  &&  ox_ == 0)
+            std::memcpy(dst, source, width);
+          else if (fx_ == 0)
+            extend(source, width, ox_, width, dst);
+          else
+            {
+              extend(source, width, ox_, width + 1, &extended[0]);
+              blendRow(&extended[0], &extended[1], dst, width, fx_);
+            }
+        }
+    }
+
+  private:
+    // dst[k] = row[borderIndex(first + k)] for k in [0, count)
+    void extend(const uint8_t* row, int width, int first, int count, uint8_t* dst) const
+    {
+      if (mode_ == BORDER_WRAP)
+        {
+          int x = borderIndex(first, width, mode_);
+          for (int k = 0; k < count; )
+            {
+              int n = std::min(count - k, width - x);
+              std::memcpy(dst + k, row + x, n);
+              k += n;
+              x = 0;
+            }
+          return;
+        }
+
+      bool replicate = mode_ == BORDER_REPLICATE;
+      int before = std::min(count, std::max(0, -first));
+      int inside = std::max(0, std::min(first + count, width) - std::max(first, 0));
+      std::memset(dst, replicate ? row[0] : border_, before);
+      std::memcpy(dst + before, row + std::max(first, 0), inside);
+      std::memset(dst + before + inside, replicate ? row[width - 1] : border_, count - before - inside);
+    }
+
+    const GrayImageView& image_;
+    int oy_;
+    int fy_;
+    int ox_;
+    int fx_;
+    BorderMode mode_;
+    uint8_t border_;
+    GrayImage::pixel_t* result_;
+  };
+}
+
+// Move each point (y, x) on source image to (y + dy, x + dx) on result image
+// for fractional dy and dx: result(y, x) is bilinear interpolation of image
+// at (y - dy, x - dx). Pixels sampled outside of image have value border for
+// BORDER_CONSTANT or are taken from inside of image by mode. Shifts are
+// rounded to 1/256 of pixel and interpolation is done in fixed point, first
+// along columns, then along rows, rounding after each. Whole shifts with
+// constant border 0 give the same result as translate(). Result must not be
+// the source image.
+void translateSubpixel(const GrayImageView& image, double dy, double dx, GrayImage& result,
+                       BorderMode mode = BORDER_CONSTANT, uint8_t border = 0);
+GrayImage translateSubpixel(const GrayImageView& image, double dy, double dx,
+                            BorderMode mode = BORDER_CONSTANT, uint8_t border = 0)
+{
+  GrayImage result;
+  translateSubpixel(image, dy, dx, result, mode, border);
+  return result;
+}
+
+void translateSubpixel(const GrayImageView& image, double dy, double dx, GrayImage& result,
+                       BorderMode mode, uint8_t border)
+{
+  GRAYIMAGE_TIMED(OP_TRANSLATE_SUBPIXEL, image.getHeight(), image.getWidth(), 2);
+  int height = image.getHeight();
+  int width = image.getWidth();
+  result.reshape(height, width);
+  if (!height  ||  !width)
+    return;
+
+  int oy, fy, ox, fx;
+  splitShift(-dy, height, mode, oy, fy);
+  splitShift(-dx, width, mode, ox, fx);
+  SubpixelRows task(image, oy, fy, ox, fx, mode, border, result.data());
+  task.run(0, height);
+}
+
+// same as above, rows are split between threads of pool
+void translateSubpixel(const GrayImageView& image, double dy, double dx, GrayImage& result,
+                       ThreadPool& pool, BorderMode mode = BORDER_CONSTANT, uint8_t border = 0)
+{
+  GRAYIMAGE_TIMED(OP_TRANSLATE_SUBPIXEL, image.getHeight(), image.getWidth(), 2);
+  int height = image.getHeight();
+  int width = image.getWidth();
+  result.reshape(height, width);
+  if (!height  ||  !width)
+    return;
+
+  int oy, fy, ox, fx;
+  splitShift(-dy, height, mode, oy, fy);
+  splitShift(-dx, width, mode, ox, fx);
+  SubpixelRows task(image, oy, fy, ox, fx, mode, border, result.data());
+  parallelForRows(pool, height, task);
+}
+
+// Affine map of point (y, x) to (yy * y + yx * x + y0, xy * y + xx * x + x0)
+struct AffineTransform
+{
+  double yy;
+  double yx;
+  double y0;
+  double xy;
+  double xx;
+  double x0;
+};
+
+// first applies second, then first
+AffineTransform operator*(const AffineTransform& first, const AffineTransform& second)
+{
+  AffineTransform result;
+  result.yy = first.yy * second.yy + first.yx * second.xy;
+  result.yx = first.yy * second.yx + first.yx * second.xx;
+  result.y0 = first.yy * second.y0 + first.yx * second.x0 + first.y0;
+  result.xy = first.xy * second.yy + first.xx * second.xy;
+  result.xx = first.xy * second.yx + first.xx * second.xx;
+  result.x0 = first.xy * second.y0 + first.xx * second.x0 + first.x0;
+  return result;
+}
+
+AffineTransform translation(double dy, double dx)
+{
+  AffineTransform result = { 1, 0, dy, 0, 1, dx };
+  return result;
+}
+
+AffineTransform scaling(double sy, double sx)
+{
+  AffineTransform result = { sy, 0, 0, 0, sx, 0 };
+  return result;
+}
+
+// x moves by sx * y, y by sy * x
+AffineTransform shear(double sy, double sx)
+{
+  AffineTransform result = { 1, sy, 0, sx, 1, 0 };
+  return result;
+}
+
+// Clockwise rotation by degrees, as seen with y growing down, around
+// (centerY, centerX). For square image of size n rotation by 90 degrees
+// around ((n - 1) / 2, (n - 1) / 2) is rotateCw90().
+AffineTransform rotation(double degrees, double centerY, double centerX)
+{
+  double radians = degrees * (3.14159265358979323846 / 180);
+  double c = std::cos(radians);
+  double s = std::sin(radians);
+  AffineTransform turn = { c, s, 0, -s, c, 0 };
+  return translation(centerY, centerX) * turn * translation(-centerY, -centerX);
+}
+
+// Returns -1 if transform maps plane to a line or point
+int invert(const AffineTransform& transform, AffineTransform& inverse)
+{
+  double det = transform.yy * transform.xx - transform.yx * transform.xy;
+  if (det == 0  ||  det != det)
+    return -1;
+
+  AffineTransform result;
+  result.yy = transform.xx / det;
+  result.yx = -transform.yx / det;
+  result.xy = -transform.xy / det;
+  result.xx = transform.yy / det;
+  result.y0 = -(result.yy * transform.y0 + result.yx * transform.x0);
+  result.x0 = -(result.xy * transform.y0 + result.xx * transform.x0);
+  inverse = result;
+  return 0;
+}
+
+enum Interpolation
+{
+  INTERPOLATION_NEAREST,
+  INTERPOLATION_BILINEAR
+};
+
+namespace
+{
+  // dst[i] = (a[i] * (256 - f[i]) + b[i] * f[i] + 128) >> 8, same as
+  // blendRow() but with weight per pixel, which may be 0
+  void blendRowVaryingScalar(const uint8_t* a, const uint8_t* b, const uint8_t* f, uint8_t* dst,
+                             size_t count)
+  {
+    for (size_t i = 0; i < count; ++i)
+      dst[i] = static_cast<uint8_t>((a[i] * (256 - f[i]) + b[i] * f[i] + 128) >> 8);
+  }
+
+#ifdef GRAYIMAGE_X86
+  // a * (256 - f) + b * f = (a << 8) + (b - a) * f, which fits in 16 bits
+  // being the sum of non-negative products
+  GRAYIMAGE_TARGET("sse2")
+  void blendRowVaryingSse2(const uint8_t* a, const uint8_t* b, const uint8_t* f, uint8_t* dst,
+                           size_t count)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(256);
+    const __m128i half = _mm_set1_epi16(128);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        __m128i vf = _mm_loadu_si128(reinterpret_cast<const __m128i*>(f + i));
+        __m128i fl = _mm_unpacklo_epi8(vf, zero);
+        __m128i fh = _mm_unpackhi_epi8(vf, zero);
+        __m128i low = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), _mm_sub_epi16(full, fl)),
+                                    _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), fl));
+        __m128i high = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), _mm_sub_epi16(full, fh)),
+                                     _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), fh));
+        low = _mm_srli_epi16(_mm_add_epi16(low, half), 8);
+        high = _mm_srli_epi16(_mm_add_epi16(high, half), 8);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_packus_epi16(low, high));
+      }
+    blendRowVaryingScalar(a + i, b + i, f + i, dst + i, count - i);
+  }
+
+  GRAYIMAGE_TARGET("avx2")
+  void blendRowVaryingAvx2(const uint8_t* a, const uint8_t* b, const uint8_t* f, uint8_t* dst,
+                           size_t count)
+  {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(256);
+    const __m256i half = _mm256_set1_epi16(128);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+      {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        __m256i vf = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(f + i));
+        __m256i fl = _mm256_unpacklo_epi8(vf, zero);
+        __m256i fh = _mm256_unpackhi_epi8(vf, zero);
+        __m256i low = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), _mm256_sub_epi16(full, fl)),
+                                       _mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), fl));
+        __m256i high = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), _mm256_sub_epi16(full, fh)),
+                                        _mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), fh));
+        low = _mm256_srli_epi16(_mm256_add_epi16(low, half), 8);
+        high = _mm256_srli_epi16(_mm256_add_epi16(high, half), 8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_packus_epi16(low, high));
+      }
+    blendRowVaryingSse2(a + i, b + i, f + i, dst + i, count - i);
+  }
+#endif
+
+#ifdef GRAYIMAGE_NEON
+  void blendRowVaryingNeon(const uint8_t* a, const uint8_t* b, const uint8_t* f, uint8_t* dst,
+                           size_t count)
+  {
+    const uint16x8_t full = vdupq_n_u16(256);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+      {
+        uint16x8_t vf = vmovl_u8(vld1_u8(f + i));
+        uint16x8_t sum = vmlaq_u16(vmulq_u16(vmovl_u8(vld1_u8(a + i)), vsubq_u16(full, vf)),
+                                   vmovl_u8(vld1_u8(b + i)), vf);
+        vst1_u8(dst + i, vrshrn_n_u16(sum, 8));
+      }
+    blendRowVaryingScalar(a + i, b + i, f + i, dst + i, count - i);
+  }
+#endif
+
+  void blendRowVarying(const uint8_t* a, const uint8_t* b, const uint8_t* f, uint8_t* dst,
+                       size_t count)
+  {
+    switch (simdLevel())
+      {
+#ifdef GRAYIMAGE_X86
+      case SIMD_AVX2:
+        blendRowVaryingAvx2(a, b, f, dst, count);
+        break;
+      case SIMD_SSE2:
+        blendRowVaryingSse2(a, b, f, dst, count);
+        break;
+#endif
+#ifdef GRAYIMAGE_NEON
+      case SIMD_NEON:
+        blendRowVaryingNeon(a, b, f, dst, count);
+        break;
+#endif
+      default:
+        blendRowVaryingScalar(a, b, f, dst, count);
+      }
+  }
+
+  // Source position of result pixel (y, x) in fixed point with 32 fraction
+  // bits is base + y * perRow + x * perColumn, one such linear function per
+  // axis. Positions are exact integers, so stepping along a row adds
+  // perColumn and gives the same value as evaluating them directly.
+  struct WarpAxis
+  {
+    int64_t base;
+    int64_t perRow;
+    int64_t perColumn;
+
+    int64_t at(int y, int x) const
+    {
+      return base + y * perRow + x * perColumn;
+    }
+  };
+
+  // double to fixed point, clamped so that positions of images smaller
+  // than 2^16 pixels don't overflow
+  int64_t toWarpFixed(double value, double limit)
+  {
+    value = std::max(-limit, std::min(limit, value)) * 4294967296.0;
+    return static_cast<int64_t>(std::floor(value + 0.5));
+  }
+
+  WarpAxis makeWarpAxis(double perRow, double perColumn, double base)
+  {
+    WarpAxis axis;
+    axis.base = toWarpFixed(base, 16777216.0);
+    axis.perRow = toWarpFixed(perRow, 4096.0);
+    axis.perColumn = toWarpFixed(perColumn, 4096.0);
+    return axis;
+  }
+
+  // whole part of fixed point position, rounding down
+  int warpWhole(int64_t position)
+  {
+    return static_cast<int>(position >= 0 ? position >> 32 : -((-position + static_cast<int64_t>(0xffffffffu)) >> 32));
+  }
+
+  uint8_t samplePixel(const GrayImageView& image, int y, int x, BorderMode mode, uint8_t border)
+  {
+    y = borderIndex(y, image.getHeight(), mode);
+    x = borderIndex(x, image.getWidth(), mode);
+    return y < 0  ||  x < 0 ? border : image(y, x);
+  }
+
+#ifdef GRAYIMAGE_X86
+  // bilinear sample at fixed point position (py, px) with its right and
+  // lower neighbors inside of image
+  uint8_t warpBilinearPixel(const uint8_t* src, size_t stride, int64_t py, int64_t px)
+  {
+    const uint8_t* p = src + static_cast<size_t>(py >> 32) * stride + static_cast<size_t>(px >> 32);
+    int fy = static_cast<int>((py >> 24) & 255);
+    int fx = static_cast<int>((px >> 24) & 255);
+    int left = (p[0] * (256 - fy) + p[stride] * fy + 128) >> 8;
+    int right = (p[1] * (256 - fy) + p[stride + 1] * fy + 128) >> 8;
+    return static_cast<uint8_t>((left * (256 - fx) + right * fx + 128) >> 8);
+  }
+
+  // Eight bilinear samples at once, positions are stepped in 64-bit lanes
+  // and two 32-bit gathers per eight pixels load pixel pairs of both rows.
+  // Each sample must be inside of image with its right and lower neighbor
+  // and two more bytes to the right, offsets must fit in 31 bits.
+  // Returns number of pixels done, a multiple of 8.
+  GRAYIMAGE_TARGET("avx2")
+  int warpBilinearAvx2(const uint8_t* src, size_t stride, int64_t py, int64_t px,
+                       int64_t sy, int64_t sx, int count, uint8_t* dst)
+  {
+    __m256i y0 = _mm256_set_epi64x(py + 3 * sy, py + 2 * sy, py + sy, py);
+    __m256i y1 = _mm256_add_epi64(y0, _mm256_set1_epi64x(4 * sy));
+    __m256i x0 = _mm256_set_epi64x(px + 3 * sx, px + 2 * sx, px + sx, px);
+    __m256i x1 = _mm256_add_epi64(x0, _mm256_set1_epi64x(4 * sx));
+    const __m256i stepY = _mm256_set1_epi64x(8 * sy);
+    const __m256i stepX = _mm256_set1_epi64x(8 * sx);
+    const __m256i rowStride = _mm256_set1_epi32(static_cast<int>(stride));
+    const __m256i low = _mm256_set1_epi32(0xff);
+    const __m256i full = _mm256_set1_epi32(256);
+    const __m256i half = _mm256_set1_epi32(128);
+    const int* below = reinterpret_cast<const int*>(src + stride);
+
+    int k = 0;
+    for (; k + 8 <= count; k += 8)
+      {
+        // whole parts are high and fractions top bytes of low halves of
+        // lanes, shuffle takes them in order 0, 1, 4, 5, 2, 3, 6, 7
+        __m256i wy = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(y0), _mm256_castsi256_ps(y1),
+                                                           _MM_SHUFFLE(3, 1, 3, 1)));
+        __m256i wx = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(x0), _mm256_castsi256_ps(x1),
+                                                           _MM_SHUFFLE(3, 1, 3, 1)));
+        __m256i fy = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(y0), _mm256_castsi256_ps(y1),
+                                                           _MM_SHUFFLE(2, 0, 2, 0)));
+        __m256i fx = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(x0), _mm256_castsi256_ps(x1),
+                                                           _MM_SHUFFLE(2, 0, 2, 0)));
+        fy = _mm256_srli_epi32(fy, 24);
+        fx = _mm256_srli_epi32(fx, 24);
+
+        __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(wy, rowStride), wx);
+        __m256i top = _mm256_i32gather_epi32(reinterpret_cast<const int*>(src), offset, 1);
+        __m256i bottom = _mm256_i32gather_epi32(below, offset, 1);
+
+        // pairs (top, bottom) of left and right pixels times (256 - fy, fy)
+        __m256i weights = _mm256_or_si256(_mm256_sub_epi32(full, fy), _mm256_slli_epi32(fy, 16));
+        __m256i left = _mm256_or_si256(_mm256_and_si256(top, low),
+                                       _mm256_slli_epi32(_mm256_and_si256(bottom, low), 16));
+        __m256i right = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(top, 8), low),
+                                        _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(bottom, 8), low), 16));
+        left = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(left, weights), half), 8);
+        right = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(right, weights), half), 8);
+
+        weights = _mm256_or_si256(_mm256_sub_epi32(full, fx), _mm256_slli_epi32(fx, 16));
+        __m256i value = _mm256_or_si256(left, _mm256_slli_epi32(right, 16));
+        value = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(value, weights), half), 8);
+
+        // back to order 0..7 in bytes 0..3 of each 128-bit lane
+        value = _mm256_packus_epi16(_mm256_packus_epi32(value, value), value);
+        int first = _mm_cvtsi128_si32(_mm256_castsi256_si128(value));
+        int second = _mm_cvtsi128_si32(_mm256_extracti128_si256(value, 1));
+        uint32_t lowOrder = (static_cast<uint32_t>(first) & 0xffff) | static_cast<uint32_t>(second) << 16;
+        uint32_t highOrder = static_cast<uint32_t>(first) >> 16 | (static_cast<uint32_t>(second) & 0xffff0000u);
+        std::memcpy(dst + k, &lowOrder, 4);
+        std::memcpy(dst + k + 4, &highOrder, 4);
+
+        y0 = _mm256_add_epi64(y0, stepY);
+        y1 = _mm256_add_epi64(y1, stepY);
+        x0 = _mm256_add_epi64(x0, stepX);
+        x1 = _mm256_add_epi64(x1, stepX);
+      }
+    return k;
+  }
+#endif
+
+  // Warps tiles of result. Row of tile gathers source pixels into buffers
+  // and blends whole buffers, gathering checks image bounds only if an end
+  // of the row samples outside of image.
+  class WarpTiles : public TileTask
+  {
+  public:
+    static const int tileHeight = 32;
+    static const int tileWidth = 256;
+
+    WarpTiles(const GrayImageView& image, const WarpAxis& ay, const WarpAxis& ax,
+              Interpolation interpolation, BorderMode mode, uint8_t border, GrayImage& result)
+      : image_(image), ay_(ay), ax_(ax), interpolation_(interpolation), mode_(mode), border_(border)
+      , result_(result.data()), width_(result.getWidth())
+      , gather_(simdLevel() == SIMD_AVX2
+                &&  static_cast<uint64_t>(image.getStride()) * image.getHeight() < 0x7fffffffu) {}
+
+    void run(const Tile& tile)
+    {
+      uint8_t buffers[8][tileWidth];
+      for (int y = tile.y; y < tile.y + tile.height; ++y)
+        {
+          GrayImage::pixel_t* dst = result_ + static_cast<size_t>(y) * width_ + tile.x;
+          if (interpolation_ == INTERPOLATION_NEAREST)
+            nearest(y, tile.x, tile.width, dst);
+          else
+            bilinear(y, tile.x, tile.width, dst, buffers);
+        }
+    }
+
+  private:
+    // rows crossing image border are split down to this length, so that
+    // only short parts of them check bounds per pixel
+    static const int minimumSplit = 8;
+
+    // true if pixels at rows [y, y + extra] and columns [x, x + extra] of
+    // whole positions of both ends are inside of image
+    bool inside(int64_t py0, int64_t px0, int64_t py1, int64_t px1, int extra) const
+    {
+      int ylimit = image_.getHeight() - extra;
+      int xlimit = image_.getWidth() - extra;
+      int y0 = warpWhole(py0);
+      int x0 = warpWhole(px0);
+      int y1 = warpWhole(py1);
+      int x1 = warpWhole(px1);
+      return y0 >= 0  &&  y0 < ylimit  &&  y1 >= 0  &&  y1 < ylimit
+          &&  x0 >= 0  &&  x0 < xlimit  &&  x1 >= 0  &&  x1 < xlimit;
+    }
+
+    void nearest(int y, int x, int count, GrayImage::pixel_t* dst) const
+    {
+      const int64_t half = static_cast<int64_t>(1) << 31;
+      int64_t py = ay_.at(y, x) + half;
+      int64_t px = ax_.at(y, x) + half;
+      int64_t sy = ay_.perColumn;
+      int64_t sx = ax_.perColumn;
+      bool within = inside(py, px, py + (count - 1) * sy, px + (count - 1) * sx, 0);
+      if (!within  &&  count > minimumSplit)
+        {
+          nearest(y, x, count / 2, dst);
+          nearest(y, x + count / 2, count - count / 2, dst + count / 2);
+          return;
+        }
+      if (within)
+        {
+          const GrayImage::pixel_t* src = image_.row(0);
+          size_t stride = image_.getStride();
+          for (int k = 0; k < count; ++k, py += sy, px += sx)
+            dst[k] = src[static_cast<size_t>(py >> 32) * stride + static_cast<size_t>(px >> 32)];
+          return;
+        }
+
+      for (int k = 0; k < count; ++k, py += sy, px += sx)
+        dst[k] = samplePixel(image_, warpWhole(py), warpWhole(px), mode_, border_);
+    }
+
+    void bilinear(int y, int x, int count, GrayImage::pixel_t* dst,
+                  uint8_t buffers[8][tileWidth]) const
+    {
+      uint8_t* p00 = buffers[0];
+      uint8_t* p01 = buffers[1];
+      uint8_t* p10 = buffers[2];
+      uint8_t* p11 = buffers[3];
+      uint8_t* fy = buffers[4];
+      uint8_t* fx = buffers[5];
+      int64_t py = ay_.at(y, x);
+      int64_t px = ax_.at(y, x);
+      int64_t sy = ay_.perColumn;
+      int64_t sx = ax_.perColumn;
+      int64_t lastY = py + (count - 1) * sy;
+      int64_t lastX = px + (count - 1) * sx;
+      bool within = inside(py, px, lastY, lastX, 1);
+      if (!within  &&  count > minimumSplit)
+        {
+          bilinear(y, x, count / 2, dst, buffers);
+          bilinear(y, x + count / 2, count - count / 2, dst + count / 2, buffers);
+          return;
+        }
+#ifdef GRAYIMAGE_X86
+      // gathers read two bytes more to the right
+      if (gather_  &&  within
+          &&  warpWhole(px) < image_.getWidth() - 3  &&  warpWhole(lastX) < image_.getWidth() - 3)
+        {
+          const GrayImage::pixel_t* src = image_.row(0);
+          size_t stride = image_.getStride();
+          int done = warpBilinearAvx2(src, stride, py, px, sy, sx, count, dst);
+          for (int k = done; k < count; ++k)
+            dst[k] = warpBilinearPixel(src, stride, py + k * sy, px + k * sx);
+          return;
+        }
+#endif
+      if (within)
+        {
+          const GrayImage::pixel_t* src = image_.row(0);
+          size_t stride = image_.getStride();
+          for (int k = 0; k < count; ++k, py += sy, px += sx)
+            {
+              const GrayImage::pixel_t* p = src + static_cast<size_t>(py >> 32) * stride
+                  + static_cast<size_t>(px >> 32);
+              p00[k] = p[0];
+              p01[k] = p[1];
+              p10[k] = p[stride];
+              p11[k] = p[stride + 1];
+              fy[k] = static_cast<uint8_t>(py >> 24);
+              fx[k] = static_cast<uint8_t>(px >> 24);
+            }
+        }
+      else
+        for (int k = 0; k < count; ++k, py += sy, px += sx)
+          {
+            int wy = warpWhole(py);
+            int wx = warpWhole(px);
+            p00[k] = samplePixel(image_, wy, wx, mode_, border_);
+            p01[k] = samplePixel(image_, wy, wx + 1, mode_, border_);
+            p10[k] = samplePixel(image_, wy + 1, wx, mode_, border_);
+            p11[k] = samplePixel(image_, wy + 1, wx + 1, mode_, border_);
+            fy[k] = static_cast<uint8_t>(py >> 24);
+            fx[k] = static_cast<uint8_t>(px >> 24);
+          }
+
+      // columns first, then along row, as translateSubpixel() does
+      blendRowVarying(p00, p10, fy, buffers[6], count);
+      blendRowVarying(p01, p11, fy, buffers[7], count);
+      blendRowVarying(buffers[6], buffers[7], fx, dst, count);
+    }
+
+    const GrayImageView& image_;
+    WarpAxis ay_;
+    WarpAxis ax_;
+    Interpolation interpolation_;
+    BorderMode mode_;
+    uint8_t border_;
+    GrayImage::pixel_t* result_;
+    int width_;
+    bool gather_;
+  };
+
+  // Source positions of result pixels for transform of source to result,
+  // returns -1 if transform is singular
+  int makeWarpAxes(const AffineTransform& transform, WarpAxis& ay, WarpAxis& ax)
+  {
+    AffineTransform inverse;
+    if (invert(transform, inverse) != 0)
+      return -1;
+    ay = makeWarpAxis(inverse.yy, inverse.yx, inverse.y0);
+    ax = makeWarpAxis(inverse.xy, inverse.xx, inverse.x0);
+    return 0;
+  }
+}
+
+// Maps image by invertible transform into result of given size:
+// result(y, x) is image sampled at position, which transform maps to (y, x).
+// Source position is stepped along rows of 32 x 256 tiles in fixed point with
+// 32 fraction bits. Bilinear interpolation uses 8 fraction bits and the same
+// rounding as translateSubpixel(), samples outside of image are taken by
+// border mode. Sizes of image and result must be below 2^16. Singular
+// transform maps no pixel of image into result, which is filled as if
+// image were empty.
+void warpAffine(const GrayImageView& image, const AffineTransform& transform, int height, int width,
+                GrayImage& result, Interpolation interpolation = INTERPOLATION_BILINEAR,
+                BorderMode mode = BORDER_CONSTANT, uint8_t border = 0);
+GrayImage warpAffine(const GrayImageView& image, const AffineTransform& transform,
+                     Interpolation interpolation = INTERPOLATION_BILINEAR,
+                     BorderMode mode = BORDER_CONSTANT, uint8_t border = 0)
+{
+  GrayImage result;
+  warpAffine(image, transform, image.getHeight(), image.getWidth(), result, interpolation, mode,
+             border);
+  return result;
+}
+
+void warpAffine(const GrayImageView& image, const AffineTransform& transform, int height, int width,
+                GrayImage& result, Interpolation interpolation, BorderMode mode, uint8_t border)
+{
+  GRAYIMAGE_TIMED(OP_WARP_AFFINE, height, width, 2);
+  assert(height < 65536  &&  width < 65536);
+  assert(image.getHeight() < 65536  &&  image.getWidth() < 65536);
+  result.reshape(height, width);
+  if (!height  ||  !width)
+    return;
+
+  WarpAxis ay, ax;
+  if (!image.getHeight()  ||  !image.getWidth()  ||  makeWarpAxes(transform, ay, ax) != 0)
+    {
+      result.fill(mode == BORDER_CONSTANT ? border : 0);
+      return;
+    }
+
+  WarpTiles task(image, ay, ax, interpolation, mode, border, result);
+  int tileHeight = WarpTiles::tileHeight;
+  int tileWidth = WarpTiles::tileWidth;
+  for (int y = 0; y < height; y += tileHeight)
+    for (int x = 0; x < width; x += tileWidth)
+      {
+        Tile tile = { y, x, std::min(tileHeight, height - y), std::min(tileWidth, width - x) };
+        task.run(tile);
+      }
+}
+
+// same as above, tiles are split between threads of pool
+void warpAffine(const GrayImageView& image, const AffineTransform& transform, int height, int width,
+                GrayImage& result, ThreadPool& pool, Interpolation interpolation = INTERPOLATION_BILINEAR,
+                BorderMode mode = BORDER_CONSTANT, uint8_t border = 0)
+{
+  GRAYIMAGE_TIMED(OP_WARP_AFFINE, height, width, 2);
+  assert(height < 65536  &&  width < 65536);
+  assert(image.getHeight() < 65536  &&  image.getWidth() < 65536);
+  result.reshape(height, width);
+  if (!height  ||  !width)
+    return;
+
+  WarpAxis ay, ax;
+  if (!image.getHeight()  ||  !image.getWidth()  ||  makeWarpAxes(transform, ay, ax) != 0)
+    {
+      result.fill(mode == BORDER_CONSTANT ? border : 0);
+      return;
+    }
+
+  WarpTiles task(image, ay, ax, interpolation, mode, border, result);
+  parallelForTiles(pool, height, width, WarpTiles::tileHeight, WarpTiles::tileWidth, task);
+}
+
+// Value of white pixel of each supported pixel type, black is zero.
+// Binary image of any type has only black and white pixels.
+template <typename Pixel>
+struct PixelTraits;
+
+template <>
+struct PixelTraits<uint8_t>
+{
+  static uint8_t white() { return 255; }
+};
+
+template <>
+struct PixelTraits<uint16_t>
+{
+  static uint16_t white() { return 65535; }
+};
+
+template <>
+struct PixelTraits<float>
+{
+  static float white() { return 1.0f; }
+};
+
+// Image of 16-bit or float pixels, same layout as GrayImage: rows are
+// contiguous and pixels outside the image are black. Only threshold(),
+// translate() and isBinary() work on it.
+template <typename Pixel>
+class Image
+{
+public:
+  typedef Pixel pixel_t;
+
+  // creates empty image
+  Image()
+    : height_(0), width_(0) {}
+
+  // creates image of given size filled with black pixels
+  Image(int height, int width)
+    : height_(height), width_(width), data_(static_cast<size_t>(height) * width)
+  {
+    assert(height > 0  &&  width > 0);
+  }
+
+  void swap(Image& other)
+  {
+    std::swap(height_, other.height_);
+    std::swap(width_, other.width_);
+    data_.swap(other.data_);
+  }
+
+  pixel_t& operator()(int y, int x)
+  {
+    assert(y >= 0  &&  y < height_  &&  x >= 0  &&  x < width_);
+    return data_[static_cast<size_t>(y) * width_ + x];
+  }
+
+  const pixel_t& operator()(int y, int x) const
+  {
+    assert(y >= 0  &&  y < height_  &&  x >= 0  &&  x < width_);
+    return data_[static_cast<size_t>(y) * width_ + x];
+  }
+
+  pixel_t* row(int y) { return data() + static_cast<size_t>(y) * width_; }
+  const pixel_t* row(int y) const { return data() + static_cast<size_t>(y) * width_; }
+  pixel_t* data() { return data_.empty() ? 0 : &data_[0]; }
+  const pixel_t* data() const { return data_.empty() ? 0 : &data_[0]; }
+
+  // keeps pixel buffer if it is large enough, content is unspecified afterwards
+  void reshape(int height, int width)
+  {
+    assert(height >= 0  &&  width >= 0);
+    if (!height  ||  !width)
+      height = width = 0;
+    height_ = height;
+    width_ = width;
+    data_.resize(static_cast<size_t>(height) * width);
+  }
+
+  void fill(pixel_t value) { std::fill(data_.begin(), data_.end(), value); }
+
+  int getHeight() const { return height_; }
+  int getWidth() const { return width_; }
+
+private:
+  int height_;
+  int width_;
+  std::vector<pixel_t> data_;
+};
+
+// Same as GrayImage operations, but for any pixel type. GrayImage arguments
+// are handed to the 8-bit code above.
+template <typename Pixel>
+void threshold(const Image<Pixel>& image, typename Image<Pixel>::pixel_t thr, Image<Pixel>& result)
+{
+  GRAYIMAGE_TIMED(OP_THRESHOLD, image.getHeight(), image.getWidth(), 2 * sizeof(Pixel));
+  result.reshape(image.getHeight(), image.getWidth());
+  const Pixel* src = image.data();
+  Pixel* dst = result.data();
+  size_t count = static_cast<size_t>(image.getHeight()) * image.getWidth();
+  Pixel white = PixelTraits<Pixel>::white();
+  for (size_t i = 0; i < count; ++i)
+    dst[i] = src[i] < thr ? Pixel(0) : white;
+}
+
+template <>
+void threshold<uint8_t>(const GrayImage& image, uint8_t thr, GrayImage& result)
+{
+  threshold(GrayImageView(image), thr, result);
+}
+
+template <typename Pixel>
+Image<Pixel> threshold(const Image<Pixel>& image, typename Image<Pixel>::pixel_t thr)
+{
+  Image<Pixel> result;
+  threshold(image, thr, result);
+  return result;
+}
+
+// Result must not be the source image
+template <typename Pixel>
+void translate(const Image<Pixel>& image, int dy, int dx, Image<Pixel>& result)
+{
+  GRAYIMAGE_TIMED(OP_TRANSLATE, image.getHeight(), image.getWidth(), 2 * sizeof(Pixel));
+  int width = image.getWidth();
+  int height = image.getHeight();
+  result.reshape(height, width);
+  if (!height  ||  !width)
+    return;
+
+  result.fill(0);
+  if (std::abs(dx) >= width  ||  std::abs(dy) >= height)
+    return;
+
+  int span = width - std::abs(dx);
+  int srcX = dx < 0 ? -dx : 0;
+  int dstX = dx > 0 ? dx : 0;
+  for (int y = std::max(0, dy); y < std::min(height, height + dy); ++y)
+    std::copy(image.row(y - dy) + srcX, image.row(y - dy) + srcX + span, result.row(y) + dstX);
+}
+
+template <>
+void translate<uint8_t>(const GrayImage& image, int dy, int dx, GrayImage& result)
+{
+  translate(GrayImageView(image), dy, dx, result);
+}
+
+template <typename Pixel>
+Image<Pixel> translate(const Image<Pixel>& image, int dy, int dx)
+{
+  Image<Pixel> result;
+  translate(image, dy, dx, result);
+  return result;
+}
+
+// empty image is not binary
+template <typename Pixel>
+bool isBinary(const Image<Pixel>& image)
+{
+  const Pixel* src = image.data();
+  size_t count = static_cast<size_t>(image.getHeight()) * image.getWidth();
+  Pixel white = PixelTraits<Pixel>::white();
+  for (size_t i = 0; i < count; ++i)
+    if (src[i] != Pixel(0)  &&  src[i] != white)
+      return false;
+  return count != 0;
+}
+
+// Calls op.apply<i>() for i from Begin to Begin + Count - 1, each with index
+// known at compile time, so that loop is unrolled and index arithmetic is
+// folded. Range is halved to keep recursion depth at log2(Count).
+template <int Begin, int Count>
+struct Unroll
+{
+  template <typename Op>
+  static GRAYIMAGE_FORCE_INLINE void run(Op& op)
+  {
+    Unroll<Begin, Count / 2>::run(op);
+    Unroll<Begin + Count / 2, Count - Count / 2>::run(op);
+  }
+};
+
+template <int Begin>
+struct Unroll<Begin, 1>
+{
+  template <typename Op>
+  static GRAYIMAGE_FORCE_INLINE void run(Op& op)
+  {
+    op.template apply<Begin>();
+  }
+};
+
+// Small image with size fixed at compile time, e.g. 8x8, 16x16 or 32x32
+// patch for feature extraction. Pixels are stored inline, and threshold(),
+// translate() and isBinary() are unrolled, so they have no loops at
+// runtime. translate() still checks bounds of each pixel against runtime
+// shift. They are not counted by instrumentation.
+template <typename Pixel, int Height, int Width>
+class FixedImage
+{
+public:
+  typedef Pixel pixel_t;
+  enum { height = Height, width = Width, size = Height * Width };
+
+  // creates image filled with black pixels
+  FixedImage() { fill(0); }
+
+  pixel_t& operator()(int y, int x) { return data_[y * Width + x]; }
+  const pixel_t& operator()(int y, int x) const { return data_[y * Width + x]; }
+  pixel_t* row(int y) { return data_ + y * Width; }
+  const pixel_t* row(int y) const { return data_ + y * Width; }
+  pixel_t* data() { return data_; }
+  const pixel_t* data() const { return data_; }
+
+  void fill(pixel_t value)
+  {
+    Fill op = { data_, value };
+    Unroll<0, size>::run(op);
+  }
+
+  static int getHeight() { return Height; }
+  static int getWidth() { return Width; }
+
+private:
+  // fails to compile for empty size
+  typedef char PositiveSize[Height > 0  &&  Width > 0 ? 1 : -1];
+
+  struct Fill
+  {
+    Pixel* dst;
+    Pixel value;
+
+    template <int i>
+    void apply() { dst[i] = value; }
+  };
+
+  Pixel data_[size];
+};
+
+namespace
+{
+  template <typename Pixel>
+  struct FixedThreshold
+  {
+    const Pixel* src;
+    Pixel* dst;
+    Pixel thr;
+    Pixel white;
+
+    template <int i>
+    void apply() { dst[i] = src[i] < thr ? Pixel(0) : white; }
+  };
+
+  // bounds of source pixel are checked with y and x of destination pixel
+  // known at compile time
+  template <typename Pixel, int Height, int Width>
+  struct FixedTranslate
+  {
+    const Pixel* src;
+    Pixel* dst;
+    int dy;
+    int dx;
+
+    template <int i>
+    void apply()
+    {
+      int y = i / Width - dy;
+      int x = i % Width - dx;
+      dst[i] = static_cast<unsigned>(y) < static_cast<unsigned>(Height)
+        &&  static_cast<unsigned>(x) < static_cast<unsigned>(Width) ? src[y * Width + x] : Pixel(0);
+    }
+  };
+
+  // all pixels are checked without early exit, so that checks are vectorized
+  template <typename Pixel>
+  struct FixedIsBinary
+  {
+    const Pixel* src;
+    Pixel white;
+    int binary;
+
+    template <int i>
+    void apply() { binary &= (src[i] == Pixel(0)) | (src[i] == white); }
+  };
+}
+
+template <typename Pixel, int Height, int Width>
+void threshold(const FixedImage<Pixel, Height, Width>& image,
+               typename FixedImage<Pixel, Height, Width>::pixel_t thr,
+               FixedImage<Pixel, Height, Width>& result)
+{
+  FixedThreshold<Pixel> op = { image.data(), result.data(), thr, PixelTraits<Pixel>::white() };
+  Unroll<0, Height * Width>::run(op);
+}
+
+template <typename Pixel, int Height, int Width>
+FixedImage<Pixel, Height, Width> threshold(const FixedImage<Pixel, Height, Width>& image,
+                                           typename FixedImage<Pixel, Height, Width>::pixel_t thr)
+{
+  FixedImage<Pixel, Height, Width> result;
+  threshold(image, thr, result);
+  return result;
+}
+
+// Result must not be the source image
+template <typename Pixel, int Height, int Width>
+void translate(const FixedImage<Pixel, Height, Width>& image, int dy, int dx,
+               FixedImage<Pixel, Height, Width>& result)
+{
+  FixedTranslate<Pixel, Height, Width> op = { image.data(), result.data(), dy, dx };
+  Unroll<0, Height * Width>::run(op);
+}
+
+template <typename Pixel, int Height, int Width>
+FixedImage<Pixel, Height, Width> translate(const FixedImage<Pixel, Height, Width>& image, int dy, int dx)
+{
+  FixedImage<Pixel, Height, Width> result;
+  translate(image, dy, dx, result);
+  return result;
+}
+
+template <typename Pixel, int Height, int Width>
+bool isBinary(const FixedImage<Pixel, Height, Width>& image)
+{
+  FixedIsBinary<Pixel> op = { image.data(), PixelTraits<Pixel>::white(), 1 };
+  Unroll<0, Height * Width>::run(op);
+  return op.binary != 0;
+}
+
+// Chain of operations recorded first and run later with fewer passes over
+// memory: consecutive point-wise (threshold, lookup table) and translate
+// steps are fused into one pass reading each source pixel once, fill steps
+// work in place on the result. Pass after a fill step is done in place too,
+// unless it has a translate, which needs a second buffer.
+//   GrayImagePipeline().threshold(128).translate(3, -5).fillHoles().run(image, result);
+class GrayImagePipeline
+{
+public:
+  GrayImagePipeline& threshold(uint8_t thr);
+  GrayImagePipeline& applyLut(const uint8_t lut[256]);
+  GrayImagePipeline& translate(int dy, int dx);
+  // any not 0 pixel is taken as foreground (255) when these steps run
+  GrayImagePipeline& fillHoles();
+  GrayImagePipeline& background();
+
+  // result is the same as running steps one by one, it must not be the source image
+  void run(const GrayImageView& image, GrayImage& result) const;
+  GrayImage run(const GrayImageView& image) const;
+
+  // same as above, fused passes are split between threads of pool
+  void run(const GrayImageView& image, GrayImage& result, ThreadPool& pool) const;
+
+private:
+  enum StepKind
+  {
+    STEP_LUT,
+    STEP_TRANSLATE,
+    STEP_FILL_HOLES,
+    STEP_BACKGROUND
+  };
+
+  struct Step
+  {
+    StepKind kind;
+    int dy;
+    int dx;
+    uint8_t lut[256];
+  };
+
+  // translate step of fused pass, pixels moved in from outside are pad
+  // mapped by lookup tables following the step
+  struct Shift
+  {
+    int dy;
+    int dx;
+    uint8_t pad;
+  };
+
+  class FusedRows;
+
+  GrayImagePipeline& addStep(StepKind kind, int dy, int dx, const uint8_t* lut);
+
+  void runSteps(const GrayImageView& image, GrayImage& result, ThreadPool* pool) const;
+
+  // runs lut and then steps [begin, end), which are all lookup tables and
+  // translates, in one pass, returns true if result is binary. If binarize
+  // is set, not 0 pixels of result are made 255. Result may be the image
+  // seen by view only if there is no translate in steps.
+  bool runFused(const GrayImageView& image, const uint8_t* lut, size_t begin, size_t end,
+                bool binarize, GrayImage& result, ThreadPool* pool) const;
+
+  std::vector<Step> steps_;
+};
+
+class GrayImagePipeline::FusedRows : public RowTask
+{
+public:
+  FusedRows(const GrayImageView& image, const std::vector<Shift>& shifts, const LutKernel& kernel,
+            GrayImage::pixel_t* result)
+    : image_(image), shifts_(shifts), kernel_(kernel), result_(result) {}
+
+  // Each output row is traced back through shifts, from the last one:
+  // pixels coming from outside of image at a shift get its pad, the rest
+  // are mapped from source row
+  void run(int yBegin, int yEnd)
+  {
+    int height = image_.getHeight();
+    int width = image_.getWidth();
+    for (int y = yBegin; y < yEnd; ++y)
+      {
+        GrayImage::pixel_t* dst = result_ + y * width;
+        int x1 = 0;
+        int x2 = width;
+        int srcY = y;
+        int offset = 0;
+        for (size_t k = shifts_.size(); k-- > 0  &&  x1 < x2; )
+          {
+            const Shift& shift = shifts_[k];
+            srcY -= shift.dy;
+            offset += shift.dx;
+            if (srcY < 0  ||  srcY >= height)
+              {
+                std::memset(dst + x1, shift.pad, x2 - x1);
+                x1 = x2;
+                break;
+              }
+
+            int begin = std::min(std::max(x1, offset), x2);
+            int end = std::max(std::min(x2, width + offset), begin);
+            std::memset(dst + x1, shift.pad, begin - x1);
+            std::memset(dst + end, shift.pad, x2 - end);
+            x1 = begin;
+            x2 = end;
+          }
+
+        if (x1 < x2)
+          kernel_.run(image_.row(srcY) + x1 - offset, dst + x1, x2 - x1);
+      }
+  }
+
+private:
+  const GrayImageView& image_;
+  const std::vector<Shift>& shifts_;
+  const LutKernel& kernel_;
+  GrayImage::pixel_t* result_;
+};
+
+GrayImagePipeline& GrayImagePipeline::threshold(uint8_t thr)
+{
+  uint8_t lut[256];
+  makeThresholdLut(thr, lut);
+  return addStep(STEP_LUT, 0, 0, lut);
+}
+
+GrayImagePipeline& GrayImagePipeline::applyLut(const uint8_t lut[256])
+{
+  return addStep(STEP_LUT, 0, 0, lut);
+}
+
+GrayImagePipeline& GrayImagePipeline::translate(int dy, int dx)
+{
+  return addStep(STEP_TRANSLATE, dy, dx, 0);
+}
+
+GrayImagePipeline& GrayImagePipeline::fillHoles()
+{
+  return addStep(STEP_FILL_HOLES, 0, 0, 0);
+}
+
+GrayImagePipeline& GrayImagePipeline::background()
+{
+  return addStep(STEP_BACKGROUND, 0, 0, 0);
+}
+
+GrayImagePipeline& GrayImagePipeline::addStep(StepKind kind, int dy, int dx, const uint8_t* lut)
+{
+  Step step;
+  step.kind = kind;
+  step.dy = dy;
+  step.dx = dx;
+  if (lut)
+    std::memcpy(step.lut, lut, sizeof(step.lut));
+  steps_.push_back(step);
+  return *this;
+}
+
+void GrayImagePipeline::run(const GrayImageView& image, GrayImage& result) const
+{
+  runSteps(image, result, 0);
+}
+
+GrayImage GrayImagePipeline::run(const GrayImageView& image) const
+{
+  GrayImage result;
+  runSteps(image, result, 0);
+  return result;
+}
+
+void GrayImagePipeline::run(const GrayImageView& image, GrayImage& result, ThreadPool& pool) const
+{
+  runSteps(image, result, &pool);
+}
+
+// Pass before a fill step makes result binary, fill steps mark background
+// in place with value 1, which is then mapped by a lookup table merged into
+// the next fused pass
+void GrayImagePipeline::runSteps(const GrayImageView& image, GrayImage& result, ThreadPool* pool) const
+{
+  uint8_t pending[256];
+  for (int v = 0; v < 256; ++v)
+    pending[v] = static_cast<uint8_t>(v);
+
+  result.reshape(image.getHeight(), image.getWidth());
+  if (!image.getHeight()  ||  !image.getWidth())
+    return;
+
+  GrayImage scratch;
+  bool fromSource = true;
+  bool binary = false;
+  size_t begin = 0;
+  for (;;)
+    {
+      size_t end = begin;
+      bool shifted = false;
+      while (end < steps_.size()  &&  (steps_[end].kind == STEP_LUT  ||  steps_[end].kind == STEP_TRANSLATE))
+        {
+          shifted = shifted  ||  steps_[end].kind == STEP_TRANSLATE;
+          ++end;
+        }
+
+      bool last = end == steps_.size();
+      if (fromSource)
+        binary = runFused(image, pending, begin, end, !last, result, pool);
+      else if (!shifted)
+        binary = runFused(GrayImageView(result), pending, begin, end, !last, result, pool);
+      else
+        {
+          binary = runFused(GrayImageView(result), pending, begin, end, !last, scratch, pool);
+          result.swap(scratch);
+        }
+      if (last)
+        break;
+
+      fillBackground(result, result.data(), 1);
+      // now 0 is hole, 1 is background and 255 is foreground
+      bool holes = steps_[end].kind == STEP_FILL_HOLES;
+      std::memset(pending, holes ? 255 : 0, sizeof(pending));
+      pending[1] = holes ? 0 : 255;
+      fromSource = false;
+      begin = end + 1;
+    }
+
+  result.binary_ = binary;
+}
+
+bool GrayImagePipeline::runFused(const GrayImageView& image, const uint8_t* lut, size_t begin, size_t end,
+                                 bool binarize, GrayImage& result, ThreadPool* pool) const
+{
+  // lookup tables are composed from the last one, so pad of each shift
+  // is mapped by the tables after it
+  uint8_t composed[256];
+  for (int v = 0; v < 256; ++v)
+    composed[v] = static_cast<uint8_t>(binarize ? (v ? 255 : 0) : v);
+  std::vector<Shift> shifts;
+  bool binary = true;
+  for (size_t i = end; i-- > begin; )
+    if (steps_[i].kind == STEP_LUT)
+      composeLut(steps_[i].lut, composed, composed);
+    else
+      {
+        Shift shift = { steps_[i].dy, steps_[i].dx, composed[0] };
+        shifts.push_back(shift);
+        binary = binary  &&  (shift.pad == 0  ||  shift.pad == 255);
+      }
+  std::reverse(shifts.begin(), shifts.end());
+  composeLut(lut, composed, composed);
+
+  LutKernel kernel(composed);
+  result.reshape(image.getHeight(), image.getWidth());
+  FusedRows task(image, shifts, kernel, result.data());
+  if (pool)
+    parallelForRows(*pool, image.getHeight(), task);
+  else
+    task.run(0, image.getHeight());
+  return binary  &&  kernel.isBinary();
+}
+
+// Connected components of white (not 0) pixels, 4-connectivity is assumed.
+// Background has label 0, components are labeled from 1 in order of their
+// first pixel in raster scan.
+
+// Area in pixels and bounding box of component
+struct ComponentStats
+{
+  int area;
+  Tile box;
+};
+
+class LabelImage
+{
+public:
+  typedef uint32_t label_t;
+
+  // creates empty image with no components
+  LabelImage();
+
+  int getHeight() const;
+  int getWidth() const;
+
+  label_t operator()(int y, int x) const;
+  const label_t* row(int y) const;
+
+  // labels of components are 1 to getComponentCount()
+  int getComponentCount() const;
+  const ComponentStats& getComponent(int label) const;
+
+private:
+  friend class ComponentLabeler;
+
+  int height_;
+  int width_;
+  std::vector<label_t> labels_;
+  // stats of component with label l are at l - 1
+  std::vector<ComponentStats> components_;
+};
+
+LabelImage::LabelImage()
+  : height_(0)
+  , width_(0)
+{
+}
+
+int LabelImage::getHeight() const
+{
+  return height_;
+}
+
+int LabelImage::getWidth() const
+{
+  return width_;
+}
+
+LabelImage::label_t LabelImage::operator()(int y, int x) const
+{
+  assert(y >= 0  &&  y < height_);
+  assert(x >= 0  &&  x < width_);
+  return labels_[static_cast<size_t>(y) * width_ + x];
+}
+
+const LabelImage::label_t* LabelImage::row(int y) const
+{
+  assert(y >= 0  &&  y < height_);
+  return &labels_[static_cast<size_t>(y) * width_];
+}
+
+int LabelImage::getComponentCount() const
+{
+  return static_cast<int>(components_.size());
+}
+
+const ComponentStats& LabelImage::getComponent(int label) const
+{
+  assert(label >= 1  &&  label <= getComponentCount());
+  return components_[label - 1];
+}
+
+// Two pass union-find labeling over runs of white pixels:
+// runs of each row are found from packed row with bit scans, each run is
+// united with overlapping runs of previous row, then roots of union-find
+// forest get labels. With thread pool bands of rows are scanned and united
+// in parallel and runs on borders of bands are merged after that.
+// Buffers are kept, so labeling sequence of images doesn't allocate.
+class ComponentLabeler
+{
+public:
+  explicit ComponentLabeler(ThreadPool* pool = 0);
+
+  void label(const GrayImageView& image, LabelImage& labels);
+  void label(const BinaryImage& image, LabelImage& labels);
+
+  // only stats of components are found, without label image
+  int count(const GrayImageView& image, std::vector<ComponentStats>& stats);
+
+private:
+  // white pixels [x1, x2] of a row
+  struct Run
+  {
+    int x1;
+    int x2;
+  };
+
+  class Bands;
+
+  void run(const GrayImageView* gray, const BinaryImage* packed, int height, int width,
+           std::vector<ComponentStats>& stats, LabelImage* labels);
+
+  int find(int run);
+  void unite(int one, int two);
+  // unites overlapping runs of row y - 1 and y
+  void uniteRows(int y);
+
+  ThreadPool* pool_;
+  int height_;
+  int width_;
+  // runs of row y are [rowStart_[y], rowStart_[y + 1])
+  std::vector<Run> runs_;
+  std::vector<int> rowStart_;
+  // union-find forest over runs, each parent has lower index than its
+  // children, so root is the first run of component in raster order
+  std::vector<int> parent_;
+  std::vector<std::vector<Run> > bandRuns_;
+  std::vector<std::vector<uint64_t> > bandWords_;
+};
+
+namespace
+{
+  // appends runs of set bits of packed row, bits past width must be 0
+  template <typename Run>
+  void appendRuns(const uint64_t* words, int width, std::vector<Run>& runs)
+  {
+    int wordCount = (width + 63) / 64;
+    int w = 0;
+    uint64_t word = wordCount ? words[0] : 0;
+    for (;;)
+      {
+        while (!word)
+          {
+            if (++w == wordCount)
+              return;
+            word = words[w];
+          }
+        Run run;
+        run.x1 = w * 64 + countTrailingZeros(word);
+
+        // bits below run start are clear, so ones of inverted word are run end
+        word = ~word & bitsFrom(run.x1 % 64);
+        while (!word)
+          {
+            if (++w == wordCount)
+              break;
+            word = ~words[w];
+          }
+        run.x2 = word ? w * 64 + countTrailingZeros(word) - 1 : width - 1;
+        runs.push_back(run);
+        if (!word)
+          return;
+
+        // continue with bits following run end
+        word = words[w] & bitsFrom((run.x2 + 1) % 64);
+      }
+  }
+}
+
+class ComponentLabeler::Bands : public ParallelTask
+{
+public:
+  enum Stage
+  {
+    SCAN,
+    UNITE,
+    WRITE
+  };
+
+  Bands(ComponentLabeler& labeler, const GrayImageView* gray, const BinaryImage* packed,
+        int bandRows, LabelImage::label_t* labels)
+    : labeler_(labeler), gray_(gray), packed_(packed), bandRows_(bandRows), labels_(labels)
+    , stage_(SCAN) {}
+
+  void setStage(Stage stage)
+  {
+    stage_ = stage;
+  }
+
+  void run(int begin, int end)
+  {
+    for (int band = begin; band < end; ++band)
+      {
+        int yBegin = band * bandRows_;
+        int yEnd = std::min(labeler_.height_, yBegin + bandRows_);
+        if (stage_ == SCAN)
+          scan(band, yBegin, yEnd);
+        else if (stage_ == UNITE)
+          unite(band, yBegin, yEnd);
+        else
+          write(yBegin, yEnd);
+      }
+  }
+
+private:
+  // runs of band are collected, rowStart_[y + 1] gets number of runs in row y
+  void scan(int band, int yBegin, int yEnd)
+  {
+    std::vector<Run>& runs = labeler_.bandRuns_[band];
+    std::vector<uint64_t>& words = labeler_.bandWords_[band];
+    runs.clear();
+    for (int y = yBegin; y < yEnd; ++y)
+      {
+        size_t before = runs.size();
+        if (packed_)
+          appendRuns(packed_->row(y), labeler_.width_, runs);
+        else
+          {
+            words.resize((labeler_.width_ + 63) / 64);
+            packRow(gray_->row(y), &words[0], labeler_.width_, 1);
+            appendRuns(&words[0], labeler_.width_, runs);
+          }
+        labeler_.rowStart_[y + 1] = static_cast<int>(runs.size() - before);
+      }
+  }
+
+  // runs of band are moved to their place, union-find inside of band
+  // touches only its own runs
+  void unite(int band, int yBegin, int yEnd)
+  {
+    std::vector<Run>& runs = labeler_.bandRuns_[band];
+    int first = labeler_.rowStart_[yBegin];
+    std::copy(runs.begin(), runs.end(), labeler_.runs_.begin() + first);
+    for (int i = first; i < first + static_cast<int>(runs.size()); ++i)
+      labeler_.parent_[i] = i;
+    for (int y = yBegin + 1; y < yEnd; ++y)
+      labeler_.uniteRows(y);
+  }
+
+  // parent_ holds labels of runs by now
+  void write(int yBegin, int yEnd)
+  {
+    int width = labeler_.width_;
+    for (int y = yBegin; y < yEnd; ++y)
+      {
+        LabelImage::label_t* row = labels_ + static_cast<size_t>(y) * width;
+        std::fill(row, row + width, 0);
+        for (int i = labeler_.rowStart_[y]; i < labeler_.rowStart_[y + 1]; ++i)
+          {
+            const Run& run = labeler_.runs_[i];
+            std::fill(row + run.x1, row + run.x2 + 1, static_cast<LabelImage::label_t>(labeler_.parent_[i]));
+          }
+      }
+  }
+
+  ComponentLabeler& labeler_;
+  const GrayImageView* gray_;
+  const BinaryImage* packed_;
+  int bandRows_;
+  LabelImage::label_t* labels_;
+  Stage stage_;
+};
+
+ComponentLabeler::ComponentLabeler(ThreadPool* pool)
+  : pool_(pool)
+  , height_(0)
+  , width_(0)
+{
+}
+
+void ComponentLabeler::label(const GrayImageView& image, LabelImage& labels)
+{
+  run(&image, 0, image.getHeight(), image.getWidth(), labels.components_, &labels);
+}
+
+void ComponentLabeler::label(const BinaryImage& image, LabelImage& labels)
+{
+  run(0, &image, image.getHeight(), image.getWidth(), labels.components_, &labels);
+}
+
+int ComponentLabeler::count(const GrayImageView& image, std::vector<ComponentStats>& stats)
+{
+  run(&image, 0, image.getHeight(), image.getWidth(), stats, 0);
+  return static_cast<int>(stats.size());
+}
+
+void ComponentLabeler::run(const GrayImageView* gray, const BinaryImage* packed, int height, int width,
+                           std::vector<ComponentStats>& stats, LabelImage* labels)
+{
+  GRAYIMAGE_TIMED(OP_LABEL_COMPONENTS, height, width, (gray ? 1 : 0.125) + (labels ? 4 : 0));
+  height_ = height;
+  width_ = width;
+  stats.clear();
+  if (labels)
+    {
+      labels->height_ = height;
+      labels->width_ = width;
+      labels->labels_.resize(static_cast<size_t>(height) * width);
+    }
+  if (!height  ||  !width)
+    return;
+
+  int bandCount = pool_ ? std::min(height, pool_->getThreadCount() * 4) : 1;
+  int bandRows = (height + bandCount - 1) / bandCount;
+  bandCount = (height + bandRows - 1) / bandRows;
+  if (static_cast<int>(bandRuns_.size()) < bandCount)
+    {
+      bandRuns_.resize(bandCount);
+      bandWords_.resize(bandCount);
+    }
+
+  Bands bands(*this, gray, packed, bandRows, labels ? &labels->labels_[0] : 0);
+  rowStart_.resize(height + 1);
+  rowStart_[0] = 0;
+  if (pool_)
+    pool_->parallelFor(bandCount, 1, bands);
+  else
+    bands.run(0, bandCount);
+
+  for (int y = 0; y < height; ++y)
+    rowStart_[y + 1] += rowStart_[y];
+  runs_.resize(rowStart_[height]);
+  parent_.resize(rowStart_[height]);
+
+  bands.setStage(Bands::UNITE);
+  if (pool_)
+    pool_->parallelFor(bandCount, 1, bands);
+  else
+    bands.run(0, bandCount);
+  for (int band = 1; band < bandCount; ++band)
+    uniteRows(band * bandRows);
+
+  // parents precede children, so in raster order parent of each run is
+  // already its root, then parent becomes label of the run
+  for (int y = 0; y < height; ++y)
+    for (int i = rowStart_[y]; i < rowStart_[y + 1]; ++i)
+      {
+        const Run& run = runs_[i];
+        int root = parent_[i];
+        if (root == i)
+          {
+            ComponentStats component = { 0, { y, run.x1, 1, 0 } };
+            stats.push_back(component);
+            parent_[i] = static_cast<int>(stats.size());
+          }
+        else
+          parent_[i] = parent_[root];
+
+        ComponentStats& component = stats[parent_[i] - 1];
+        component.area += run.x2 - run.x1 + 1;
+        Tile& box = component.box;
+        int right = std::max(box.x + box.width, run.x2 + 1);
+        box.x = std::min(box.x, run.x1);
+        box.width = right - box.x;
+        box.height = y - box.y + 1;
+      }
+
+  if (labels)
+    {
+      bands.setStage(Bands::WRITE);
+      if (pool_)
+        pool_->parallelFor(bandCount, 1, bands);
+      else
+        bands.run(0, bandCount);
+    }
+}
+
+// path halving keeps parents before children
+int ComponentLabeler::find(int run)
+{
+  while (parent_[run] != run)
+    {
+      parent_[run] = parent_[parent_[run]];
+      run = parent_[run];
+    }
+  return run;
+}
+
+void ComponentLabeler::unite(int one, int two)
+{
+  one = find(one);
+  two = find(two);
+  if (one < two)
+    parent_[two] = one;
+  else if (two < one)
+    parent_[one] = two;
+}
+
+void ComponentLabeler::uniteRows(int y)
+{
+  int previous = rowStart_[y - 1];
+  int previousEnd = rowStart_[y];
+  for (int i = rowStart_[y]; i < rowStart_[y + 1]; ++i)
+    {
+      const Run& run = runs_[i];
+      while (previous < previousEnd  &&  runs_[previous].x2 < run.x1)
+        ++previous;
+      for (int j = previous; j < previousEnd  &&  runs_[j].x1 <= run.x2; ++j)
+        unite(j, i);
+    }
+}
+
+LabelImage labelComponents(const GrayImageView& image)
+{
+  LabelImage labels;
+  ComponentLabeler().label(image, labels);
+  return labels;
+}
+
+void labelComponents(const GrayImageView& image, LabelImage& labels, ThreadPool& pool)
+{
+  ComponentLabeler(&pool).label(image, labels);
+}
+
+LabelImage labelComponents(const BinaryImage& image)
+{
+  LabelImage labels;
+  ComponentLabeler().label(image, labels);
+  return labels;
+}
+
+// number of components, without writing label image
+int countComponents(const GrayImageView& image)
+{
+  std::vector<ComponentStats> stats;
+  return ComponentLabeler().count(image, stats);
+}
+
+// Binary image stored as runs of white pixels of each row. Sparse masks,
+// e.g. of documents, take a few runs per row instead of a byte per pixel,
+// and operations below cost per run instead of per pixel.
+class RleImage
+{
+public:
+  // white pixels [x1, x2] of a row
+  struct Run
+  {
+    int x1;
+    int x2;
+  };
+
+  // creates empty image
+  RleImage();
+
+  // creates image of given size filled with black pixels
+  RleImage(int height, int width);
+
+  // pixels not equal to 0 become white
+  explicit RleImage(const GrayImageView& image);
+  explicit RleImage(const BinaryImage& image);
+
+  // unpacks to image with pixels 0 and 255
+  GrayImage toGrayImage() const;
+  void toGrayImage(GrayImage& result) const;
+
+  int getHeight() const;
+  int getWidth() const;
+
+  // Runs of row y from left to right, they are separated by black
+  // pixels, so each image has single representation.
+  const Run* rowBegin(int y) const;
+  const Run* rowEnd(int y) const;
+
+  size_t getRunCount() const;
+
+  // number of white pixels
+  size_t count() const;
+
+  friend bool operator==(const RleImage& one, const RleImage& two);
+  friend bool operator!=(const RleImage& one, const RleImage& two);
+
+  friend void translate(const RleImage& image, int dy, int dx, RleImage& result);
+  friend void binaryFillHoles(const RleImage& image, RleImage& result);
+  friend void binaryBackground(const RleImage& image, RleImage& result);
+
+private:
+  // Image without rows, runs of each row are appended to runs_ followed
+  // by endRow(). Run must follow previous run of row with black pixel
+  // between them.
+  void clear(int height, int width);
+  void endRow();
+
+  int height_;
+  int width_;
+  // runs of row y are [rowStart_[y], rowStart_[y + 1])
+  std::vector<Run> runs_;
+  std::vector<size_t> rowStart_;
+};
+
+RleImage::RleImage()
+  : height_(0)
+  , width_(0)
+  , rowStart_(1, 0)
+{
+}
+
+RleImage::RleImage(int height, int width)
+  : height_(height)
+  , width_(width)
+  , rowStart_(height + 1, 0)
+{
+  assert(height > 0  &&  width > 0);
+}
+
+RleImage::RleImage(const GrayImageView& image)
+  : height_(0)
+  , width_(0)
+  , rowStart_(1, 0)
+{
+  if (!image.getHeight()  ||  !image.getWidth())
+    return;
+
+  // rows are packed first, runs are found with bit scans of words
+  clear(image.getHeight(), image.getWidth());
+  std::vector<uint64_t> words((width_ + 63) / 64);
+  for (int y = 0; y < height_; ++y)
+    {
+      packRow(image.row(y), &words[0], width_, 1);
+      appendRuns(&words[0], width_, runs_);
+      endRow();
+    }
+}
+
+RleImage::RleImage(const BinaryImage& image)
+  : height_(0)
+  , width_(0)
+  , rowStart_(1, 0)
+{
+  if (!image.getHeight())
+    return;
+
+  clear(image.getHeight(), image.getWidth());
+  for (int y = 0; y < height_; ++y)
+    {
+      appendRuns(image.row(y), width_, runs_);
+      endRow();
+    }
+}
+
+GrayImage RleImage::toGrayImage() const
+{
+  // single named result for return value optimization
+  GrayImage result;
+  toGrayImage(result);
+  return result;
+}
+
+void RleImage::toGrayImage(GrayImage& result) const
+{
+  result.reshape(height_, width_);
+  for (int y = 0; y < height_; ++y)
+    {
+      GrayImage::pixel_t* row = result.row(y);
+      std::memset(row, 0, width_);
+      for (const Run* run = rowBegin(y); run != rowEnd(y); ++run)
+        std::memset(row + run->x1, 255, run->x2 - run->x1 + 1);
+    }
+  // pixels are 0 and 255, let isBinary() know it without scan
+  result.binary_ = height_ != 0;
+}
+
+int RleImage::getHeight() const
+{
+  return height_;
+}
+
+int RleImage::getWidth() const
+{
+  return width_;
+}
+
+const RleImage::Run* RleImage::rowBegin(int y) const
+{
+  assert(y >= 0  &&  y < height_);
+  return runs_.empty() ? 0 : &runs_[0] + rowStart_[y];
+}
+
+const RleImage::Run* RleImage::rowEnd(int y) const
+{
+  assert(y >= 0  &&  y < height_);
+  return runs_.empty() ? 0 : &runs_[0] + rowStart_[y + 1];
+}
+
+size_t RleImage::getRunCount() const
+{
+  return runs_.size();
+}
+
+size_t RleImage::count() const
+{
+  size_t result = 0;
+  for (size_t i = 0; i < runs_.size(); ++i)
+    result += runs_[i].x2 - runs_[i].x1 + 1;
+  return result;
+}
+
+void RleImage::clear(int height, int width)
+{
+  height_ = height;
+  width_ = width;
+  runs_.clear();
+  rowStart_.assign(1, 0);
+  rowStart_.reserve(height + 1);
+}
+
+void RleImage::endRow()
+{
+  rowStart_.push_back(runs_.size());
+}
+
+bool operator==(const RleImage& one, const RleImage& two)
+{
+  if (one.height_ != two.height_  ||  one.width_ != two.width_  ||  one.rowStart_ != two.rowStart_)
+    return false;
+
+  for (size_t i = 0; i < one.runs_.size(); ++i)
+    if (one.runs_[i].x1 != two.runs_[i].x1  ||  one.runs_[i].x2 != two.runs_[i].x2)
+      return false;
+  return true;
+}
+
+bool operator!=(const RleImage& one, const RleImage& two)
+{
+  return !(one == two);
+}
+
+// runs are always white pixels
+bool isBinary(const RleImage&)
+{
+  return true;
+}
+
+// Same as translate() for GrayImage, runs are moved and clipped
+void translate(const RleImage& image, int dy, int dx, RleImage& result);
+RleImage translate(const RleImage& image, int dy, int dx)
+{
+  RleImage result;
+  translate(image, dy, dx, result);
+  return result;
+}
+
+// Same as above, but result is written to given image, whose buffers are
+// reused. Result must not be the source image.
+void translate(const RleImage& image, int dy, int dx, RleImage& result)
+{
+  assert(&result != &image);
+  result.clear(image.height_, image.width_);
+  result.rowStart_.resize(image.height_ + 1);
+  // runs moved by the same offset stay separated, clipping only drops
+  // or shortens them, so result has at most as many runs as image
+  result.runs_.resize(image.runs_.size());
+  RleImage::Run* out = result.runs_.empty() ? 0 : &result.runs_[0];
+  size_t count = 0;
+  int last = image.width_ - 1;
+  for (int y = 0; y < image.height_; ++y)
+    {
+      result.rowStart_[y] = count;
+      int source = y - dy;
+      if (source < 0  ||  source >= image.height_)
+        continue;
+
+      const RleImage::Run* begin = image.rowBegin(source);
+      const RleImage::Run* end = image.rowEnd(source);
+      if (begin == end)
+        continue;
+      if (begin->x1 + dx >= 0  &&  (end - 1)->x2 + dx <= last)
+        for (const RleImage::Run* run = begin; run != end; ++run, ++count)
+          {
+            out[count].x1 = run->x1 + dx;
+            out[count].x2 = run->x2 + dx;
+          }
+      else
+        for (const RleImage::Run* run = begin; run != end; ++run)
+          {
+            out[count].x1 = std::max(0, run->x1 + dx);
+            out[count].x2 = std::min(last, run->x2 + dx);
+            count += out[count].x1 <= out[count].x2;
+          }
+    }
+  result.rowStart_[image.height_] = count;
+  result.runs_.resize(count);
+}
+
+namespace
+{
+  // Runs of black pixels of image united into 4-connected components,
+  // components touching border of image are background. Row with n white
+  // runs has n + 1 black runs around them, some of them empty, so black
+  // runs need no storage of their own: run k of row y has index
+  // rowStart[y] + y + k and lies between white runs k - 1 and k.
+  class RleBackground
+  {
+  public:
+    explicit RleBackground(const RleImage& image)
+      : image_(image), width_(image.getWidth())
+    {
+      int height = image.getHeight();
+      size_t count = image.getRunCount() + height;
+      parent_.resize(count);
+      border_.resize(count);
+      for (int y = 0; y < height; ++y)
+        {
+          const RleImage::Run* white = image.rowBegin(y);
+          size_t runs = image.rowEnd(y) - white;
+          size_t first = start(y);
+          bool edgeRow = y == 0  ||  y == height - 1;
+          for (size_t k = 0; k <= runs; ++k)
+            {
+              parent_[first + k] = static_cast<int>(first + k);
+              border_[first + k] = edgeRow  ||  k == 0  ||  k == runs;
+            }
+          if (y)
+            uniteRows(y);
+        }
+
+      // parents precede children, so in raster order each parent already
+      // points to root, then border flags are moved to roots
+      for (size_t i = 0; i < count; ++i)
+        {
+          parent_[i] = parent_[parent_[i]];
+          border_[parent_[i]] |= border_[i];
+        }
+    }
+
+    // black runs of background of row y are appended to result
+    void appendBackground(int y, std::vector<RleImage::Run>& result) const
+    {
+      const RleImage::Run* white = image_.rowBegin(y);
+      size_t runs = image_.rowEnd(y) - white;
+      size_t first = start(y);
+      for (size_t k = 0; k <= runs; ++k)
+        {
+          RleImage::Run run = gap(white, runs, k);
+          if (run.x1 <= run.x2  &&  border_[parent_[first + k]])
+            result.push_back(run);
+        }
+    }
+
+    // white runs of row y with holes filled are appended to result: they
+    // are gaps between background runs
+    void appendFilled(int y, std::vector<RleImage::Run>& result) const
+    {
+      const RleImage::Run* white = image_.rowBegin(y);
+      size_t runs = image_.rowEnd(y) - white;
+      size_t first = start(y);
+      int x = 0;
+      for (size_t k = 0; k <= runs; ++k)
+        {
+          RleImage::Run run = gap(white, runs, k);
+          if (run.x1 > run.x2  ||  !border_[parent_[first + k]])
+            continue;
+          if (x < run.x1)
+            {
+              RleImage::Run filled = { x, run.x1 - 1 };
+              result.push_back(filled);
+            }
+          x = run.x2 + 1;
+        }
+      if (x < width_)
+        {
+          RleImage::Run filled = { x, width_ - 1 };
+          result.push_back(filled);
+        }
+    }
+
+  private:
+    size_t start(int y) const
+    {
+      return (image_.rowBegin(y) - image_.rowBegin(0)) + y;
+    }
+
+    // black run k of row with given white runs, empty if x1 > x2
+    RleImage::Run gap(const RleImage::Run* white, size_t whiteRuns, size_t k) const
+    {
+      RleImage::Run run = { k ? white[k - 1].x2 + 1 : 0, k < whiteRuns ? white[k].x1 - 1 : width_ - 1 };
+      return run;
+    }
+
+    // white runs are separated, so only the first and the last gap may be empty
+    bool isEmpty(const RleImage::Run* white, size_t whiteRuns, size_t k) const
+    {
+      return whiteRuns  &&  ((k == 0  &&  white[0].x1 == 0)
+                             ||  (k == whiteRuns  &&  white[whiteRuns - 1].x2 == width_ - 1));
+    }
+
+    int find(int run)
+    {
+      while (parent_[run] != run)
+        {
+          parent_[run] = parent_[parent_[run]];
+          run = parent_[run];
+        }
+      return run;
+    }
+
+    void unite(int one, int two)
+    {
+      one = find(one);
+      two = find(two);
+      if (one < two)
+        parent_[two] = one;
+      else if (two < one)
+        parent_[one] = two;
+    }
+
+    // black runs of previous and current row overlapping in at least one column
+    void uniteRows(int y)
+    {
+      const RleImage::Run* white = image_.rowBegin(y);
+      const RleImage::Run* previousWhite = image_.rowBegin(y - 1);
+      size_t whiteRuns = image_.rowEnd(y) - white;
+      size_t previousWhiteRuns = image_.rowEnd(y - 1) - previousWhite;
+      int* parent = &parent_[start(y)];
+      int previous = static_cast<int>(start(y - 1));
+
+      // In rows with the same white runs, as in strokes of letters or in
+      // blank rows, each black run meets only the one right above it
+      if (whiteRuns == previousWhiteRuns
+          &&  std::memcmp(white, previousWhite, whiteRuns * sizeof(RleImage::Run)) == 0)
+        {
+          for (size_t i = 0; i <= whiteRuns; ++i)
+            if (!isEmpty(white, whiteRuns, i))
+              parent[i] = find(previous + static_cast<int>(i));
+          return;
+        }
+
+      size_t k = 0;
+      for (size_t i = 0; i <= whiteRuns; ++i)
+        {
+          RleImage::Run run = gap(white, whiteRuns, i);
+          if (run.x1 > run.x2)
+            continue;
+          while (k < previousWhiteRuns  &&  gap(previousWhite, previousWhiteRuns, k).x2 < run.x1)
+            ++k;
+          // run is still its own root when it meets first run above
+          bool own = true;
+          for (size_t j = k; j <= previousWhiteRuns; ++j)
+            {
+              RleImage::Run above = gap(previousWhite, previousWhiteRuns, j);
+              if (above.x1 > run.x2)
+                break;
+              if (above.x1 > above.x2)
+                continue;
+              if (own)
+                parent[i] = find(previous + static_cast<int>(j));
+              else
+                unite(previous + static_cast<int>(j), static_cast<int>(&parent[i] - &parent_[0]));
+              own = false;
+            }
+        }
+    }
+
+    const RleImage& image_;
+    int width_;
+    std::vector<int> parent_;
+    std::vector<char> border_;
+  };
+}
+
+// Same as binaryBackground() for GrayImage: white pixels are black pixels
+// of image connected to border
+void binaryBackground(const RleImage& image, RleImage& result);
+RleImage binaryBackground(const RleImage& image)
+{
+  RleImage result;
+  binaryBackground(image, result);
+  return result;
+}
+
+// same as above, buffers of result are reused, it must not be the source image
+void binaryBackground(const RleImage& image, RleImage& result)
+{
+  assert(&result != &image);
+  RleBackground background(image);
+  result.clear(image.height_, image.width_);
+  for (int y = 0; y < image.height_; ++y)
+    {
+      background.appendBackground(y, result.runs_);
+      result.endRow();
+    }
+}
+
+// Same as binaryFillHoles() for GrayImage: runs are gaps of background
+void binaryFillHoles(const RleImage& image, RleImage& result);
+RleImage binaryFillHoles(const RleImage& image)
+{
+  RleImage result;
+  binaryFillHoles(image, result);
+  return result;
+}
+
+// same as above, buffers of result are reused, it must not be the source image
+void binaryFillHoles(const RleImage& image, RleImage& result)
+{
+  assert(&result != &image);
+  RleBackground background(image);
+  result.clear(image.height_, image.width_);
+  result.runs_.reserve(image.runs_.size());
+  for (int y = 0; y < image.height_; ++y)
+    {
+      background.appendFilled(y, result.runs_);
+      result.endRow();
+    }
+}
+
+// Content hash and differences of images
+namespace
+{
+  // XXH64 primes, built from halves as C++03 has no 64-bit literals
+  const uint64_t hashPrime1 = static_cast<uint64_t>(0x9e3779b1u) << 32 | 0x85ebca87u;
+  const uint64_t hashPrime2 = static_cast<uint64_t>(0xc2b2ae3du) << 32 | 0x27d4eb4fu;
+  const uint64_t hashPrime3 = static_cast<uint64_t>(0x165667b1u) << 32 | 0x9e3779f9u;
+  const uint64_t hashPrime4 = static_cast<uint64_t>(0x85ebca77u) << 32 | 0xc2b2ae63u;
+  const uint64_t hashPrime5 = static_cast<uint64_t>(0x27d4eb2fu) << 32 | 0x165667c5u;
+
+  uint64_t rotateLeft(uint64_t value, int bits)
+  {
+    return (value << bits) | (value >> (64 - bits));
+  }
+
+  uint64_t load64(const uint8_t* p)
+  {
+    uint64_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+
+  uint64_t hashRound(uint64_t acc, uint64_t input)
+  {
+    return rotateLeft(acc + input * hashPrime2, 31) * hashPrime1;
+  }
+
+  uint64_t hashMerge(uint64_t acc, uint64_t value)
+  {
+    return (acc ^ hashRound(0, value)) * hashPrime1 + hashPrime4;
+  }
+
+  // XXH64: 32-byte stripes feed four independent lanes, which keeps
+  // multipliers busy at memory speed, tail and avalanche mix all bits
+  uint64_t hashBytes(const uint8_t* p, size_t size, uint64_t seed)
+  {
+    const uint8_t* end = p + size;
+    uint64_t h;
+    if (size >= 32)
+      {
+        uint64_t v1 = seed + hashPrime1 + hashPrime2;
+        uint64_t v2 = seed + hashPrime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - hashPrime1;
+        for (; end - p >= 32; p += 32)
+          {
+            v1 = hashRound(v1, load64(p));
+            v2 = hashRound(v2, load64(p + 8));
+            v3 = hashRound(v3, load64(p + 16));
+            v4 = hashRound(v4, load64(p + 24));
+          }
+        h = rotateLeft(v1, 1) + rotateLeft(v2, 7) + rotateLeft(v3, 12) + rotateLeft(v4, 18);
+        h = hashMerge(h, v1);
+        h = hashMerge(h, v2);
+        h = hashMerge(h, v3);
+        h = hashMerge(h, v4);
+      }
+    else
+      h = seed + hashPrime5;
+
+    h += size;
+    for (; end - p >= 8; p += 8)
+      h = rotateLeft(h ^ hashRound(0, load64(p)), 27) * hashPrime1 + hashPrime4;
+    if (end - p >= 4)
+      {
+        uint32_t word;
+        std::memcpy(&word, p, sizeof(word));
+        h = rotateLeft(h ^ (word * hashPrime1), 23) * hashPrime2 + hashPrime3;
+        p += 4;
+      }
+    for (; p < end; ++p)
+      h = rotateLeft(h ^ (*p * hashPrime5), 11) * hashPrime1;
+
+    h ^= h >> 33;
+    h *= hashPrime2;
+    h ^= h >> 29;
+    h *= hashPrime3;
+    h ^= h >> 32;
+    return h;
+  }
+}
+
+uint64_t GrayImage::hash() const
+{
+  if (!hashValid_)
+    {
+      uint64_t size = static_cast<uint64_t>(height_) << 32 | static_cast<uint32_t>(width_);
+      hash_ = hashBytes(data(), data_.size(), size);
+      hashValid_ = true;
+    }
+  return hash_;
+}
+
+bool hashEquals(const GrayImage& one, const GrayImage& two)
+{
+  if (one.height_ != two.height_  ||  one.width_ != two.width_)
+    return false;
+  if (one.hash() != two.hash())
+    return false;
+  return &one == &two  ||  one.data_ == two.data_;
+}
+
+// Where two images of the same size differ: number of differing pixels
+// and smallest rectangle containing them, which is empty if count is 0
+struct ImageDiff
+{
+  size_t count;
+  Tile bounds;
+};
+
+namespace
+{
+  // Differences in row, first and last are set to x of first and last
+  // differing pixel if there are any
+  size_t diffRowScalar(const uint8_t* one, const uint8_t* two, int begin, int end,
+                       int& first, int& last)
+  {
+    size_t count = 0;
+    for (int x = begin; x < end; ++x)
+      if (one[x] != two[x])
+        {
+          if (first < 0)
+            first = x;
+          last = x;
+          ++count;
+        }
+    return count;
+  }
+
+#ifdef GRAYIMAGE_X86
+  // adds differences marked by set bits of mask for pixels from x
+  size_t addDiffMask(uint64_t mask, int x, int& first, int& last)
+  {
+    if (first < 0)
+      first = x + countTrailingZeros(mask);
+    last = x + 63 - countLeadingZeros(mask);
+    return popCount(mask);
+  }
+
+  // equal bytes are found with compare and movemask, runs of equal
+  // pixels cost one test per 16 or 32 of them
+  GRAYIMAGE_TARGET("sse2")
+  size_t diffRowSse2(const uint8_t* one, const uint8_t* two, int width, int& first, int& last)
+  {
+    size_t count = 0;
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+      {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(one + x));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(two + x));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+        if (mask)
+          count += addDiffMask(mask, x, first, last);
+      }
+    return count + diffRowScalar(one, two, x, width, first, last);
+  }
+
+  GRAYIMAGE_TARGET("avx2")
+  size_t diffRowAvx2(const uint8_t* one, const uint8_t* two, int width, int& first, int& last)
+  {
+    size_t count = 0;
+    int x = 0;
+    for (; x + 32 <= width; x += 32)
+      {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(one + x));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(two + x));
+        uint32_t mask = ~static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)));
+        if (mask)
+          count += addDiffMask(mask, x, first, last);
+      }
+    return count + diffRowScalar(one, two, x, width, first, last);
+  }
+#endif
+
+#ifdef GRAYIMAGE_NEON
+  // NEON has no movemask: blocks of 16 with any difference are scanned
+  // per pixel
+  size_t diffRowNeon(const uint8_t* one, const uint8_t* two, int width, int& first, int& last)
+  {
+    size_t count = 0;
+    int x = 0;
+    for (; x + 16 <= width; x += 16)
+      {
+        uint8x16_t ne = vmvnq_u8(vceqq_u8(vld1q_u8(one + x), vld1q_u8(two + x)));
+        uint8x8_t half = vpmax_u8(vget_low_u8(ne), vget_high_u8(ne));
+        half = vpmax_u8(half, half);
+        half = vpmax_u8(half, half);
+        half = vpmax_u8(half, half);
+        if (vget_lane_u8(half, 0))
+          count += diffRowScalar(one, two, x, x + 16, first, last);
+      }
+    return count + diffRowScalar(one, two, x, width, first, last);
+  }
+#endif
+
+  size_t diffRow(const uint8_t* one, const uint8_t* two, int width, int& first, int& last)
+  {
+    switch (simdLevel())
+      {
+#ifdef GRAYIMAGE_X86
+      case SIMD_AVX2:
+        return diffRowAvx2(one, two, width, first, last);
+      case SIMD_SSE2:
+        return diffRowSse2(one, two, width, first, last);
+#endif
+#ifdef GRAYIMAGE_NEON
+      case SIMD_NEON:
+        return diffRowNeon(one, two, width, first, last);
+#endif
+      default:
+        return diffRowScalar(one, two, 0, width, first, last);
+      }
+  }
+}
+
+// Views must have the same size
+ImageDiff diff(const GrayImageView& one, const GrayImageView& two)
+{
+  assert(one.getHeight() == two.getHeight()  &&  one.getWidth() == two.getWidth());
+
+  ImageDiff result;
+  result.count = 0;
+  int top = -1;
+  int bottom = -1;
+  int left = one.getWidth();
+  int right = -1;
+  for (int y = 0; y < one.getHeight(); ++y)
+    {
+      int first = -1;
+      int last = -1;
+      size_t count = diffRow(one.row(y), two.row(y), one.getWidth(), first, last);
+      if (!count)
+        continue;
+
+      result.count += count;
+      if (top < 0)
+        top = y;
+      bottom = y;
+      left = std::min(left, first);
+      right = std::max(right, last);
+    }
+
+  Tile empty = { 0, 0, 0, 0 };
+  Tile bounds = { top, left, bottom - top + 1, right - left + 1 };
+  result.bounds = result.count ? bounds : empty;
+  return result;
+}
+
+// Incremental operations for frames that change in small areas between
+// calls. Source image tracks changes (GrayImage::trackChanges()) and result
+// holds output of previous call for the same source; only what dirty tiles
+// of source can affect is recomputed and dirty tiles of source are cleared.
+// Pixels of result that change are marked dirty in it, so that incremental
+// operations can be chained. Everything is recomputed if source doesn't
+// track changes or result has different size. Pixels of source must be
+// written through pointers fetched after previous call, see trackChanges().
+
+// Keeps result equal to threshold(frame, thr), thr must be the same in
+// every call for given result
+void updateThreshold(GrayImage& frame, uint8_t thr, GrayImage& result)
+{
+  if (frame.dirtyShift_ < 0  ||  result.getHeight() != frame.getHeight()
+      ||  result.getWidth() != frame.getWidth())
+    {
+      threshold(frame, thr, result);
+      frame.clearDirty();
+      return;
+    }
+
+  uint8_t lut[256];
+  makeThresholdLut(thr, lut);
+  LutKernel kernel(lut);
+
+  std::vector<Tile> tiles;
+  frame.getDirtyTiles(tiles);
+  std::vector<GrayImage::pixel_t> line(frame.getDirtyTileSize());
+  int width = frame.getWidth();
+  for (size_t i = 0; i < tiles.size(); ++i)
+    {
+      const Tile& tile = tiles[i];
+      bool changed = false;
+      for (int y = tile.y; y < tile.y + tile.height; ++y)
+        {
+          size_t offset = static_cast<size_t>(y) * width + tile.x;
+          GrayImage::pixel_t* dst = &result.data_[offset];
+          kernel.run(&frame.data_[offset], &line[0], tile.width);
+          if (std::memcmp(dst, &line[0], tile.width) != 0)
+            {
+              std::memcpy(dst, &line[0], tile.width);
+              changed = true;
+            }
+        }
+      if (changed)
+        {
+          result.hashValid_ = false;
+          result.markDirty(tile);
+        }
+    }
+  frame.clearDirty();
+}
+
+// Keeps result equal to binaryFillHoles(mask) for binary mask.
+// Only components of black pixels touching dirty tiles of mask expanded by
+// one pixel can change. Each of them is searched starting from its pixel
+// there, going first to pixels closest to image border: component is
+// background as soon as border or pixel of other background component is
+// reached, so search usually walks straight to border or next to previous
+// search. Component is hole if search runs out of pixels, then all of it
+// has been visited once. Thus cost depends on size of changed area and of
+// holes near it, not on image size.
+class FillHolesUpdater
+{
+public:
+  FillHolesUpdater();
+
+  void update(GrayImage& mask, GrayImage& result);
+
+private:
+  // returns true if component of black pixel start is background,
+  // reached_ gets its pixels visited by search
+  bool search(const GrayImage::pixel_t* mask, int start, uint32_t firstId);
+
+  int height_;
+  int width_;
+
+  // id of search which reached pixel, ids of current update() are at
+  // least its firstId, so marks need no clearing between updates
+  std::vector<uint32_t> stamps_;
+  uint32_t nextId_;
+
+  // pixels waiting for search by distance to border, from lowest_
+  std::vector<std::vector<int> > pending_;
+  int lowest_;
+
+  std::vector<int> reached_;
+  std::vector<int> stack_;
+};
+
+FillHolesUpdater::FillHolesUpdater()
+  : height_(0)
+  , width_(0)
+  , nextId_(1)
+  , lowest_(0)
+{
+}
+
+void FillHolesUpdater::update(GrayImage& mask, GrayImage& result)
+{
+  if (mask.dirtyShift_ < 0  ||  result.getHeight() != mask.getHeight()
+      ||  result.getWidth() != mask.getWidth())
+    {
+      binaryFillHoles(mask, result);
+      mask.clearDirty();
+      return;
+    }
+
+  std::vector<Tile> tiles;
+  mask.getDirtyTiles(tiles);
+  if (tiles.empty())
+    return;
+
+  int height = mask.getHeight();
+  int width = mask.getWidth();
+  size_t count = static_cast<size_t>(height) * width;
+  if (height != height_  ||  width != width_  ||  nextId_ > 0xffffffffu - count)
+    {
+      height_ = height;
+      width_ = width;
+      stamps_.assign(count, 0);
+      nextId_ = 1;
+      // distance to border is at most (min(height, width) - 1) / 2
+      pending_.assign((std::min(height, width) + 1) / 2, std::vector<int>());
+    }
+
+  const GrayImage::pixel_t* src = &mask.data_[0];
+  GrayImage::pixel_t* dst = &result.data_[0];
+  result.hashValid_ = false;
+
+  // foreground is kept as is
+  for (size_t i = 0; i < tiles.size(); ++i)
+    for (int y = tiles[i].y; y < tiles[i].y + tiles[i].height; ++y)
+      for (int x = tiles[i].x; x < tiles[i].x + tiles[i].width; ++x)
+        {
+          size_t p = static_cast<size_t>(y) * width + x;
+          if (src[p]  &&  dst[p] != 255)
+            {
+              dst[p] = 255;
+              result.markDirtyPixel(y, x);
+            }
+        }
+
+  uint32_t firstId = nextId_;
+  for (size_t i = 0; i < tiles.size(); ++i)
+    {
+      int y1 = std::max(tiles[i].y - 1, 0);
+      int x1 = std::max(tiles[i].x - 1, 0);
+      int y2 = std::min(tiles[i].y + tiles[i].height + 1, height);
+      int x2 = std::min(tiles[i].x + tiles[i].width + 1, width);
+      for (int y = y1; y < y2; ++y)
+        for (int x = x1; x < x2; ++x)
+          {
+            int start = y * width + x;
+            if (src[start]  ||  stamps_[start] >= firstId)
+              continue;
+
+            uint32_t id = nextId_;
+            bool background = search(src, start, firstId);
+            GrayImage::pixel_t value = background ? 0 : 255;
+            for (size_t j = 0; j < reached_.size(); ++j)
+              {
+                int p = reached_[j];
+                if (dst[p] == value)
+                  continue;
+                dst[p] = value;
+                result.markDirtyPixel(p / width, p % width);
+                if (background)
+                  stack_.push_back(p);
+              }
+
+            // pixels that were hole before are now connected to background,
+            // the rest of their hole is not reached by search, which stops early
+            while (!stack_.empty())
+              {
+                int p = stack_.back();
+                stack_.pop_back();
+                int py = p / width;
+                int px = p % width;
+                int neighbors[4] = { py > 0 ? p - width : -1, py + 1 < height ? p + width : -1,
+                                     px > 0 ? p - 1 : -1, px + 1 < width ? p + 1 : -1 };
+                for (int k = 0; k < 4; ++k)
+                  {
+                    int q = neighbors[k];
+                    if (q < 0  ||  src[q]  ||  dst[q] != 255)
+                      continue;
+                    dst[q] = 0;
+                    stamps_[q] = id;
+                    result.markDirtyPixel(q / width, q % width);
+                    stack_.push_back(q);
+                  }
+              }
+          }
+    }
+  mask.clearDirty();
+}
+
+bool FillHolesUpdater::search(const GrayImage::pixel_t* mask, int start, uint32_t firstId)
+{
+  uint32_t id = nextId_++;
+  int width = width_;
+  int lastRow = height_ - 1;
+  int lastColumn = width_ - 1;
+
+  reached_.clear();
+  reached_.push_back(start);
+  stamps_[start] = id;
+
+  int y = start / width;
+  int x = start % width;
+  int distance = std::min(std::min(y, x), std::min(lastRow - y, lastColumn - x));
+  if (distance == 0)
+    return true;
+
+  lowest_ = distance;
+  int highest = distance;
+  int waiting = 1;
+  pending_[distance].push_back(start);
+
+  bool background = false;
+  while (!background  &&  waiting > 0)
+    {
+      while (pending_[lowest_].empty())
+        ++lowest_;
+      int p = pending_[lowest_].back();
+      pending_[lowest_].pop_back();
+      --waiting;
+
+      // pixels with non-zero distance have all four neighbors inside image
+      int neighbors[4] = { p - width, p + width, p - 1, p + 1 };
+      for (int k = 0; k < 4; ++k)
+        {
+          int q = neighbors[k];
+          if (mask[q])
+            continue;
+          if (stamps_[q] >= firstId)
+            {
+              // only background searches stop before visiting whole component
+              if (stamps_[q] != id)
+                {
+                  background = true;
+                  break;
+                }
+              continue;
+            }
+
+          stamps_[q] = id;
+          reached_.push_back(q);
+          int qy = q / width;
+          int qx = q % width;
+          int d = std::min(std::min(qy, qx), std::min(lastRow - qy, lastColumn - qx));
+          if (d == 0)
+            {
+              background = true;
+              break;
+            }
+          pending_[d].push_back(q);
+          ++waiting;
+          lowest_ = std::min(lowest_, d);
+          highest = std::max(highest, d);
+        }
+    }
+
+  for (int d = lowest_; d <= highest; ++d)
+    pending_[d].clear();
+  return background;
+}
+
+// Histogram: counts[v] is number of pixels with value v
+namespace
+{
+  // Consecutive equal pixels would make each increment wait for previous
+  // one to be stored, so each of 8 pixels loaded at once goes to its own
+  // sub-histogram. Counts are 32-bit, so they are flushed before overflow.
+  void countPixels(const uint8_t* p, size_t count, uint64_t counts[256])
+  {
+    const size_t maxBlock = size_t(1) << 30;
+    uint32_t sub[8][256];
+    while (count > 0)
+      {
+        size_t block = std::min(count, maxBlock);
+        std::memset(sub, 0, sizeof(sub));
+        size_t i = 0;
+        for (; i + 8 <= block; i += 8)
+          {
+            uint64_t v;
+            std::memcpy(&v, p + i, 8);
+            ++sub[0][v & 0xff];
+            ++sub[1][(v >> 8) & 0xff];
+            ++sub[2][(v >> 16) & 0xff];
+            ++sub[3][(v >> 24) & 0xff];
+            ++sub[4][(v >> 32) & 0xff];
+            ++sub[5][(v >> 40) & 0xff];
+            ++sub[6][(v >> 48) & 0xff];
+            ++sub[7][v >> 56];
+          }
+        for (; i < block; ++i)
+          ++sub[0][p[i]];
+        for (int v = 0; v < 256; ++v)
+          {
+            uint64_t sum = 0;
+            for (int k = 0; k < 8; ++k)
+              sum += sub[k][v];
+            counts[v] += sum;
+          }
+        p += block;
+        count -= block;
+      }
+  }
+
+  void countRows(const GrayImageView& image, int yBegin, int yEnd, uint64_t counts[256])
+  {
+    if (image.isContiguous())
+      countPixels(image.row(yBegin), static_cast<size_t>(yEnd - yBegin) * image.getWidth(), counts);
+    else
+      for (int y = yBegin; y < yEnd; ++y)
+        countPixels(image.row(y), image.getWidth(), counts);
+  }
+
+  // each band is counted separately and added to result under lock
+  class HistogramRows : public RowTask
+  {
+  public:
+    HistogramRows(const GrayImageView& image, uint64_t* counts)
+      : image_(image), counts_(counts) {}
+
+    void run(int yBegin, int yEnd)
+    {
+      uint64_t counts[256] = { 0 };
+      countRows(image_, yBegin, yEnd, counts);
+      MutexLock lock(mutex_);
+      for (int v = 0; v < 256; ++v)
+        counts_[v] += counts[v];
+    }
+
+  private:
+    const GrayImageView& image_;
+    uint64_t* counts_;
+    Mutex mutex_;
+  };
+}
+
+void histogram(const GrayImageView& image, uint64_t counts[256])
+{
+  GRAYIMAGE_TIMED(OP_HISTOGRAM, image.getHeight(), image.getWidth(), 1);
+  std::fill(counts, counts + 256, 0);
+  if (image.getHeight()  &&  image.getWidth())
+    countRows(image, 0, image.getHeight(), counts);
+}
+
+void histogram(const GrayImageView& image, uint64_t counts[256], ThreadPool& pool)
+{
+  GRAYIMAGE_TIMED(OP_HISTOGRAM, image.getHeight(), image.getWidth(), 1);
+  std::fill(counts, counts + 256, 0);
+  if (!image.getHeight()  ||  !image.getWidth())
+    return;
+
+  HistogramRows task(image, counts);
+  parallelForRows(pool, image.getHeight(), task);
+}
+
+// Otsu's method: threshold maximizing variance between pixels below it and
+// the others, for use with threshold(). Result is in [1, 255], the lowest
+// one if several are equally good, e.g. 1 for image of single value.
+uint8_t autoThreshold(const uint64_t counts[256])
+{
+  double total = 0;
+  double totalSum = 0;
+  for (int v = 0; v < 256; ++v)
+    {
+      total += counts[v];
+      totalSum += static_cast<double>(v) * counts[v];
+    }
+
+  int best = 1;
+  double bestVariance = -1;
+  double below = 0;
+  double belowSum = 0;
+  for (int t = 1; t < 256; ++t)
+    {
+      below += counts[t - 1];
+      belowSum += static_cast<double>(t - 1) * counts[t - 1];
+      double above = total - below;
+      if (below == 0  ||  above == 0)
+        {
+          if (bestVariance < 0)
+            {
+              best = t;
+              bestVariance = 0;
+            }
+          continue;
+        }
+
+      // between class variance scaled by total squared
+      double difference = belowSum / below - (totalSum - belowSum) / above;
+      double variance = below * above * difference * difference;
+      if (variance > bestVariance)
+        {
+          best = t;
+          bestVariance = variance;
+        }
+    }
+  return static_cast<uint8_t>(best);
+}
+
+uint8_t autoThreshold(const GrayImageView& image)
+{
+  uint64_t counts[256];
+  histogram(image, counts);
+  return autoThreshold(counts);
+}
+
+// threshold() with threshold chosen by autoThreshold()
+GrayImage thresholdOtsu(const GrayImageView& image)
+{
+  return threshold(image, autoThreshold(image));
+}
+
+void thresholdOtsu(const GrayImageView& image, GrayImage& result)
+{
+  threshold(image, autoThreshold(image), result);
+}
+
+void thresholdOtsu(const GrayImageView& image, GrayImage& result, ThreadPool& pool)
+{
+  uint64_t counts[256];
+  histogram(image, counts, pool);
+  threshold(image, autoThreshold(counts), result, pool);
+}
+
+// Conversion of PGM pixel data to 8-bit pixels
+
+namespace
+{
+  // Samples of max value 65535 are scaled as (v * 255 + 32767) / 65535,
+  // which equals (w - (w >> 8)) >> 8 for w = v + 128 saturated to 65535.
+  void scaleSamples16Scalar(const char* src, uint8_t* dst, size_t count)
+  {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(src);
+    for (size_t i = 0; i < count; ++i)
+      {
+        uint32_t w = std::min<uint32_t>((p[2 * i] << 8 | p[2 * i + 1]) + 128, 65535);
+        dst[i] = static_cast<uint8_t>((w - (w >> 8)) >> 8);
+      }
+  }
+
+#ifdef GRAYIMAGE_X86
+  GRAYIMAGE_TARGET("sse2")
+  __m128i scaleSamples16Sse2(__m128i v)
+  {
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    __m128i w = _mm_adds_epu16(v, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_sub_epi16(w, _mm_srli_epi16(w, 8)), 8);
+  }
+
+  GRAYIMAGE_TARGET("sse2")
+  void scaleSamples16Sse2(const char* src, uint8_t* dst, size_t count)
+  {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      {
+        __m128i v0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i));
+        __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * i + 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+                         _mm_packus_epi16(scaleSamples16Sse2(v0), scaleSamples16Sse2(v1)));
+      }
+    scaleSamples16Scalar(src + 2 * i, dst + i, count - i);
+  }
+
+  GRAYIMAGE_TARGET("avx2")
+  __m256i scaleSamples16Avx2(__m256i v)
+  {
+    v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+    __m256i w = _mm256_adds_epu16(v, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_sub_epi16(w, _mm256_srli_epi16(w, 8)), 8);
+  }
+
+  // packus works within 128-bit lanes, permute puts quarters back in order
+  GRAYIMAGE_TARGET("avx2")
+  void scaleSamples16Avx2(const char* src, uint8_t* dst, size_t count)
+  {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32)
+      {
+        __m256i v0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 2 * i));
+        __m256i v1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + 2 * i + 32));
+        __m256i packed = _mm256_packus_epi16(scaleSamples16Avx2(v0), scaleSamples16Avx2(v1));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_permute4x64_epi64(packed, 0xd8));
+      }
+    scaleSamples16Sse2(src + 2 * i, dst + i, count - i);
+  }
+#endif
+
+#ifdef GRAYIMAGE_NEON
+  void scaleSamples16Neon(const char* src, uint8_t* dst, size_t count)
+  {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(src);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+      {
+        uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(p + 2 * i)));
+        uint16x8_t w = vqaddq_u16(v, vdupq_n_u16(128));
+        vst1_u8(dst + i, vshrn_n_u16(vsubq_u16(w, vshrq_n_u16(w, 8)), 8));
+      }
+    scaleSamples16Scalar(src + 2 * i, dst + i, count - i);
+  }
+#endif
+
+  void scaleSamples16(const char* src, uint8_t* dst, size_t count)
+  {
+    switch (simdLevel())
+      {
+#ifdef GRAYIMAGE_X86
+      case SIMD_AVX2:
+        scaleSamples16Avx2(src, dst, count);
+        return;
+      case SIMD_SSE2:
+        scaleSamples16Sse2(src, dst, count);
+        return;
+#endif
+#ifdef GRAYIMAGE_NEON
+      case SIMD_NEON:
+        scaleSamples16Neon(src, dst, count);
+        return;
+#endif
+      default:
+        scaleSamples16Scalar(src, dst, count);
+      }
+  }
+
+  // values above maxValue are invalid and rejected by decoders, here they
+  // would become white
+  uint8_t scaleSample(uint32_t value, uint32_t maxValue)
+  {
+    return static_cast<uint8_t>((std::min(value, maxValue) * 255 + maxValue / 2) / maxValue);
+  }
+
+  int decodeAsciiPixels(const char* data, size_t size, int maxValue, size_t count, uint8_t* pixels)
+  {
+    size_t pos = 0;
+    for (size_t i = 0; i < count; ++i)
+      {
+        int value;
+        if (!parsePGMNumber(data, size, pos, value)  ||  value < 0  ||  value > maxValue)
+          {
+            std::cerr << "Invalid pixel value at pixel " << i << std::endl;
+            return -1;
+          }
+        pixels[i] = maxValue == 255 ? static_cast<uint8_t>(value) : scaleSample(value, maxValue);
+      }
+    return 0;
+  }
+}
+
+int decodePGMPixels(const char* data, size_t size, const PGMHeader& header, size_t count,
+                    uint8_t* pixels)
+{
+  uint32_t maxValue = header.maxValue;
+  if (header.ascii)
+    return decodeAsciiPixels(data, size, header.maxValue, count, pixels);
+
+  assert(size >= count * header.getSampleSize());
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+  if (maxValue == 65535)
+    scaleSamples16(data, pixels, count);
+  else if (maxValue > 255)
+    for (size_t i = 0; i < count; ++i)
+      {
+        uint32_t value = p[2 * i] << 8 | p[2 * i + 1];
+        if (value > maxValue)
+          {
+            std::cerr << "Invalid pixel value at pixel " << i << std::endl;
+            return -1;
+          }
+        pixels[i] = scaleSample(value, maxValue);
+      }
+  else
+    {
+      // samples are checked in a separate pass, so that the common case
+      // maxValue == 255 keeps running lookup table kernel only
+      for (size_t i = 0; maxValue < 255  &&  i < count; ++i)
+        if (p[i] > maxValue)
+          {
+            std::cerr << "Invalid pixel value at pixel " << i << std::endl;
+            return -1;
+          }
+      uint8_t lut[256];
+      for (uint32_t v = 0; v < 256; ++v)
+        lut[v] = scaleSample(v, maxValue);
+      LutKernel(lut).run(reinterpret_cast<const uint8_t*>(data), pixels, count);
+    }
+  return 0;
+}
+
+// Streaming PGM reader and writer: image is read and written band by band
+// of rows, so images larger than memory can be processed.
+
+class PGMReader
+{
+public:
+  PGMReader();
+
+  // Header is parsed, pixel data are read by readRows(). Only binary PGM
+  // can be streamed, values are scaled as by GrayImage::loadFromPGM().
+  int open(const std::string& pathToPGMFile);
+  void close();
+
+  int getHeight() const;
+  int getWidth() const;
+
+  // number of rows read or skipped so far
+  int getRow() const;
+
+  // Reads next rows, at most maxRows of them, to the top of band, it is
+  // resized only if it has other width or less than maxRows rows.
+  // Returns number of rows read, which is 0 at end of image, or -1 on error.
+  int readRows(GrayImage& band, int maxRows);
+
+  int skipRows(int rows);
+
+private:
+  std::ifstream ifs_;
+  std::string path_;
+  PGMHeader header_;
+  int height_;
+  int width_;
+  int row_;
+  // pixel data read before conversion
+  std::vector<char> raw_;
+};
+
+PGMReader::PGMReader()
+  : height_(0)
+  , width_(0)
+  , row_(0)
+{
+}
+
+int PGMReader::open(const std::string& pathToPGMFile)
+{
+  close();
+  ifs_.open(pathToPGMFile.c_str(), std::ios::binary);
+
+  if (!ifs_.is_open())
+    {
+      std::cerr << "Failed to open file for reading: " << pathToPGMFile << std::endl;
+      return -1;
+    }
+
+  ifs_.seekg(0, std::ios::end);
+  size_t fileSize = static_cast<size_t>(ifs_.tellg());
+  ifs_.seekg(0, std::ios::beg);
+
+  // header is expected to fit in this prefix
+  std::vector<char> prefix(std::min<size_t>(fileSize, 4096));
+  if (!prefix.empty())
+    ifs_.read(&prefix[0], prefix.size());
+
+  PGMHeader header;
+  if (!ifs_  ||  parsePGMHeader(prefix.empty() ? "" : &prefix[0], prefix.size(), fileSize, header) != 0)
+    {
+      close();
+      return -1;
+    }
+
+  if (header.ascii)
+    {
+      std::cerr << "Text PGM can't be streamed: " << pathToPGMFile << std::endl;
+      close();
+      return -1;
+    }
+
+  ifs_.seekg(header.dataOffset, std::ios::beg);
+  path_ = pathToPGMFile;
+  header_ = header;
+  height_ = header.height;
+  width_ = header.width;
+  return 0;
+}
+
+void PGMReader::close()
+{
+  if (ifs_.is_open())
+    ifs_.close();
+  ifs_.clear();
+  height_ = 0;
+  width_ = 0;
+  row_ = 0;
+}
+
+int PGMReader::getHeight() const
+{
+  return height_;
+}
+
+int PGMReader::getWidth() const
+{
+  return width_;
+}
+
+int PGMReader::getRow() const
+{
+  return row_;
+}
+
+int PGMReader::readRows(GrayImage& band, int maxRows)
+{
+  assert(maxRows > 0);
+  int rows = std::min(maxRows, height_ - row_);
+  if (rows <= 0)
+    return 0;
+
+  if (band.getHeight() < rows  ||  band.getWidth() != width_)
+    band.resize(maxRows, width_);
+
+  size_t count = static_cast<size_t>(rows) * width_;
+  size_t size = count * header_.getSampleSize();
+  char* dst = reinterpret_cast<char*>(band.row(0));
+  if (!header_.isPlain())
+    {
+      raw_.resize(size);
+      dst = &raw_[0];
+    }
+
+  ifs_.read(dst, static_cast<std::streamsize>(size));
+  if (!ifs_)
+    {
+      std::cerr << "Error reading pixel data: " << path_ << std::endl;
+      return -1;
+    }
+  if (!header_.isPlain()  &&  decodePGMPixels(dst, size, header_, count, band.row(0)) != 0)
+    {
+      std::cerr << "Invalid pixel data: " << path_ << std::endl;
+      return -1;
+    }
+
+  row_ += rows;
+  return rows;
+}
+
+int PGMReader::skipRows(int rows)
+{
+  rows = std::min(rows, height_ - row_);
+  std::streamoff rowSize = static_cast<std::streamoff>(width_) * header_.getSampleSize();
+  ifs_.seekg(rows * rowSize, std::ios::cur);
+  row_ += rows;
+  return ifs_ ? 0 : -1;
+}
+
+class PGMWriter
+{
+public:
+  PGMWriter();
+
+  // writes header of height * width image
+  int open(const std::string& pathToPGMFile, int height, int width);
+
+  // fails if not all rows were written
+  int close();
+
+  int writeRows(const GrayImageView& band);
+
+  int writeBlackRows(int rows);
+
+private:
+  std::ofstream ofs_;
+  std::string path_;
+  int height_;
+  int width_;
+  int row_;
+};
+
+PGMWriter::PGMWriter()
+  : height_(0)
+  , width_(0)
+  , row_(0)
+{
+}
+
+int PGMWriter::open(const std::string& pathToPGMFile, int height, int width)
+{
+  assert(height > 0  &&  width > 0);
+  ofs_.open(pathToPGMFile.c_str(), std::ios::binary);
+
+  if (!ofs_.is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << pathToPGMFile << std::endl;
+      return -1;
+    }
+
+  ofs_ << "P5" << '\n' << width << ' ' << height << '\n' << 255 << '\n';
+  path_ = pathToPGMFile;
+  height_ = height;
+  width_ = width;
+  row_ = 0;
+  return 0;
+}
+
+int PGMWriter::close()
+{
+  if (!ofs_.is_open())
+    return 0;
+
+  ofs_.close();
+  if (row_ != height_  ||  !ofs_)
+    {
+      std::cerr << "Error writing pixel data: " << path_ << std::endl;
+      return -1;
+    }
+  return 0;
+}
+
+int PGMWriter::writeRows(const GrayImageView& band)
+{
+  assert(band.getWidth() == width_  &&  row_ + band.getHeight() <= height_);
+  if (band.isContiguous()  &&  band.getHeight())
+    ofs_.write(reinterpret_cast<const char*>(band.row(0)),
+               static_cast<std::streamsize>(band.getHeight()) * width_);
+  else
+    for (int y = 0; y < band.getHeight(); ++y)
+      ofs_.write(reinterpret_cast<const char*>(band.row(y)), width_);
+
+  row_ += band.getHeight();
+  return ofs_ ? 0 : -1;
+}
+
+int PGMWriter::writeBlackRows(int rows)
+{
+  assert(row_ + rows <= height_);
+  std::vector<char> black(width_);
+  for (int i = 0; i < rows; ++i)
+    ofs_.write(&black[0], width_);
+  row_ += rows;
+  return ofs_ ? 0 : -1;
+}
+
+// Operation applied to each band of streamed image
+class BandOperation
+{
+public:
+  virtual ~BandOperation() {}
+
+  // Processes rows [y, y + band height) of source image to result, which
+  // has the size of band already. Returns false to stop processing.
+  virtual bool process(const GrayImageView& band, int y, GrayImage& result) = 0;
+};
+
+namespace
+{
+  // Pipeline of streaming: in each step next band is read, current band is
+  // processed and result of previous band is written, by different threads.
+  // Each of input and output has two buffers, which are swapped between steps.
+  class StreamPipeline : public ParallelTask
+  {
+  public:
+    StreamPipeline(PGMReader& reader, PGMWriter* writer, BandOperation& operation, int bandRows)
+      : reader_(reader), writer_(writer), operation_(operation), bandRows_(bandRows)
+      , remaining_(0), current_(0), currentRows_(0), currentY_(0), nextRows_(0), previousRows_(0)
+      , writeStatus_(0), proceed_(true) {}
+
+    // processes given number of rows starting from current row of reader,
+    // stages run on threads of pool
+    int run(int rows, ThreadPool& pool)
+    {
+      remaining_ = rows;
+      currentY_ = reader_.getRow();
+      read(input_[current_], currentRows_);
+
+      while (currentRows_ > 0  ||  previousRows_ > 0)
+        {
+          if (currentRows_ < 0)
+            return -1;
+
+          pool.parallelFor(3, 1, *this);
+          if (nextRows_ < 0  ||  writeStatus_ != 0)
+            return -1;
+          if (!proceed_)
+            return 0;
+
+          previousRows_ = currentRows_;
+          currentY_ += currentRows_;
+          currentRows_ = nextRows_;
+          current_ = 1 - current_;
+        }
+      return 0;
+    }
+
+    void run(int begin, int end)
+    {
+      for (int stage = begin; stage < end; ++stage)
+        if (stage == 0)
+          read(input_[1 - current_], nextRows_);
+        else if (stage == 1)
+          process();
+        else
+          write();
+    }
+
+  private:
+    void read(GrayImage& band, int& rows)
+    {
+      rows = 0;
+      if (remaining_ > 0)
+        rows = reader_.readRows(band, std::min(bandRows_, remaining_));
+      if (rows > 0)
+        remaining_ -= rows;
+    }
+
+    void process()
+    {
+      if (currentRows_ <= 0)
+        return;
+
+      int width = reader_.getWidth();
+      GrayImage& result = output_[current_];
+      if (result.getHeight() != currentRows_  ||  result.getWidth() != width)
+        result.reshape(currentRows_, width);
+      proceed_ = operation_.process(GrayImageView(input_[current_]).subView(0, 0, currentRows_, width),
+                                    currentY_, result);
+    }
+
+    void write()
+    {
+      writeStatus_ = 0;
+      if (writer_  &&  previousRows_ > 0)
+        writeStatus_ = writer_->writeRows(output_[1 - current_]);
+    }
+
+    PGMReader& reader_;
+    PGMWriter* writer_;
+    BandOperation& operation_;
+    int bandRows_;
+    int remaining_;
+    int current_;
+    int currentRows_;
+    int currentY_;
+    int nextRows_;
+    int previousRows_;
+    int writeStatus_;
+    bool proceed_;
+    GrayImage input_[2];
+    GrayImage output_[2];
+  };
+}
+
+// Streams PGM file through operation band by band of bandRows rows and
+// writes result to outPath, or only reads it if outPath is empty.
+// Result is moved down by dy rows, rows coming from outside are black.
+// Reading, processing and writing of consecutive bands overlap, memory use
+// doesn't depend on image height.
+int processPGMStream(const std::string& inPath, const std::string& outPath,
+                     BandOperation& operation, int bandRows, ThreadPool& pool, int dy = 0);
+int processPGMStream(const std::string& inPath, const std::string& outPath,
+                     BandOperation& operation, int bandRows, int dy = 0)
+{
+  ThreadPool pool(3);
+  return processPGMStream(inPath, outPath, operation, bandRows, pool, dy);
+}
+
+// same as above, stages of each band run on threads of pool, which is kept
+// between calls; pool of 3 threads overlaps all of them
+int processPGMStream(const std::string& inPath, const std::string& outPath,
+                     BandOperation& operation, int bandRows, ThreadPool& pool, int dy)
+{
+  assert(bandRows > 0);
+  PGMReader reader;
+  if (reader.open(inPath) != 0)
+    return -1;
+
+  int height = reader.getHeight();
+  PGMWriter writer;
+  PGMWriter* output = outPath.empty() ? 0 : &writer;
+  if (output  &&  writer.open(outPath, height, reader.getWidth()) != 0)
+    return -1;
+
+  // rows moved outside of image are not read at all
+  int shift = std::max(-height, std::min(height, dy));
+  if (shift < 0  &&  reader.skipRows(-shift) != 0)
+    return -1;
+  if (shift > 0  &&  output  &&  writer.writeBlackRows(shift) != 0)
+    return -1;
+
+  StreamPipeline pipeline(reader, output, operation, bandRows);
+  if (pipeline.run(height - std::abs(shift), pool) != 0)
+    return -1;
+
+  if (!output)
+    return 0;
+  if (shift < 0  &&  writer.writeBlackRows(-shift) != 0)
+    return -1;
+  return writer.close();
+}
+
+namespace
+{
+  class ThresholdBand : public BandOperation
+  {
+  public:
+    explicit ThresholdBand(uint8_t thr) : thr_(thr) {}
+
+    bool process(const GrayImageView& band, int, GrayImage& result)
+    {
+      thresholdRow(band.row(0), result.data(),
+                   static_cast<size_t>(band.getHeight()) * band.getWidth(), thr_);
+      return true;
+    }
+
+  private:
+    uint8_t thr_;
+  };
+
+  class IsBinaryBand : public BandOperation
+  {
+  public:
+    IsBinaryBand() : binary_(true) {}
+
+    bool process(const GrayImageView& band, int, GrayImage&)
+    {
+      binary_ = isBinary(band);
+      return binary_;
+    }
+
+    bool binary_;
+  };
+
+  class TranslateBand : public BandOperation
+  {
+  public:
+    explicit TranslateBand(int dx) : dx_(dx) {}
+
+    bool process(const GrayImageView& band, int, GrayImage& result)
+    {
+      translate(band, 0, dx_, result);
+      return true;
+    }
+
+  private:
+    int dx_;
+  };
+}
+
+// Same as threshold(), but image is streamed from inPath to outPath
+int thresholdPGM(const std::string& inPath, const std::string& outPath, uint8_t thr,
+                 int bandRows = 256)
+{
+  ThresholdBand operation(thr);
+  return processPGMStream(inPath, outPath, operation, bandRows);
+}
+
+// Same as isBinary(), but image is streamed from file, reading stops at
+// first band with non-binary pixel
+int isBinaryPGM(const std::string& path, bool& binary, int bandRows = 256)
+{
+  IsBinaryBand operation;
+  int status = processPGMStream(path, std::string(), operation, bandRows);
+  binary = status == 0  &&  operation.binary_;
+  return status;
+}
+
+// Same as translate(), but image is streamed from inPath to outPath
+int translatePGM(const std::string& inPath, const std::string& outPath, int dy, int dx,
+                 int bandRows = 256)
+{
+  TranslateBand operation(dx);
+  return processPGMStream(inPath, outPath, operation, bandRows, dy);
+}
+
+// Batch processing of many PGM files
+
+namespace
+{
+  // Queue of at most capacity slot indices, push() waits while it is full,
+  // pop() waits while it is empty and fails once it is closed and drained
+  class SlotQueue
+  {
+  public:
+    explicit SlotQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+    void push(int slot)
+    {
+      MutexLock lock(mutex_);
+      while (slots_.size() == capacity_)
+        changed_.wait(mutex_);
+      slots_.push_back(slot);
+      changed_.notifyAll();
+    }
+
+    bool pop(int& slot)
+    {
+      MutexLock lock(mutex_);
+      while (slots_.empty()  &&  !closed_)
+        changed_.wait(mutex_);
+      if (slots_.empty())
+        return false;
+      slot = slots_.front();
+      slots_.pop_front();
+      changed_.notifyAll();
+      return true;
+    }
+
+    void close()
+    {
+      MutexLock lock(mutex_);
+      closed_ = true;
+      changed_.notifyAll();
+    }
+
+  private:
+    Mutex mutex_;
+    Condition changed_;
+    std::deque<int> slots_;
+    size_t capacity_;
+    bool closed_;
+  };
+
+  // Stages of batch: loader, compute workers and saver, each running in its
+  // own thread. Files travel through them in slots, whose images keep their
+  // buffers, so after the first few files nothing is allocated.
+  class BatchStages : public ParallelTask
+  {
+  public:
+    BatchStages(const std::vector<std::string>& inPaths, const std::vector<std::string>& outPaths,
+                const GrayImagePipeline& pipeline, int workers, std::vector<int>& statuses)
+      : inPaths_(inPaths), outPaths_(outPaths), pipeline_(pipeline), statuses_(statuses)
+      , slots_(2 * workers + 2), free_(slots_.size()), loaded_(slots_.size()), computed_(slots_.size())
+      , runningWorkers_(workers)
+    {
+      for (size_t i = 0; i < slots_.size(); ++i)
+        free_.push(static_cast<int>(i));
+    }
+
+    // index 0 is loader, 1 is saver, others are compute workers
+    void run(int begin, int end)
+    {
+      for (int stage = begin; stage < end; ++stage)
+        if (stage == 0)
+          load();
+        else if (stage == 1)
+          save();
+        else
+          compute();
+    }
+
+    // same work in calling thread, one file after another
+    void runOneByOne()
+    {
+      for (size_t file = 0; file < inPaths_.size(); ++file)
+        if (load(file, slots_[0]))
+          {
+            pipeline_.run(slots_[0].image, slots_[0].result);
+            save(slots_[0]);
+          }
+    }
+
+  private:
+    struct Slot
+    {
+      size_t file;
+      GrayImage image;
+      GrayImage result;
+    };
+
+    void load()
+    {
+      for (size_t file = 0; file < inPaths_.size(); ++file)
+        {
+          // free slots are never closed
+          int slot = 0;
+          free_.pop(slot);
+          if (load(file, slots_[slot]))
+            loaded_.push(slot);
+          else
+            free_.push(slot);
+        }
+      loaded_.close();
+    }
+
+    void compute()
+    {
+      int slot;
+      while (loaded_.pop(slot))
+        {
+          pipeline_.run(slots_[slot].image, slots_[slot].result);
+          computed_.push(slot);
+        }
+
+      MutexLock lock(mutex_);
+      if (--runningWorkers_ == 0)
+        computed_.close();
+    }
+
+    void save()
+    {
+      int slot;
+      while (computed_.pop(slot))
+        {
+          save(slots_[slot]);
+          free_.push(slot);
+        }
+    }
+
+    bool load(size_t file, Slot& slot)
+    {
+      slot.file = file;
+      statuses_[file] = slot.image.loadFromPGM(inPaths_[file]);
+      return statuses_[file] == 0;
+    }
+
+    void save(Slot& slot)
+    {
+      const std::string& path = outPaths_[slot.file];
+      if (!path.empty())
+        statuses_[slot.file] = savePGM(path, slot.result);
+    }
+
+    static int savePGM(const std::string& path, const GrayImage& image)
+    {
+      if (!image.getHeight())
+        {
+          std::cerr << "Empty image can't be written: " << path << std::endl;
+          return -1;
+        }
+
+      PGMWriter writer;
+      if (writer.open(path, image.getHeight(), image.getWidth()) != 0)
+        return -1;
+      if (writer.writeRows(image) != 0)
+        {
+          writer.close();
+          return -1;
+        }
+      return writer.close();
+    }
+
+    const std::vector<std::string>& inPaths_;
+    const std::vector<std::string>& outPaths_;
+    const GrayImagePipeline& pipeline_;
+    std::vector<int>& statuses_;
+    std::vector<Slot> slots_;
+    SlotQueue free_;
+    SlotQueue loaded_;
+    SlotQueue computed_;
+    Mutex mutex_;
+    int runningWorkers_;
+  };
+}
+
+// Runs pipeline on each of inPaths and writes result to file of the same
+// index in outPaths, or nowhere if that path is empty. Files are loaded,
+// processed by workers threads (one per CPU for workers <= 0) and saved
+// concurrently, so disk and CPUs are busy at the same time. A file that
+// fails doesn't stop others, statuses gets 0 or -1 for each file.
+// Returns -1 if any file failed.
+int processPGMBatch(const std::vector<std::string>& inPaths, const std::vector<std::string>& outPaths,
+                    const GrayImagePipeline& pipeline, int workers = 0, std::vector<int>* statuses = 0)
+{
+  assert(inPaths.size() == outPaths.size());
+  if (workers <= 0)
+    workers = ThreadPool::cpuCount();
+
+  std::vector<int> fileStatuses(inPaths.size(), 0);
+  BatchStages stages(inPaths, outPaths, pipeline, workers, fileStatuses);
+  ThreadPool pool(workers + 2);
+  // stages wait for each other, so each needs a thread of its own
+  if (pool.getThreadCount() == workers + 2)
+    pool.parallelFor(workers + 2, 1, stages);
+  else
+    stages.runOneByOne();
+
+  int failed = static_cast<int>(std::count(fileStatuses.begin(), fileStatuses.end(), -1));
+  if (statuses)
+    statuses->swap(fileStatuses);
+  return failed ? -1 : 0;
+}
+
+// Tiled image files: image is split to tiles of tileSize x tileSize pixels,
+// smaller on right and bottom border, each compressed on its own, so any
+// region is read without decoding the rest of file.
+//
+// Layout, all numbers little-endian:
+//   "GTIL", u32 version, u32 height, u32 width, u32 tileSize
+//   index of tiles row by row: u64 offset, u32 size, u32 codec
+//   tile data
+// Tile pixels are stored row by row, codec tells how they are compressed.
+
+namespace
+{
+  enum TileCodec
+  {
+    // pixels as they are
+    TILE_RAW,
+    // single byte, all pixels have its value
+    TILE_FILL,
+    // binary tile, groups of identical rows: varint count of rows, then
+    // varint lengths of runs of the row alternating 0 and 255, starting with 0
+    TILE_RUNS,
+    // LZ77 sequences in LZ4 style: token with literal and match length
+    // nibbles, literals, u16 offset; last sequence has only literals
+    TILE_LZ
+  };
+
+  const char tiledMagic[] = "GTIL";
+  const uint32_t tiledVersion = 1;
+  const size_t tiledHeaderSize = 20;
+  const size_t tiledEntrySize = 16;
+  // pixel positions inside tile must fit int of LZ hash table
+  const int tiledMaxTileSize = 32768;
+
+  void putNumber(std::vector<char>& out, uint64_t value, int bytes)
+  {
+    for (int i = 0; i < bytes; ++i)
+      out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+
+  uint64_t getNumber(const char* p, int bytes)
+  {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i)
+      value |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+    return value;
+  }
+
+  void putVarint(std::vector<char>& out, size_t value)
+  {
+    for (; value >= 128; value >>= 7)
+      out.push_back(static_cast<char>(value | 128));
+    out.push_back(static_cast<char>(value));
+  }
+
+  bool getVarint(const uint8_t*& p, const uint8_t* end, size_t& value)
+  {
+    value = 0;
+    for (int shift = 0; p != end  &&  shift < 35; shift += 7)
+      {
+        uint8_t byte = *p++;
+        value |= static_cast<size_t>(byte & 127) << shift;
+        if (byte < 128)
+          return true;
+      }
+    return false;
+  }
+
+  // length of run of value at p, at most count, compared word by word
+  size_t runLength(const uint8_t* p, size_t count, uint8_t value)
+  {
+    const uint64_t pattern = value ? ~uint64_t(0) : 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+      {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        if (word != pattern)
+          break;
+      }
+    while (i < count  &&  p[i] == value)
+      ++i;
+    return i;
+  }
+
+  void encodeRuns(const uint8_t* pixels, int height, int width, std::vector<char>& out)
+  {
+    for (int y = 0; y < height; )
+      {
+        const uint8_t* row = pixels + static_cast<size_t>(y) * width;
+        int rows = 1;
+        while (y + rows < height  &&  std::memcmp(row, row + static_cast<size_t>(rows) * width, width) == 0)
+          ++rows;
+        putVarint(out, rows);
+
+        uint8_t value = 0;
+        for (int x = 0; x < width; value ^= 255)
+          {
+            size_t run = runLength(row + x, width - x, value);
+            putVarint(out, run);
+            x += static_cast<int>(run);
+          }
+        y += rows;
+      }
+  }
+
+  bool decodeRuns(const uint8_t* p, const uint8_t* end, uint8_t* pixels, int height, int width)
+  {
+    for (int y = 0; y < height; )
+      {
+        size_t rows;
+        if (!getVarint(p, end, rows)  ||  rows == 0  ||  rows > static_cast<size_t>(height - y))
+          return false;
+
+        uint8_t* row = pixels + static_cast<size_t>(y) * width;
+        uint8_t value = 0;
+        for (size_t x = 0; x < static_cast<size_t>(width); value ^= 255)
+          {
+            size_t run;
+            if (!getVarint(p, end, run)  ||  run > width - x)
+              return false;
+            std::memset(row + x, value, run);
+            x += run;
+          }
+        for (size_t i = 1; i < rows; ++i)
+          std::memcpy(row + i * width, row, width);
+        y += static_cast<int>(rows);
+      }
+    return p == end;
+  }
+
+  void putLzLength(std::vector<char>& out, size_t length)
+  {
+    for (; length >= 255; length -= 255)
+      out.push_back(static_cast<char>(255));
+    out.push_back(static_cast<char>(length));
+  }
+
+  bool getLzLength(const uint8_t*& p, const uint8_t* end, size_t& length)
+  {
+    if (length != 15)
+      return true;
+    uint8_t byte;
+    do
+      {
+        if (p == end)
+          return false;
+        byte = *p++;
+        length += byte;
+      }
+    while (byte == 255);
+    return true;
+  }
+
+  void putLzSequence(std::vector<char>& out, const uint8_t* literals, size_t literalCount,
+                     size_t offset, size_t matchLength)
+  {
+    size_t matchCode = matchLength ? matchLength - 4 : 0;
+    out.push_back(static_cast<char>(std::min<size_t>(literalCount, 15) << 4
+                                    | std::min<size_t>(matchCode, 15)));
+    if (literalCount >= 15)
+      putLzLength(out, literalCount - 15);
+    out.insert(out.end(), literals, literals + literalCount);
+    if (!matchLength)
+      return;
+
+    putNumber(out, offset, 2);
+    if (matchCode >= 15)
+      putLzLength(out, matchCode - 15);
+  }
+
+  uint32_t load32(const uint8_t* p)
+  {
+    uint32_t value;
+    std::memcpy(&value, p, 4);
+    return value;
+  }
+
+  // Greedy matching against last position of each hashed 4 bytes, search
+  // steps faster over data that don't compress
+  void encodeLz(const uint8_t* src, size_t count, std::vector<char>& out)
+  {
+    const int hashBits = 12;
+    std::vector<int> table(1 << hashBits, -1);
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + 4 <= count)
+      {
+        uint32_t sequence = load32(src + i);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - hashBits);
+        int candidate = table[hash];
+        table[hash] = static_cast<int>(i);
+        if (candidate < 0  ||  i - candidate > 65535  ||  load32(src + candidate) != sequence)
+          {
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+          }
+
+        size_t length = 4;
+        while (i + length < count  &&  src[candidate + length] == src[i + length])
+          ++length;
+        putLzSequence(out, src + anchor, i - anchor, i - candidate, length);
+        i += length;
+        anchor = i;
+      }
+    putLzSequence(out, src + anchor, count - anchor, 0, 0);
+  }
+
+  bool decodeLz(const uint8_t* p, const uint8_t* end, uint8_t* dst, size_t count)
+  {
+    size_t i = 0;
+    for (;;)
+      {
+        if (p == end)
+          return false;
+        uint8_t token = *p++;
+        size_t literalCount = token >> 4;
+        if (!getLzLength(p, end, literalCount)
+            ||  literalCount > static_cast<size_t>(end - p)  ||  literalCount > count - i)
+          return false;
+        std::memcpy(dst + i, p, literalCount);
+        p += literalCount;
+        i += literalCount;
+        if (i == count)
+          return p == end;
+
+        if (end - p < 2)
+          return false;
+        size_t offset = p[0] | p[1] << 8;
+        p += 2;
+        size_t length = token & 15;
+        if (!getLzLength(p, end, length))
+          return false;
+        length += 4;
+        if (offset == 0  ||  offset > i  ||  length > count - i)
+          return false;
+
+        // match may overlap bytes it produces
+        const uint8_t* match = dst + i - offset;
+        if (offset >= length)
+          std::memcpy(dst + i, match, length);
+        else
+          for (size_t k = 0; k < length; ++k)
+            dst[i + k] = match[k];
+        i += length;
+      }
+  }
+
+  // Compresses height x width pixels to out, returns codec used
+  TileCodec encodeTile(const uint8_t* pixels, int height, int width, std::vector<char>& out)
+  {
+    size_t count = static_cast<size_t>(height) * width;
+    out.clear();
+    if (runLength(pixels, count, pixels[0]) == count)
+      {
+        out.push_back(static_cast<char>(pixels[0]));
+        return TILE_FILL;
+      }
+
+    bool binary = isBinaryRow(pixels, count);
+    if (binary)
+      encodeRuns(pixels, height, width, out);
+    else
+      encodeLz(pixels, count, out);
+    if (out.size() < count)
+      return binary ? TILE_RUNS : TILE_LZ;
+
+    out.assign(pixels, pixels + count);
+    return TILE_RAW;
+  }
+
+  bool decodeTile(uint32_t codec, const char* data, size_t size, uint8_t* pixels, int height, int width)
+  {
+    size_t count = static_cast<size_t>(height) * width;
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data);
+    switch (codec)
+      {
+      case TILE_RAW:
+        if (size != count)
+          return false;
+        std::memcpy(pixels, p, count);
+        return true;
+      case TILE_FILL:
+        if (size != 1)
+          return false;
+        std::memset(pixels, p[0], count);
+        return true;
+      case TILE_RUNS:
+        return decodeRuns(p, p + size, pixels, height, width);
+      case TILE_LZ:
+        return decodeLz(p, p + size, pixels, count);
+      default:
+        return false;
+      }
+  }
+
+  // Compresses each tile it is given to blob of its index
+  class TileEncoder : public TileTask
+  {
+  public:
+    TileEncoder(const GrayImageView& image, int tileSize, std::vector<std::vector<char> >& blobs,
+                std::vector<uint32_t>& codecs)
+      : image_(image), tileSize_(tileSize), tilesPerRow_((image.getWidth() + tileSize - 1) / tileSize)
+      , blobs_(blobs), codecs_(codecs) {}
+
+    void run(const Tile& tile)
+    {
+      std::vector<uint8_t> pixels(static_cast<size_t>(tile.height) * tile.width);
+      for (int y = 0; y < tile.height; ++y)
+        std::memcpy(&pixels[static_cast<size_t>(y) * tile.width], image_.row(tile.y + y) + tile.x,
+                    tile.width);
+
+      size_t index = static_cast<size_t>(tile.y / tileSize_) * tilesPerRow_ + tile.x / tileSize_;
+      codecs_[index] = encodeTile(&pixels[0], tile.height, tile.width, blobs_[index]);
+    }
+
+  private:
+    const GrayImageView& image_;
+    int tileSize_;
+    int tilesPerRow_;
+    std::vector<std::vector<char> >& blobs_;
+    std::vector<uint32_t>& codecs_;
+  };
+
+  int saveTiled(const GrayImageView& image, const std::string& path, int tileSize, ThreadPool* pool)
+  {
+    if (tileSize <= 0  ||  tileSize > tiledMaxTileSize)
+      {
+        std::cerr << "Invalid tile size: " << tileSize << std::endl;
+        return -1;
+      }
+
+    int height = image.getHeight();
+    int width = image.getWidth();
+    int tilesPerRow = (width + tileSize - 1) / tileSize;
+    size_t tiles = static_cast<size_t>((height + tileSize - 1) / tileSize) * tilesPerRow;
+
+    std::vector<std::vector<char> > blobs(tiles);
+    std::vector<uint32_t> codecs(tiles);
+    TileEncoder encoder(image, tileSize, blobs, codecs);
+    if (pool)
+      parallelForTiles(*pool, height, width, tileSize, tileSize, encoder);
+    else
+      for (int y = 0; y < height; y += tileSize)
+        for (int x = 0; x < width; x += tileSize)
+          {
+            Tile tile = { y, x, std::min(tileSize, height - y), std::min(tileSize, width - x) };
+            encoder.run(tile);
+          }
+
+    std::vector<char> header(tiledMagic, tiledMagic + 4);
+    putNumber(header, tiledVersion, 4);
+    putNumber(header, height, 4);
+    putNumber(header, width, 4);
+    putNumber(header, tileSize, 4);
+    uint64_t offset = tiledHeaderSize + tiles * tiledEntrySize;
+    for (size_t i = 0; i < tiles; ++i)
+      {
+        putNumber(header, offset, 8);
+        putNumber(header, blobs[i].size(), 4);
+        putNumber(header, codecs[i], 4);
+        offset += blobs[i].size();
+      }
+
+    std::ofstream ofs(path.c_str(), std::ios::binary);
+    if (!ofs.is_open())
+      {
+        std::cerr << "Failed to open file for writing: " << path << std::endl;
+        return -1;
+      }
+
+    ofs.write(&header[0], header.size());
+    for (size_t i = 0; i < tiles; ++i)
+      ofs.write(&blobs[i][0], blobs[i].size());
+    ofs.close();
+    if (!ofs)
+      {
+        std::cerr << "Error writing tiled image: " << path << std::endl;
+        return -1;
+      }
+    return 0;
+  }
+}
+
+// Saves image as tiled file, tiles are compressed one by one: binary tiles
+// as runs, others with LZ, uniform tiles take one byte. Tile size is at
+// most 32768.
+int saveTiled(const GrayImageView& image, const std::string& path, int tileSize = 256)
+{
+  return saveTiled(image, path, tileSize, 0);
+}
+
+// same as above, tiles are compressed by threads of pool
+int saveTiled(const GrayImageView& image, const std::string& path, int tileSize, ThreadPool& pool)
+{
+  return saveTiled(image, path, tileSize, &pool);
+}
+
+// Tiled image file opened for reading, file is memory-mapped and only tiles
+// overlapping region being read are touched
+class TiledImageFile
+{
+public:
+  TiledImageFile();
+
+  // header and index of tiles are read and checked
+  int open(const std::string& path);
+  void close();
+
+  int getHeight() const;
+  int getWidth() const;
+  int getTileSize() const;
+
+  // Reads pixels of region to result, region must be inside image.
+  // Returns -1 if some tile is corrupted.
+  int read(const Tile& region, GrayImage& result) const;
+  // same as above, tiles are decoded by threads of pool
+  int read(const Tile& region, GrayImage& result, ThreadPool& pool) const;
+
+  // whole image
+  int read(GrayImage& result) const;
+
+private:
+  struct Entry
+  {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t codec;
+  };
+
+  class Decoder;
+
+  int read(const Tile& region, GrayImage& result, ThreadPool* pool) const;
+
+  MappedFile file_;
+  std::string path_;
+  int height_;
+  int width_;
+  int tileSize_;
+  std::vector<Entry> entries_;
+};
+
+// Decodes tiles of given indices overlapping region, each to its part of result
+class TiledImageFile::Decoder : public ParallelTask
+{
+public:
+  Decoder(const TiledImageFile& file, const Tile& region, const std::vector<int>& tiles,
+          GrayImage& result, std::vector<char>& failed)
+    : file_(file), region_(region), tiles_(tiles), result_(result.data()), failed_(failed) {}
+
+  void run(int begin, int end)
+  {
+    int tileSize = file_.tileSize_;
+    int tilesPerRow = (file_.width_ + tileSize - 1) / tileSize;
+    std::vector<uint8_t> pixels(static_cast<size_t>(tileSize) * tileSize);
+    for (int i = begin; i < end; ++i)
+      {
+        int y = tiles_[i] / tilesPerRow * tileSize;
+        int x = tiles_[i] % tilesPerRow * tileSize;
+        int height = std::min(tileSize, file_.height_ - y);
+        int width = std::min(tileSize, file_.width_ - x);
+        const Entry& entry = file_.entries_[tiles_[i]];
+        if (!decodeTile(entry.codec, file_.file_.data() + entry.offset, entry.size,
+                        &pixels[0], height, width))
+          {
+            failed_[i] = 1;
+            continue;
+          }
+
+        int yBegin = std::max(y, region_.y);
+        int yEnd = std::min(y + height, region_.y + region_.height);
+        int xBegin = std::max(x, region_.x);
+        int xEnd = std::min(x + width, region_.x + region_.width);
+        for (int row = yBegin; row < yEnd; ++row)
+          std::memcpy(result_ + static_cast<size_t>(row - region_.y) * region_.width + xBegin - region_.x,
+                      &pixels[static_cast<size_t>(row - y) * width + xBegin - x], xEnd - xBegin);
+      }
+  }
+
+private:
+  const TiledImageFile& file_;
+  const Tile& region_;
+  const std::vector<int>& tiles_;
+  GrayImage::pixel_t* result_;
+  std::vector<char>& failed_;
+};
+
+TiledImageFile::TiledImageFile()
+  : height_(0)
+  , width_(0)
+  , tileSize_(0)
+{
+}
+
+int TiledImageFile::open(const std::string& path)
+{
+  close();
+  if (file_.open(path) != 0)
+    {
+      std::cerr << "Failed to open file for reading: " << path << std::endl;
+      return -1;
+    }
+
+  const char* data = file_.data();
+  size_t size = file_.size();
+  if (size < tiledHeaderSize  ||  std::memcmp(data, tiledMagic, 4) != 0
+      ||  getNumber(data + 4, 4) != tiledVersion)
+    {
+      std::cerr << "Not a tiled image file: " << path << std::endl;
+      close();
+      return -1;
+    }
+
+  uint64_t height = getNumber(data + 8, 4);
+  uint64_t width = getNumber(data + 12, 4);
+  uint64_t tileSize = getNumber(data + 16, 4);
+  if (height > INT_MAX  ||  width > INT_MAX  ||  (height == 0) != (width == 0)
+      ||  tileSize == 0  ||  tileSize > static_cast<uint64_t>(tiledMaxTileSize))
+    {
+      std::cerr << "Invalid size of tiled image: " << path << std::endl;
+      close();
+      return -1;
+    }
+
+  uint64_t tiles = ((height + tileSize - 1) / tileSize) * ((width + tileSize - 1) / tileSize);
+  if ((size - tiledHeaderSize) / tiledEntrySize < tiles)
+    {
+      std::cerr << "Truncated index of tiles: " << path << std::endl;
+      close();
+      return -1;
+    }
+
+  entries_.resize(static_cast<size_t>(tiles));
+  for (size_t i = 0; i < entries_.size(); ++i)
+    {
+      const char* p = data + tiledHeaderSize + i * tiledEntrySize;
+      entries_[i].offset = getNumber(p, 8);
+      entries_[i].size = static_cast<uint32_t>(getNumber(p + 8, 4));
+      entries_[i].codec = static_cast<uint32_t>(getNumber(p + 12, 4));
+      if (entries_[i].offset > size  ||  size - entries_[i].offset < entries_[i].size)
+        {
+          std::cerr << "Tile " << i << " outside of file: " << path << std::endl;
+          close();
+          return -1;
+        }
+    }
+
+  path_ = path;
+  height_ = static_cast<int>(height);
+  width_ = static_cast<int>(width);
+  tileSize_ = static_cast<int>(tileSize);
+  return 0;
+}
+
+void TiledImageFile::close()
+{
+  file_.close();
+  entries_.clear();
+  height_ = 0;
+  width_ = 0;
+  tileSize_ = 0;
+}
+
+int TiledImageFile::getHeight() const
+{
+  return height_;
+}
+
+int TiledImageFile::getWidth() const
+{
+  return width_;
+}
+
+int TiledImageFile::getTileSize() const
+{
+  return tileSize_;
+}
+
+int TiledImageFile::read(const Tile& region, GrayImage& result) const
+{
+  return read(region, result, 0);
+}
+
+int TiledImageFile::read(const Tile& region, GrayImage& result, ThreadPool& pool) const
+{
+  return read(region, result, &pool);
+}
+
+int TiledImageFile::read(GrayImage& result) const
+{
+  Tile all = { 0, 0, height_, width_ };
+  return read(all, result, 0);
+}
+
+int TiledImageFile::read(const Tile& region, GrayImage& result, ThreadPool* pool) const
+{
+  assert(region.y >= 0  &&  region.x >= 0  &&  region.height >= 0  &&  region.width >= 0);
+  assert(region.y + region.height <= height_  &&  region.x + region.width <= width_);
+  if (!region.height  ||  !region.width)
+    {
+      result.reshape(0, 0);
+      return 0;
+    }
+
+  std::vector<int> tiles;
+  int tilesPerRow = (width_ + tileSize_ - 1) / tileSize_;
+  for (int ty = region.y / tileSize_; ty * tileSize_ < region.y + region.height; ++ty)
+    for (int tx = region.x / tileSize_; tx * tileSize_ < region.x + region.width; ++tx)
+      tiles.push_back(ty * tilesPerRow + tx);
+
+  result.reshape(region.height, region.width);
+  std::vector<char> failed(tiles.size(), 0);
+  Decoder decoder(*this, region, tiles, result, failed);
+  if (pool)
+    pool->parallelFor(static_cast<int>(tiles.size()), 1, decoder);
+  else
+    decoder.run(0, static_cast<int>(tiles.size()));
+
+  for (size_t i = 0; i < tiles.size(); ++i)
+    if (failed[i])
+      {
+        std::cerr << "Corrupted tile " << tiles[i] << ": " << path_ << std::endl;
+        return -1;
+      }
+  return 0;
+}
+
+// Reference implementations kept as baselines for tests and benchmarks
+
+// Pixel by pixel translate() used before row-wise implementation,
+// kept as baseline for benchmarks
+GrayImage translatePerPixel(const GrayImageView& image, int dy, int dx)
+{
+  if(dy == 0 && dx == 0)
+    return GrayImage(image);
+
+  int width = image.getWidth();
+  int height = image.getHeight();
+  if(std::abs(dx) >= width || std::abs(dy) >= height)
+    return GrayImage(height, width, std::string(width*height, 'o'));
+
+  GrayImage result(height, width, std::string(width*height, 'o'));
+  for(int cur_height = 0; cur_height < height; ++cur_height)
+    {
+      int cur_y = cur_height + dy;
+      if (cur_y >= 0 && cur_y < height)
+        {
+          for (int cur_width = 0; cur_width < width; ++cur_width)
+            {
+              int cur_x = cur_width + dx;
+              if(cur_x >= 0 && cur_x < width)
+                result(cur_y, cur_x) = image(cur_height, cur_width);
+            }
+        }
+    }
+  return result;
+}
+
+// Subpixel translate sampling each pixel through operator() with the same
+// fixed point rounding as translateSubpixel()
+GrayImage translateSubpixelPerPixel(const GrayImageView& image, double dy, double dx,
+                                    BorderMode mode, uint8_t border)
+{
+  int height = image.getHeight();
+  int width = image.getWidth();
+  GrayImage result(height, width);
+
+  int oy, fy, ox, fx;
+  splitShift(-dy, height, mode, oy, fy);
+  splitShift(-dx, width, mode, ox, fx);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      {
+        int column[2];
+        for (int k = 0; k < 2; ++k)
+          {
+            int c = borderIndex(x + ox + k, width, mode);
+            int r0 = borderIndex(y + oy, height, mode);
+            int r1 = borderIndex(y + oy + 1, height, mode);
+            int top = c < 0  ||  r0 < 0 ? border : image(r0, c);
+            int bottom = c < 0  ||  r1 < 0 ? border : image(r1, c);
+            column[k] = (top * (256 - fy) + bottom * fy + 128) >> 8;
+          }
+        result(y, x) = static_cast<GrayImage::pixel_t>((column[0] * (256 - fx) + column[1] * fx + 128) >> 8);
+      }
+  return result;
+}
+
+// Affine warp evaluating source position of each pixel from transform and
+// sampling through operator(), with the same fixed point as warpAffine()
+GrayImage warpAffinePerPixel(const GrayImageView& image, const AffineTransform& transform,
+                             Interpolation interpolation, BorderMode mode, uint8_t border)
+{
+  int height = image.getHeight();
+  int width = image.getWidth();
+  GrayImage result(height, width);
+
+  WarpAxis ay, ax;
+  if (makeWarpAxes(transform, ay, ax) != 0)
+    {
+      result.fill(mode == BORDER_CONSTANT ? border : 0);
+      return result;
+    }
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      {
+        int64_t py = ay.at(y, x);
+        int64_t px = ax.at(y, x);
+        if (interpolation == INTERPOLATION_NEAREST)
+          {
+            int64_t half = static_cast<int64_t>(1) << 31;
+            result(y, x) = samplePixel(image, warpWhole(py + half), warpWhole(px + half), mode, border);
+            continue;
+          }
+
+        int fy = static_cast<int>((py >> 24) & 255);
+        int fx = static_cast<int>((px >> 24) & 255);
+        int column[2];
+        for (int k = 0; k < 2; ++k)
+          {
+            int top = samplePixel(image, warpWhole(py), warpWhole(px) + k, mode, border);
+            int bottom = samplePixel(image, warpWhole(py) + 1, warpWhole(px) + k, mode, border);
+            column[k] = (top * (256 - fy) + bottom * fy + 128) >> 8;
+          }
+        result(y, x) = static_cast<GrayImage::pixel_t>((column[0] * (256 - fx) + column[1] * fx + 128) >> 8);
+      }
+  return result;
+}
+
+// GrayImage::translateInplace() used before row-wise implementation,
+// kept as baseline for benchmarks
+template <typename iter>
+void doTranslateInplacePerPixel(int& move_offset, int& dy, int& width_,
+                                iter iter_begin, iter iter_end)
+{
+  for (iter dest_it = iter_begin; dest_it < iter_end; ++dest_it)
+    {
+      int dest = std::distance(iter_begin, dest_it);
+      int dest_y = dest / width_;
+      int source = dest + std::abs(move_offset);
+      int source_y = source / width_;
+
+      if (std::abs(dest_y - source_y) > std::abs(dy) || source < 0 || source >= iter_end - iter_begin)
+        {
+          *dest_it = 0;
+          continue;
+        }
+      else
+        {
+          iter source_it = dest_it + std::abs(move_offset);
+          *dest_it = *source_it;
+        }
+    }
+}
+
+void translateInplacePerPixel(GrayImage& image, int dy, int dx)
+{
+  int width = image.getWidth();
+  int move_offset = dy*width + dx;
+  GrayImage::pixel_t* begin = image.data();
+  GrayImage::pixel_t* end = begin + image.getHeight() * width;
+  if (move_offset < 0)
+    doTranslateInplacePerPixel(move_offset, dy, width, begin, end);
+  else if (move_offset > 0)
+    doTranslateInplacePerPixel(move_offset, dy, width,
+                               std::reverse_iterator<GrayImage::pixel_t*>(end),
+                               std::reverse_iterator<GrayImage::pixel_t*>(begin));
+}
+
+// Rotation into new image, baseline for benchmarks of in-place rotations
+GrayImage rotateCw90Copy(const GrayImage& image)
+{
+  int height = image.getHeight();
+  int width = image.getWidth();
+  GrayImage result(width, height);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      result(x, height - 1 - y) = image(y, x);
+  return result;
+}
+
+// Breadth-first search over pixels, reference for testing binaryBackground()
+GrayImage binaryBackgroundPerPixel(const GrayImage& image)
+{
+  int height = image.getHeight();
+  int width = image.getWidth();
+  GrayImage result(height, width);
+  std::vector<int> queue;
+
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      if ((y == 0  ||  x == 0  ||  y == height - 1  ||  x == width - 1)  &&  !image(y, x))
+        {
+          result(y, x) = 255;
+          queue.push_back(y * width + x);
+        }
+
+  for (size_t i = 0; i < queue.size(); ++i)
+    {
+      int y = queue[i] / width;
+      int x = queue[i] % width;
+      const int dys[] = { -1, 1, 0, 0 };
+      const int dxs[] = { 0, 0, -1, 1 };
+      for (int k = 0; k < 4; ++k)
+        {
+          int ny = y + dys[k];
+          int nx = x + dxs[k];
+          if (ny >= 0  &&  ny < height  &&  nx >= 0  &&  nx < width
+              &&  !image(ny, nx)  &&  !result(ny, nx))
+            {
+              result(ny, nx) = 255;
+              queue.push_back(ny * width + nx);
+            }
+        }
+    }
+  return result;
+}
+
+// Breadth-first search from each unlabeled white pixel in raster order,
+// reference for testing labelComponents(). Labels are stored row by row.
+std::vector<int> labelComponentsPerPixel(const GrayImage& image, int& count)
+{
+  int height = image.getHeight();
+  int width = image.getWidth();
+  std::vector<int> labels(static_cast<size_t>(height) * width);
+  std::vector<int> queue;
+  count = 0;
+
+  for (int start = 0; start < height * width; ++start)
+    {
+      if (!image(start / width, start % width)  ||  labels[start])
+        continue;
+
+      labels[start] = ++count;
+      queue.assign(1, start);
+      for (size_t i = 0; i < queue.size(); ++i)
+        {
+          int y = queue[i] / width;
+          int x = queue[i] % width;
+          const int dys[] = { -1, 1, 0, 0 };
+          const int dxs[] = { 0, 0, -1, 1 };
+          for (int k = 0; k < 4; ++k)
+            {
+              int ny = y + dys[k];
+              int nx = x + dxs[k];
+              if (ny >= 0  &&  ny < height  &&  nx >= 0  &&  nx < width
+                  &&  image(ny, nx)  &&  !labels[ny * width + nx])
+                {
+                  labels[ny * width + nx] = count;
+                  queue.push_back(ny * width + nx);
+                }
+            }
+        }
+    }
+  return labels;
+}
+
+// Header parsed with iostream operator>>, as loadFromPGM() used to do it,
+// baseline for parsePGMHeader() benchmark. Comments are not supported.
+int parsePGMHeaderStream(const char* buf, size_t size, PGMHeader& header)
+{
+  std::istringstream is(std::string(buf, size));
+  std::string magic;
+  is >> magic >> header.width >> header.height >> header.maxValue;
+  if (!is  ||  magic != "P5"  ||  header.width <= 0  ||  header.height <= 0  ||  header.maxValue != 255)
+    return -1;
+
+  is.get();
+  header.ascii = false;
+  header.dataOffset = static_cast<size_t>(is.tellg());
+  return 0;
+}
+
+// Single counter per value, baseline for histogram() benchmark
+void histogramPerPixel(const GrayImage& image, uint64_t counts[256])
+{
+  std::fill(counts, counts + 256, 0);
+  for (int y = 0; y < image.getHeight(); ++y)
+    for (int x = 0; x < image.getWidth(); ++x)
+      ++counts[image(y, x)];
+}
+
+// Minimum or maximum over window of each pixel, reference for testing
+// erode() and dilate()
+GrayImage morphologyPerPixel(const GrayImage& image, int seHeight, int seWidth, bool dilation)
+{
+  int height = image.getHeight();
+  int width = image.getWidth();
+  int top = dilation ? seHeight / 2 : (seHeight - 1) / 2;
+  int left = dilation ? seWidth / 2 : (seWidth - 1) / 2;
+  GrayImage result(height, width);
+  for (int y = 0; y < height; ++y)
+    for (int x = 0; x < width; ++x)
+      {
+        int value = dilation ? 0 : 255;
+        for (int wy = y - top; wy < y - top + seHeight; ++wy)
+          for (int wx = x - left; wx < x - left + seWidth; ++wx)
+            {
+              int pixel = wy >= 0  &&  wy < height  &&  wx >= 0  &&  wx < width ? image(wy, wx) : 0;
+              value = dilation ? std::max(value, pixel) : std::min(value, pixel);
+            }
+        result(y, x) = static_cast<GrayImage::pixel_t>(value);
+      }
+  return result;
+}
+
+void fillWithPattern(GrayImage& image)
+{
+  for (int y = 0; y < image.getHeight(); ++y)
+    for (int x = 0; x < image.getWidth(); ++x)
+      image(y, x) = static_cast<GrayImage::pixel_t>(x * 7 + y * 13);
+}
+
+// Pseudo-random binary image with given percent of white pixels
+void fillWithNoise(GrayImage& image, int whitePercent, uint32_t seed)
+{
+  for (int y = 0; y < image.getHeight(); ++y)
+    for (int x = 0; x < image.getWidth(); ++x)
+      {
+        seed = seed * 1103515245u + 12345u;
+        image(y, x) = (seed >> 16) % 100 < static_cast<uint32_t>(whitePercent) ? 255 : 0;
+      }
+}
+
+// Sparse mask like scanned text: lines of 8 x 10 letter outlines with
+// holes inside, about 10% of pixels are white
+void fillWithDocument(GrayImage& image)
+{
+  image.fill(0);
+  for (int top = 8; top + 10 <= image.getHeight(); top += 24)
+    for (int left = 8; left + 8 <= image.getWidth(); left += 12)
+      {
+        if ((top * 7 + left * 3) % 11 == 0)
+          continue;
+        for (int y = top; y < top + 10; ++y)
+          {
+            GrayImage::pixel_t* row = image.row(y);
+            bool edge = y == top  ||  y == top + 9;
+            std::memset(row + left, 255, edge ? 8 : 2);
+            if (!edge)
+              std::memset(row + left + 6, 255, 2);
+          }
+      }
+}
+
+// Benchmarks, run with "--bench" command line option:
+//   --bench [--sizes 1024,4096] [--runs 5] [--filter name] [--baselines]
+//           [--json file] [--csv file] [--profile] [--profile-json file]
+// Each benchmark is run on synthetic square images of each size and
+// reports time percentiles, ns per pixel and memory throughput.
+// --profile prints counters of instrumented operations after benchmarks,
+// program must be built with GRAYIMAGE_INSTRUMENT for them.
+
+// Operation measured by runBenchmark()
+class BenchmarkCase
+{
+public:
+  virtual ~BenchmarkCase() {}
+  virtual void run() = 0;
+};
+
+struct BenchmarkResult
+{
+  std::string name;
+  int height;
+  int width;
+  int runs;
+  uint64_t minNs;
+  uint64_t p50Ns;
+  uint64_t p90Ns;
+  uint64_t p99Ns;
+  // bytes read and written by one run
+  double bytes;
+};
+
+namespace
+{
+  // nearest-rank percentile of sorted times
+  uint64_t percentile(const std::vector<uint64_t>& sorted, int percent)
+  {
+    size_t rank = (sorted.size() * percent + 99) / 100;
+    return sorted[std::max<size_t>(rank, 1) - 1];
+  }
+}
+
+// Runs benchmark given number of times, the first run is used for warm up
+BenchmarkResult runBenchmark(const std::string& name, BenchmarkCase& benchmarkCase, int runs,
+                             int height, int width, double bytesPerPixel)
+{
+  benchmarkCase.run();
+
+  std::vector<uint64_t> times;
+  for (int i = 0; i < runs; ++i)
+    {
+      uint64_t start = monotonicNanoseconds();
+      benchmarkCase.run();
+      times.push_back(monotonicNanoseconds() - start);
+    }
+  std::sort(times.begin(), times.end());
+
+  BenchmarkResult result;
+  result.name = name;
+  result.height = height;
+  result.width = width;
+  result.runs = runs;
+  result.minNs = times.front();
+  result.p50Ns = percentile(times, 50);
+  result.p90Ns = percentile(times, 90);
+  result.p99Ns = percentile(times, 99);
+  result.bytes = bytesPerPixel * height * width;
+  return result;
+}
+
+double nsPerPixel(const BenchmarkResult& result)
+{
+  return double(result.p50Ns) / (double(result.height) * result.width);
+}
+
+double gigabytesPerSecond(const BenchmarkResult& result)
+{
+  return result.bytes / std::max<uint64_t>(result.p50Ns, 1);
+}
+
+class TranslateBenchmark : public BenchmarkCase
+{
+public:
+  TranslateBenchmark(const GrayImage& image, int dy, int dx, bool perPixel)
+    : image_(image), dy_(dy), dx_(dx), perPixel_(perPixel) {}
+
+  void run()
+  {
+    GrayImage result = perPixel_ ? translatePerPixel(image_, dy_, dx_) : translate(image_, dy_, dx_);
+    sink_ = result(0, 0);
+  }
+
+private:
+  const GrayImage& image_;
+  int dy_;
+  int dx_;
+  bool perPixel_;
+  GrayImage::pixel_t sink_;
+};
+
+// Shift by (2.3, -4.6) pixels into reused result
+class SubpixelBenchmark : public BenchmarkCase
+{
+public:
+  SubpixelBenchmark(const GrayImage& image, BorderMode mode, ThreadPool* pool, bool perPixel)
+    : image_(image), mode_(mode), pool_(pool), perPixel_(perPixel) {}
+
+  void run()
+  {
+    if (perPixel_)
+      result_ = translateSubpixelPerPixel(image_, 2.3, -4.6, mode_, 0);
+    else if (pool_)
+      translateSubpixel(image_, 2.3, -4.6, result_, *pool_, mode_);
+    else
+      translateSubpixel(image_, 2.3, -4.6, result_, mode_);
+  }
+
+private:
+  const GrayImage& image_;
+  BorderMode mode_;
+  ThreadPool* pool_;
+  bool perPixel_;
+  GrayImage result_;
+};
+
+// Deskew: rotation by 1.5 degrees around center into reused result
+class WarpBenchmark : public BenchmarkCase
+{
+public:
+  WarpBenchmark(const GrayImage& image, Interpolation interpolation, ThreadPool* pool, bool perPixel)
+    : image_(image), interpolation_(interpolation), pool_(pool), perPixel_(perPixel)
+    , transform_(rotation(1.5, image.getHeight() / 2.0, image.getWidth() / 2.0)) {}
+
+  void run()
+  {
+    int height = image_.getHeight();
+    int width = image_.getWidth();
+    if (perPixel_)
+      result_ = warpAffinePerPixel(image_, transform_, interpolation_, BORDER_CONSTANT, 255);
+    else if (pool_)
+      warpAffine(image_, transform_, height, width, result_, *pool_, interpolation_, BORDER_CONSTANT, 255);
+    else
+      warpAffine(image_, transform_, height, width, result_, interpolation_, BORDER_CONSTANT, 255);
+  }
+
+private:
+  const GrayImage& image_;
+  Interpolation interpolation_;
+  ThreadPool* pool_;
+  bool perPixel_;
+  AffineTransform transform_;
+  GrayImage result_;
+};
+
+class TranslateInplaceBenchmark : public BenchmarkCase
+{
+public:
+  TranslateInplaceBenchmark(GrayImage& image, int dy, int dx, bool perPixel)
+    : image_(image), dy_(dy), dx_(dx), perPixel_(perPixel) {}
+
+  void run()
+  {
+    // alternate direction so that image doesn't become black
+    if (perPixel_)
+      translateInplacePerPixel(image_, dy_, dx_);
+    else
+      image_.translateInplace(dy_, dx_);
+    dy_ = -dy_;
+    dx_ = -dx_;
+  }
+
+private:
+  GrayImage& image_;
+  int dy_;
+  int dx_;
+  bool perPixel_;
+};
+
+class ThresholdBenchmark : public BenchmarkCase
+{
+public:
+  ThresholdBenchmark(const GrayImage& image, ThreadPool* pool)
+    : image_(image), pool_(pool) {}
+
+  void run()
+  {
+    GrayImage result = pool_ ? threshold(image_, 128, *pool_) : threshold(image_, 128);
+    sink_ = result(0, 0);
+  }
+
+private:
+  const GrayImage& image_;
+  ThreadPool* pool_;
+  GrayImage::pixel_t sink_;
+};
+
+// Result is written to the same image each run, so its buffer is reused
+class ThresholdIntoBenchmark : public BenchmarkCase
+{
+public:
+  explicit ThresholdIntoBenchmark(const GrayImage& image)
+    : image_(image) {}
+
+  void run()
+  {
+    threshold(image_, 128, result_);
+  }
+
+private:
+  const GrayImage& image_;
+  GrayImage result_;
+};
+
+// Applies given tables one after another, a pass over image for each
+class LutBenchmark : public BenchmarkCase
+{
+public:
+  LutBenchmark(const GrayImage& image, const uint8_t* first, const uint8_t* second)
+    : image_(image), first_(first), second_(second) {}
+
+  void run()
+  {
+    applyLut(image_, first_, result_);
+    if (second_)
+      applyLutInplace(result_, second_);
+  }
+
+private:
+  const GrayImage& image_;
+  const uint8_t* first_;
+  const uint8_t* second_;
+  GrayImage result_;
+};
+
+// threshold, translate and fill holes, fused by pipeline or one by one
+// with intermediate images
+class PipelineBenchmark : public BenchmarkCase
+{
+public:
+  PipelineBenchmark(const GrayImage& image, bool fused)
+    : image_(image), fused_(fused)
+  {
+    pipeline_.threshold(128).translate(3, -5).fillHoles();
+  }
+
+  void run()
+  {
+    if (fused_)
+      pipeline_.run(image_, result_);
+    else
+      {
+        threshold(image_, 128, mask_);
+        translate(mask_, 3, -5, moved_);
+        binaryFillHoles(moved_, result_);
+      }
+  }
+
+private:
+  const GrayImage& image_;
+  bool fused_;
+  GrayImagePipeline pipeline_;
+  GrayImage mask_;
+  GrayImage moved_;
+  GrayImage result_;
+};
+
+// Files are processed by processPGMBatch() or one by one in calling thread
+class BatchBenchmark : public BenchmarkCase
+{
+public:
+  BatchBenchmark(const std::vector<std::string>& inPaths, const std::vector<std::string>& outPaths,
+                 bool oneByOne)
+    : inPaths_(inPaths), outPaths_(outPaths), oneByOne_(oneByOne)
+  {
+    pipeline_.threshold(128).translate(3, -5);
+  }
+
+  void run()
+  {
+    if (!oneByOne_)
+      {
+        processPGMBatch(inPaths_, outPaths_, pipeline_);
+        return;
+      }
+
+    for (size_t i = 0; i < inPaths_.size(); ++i)
+      {
+        image_.loadFromPGM(inPaths_[i]);
+        pipeline_.run(image_, result_);
+        result_.saveToPGM(outPaths_[i]);
+      }
+  }
+
+private:
+  const std::vector<std::string>& inPaths_;
+  const std::vector<std::string>& outPaths_;
+  bool oneByOne_;
+  GrayImagePipeline pipeline_;
+  GrayImage image_;
+  GrayImage result_;
+};
+
+class MorphologyBenchmark : public BenchmarkCase
+{
+public:
+  MorphologyBenchmark(const GrayImage& image, const BinaryImage* packed, int size, bool perPixel)
+    : image_(image), packed_(packed), size_(size), perPixel_(perPixel) {}
+
+  void run()
+  {
+    if (perPixel_)
+      result_ = morphologyPerPixel(image_, size_, size_, false);
+    else if (packed_)
+      packedResult_ = erode(*packed_, size_, size_);
+    else
+      erode(image_, size_, size_, result_);
+  }
+
+private:
+  const GrayImage& image_;
+  const BinaryImage* packed_;
+  int size_;
+  bool perPixel_;
+  GrayImage result_;
+  BinaryImage packedResult_;
+};
+
+class AdaptiveThresholdBenchmark : public BenchmarkCase
+{
+public:
+  // method is "integral", "bradley" or "sauvola"
+  AdaptiveThresholdBenchmark(const GrayImage& image, const std::string& method)
+    : image_(image), method_(method) {}
+
+  void run()
+  {
+    if (method_ == "integral")
+      integral_.build(image_, true);
+    else if (method_ == "bradley")
+      thresholdBradley(image_, 31, 15, result_);
+    else
+      thresholdSauvola(image_, 31, 0.5, 128, result_);
+  }
+
+private:
+  const GrayImage& image_;
+  std::string method_;
+  IntegralImage integral_;
+  GrayImage result_;
+};
+
+class HistogramBenchmark : public BenchmarkCase
+{
+public:
+  HistogramBenchmark(const GrayImage& image, ThreadPool* pool, bool perPixel)
+    : image_(image), pool_(pool), perPixel_(perPixel) {}
+
+  void run()
+  {
+    if (perPixel_)
+      histogramPerPixel(image_, counts_);
+    else if (pool_)
+      histogram(image_, counts_, *pool_);
+    else
+      histogram(image_, counts_);
+  }
+
+private:
+  const GrayImage& image_;
+  ThreadPool* pool_;
+  bool perPixel_;
+  uint64_t counts_[256];
+};
+
+class LabelBenchmark : public BenchmarkCase
+{
+public:
+  LabelBenchmark(const GrayImage& image, const BinaryImage* packed, ThreadPool* pool, bool perPixel)
+    : image_(image), packed_(packed), labeler_(pool), perPixel_(perPixel) {}
+
+  void run()
+  {
+    if (perPixel_)
+      labelComponentsPerPixel(image_, count_);
+    else if (packed_)
+      labeler_.label(*packed_, labels_);
+    else
+      labeler_.label(image_, labels_);
+  }
+
+private:
+  const GrayImage& image_;
+  const BinaryImage* packed_;
+  ComponentLabeler labeler_;
+  bool perPixel_;
+  LabelImage labels_;
+  int count_;
+};
+
+// Comparison of image with copy differing in last pixel
+class CompareBenchmark : public BenchmarkCase
+{
+public:
+  CompareBenchmark(const GrayImage& image, const std::string& operation)
+    : image_(image), other_(image), operation_(operation)
+  {
+    if (image.getHeight())
+      other_(image.getHeight() - 1, image.getWidth() - 1) ^= 1;
+    if (operation_ == "equal/hashed")
+      {
+        image_.hash();
+        other_.hash();
+      }
+  }
+
+  void run()
+  {
+    if (operation_ == "hash")
+      {
+        // write through data() forgets hash, so that it is computed again
+        image_.data();
+        sink_ = static_cast<size_t>(static_cast<const GrayImage&>(image_).hash());
+      }
+    else if (operation_ == "diff")
+      sink_ = diff(image_, other_).count;
+    else if (operation_ == "equal/hashed")
+      sink_ = hashEquals(image_, other_);
+    else
+      sink_ = image_ == other_;
+  }
+
+private:
+  GrayImage image_;
+  GrayImage other_;
+  std::string operation_;
+  size_t sink_;
+};
+
+class IsBinaryBenchmark : public BenchmarkCase
+{
+public:
+  IsBinaryBenchmark(const GrayImage& image, ThreadPool* pool)
+    : image_(image), pool_(pool) {}
+
+  // view is checked, so that flag remembered by image is not used
+  void run()
+  {
+    sink_ = pool_ ? isBinary(GrayImageView(image_), *pool_) : isBinary(GrayImageView(image_));
+  }
+
+private:
+  const GrayImage& image_;
+  ThreadPool* pool_;
+  bool sink_;
+};
+
+// Each 16x16 patch of image is copied out, thresholded, translated and
+// checked to be binary, either as FixedImage or as GrayImage of that size
+class PatchBenchmark : public BenchmarkCase
+{
+public:
+  PatchBenchmark(const GrayImage& image, bool fixed)
+    : image_(image), fixed_(fixed), patch_(patchSize, patchSize), sink_(0) {}
+
+  void run()
+  {
+    for (int y = 0; y + patchSize <= image_.getHeight(); y += patchSize)
+      for (int x = 0; x + patchSize <= image_.getWidth(); x += patchSize)
+        {
+          if (fixed_)
+            {
+              for (int row = 0; row < patchSize; ++row)
+                std::memcpy(fixedPatch_.row(row), image_.row(y + row) + x, patchSize);
+              threshold(fixedPatch_, 128, fixedThresholded_);
+              translate(fixedThresholded_, 1, -1, fixedMoved_);
+              sink_ += isBinary(fixedMoved_);
+            }
+          else
+            {
+              for (int row = 0; row < patchSize; ++row)
+                std::memcpy(patch_.row(row), image_.row(y + row) + x, patchSize);
+              threshold(GrayImageView(patch_), 128, thresholded_);
+              translate(GrayImageView(thresholded_), 1, -1, moved_);
+              sink_ += isBinary(GrayImageView(moved_));
+            }
+        }
+  }
+
+private:
+  enum { patchSize = 16 };
+
+  const GrayImage& image_;
+  bool fixed_;
+  FixedImage<uint8_t, patchSize, patchSize> fixedPatch_;
+  FixedImage<uint8_t, patchSize, patchSize> fixedThresholded_;
+  FixedImage<uint8_t, patchSize, patchSize> fixedMoved_;
+  GrayImage patch_;
+  GrayImage thresholded_;
+  GrayImage moved_;
+  int sink_;
+};
+
+class PGMBenchmark : public BenchmarkCase
+{
+public:
+  PGMBenchmark(GrayImage& image, const std::string& path, bool save)
+    : image_(image), path_(path), save_(save) {}
+
+  void run()
+  {
+    if (save_)
+      image_.saveToPGM(path_);
+    else
+      image_.loadFromPGM(path_);
+  }
+
+private:
+  GrayImage& image_;
+  std::string path_;
+  bool save_;
+};
+
+// Parses header of small file 1000 times, so "pixel" is one header.
+// Parsers get 64 bytes prefix of file, as readers do.
+class PGMHeaderBenchmark : public BenchmarkCase
+{
+public:
+  PGMHeaderBenchmark(const std::string& header, int pixels, bool stream)
+    : file_(header + std::string(pixels, '\0')), stream_(stream) {}
+
+  void run()
+  {
+    PGMHeader header;
+    size_t prefix = std::min<size_t>(file_.size(), 64);
+    for (int i = 0; i < 1000; ++i)
+      if (stream_)
+        parsePGMHeaderStream(file_.data(), prefix, header);
+      else
+        parsePGMHeader(file_.data(), prefix, file_.size(), header);
+  }
+
+private:
+  std::string file_;
+  bool stream_;
+};
+
+// Saves image as tiled file, or reads region of it
+class TiledBenchmark : public BenchmarkCase
+{
+public:
+  TiledBenchmark(const GrayImage& image, const std::string& path, ThreadPool* pool)
+    : image_(image), path_(path), pool_(pool), file_(0) {}
+
+  TiledBenchmark(const TiledImageFile& file, const Tile& region, ThreadPool* pool)
+    : image_(result_), pool_(pool), file_(&file), region_(region) {}
+
+  void run()
+  {
+    if (file_  &&  pool_)
+      file_->read(region_, result_, *pool_);
+    else if (file_)
+      file_->read(region_, result_);
+    else if (pool_)
+      saveTiled(image_, path_, 256, *pool_);
+    else
+      saveTiled(image_, path_);
+  }
+
+private:
+  const GrayImage& image_;
+  std::string path_;
+  ThreadPool* pool_;
+  const TiledImageFile* file_;
+  Tile region_;
+  GrayImage result_;
+};
+
+// Operation on RleImage of mask, or on mask itself
+class RleBenchmark : public BenchmarkCase
+{
+public:
+  RleBenchmark(const GrayImage& mask, const std::string& operation, bool rle)
+    : mask_(mask), rleMask_(mask), operation_(operation), rle_(rle) {}
+
+  void run()
+  {
+    if (operation_ == "convert")
+      rleResult_ = RleImage(mask_);
+    else if (operation_ == "translate"  &&  rle_)
+      translate(rleMask_, 3, -5, rleResult_);
+    else if (operation_ == "translate")
+      translate(mask_, 3, -5, result_);
+    else if (rle_)
+      binaryFillHoles(rleMask_, rleResult_);
+    else
+      binaryFillHoles(mask_, result_);
+  }
+
+private:
+  const GrayImage& mask_;
+  RleImage rleMask_;
+  std::string operation_;
+  bool rle_;
+  RleImage rleResult_;
+  GrayImage result_;
+};
+
+// Frame where 16 x 16 square with hole moves by a few pixels per run,
+// kept thresholded and filled incrementally or recomputed in full
+class DirtyFrameBenchmark : public BenchmarkCase
+{
+public:
+  DirtyFrameBenchmark(const GrayImage& background, bool incremental)
+    : background_(background), frame_(background), incremental_(incremental), y_(0), x_(0)
+  {
+    frame_.trackChanges(64);
+    updateThreshold(frame_, 128, mask_);
+    mask_.trackChanges(64);
+    updater_.update(mask_, filled_);
+  }
+
+  void run()
+  {
+    int height = frame_.getHeight();
+    int width = frame_.getWidth();
+    drawSquare(false);
+    y_ = (y_ + 3) % std::max(1, height - 16);
+    x_ = (x_ + 5) % std::max(1, width - 16);
+    drawSquare(true);
+
+    if (incremental_)
+      {
+        updateThreshold(frame_, 128, mask_);
+        updater_.update(mask_, filled_);
+      }
+    else
+      {
+        threshold(frame_, 128, mask_);
+        binaryFillHoles(mask_, filled_);
+      }
+  }
+
+private:
+  void drawSquare(bool draw)
+  {
+    for (int y = y_; y < std::min(y_ + 16, frame_.getHeight()); ++y)
+      for (int x = x_; x < std::min(x_ + 16, frame_.getWidth()); ++x)
+        {
+          bool hole = y >= y_ + 4  &&  y < y_ + 12  &&  x >= x_ + 4  &&  x < x_ + 12;
+          frame_(y, x) = draw ? (hole ? 0 : 255) : background_(y, x);
+        }
+    Tile square = { y_, x_, 16, 16 };
+    frame_.markDirty(square);
+  }
+
+  const GrayImage& background_;
+  GrayImage frame_;
+  bool incremental_;
+  int y_;
+  int x_;
+  GrayImage mask_;
+  GrayImage filled_;
+  FillHolesUpdater updater_;
+};
+
+class RotateBenchmark : public BenchmarkCase
+{
+public:
+  RotateBenchmark(GrayImage& image, bool clockwise, bool copy)
+    : image_(image), clockwise_(clockwise), copy_(copy) {}
+
+  void run()
+  {
+    if (copy_)
+      rotateCw90Copy(image_).swap(image_);
+    else if (clockwise_)
+      image_.rotateCw90();
+    else
+      image_.rotateCcw90();
+  }
+
+private:
+  GrayImage& image_;
+  bool clockwise_;
+  bool copy_;
+};
+
+class FillHolesBenchmark : public BenchmarkCase
+{
+public:
+  FillHolesBenchmark(const GrayImage& image, bool perPixel)
+    : image_(image), perPixel_(perPixel) {}
+
+  void run()
+  {
+    GrayImage result = perPixel_ ? binaryBackgroundPerPixel(image_) : binaryFillHoles(image_);
+    sink_ = result(0, 0);
+  }
+
+private:
+  const GrayImage& image_;
+  bool perPixel_;
+  GrayImage::pixel_t sink_;
+};
+
+class PackedFillHolesBenchmark : public BenchmarkCase
+{
+public:
+  PackedFillHolesBenchmark(const BinaryImage& image)
+    : image_(image) {}
+
+  void run()
+  {
+    BinaryImage result = binaryFillHoles(image_);
+    sink_ = result.get(0, 0);
+  }
+
+private:
+  const BinaryImage& image_;
+  bool sink_;
+};
+
+// Runs benchmarks with names containing filter and collects results
+class BenchmarkSuite
+{
+public:
+  BenchmarkSuite(const std::string& filter, int runs)
+    : filter_(filter), runs_(runs) {}
+
+  void run(const std::string& name, BenchmarkCase& benchmarkCase,
+           int height, int width, double bytesPerPixel)
+  {
+    if (name.find(filter_) == std::string::npos)
+      return;
+
+    results_.push_back(runBenchmark(name, benchmarkCase, runs_, height, width, bytesPerPixel));
+    print(std::cout, results_.back());
+  }
+
+  const std::vector<BenchmarkResult>& getResults() const
+  {
+    return results_;
+  }
+
+  static void printHeader(std::ostream& os)
+  {
+    os << "benchmark                        size        min ms    p50 ms    p90 ms    p99 ms"
+       << "  ns/pixel      GB/s" << std::endl;
+  }
+
+  static void print(std::ostream& os, const BenchmarkResult& result)
+  {
+    std::ostringstream size;
+    size << result.height << "x" << result.width;
+    os << result.name << std::string(std::max<size_t>(1, 33 - result.name.size()), ' ')
+       << size.str() << std::string(std::max<size_t>(1, 12 - size.str().size()), ' ');
+    const uint64_t times[] = { result.minNs, result.p50Ns, result.p90Ns, result.p99Ns };
+    for (int i = 0; i < 4; ++i)
+      os << formatNumber(times[i] / 1000000.0, 10);
+    os << formatNumber(nsPerPixel(result), 10) << formatNumber(gigabytesPerSecond(result), 10)
+       << std::endl;
+  }
+
+private:
+  static std::string formatNumber(double value, size_t width)
+  {
+    std::ostringstream os;
+    os.precision(value < 10 ? 3 : 1);
+    os << std::fixed << value;
+    std::string text = os.str();
+    return std::string(text.size() < width ? width - text.size() : 1, ' ') + text;
+  }
+
+  std::string filter_;
+  int runs_;
+  std::vector<BenchmarkResult> results_;
+};
+
+int writeBenchmarkJson(const std::string& path, const std::vector<BenchmarkResult>& results)
+{
+  std::ofstream ofs(path.c_str());
+  if (!ofs.is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << path << std::endl;
+      return -1;
+    }
+
+  ofs << "{\n  \"benchmarks\": [";
+  for (size_t i = 0; i < results.size(); ++i)
+    {
+      const BenchmarkResult& r = results[i];
+      ofs << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\", \"height\": " << r.height
+          << ", \"width\": " << r.width << ", \"runs\": " << r.runs
+          << ", \"min_ns\": " << r.minNs << ", \"p50_ns\": " << r.p50Ns
+          << ", \"p90_ns\": " << r.p90Ns << ", \"p99_ns\": " << r.p99Ns
+          << ", \"ns_per_pixel\": " << nsPerPixel(r) << ", \"gb_per_s\": " << gigabytesPerSecond(r) << "}";
+    }
+  ofs << "\n  ]\n}\n";
+  return ofs ? 0 : -1;
+}
+
+int writeBenchmarkCsv(const std::string& path, const std::vector<BenchmarkResult>& results)
+{
+  std::ofstream ofs(path.c_str());
+  if (!ofs.is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << path << std::endl;
+      return -1;
+    }
+
+  ofs << "name,height,width,runs,min_ns,p50_ns,p90_ns,p99_ns,ns_per_pixel,gb_per_s\n";
+  for (size_t i = 0; i < results.size(); ++i)
+    {
+      const BenchmarkResult& r = results[i];
+      ofs << r.name << ',' << r.height << ',' << r.width << ',' << r.runs << ','
+          << r.minNs << ',' << r.p50Ns << ',' << r.p90Ns << ',' << r.p99Ns << ','
+          << nsPerPixel(r) << ',' << gigabytesPerSecond(r) << '\n';
+    }
+  return ofs ? 0 : -1;
+}
+
+// Path of scratch file in directory for temporary files (TMPDIR, or system
+// one), name gets process id, so that parallel runs don't share files
+std::string tempFilePath(const std::string& name, const std::string& extension)
+{
+  std::ostringstream path;
+#ifdef _WIN32
+  char dir[MAX_PATH + 1];
+  DWORD length = GetTempPathA(sizeof(dir), dir);
+  path << (length > 0  &&  length <= MAX_PATH ? std::string(dir, length) : std::string(".\\"))
+       << name << '_' << GetCurrentProcessId();
+#else
+  const char* dir = std::getenv("TMPDIR");
+  std::string base = dir  &&  *dir ? dir : "/tmp";
+  if (base[base.size() - 1] != '/')
+    base += '/';
+  path << base << name << '_' << getpid();
+#endif
+  path << extension;
+  return path.str();
+}
+
+// Runs all benchmarks on image of size * size pixels, scratch files are
+// written to directory for temporary files and removed afterwards
+void runBenchmarks(BenchmarkSuite& suite, int size, bool baselines, ThreadPool& pool)
+{
+  GrayImage image(size, size);
+  fillWithPattern(image);
+
+  TranslateBenchmark translateCase(image, 3, -5, false);
+  suite.run("translate", translateCase, size, size, 2);
+  TranslateInplaceBenchmark inplaceCase(image, 3, -5, false);
+  suite.run("translateInplace", inplaceCase, size, size, 2);
+  if (baselines)
+    {
+      TranslateBenchmark translatePerPixelCase(image, 3, -5, true);
+      suite.run("translate/per-pixel", translatePerPixelCase, size, size, 2);
+      TranslateInplaceBenchmark inplacePerPixelCase(image, 3, -5, true);
+      suite.run("translateInplace/per-pixel", inplacePerPixelCase, size, size, 2);
+    }
+
+  SubpixelBenchmark subpixelCase(image, BORDER_CONSTANT, 0, false);
+  suite.run("translateSubpixel", subpixelCase, size, size, 2);
+  SubpixelBenchmark wrapSubpixelCase(image, BORDER_WRAP, 0, false);
+  suite.run("translateSubpixel/wrap", wrapSubpixelCase, size, size, 2);
+  SubpixelBenchmark parallelSubpixelCase(image, BORDER_CONSTANT, &pool, false);
+  suite.run("translateSubpixel/parallel", parallelSubpixelCase, size, size, 2);
+  if (baselines)
+    {
+      SubpixelBenchmark subpixelPerPixelCase(image, BORDER_CONSTANT, 0, true);
+      suite.run("translateSubpixel/per-pixel", subpixelPerPixelCase, size, size, 2);
+    }
+
+  WarpBenchmark warpCase(image, INTERPOLATION_BILINEAR, 0, false);
+  suite.run("warpAffine", warpCase, size, size, 2);
+  WarpBenchmark nearestWarpCase(image, INTERPOLATION_NEAREST, 0, false);
+  suite.run("warpAffine/nearest", nearestWarpCase, size, size, 2);
+  WarpBenchmark parallelWarpCase(image, INTERPOLATION_BILINEAR, &pool, false);
+  suite.run("warpAffine/parallel", parallelWarpCase, size, size, 2);
+  if (baselines)
+    {
+      WarpBenchmark warpPerPixelCase(image, INTERPOLATION_BILINEAR, 0, true);
+      suite.run("warpAffine/per-pixel", warpPerPixelCase, size, size, 2);
+    }
+
+  ThresholdBenchmark thresholdCase(image, 0);
+  suite.run("threshold", thresholdCase, size, size, 2);
+  ThresholdBenchmark parallelThresholdCase(image, &pool);
+  suite.run("threshold/parallel", parallelThresholdCase, size, size, 2);
+  ThresholdIntoBenchmark thresholdIntoCase(image);
+  suite.run("threshold/out-param", thresholdIntoCase, size, size, 2);
+
+  uint8_t gamma[256], invert[256], fused[256];
+  makeGammaLut(0.45, gamma);
+  makeInvertLut(invert);
+  composeLut(gamma, invert, fused);
+  LutBenchmark lutCase(image, gamma, 0);
+  suite.run("applyLut", lutCase, size, size, 2);
+  LutBenchmark fusedCase(image, fused, 0);
+  suite.run("applyLut/fused", fusedCase, size, size, 2);
+  if (baselines)
+    {
+      LutBenchmark twoPassCase(image, gamma, invert);
+      suite.run("applyLut/two-passes", twoPassCase, size, size, 2);
+    }
+
+  GrayImage mask = threshold(image, 128);
+  IsBinaryBenchmark isBinaryCase(mask, 0);
+  suite.run("isBinary", isBinaryCase, size, size, 1);
+  IsBinaryBenchmark parallelIsBinaryCase(mask, &pool);
+  suite.run("isBinary/parallel", parallelIsBinaryCase, size, size, 1);
+
+  PatchBenchmark patchCase(image, true);
+  suite.run("patches/16x16", patchCase, size, size, 4);
+  if (baselines)
+    {
+      PatchBenchmark dynamicPatchCase(image, false);
+      suite.run("patches/16x16/dynamic", dynamicPatchCase, size, size, 4);
+    }
+
+  CompareBenchmark hashCase(image, "hash");
+  suite.run("hash", hashCase, size, size, 1);
+  CompareBenchmark equalCase(image, "equal");
+  suite.run("equal", equalCase, size, size, 2);
+  CompareBenchmark hashedEqualCase(image, "equal/hashed");
+  suite.run("equal/hashed", hashedEqualCase, size, size, 2);
+  CompareBenchmark diffCase(image, "diff");
+  suite.run("diff", diffCase, size, size, 2);
+
+  const std::string path = tempFilePath("gray_image_benchmark", ".pgm");
+  PGMBenchmark saveCase(image, path, true);
+  suite.run("saveToPGM", saveCase, size, size, 1);
+  GrayImage loaded;
+  image.saveToPGM(path);
+  PGMBenchmark loadCase(loaded, path, false);
+  suite.run("loadFromPGM", loadCase, size, size, 1);
+
+  // same pixels as 16-bit and as text
+  {
+    std::ofstream ofs(path.c_str(), std::ios::binary);
+    ofs << "P5\n" << size << ' ' << size << "\n65535\n";
+    for (int y = 0; y < size; ++y)
+      for (int x = 0; x < size; ++x)
+        ofs.put(static_cast<char>(image(y, x))).put(static_cast<char>(y));
+  }
+  PGMBenchmark load16Case(loaded, path, false);
+  suite.run("loadFromPGM/16-bit", load16Case, size, size, 3);
+  {
+    std::ofstream ofs(path.c_str(), std::ios::binary);
+    ofs << "P2\n" << size << ' ' << size << "\n255\n";
+    for (int y = 0; y < size; ++y)
+      for (int x = 0; x < size; ++x)
+        ofs << static_cast<int>(image(y, x)) << (x + 1 < size ? ' ' : '\n');
+  }
+  PGMBenchmark loadAsciiCase(loaded, path, false);
+  suite.run("loadFromPGM/ascii", loadAsciiCase, size, size, 1);
+  std::remove(path.c_str());
+
+  const std::string tiledPath = tempFilePath("gray_image_benchmark", ".gti");
+  TiledBenchmark saveTiledCase(image, tiledPath, 0);
+  suite.run("saveTiled", saveTiledCase, size, size, 1);
+  TiledBenchmark parallelSaveTiledCase(image, tiledPath, &pool);
+  suite.run("saveTiled/parallel", parallelSaveTiledCase, size, size, 1);
+  TiledBenchmark saveMaskCase(mask, tiledPath, 0);
+  suite.run("saveTiled/binary", saveMaskCase, size, size, 1);
+  {
+    TiledImageFile tiled;
+    saveTiled(image, tiledPath);
+    tiled.open(tiledPath);
+    Tile all = { 0, 0, size, size };
+    TiledBenchmark readCase(tiled, all, 0);
+    suite.run("readTiled", readCase, size, size, 1);
+    TiledBenchmark parallelReadCase(tiled, all, &pool);
+    suite.run("readTiled/parallel", parallelReadCase, size, size, 1);
+    int side = std::min(size, 256);
+    Tile center = { (size - side) / 2, (size - side) / 2, side, side };
+    TiledBenchmark regionCase(tiled, center, 0);
+    suite.run("readTiled/region", regionCase, side, side, 1);
+  }
+  std::remove(tiledPath.c_str());
+
+  const std::string smallHeader = "P5\n# small tile\n64 48\n255\n";
+  PGMHeaderBenchmark headerCase(smallHeader, 64 * 48, false);
+  suite.run("parsePGMHeader", headerCase, 1, 1000, static_cast<double>(smallHeader.size()));
+  if (baselines)
+    {
+      // iostream parser doesn't know comments
+      const std::string plainHeader = "P5\n64 48\n255\n";
+      PGMHeaderBenchmark plainCase(plainHeader, 64 * 48, false);
+      suite.run("parsePGMHeader/no-comment", plainCase, 1, 1000, static_cast<double>(plainHeader.size()));
+      PGMHeaderBenchmark streamCase(plainHeader, 64 * 48, true);
+      suite.run("parsePGMHeader/iostream", streamCase, 1, 1000, static_cast<double>(plainHeader.size()));
+    }
+
+  RotateBenchmark rotateCwCase(image, true, false);
+  suite.run("rotateCw90", rotateCwCase, size, size, 2);
+  RotateBenchmark rotateCcwCase(image, false, false);
+  suite.run("rotateCcw90", rotateCcwCase, size, size, 2);
+  GrayImage wide(size * 3 / 4, size);
+  fillWithPattern(wide);
+  RotateBenchmark rotateWideCase(wide, true, false);
+  suite.run("rotateCw90/non-square", rotateWideCase, wide.getHeight(), size, 2);
+  if (baselines)
+    {
+      RotateBenchmark rotateCopyCase(image, true, true);
+      suite.run("rotateCw90/copy", rotateCopyCase, size, size, 2);
+      RotateBenchmark rotateWideCopyCase(wide, true, true);
+      suite.run("rotateCw90/non-square-copy", rotateWideCopyCase, wide.getHeight(), size, 2);
+    }
+
+  GrayImage noise(size, size);
+  fillWithNoise(noise, 45, 1);
+  FillHolesBenchmark fillCase(noise, false);
+  suite.run("binaryFillHoles", fillCase, size, size, 2);
+  BinaryImage packedNoise(noise);
+  PackedFillHolesBenchmark packedFillCase(packedNoise);
+  suite.run("binaryFillHoles/packed", packedFillCase, size, size, 0.25);
+  if (baselines)
+    {
+      FillHolesBenchmark fillPerPixelCase(noise, true);
+      suite.run("binaryFillHoles/per-pixel", fillPerPixelCase, size, size, 2);
+    }
+
+  MorphologyBenchmark erodeCase(image, 0, 5, false);
+  suite.run("erode/5x5", erodeCase, size, size, 2);
+  MorphologyBenchmark erodeLargeCase(image, 0, 31, false);
+  suite.run("erode/31x31", erodeLargeCase, size, size, 2);
+  MorphologyBenchmark packedErodeCase(noise, &packedNoise, 31, false);
+  suite.run("erode/31x31-packed", packedErodeCase, size, size, 0.25);
+  if (baselines)
+    {
+      MorphologyBenchmark erodePerPixelCase(image, 0, 5, true);
+      suite.run("erode/5x5-per-pixel", erodePerPixelCase, size, size, 2);
+    }
+
+  // flat image makes every increment hit the same counter
+  GrayImage flat(size, size);
+  flat.fill(100);
+  HistogramBenchmark histogramCase(image, 0, false);
+  suite.run("histogram", histogramCase, size, size, 1);
+  HistogramBenchmark parallelHistogramCase(image, &pool, false);
+  suite.run("histogram/parallel", parallelHistogramCase, size, size, 1);
+  HistogramBenchmark flatHistogramCase(flat, 0, false);
+  suite.run("histogram/flat", flatHistogramCase, size, size, 1);
+  if (baselines)
+    {
+      HistogramBenchmark histogramPerPixelCase(image, 0, true);
+      suite.run("histogram/per-pixel", histogramPerPixelCase, size, size, 1);
+      HistogramBenchmark flatPerPixelCase(flat, 0, true);
+      suite.run("histogram/flat-per-pixel", flatPerPixelCase, size, size, 1);
+    }
+
+  AdaptiveThresholdBenchmark integralCase(image, "integral");
+  suite.run("integralImage", integralCase, size, size, 1);
+  AdaptiveThresholdBenchmark bradleyCase(image, "bradley");
+  suite.run("thresholdBradley/31x31", bradleyCase, size, size, 2);
+  AdaptiveThresholdBenchmark sauvolaCase(image, "sauvola");
+  suite.run("thresholdSauvola/31x31", sauvolaCase, size, size, 2);
+
+  LabelBenchmark labelCase(noise, 0, 0, false);
+  suite.run("labelComponents", labelCase, size, size, 5);
+  LabelBenchmark parallelLabelCase(noise, 0, &pool, false);
+  suite.run("labelComponents/parallel", parallelLabelCase, size, size, 5);
+  LabelBenchmark packedLabelCase(noise, &packedNoise, 0, false);
+  suite.run("labelComponents/packed", packedLabelCase, size, size, 4.125);
+  if (baselines)
+    {
+      LabelBenchmark labelPerPixelCase(noise, 0, 0, true);
+      suite.run("labelComponents/per-pixel", labelPerPixelCase, size, size, 5);
+    }
+
+  GrayImage document(size, size);
+  fillWithDocument(document);
+  RleBenchmark rleConvertCase(document, "convert", true);
+  suite.run("rle/convert", rleConvertCase, size, size, 1);
+  RleBenchmark rleTranslateCase(document, "translate", true);
+  suite.run("rle/translate", rleTranslateCase, size, size, 2);
+  RleBenchmark rleFillCase(document, "fillHoles", true);
+  suite.run("rle/fillHoles", rleFillCase, size, size, 2);
+  if (baselines)
+    {
+      RleBenchmark translateDocumentCase(document, "translate", false);
+      suite.run("rle/translate-bytes", translateDocumentCase, size, size, 2);
+      RleBenchmark fillDocumentCase(document, "fillHoles", false);
+      suite.run("rle/fillHoles-bytes", fillDocumentCase, size, size, 2);
+    }
+
+  DirtyFrameBenchmark dirtyFrameCase(document, true);
+  suite.run("dirtyFrame/incremental", dirtyFrameCase, size, size, 3);
+  if (baselines)
+    {
+      DirtyFrameBenchmark fullFrameCase(document, false);
+      suite.run("dirtyFrame/full", fullFrameCase, size, size, 3);
+    }
+
+  PipelineBenchmark pipelineCase(image, true);
+  suite.run("pipeline", pipelineCase, size, size, 2);
+  PipelineBenchmark separateCase(image, false);
+  suite.run("pipeline/separate", separateCase, size, size, 2);
+
+  // 64 files of 1/64 of image each
+  GrayImage small(std::max(1, size / 8), std::max(1, size / 8));
+  fillWithPattern(small);
+  std::vector<std::string> inPaths, outPaths;
+  for (int i = 0; i < 64; ++i)
+    {
+      std::ostringstream name;
+      name << "gray_image_batch_" << i;
+      inPaths.push_back(tempFilePath(name.str(), "_in.pgm"));
+      outPaths.push_back(tempFilePath(name.str(), "_out.pgm"));
+      small.saveToPGM(inPaths.back());
+    }
+  BatchBenchmark batchCase(inPaths, outPaths, false);
+  suite.run("pgmBatch", batchCase, small.getHeight() * 8, small.getWidth() * 8, 2);
+  if (baselines)
+    {
+      BatchBenchmark oneByOneCase(inPaths, outPaths, true);
+      suite.run("pgmBatch/one-by-one", oneByOneCase, small.getHeight() * 8, small.getWidth() * 8, 2);
+    }
+  for (size_t i = 0; i < inPaths.size(); ++i)
+    {
+      std::remove(inPaths[i].c_str());
+      std::remove(outPaths[i].c_str());
+    }
+}
+
+int runBenchmarks(int argc, char *argv[])
+{
+  std::vector<int> sizes;
+  int runs = 5;
+  bool baselines = false;
+  std::string filter;
+  std::string jsonPath;
+  std::string csvPath;
+  bool profile = false;
+  std::string profilePath;
+
+  for (int i = 2; i < argc; ++i)
+    {
+      std::string arg = argv[i];
+      bool hasValue = i + 1 < argc;
+      if (arg == "--sizes"  &&  hasValue)
+        {
+          std::istringstream list(argv[++i]);
+          std::string item;
+          while (std::getline(list, item, ','))
+            sizes.push_back(std::atoi(item.c_str()));
+        }
+      else if (arg == "--runs"  &&  hasValue)
+        runs = std::atoi(argv[++i]);
+      else if (arg == "--filter"  &&  hasValue)
+        filter = argv[++i];
+      else if (arg == "--json"  &&  hasValue)
+        jsonPath = argv[++i];
+      else if (arg == "--csv"  &&  hasValue)
+        csvPath = argv[++i];
+      else if (arg == "--baselines")
+        baselines = true;
+      else if (arg == "--profile")
+        profile = true;
+      else if (arg == "--profile-json"  &&  hasValue)
+        profilePath = argv[++i];
+      else if (!arg.empty()  &&  arg[0] != '-')
+        sizes.push_back(std::atoi(arg.c_str()));
+      else
+        {
+          std::cerr << "Unknown benchmark option: " << arg << std::endl;
+          return -1;
+        }
+    }
+
+  if (sizes.empty())
+    {
+      sizes.push_back(1024);
+      sizes.push_back(4096);
+    }
+
+  // pixel count of square image must fit in int
+  for (size_t i = 0; i < sizes.size(); ++i)
+    if (sizes[i] <= 0  ||  sizes[i] > 16384)
+      {
+        std::cerr << "Invalid benchmark image size: " << sizes[i] << std::endl;
+        return -1;
+      }
+
+  if (runs <= 0)
+    {
+      std::cerr << "Invalid number of benchmark runs: " << runs << std::endl;
+      return -1;
+    }
+
+  if ((profile  ||  !profilePath.empty())  &&  !instrumentationEnabled())
+    {
+      std::cerr << "Profile needs build with GRAYIMAGE_INSTRUMENT defined" << std::endl;
+      return -1;
+    }
+
+  ThreadPool pool;
+  std::cout << runs << " runs per benchmark, " << pool.getThreadCount() << " threads" << std::endl;
+  BenchmarkSuite suite(filter, runs);
+  BenchmarkSuite::printHeader(std::cout);
+  for (size_t i = 0; i < sizes.size(); ++i)
+    runBenchmarks(suite, sizes[i], baselines, pool);
+
+  if (!jsonPath.empty()  &&  writeBenchmarkJson(jsonPath, suite.getResults()) != 0)
+    return -1;
+  if (!csvPath.empty()  &&  writeBenchmarkCsv(csvPath, suite.getResults()) != 0)
+    return -1;
+
+  if (profile)
+    {
+      std::cout << std::endl;
+      writeInstrumentationText(std::cout);
+    }
+  if (!profilePath.empty())
+    {
+      std::ofstream ofs(profilePath.c_str());
+      if (!ofs.is_open())
+        {
+          std::cerr << "Failed to open file for writing: " << profilePath << std::endl;
+          return -1;
+        }
+      writeInstrumentationJson(ofs);
+      if (!ofs)
+        return -1;
+    }
+  return 0;
+}
+
+std::string failedTests;
+void require(bool req, std::string unitName)
+{
+  if (!req)
+    failedTests += (unitName + "\n");
+}
+
+// same as require(actual == expected, unitName), but reports where images differ
+void requireEqual(const GrayImage& actual, const GrayImage& expected, std::string unitName)
+{
+  if (actual == expected)
+    return;
+
+  std::ostringstream report;
+  report << unitName << ": ";
+  if (actual.getHeight() != expected.getHeight()  ||  actual.getWidth() != expected.getWidth())
+    report << "size " << actual.getHeight() << "x" << actual.getWidth() << ", expected "
+           << expected.getHeight() << "x" << expected.getWidth();
+  else
+    {
+      ImageDiff difference = diff(actual, expected);
+      const Tile& bounds = difference.bounds;
+      int x = bounds.x;
+      while (actual(bounds.y, x) == expected(bounds.y, x))
+        ++x;
+      report << difference.count << " pixels differ in " << bounds.height << "x" << bounds.width
+             << " at (" << bounds.y << ", " << bounds.x << "), first (" << bounds.y << ", " << x
+             << ") is " << static_cast<int>(actual(bounds.y, x)) << ", expected "
+             << static_cast<int>(expected(bounds.y, x));
+    }
+  failedTests += report.str() + "\n";
+}
+
+// true if fixed-size kernels give the same pixels as GrayImage ones on top
+// left Height x Width patch of image
+template <int Height, int Width>
+bool fixedMatchesGray(const GrayImage& image, uint8_t thr, int dy, int dx)
+{
+  FixedImage<uint8_t, Height, Width> patch;
+  GrayImage gray(Height, Width);
+  for (int y = 0; y < Height; ++y)
+    for (int x = 0; x < Width; ++x)
+      patch(y, x) = gray(y, x) = image(y, x);
+
+  GrayImage grayThresholded = threshold(GrayImageView(gray), thr);
+  GrayImage grayMoved = translate(GrayImageView(gray), dy, dx);
+  FixedImage<uint8_t, Height, Width> thresholded = threshold(patch, thr);
+  FixedImage<uint8_t, Height, Width> moved = translate(patch, dy, dx);
+  for (int y = 0; y < Height; ++y)
+    for (int x = 0; x < Width; ++x)
+      if (thresholded(y, x) != grayThresholded(y, x)  ||  moved(y, x) != grayMoved(y, x))
+        return false;
+  return isBinary(thresholded)  &&  isBinary(patch) == isBinary(gray);
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc > 1  &&  std::string(argv[1]) == "--bench")
+    return runBenchmarks(argc, argv);
+
+  // TODO: insert your code below
+
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    require( isBinary(im1),   "is binary for created from string");
+  }
+
+  {
+    GrayImage im1;
+    require( !isBinary(im1), "is binary for empty");
+  }
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    require(threshold(im1, 10) == im1, "threshold for binary" );
+  }
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    GrayImage im_trans = translate(im1, 0, 1);
+    require( im_trans == GrayImage(3,3,"oxooxooxx"), "move 3*3 for dx = 1" );
+  }
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    GrayImage im_trans = translate(im1, 1, 0);
+    require( im_trans == GrayImage(3,3,"oooxoxxox") , "move 3*3 for dy = 1");
+  }
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    GrayImage im_trans = translate(im1, 1, 1);
+    require( im_trans == GrayImage(3,3,"ooooxooxo") ,"move 3*3 for dx =1 dy = 1");
+  }
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    GrayImage im_trans = translate(im1, 0, -1);
+    require( im_trans == GrayImage(3,3,"oxooxoxxo"), "move 3*3 for dx = -1" );
+  }
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    GrayImage im_trans = translate(im1, -1, -1);
+    require( im_trans == GrayImage(3,3,"oxoxxoooo"), "move 3*3 for dx = -1 dy = -1" );
+  }
+
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    GrayImage im_trans = translate(im1, 0, 10);
+    require( im_trans == GrayImage(3,3,"ooooooooo"), "move 3*3 for dx = 10" );
+  }
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    GrayImage im_trans = translate(im1, 10, 0);
+    require( im_trans == GrayImage(3,3,"ooooooooo"), "move 3*3 for dy = 10" );
+  }
+
+  {
+    GrayImage imPGM;
+    require( imPGM.loadFromPGM("pic1.pgm") == 0, "read PGM" );
+  }
+
+  {
+    GrayImage imPGM;
+    imPGM.loadFromPGM("pic1.pgm");
+    require( !isBinary(imPGM), "NOT binary PGM");
+  }
+
+
+  {
+    GrayImage imPGM;
+    imPGM.loadFromPGM("pic1.pgm");
+
+    GrayImage im1(3,3, "ooooooooo");
+    require( threshold(imPGM, 255) == im1, "threshold 255 for NOT binary" );
+  }
+
+  {
+    GrayImage imPGM;
+    imPGM.loadFromPGM("pic1.pgm");
+
+    GrayImage im1(3,3, "xxxxxxxxx");
+    require( threshold(imPGM, 0) == im1, "threshold 0 for NOT binary" );
+  }
+
+  {
+    GrayImage imPGM;
+    imPGM.loadFromPGM("pic1.pgm");
+
+    GrayImage im1(3,3, "ooooooxxx");
+    require( threshold(imPGM, 53) == im1, "threshold 53 for NOT binary" );
+  }
+
+  {
+    GrayImage im1(3, 3, "xoxxoxxxx");
+    im1.translateInplace(0, -1);
+    require( im1 == GrayImage(3,3,"oxooxoxxo") , "translate in place Binary, dx = -1");
+  }
+
+  {
+    GrayImage im1(3, 3, "xoxxoxxxx");
+    im1.translateInplace(0, -2);
+    require( im1 == GrayImage(3,3,"xooxooxoo"), "translate in place Binary, dx = -2" );
+  }
+
+  {
+    GrayImage im1(3, 3, "xoxxoxxxx");
+    im1.translateInplace(-2, 0);
+    require( im1 == GrayImage(3,3,"xxxoooooo"), "translate in place Binary, dy = -2" );
+  }
+
+  {
+    GrayImage im1(3, 3, "xoxxoxxxx");
+    im1.translateInplace(-2, -2);
+    require( im1 == GrayImage(3,3,"xoooooooo"), "translate in place Binary, dx = -2, dy -2" );
+  }
+
+  {
+    GrayImage im1(3, 3, "xoxxoxxxx");
+    im1.translateInplace(1, 0);
+    require( im1 == GrayImage(3,3,"oooxoxxox"), "translate in place Binary, dy = 1" );
+  }
+
+  {
+    GrayImage im1(3, 3, "xoxxoxxxx");
+    im1.translateInplace(0, 1);
+    require(im1 == GrayImage(3, 3, "oxooxooxx"), "translate in place Binary, dx = 1");
+  }
+
+  {
+    GrayImage im1(3, 3, "xoxxoxxxx");
+    im1.translateInplace(1, 1);
+    require(im1 == GrayImage(3, 3, "ooooxooxo"), "translate in place Binary, dx = 1, dy = 1");
+  }
+
+  {
+    GrayImage im1(3, 3, "xoxxoxxxx");
+    im1.translateInplace(2, 2);
+    require(im1 == GrayImage(3, 3, "oooooooox"), "translate in place Binary, dx = 2, dy = 2");
+  }
+
+  {
+    GrayImage im1, im2;
+    im1.loadFromPGM("pic1.pgm");
+    im2.loadFromPGM("pic1dx-1.pgm");
+    im1.translateInplace(0, -1);
+    require(im1 == im2, "translate in place PGM, dx = -1");
+  }
+
+  {
+    GrayImage im1, im2;
+    im1.loadFromPGM("pic1.pgm");
+    im2.loadFromPGM("pic1dx1dy2.pgm");
+    im1.translateInplace(2, 1);
+    require(im1 == im2, "translate in place PGM, dx = 1, dy = 2");
+  }
+
+  {
+    GrayImage imPGM;
+    require( imPGM.loadFromPGM("no_such_file.pgm") != 0, "read missing PGM" );
+  }
+
+  {
+    GrayImage imPGM;
+    imPGM.loadFromPGM("pic1.pgm");
+    MappedGrayImage mapped;
+    require( mapped.open("pic1.pgm") == 0, "map PGM" );
+
+    bool same = mapped.getHeight() == imPGM.getHeight()  &&  mapped.getWidth() == imPGM.getWidth();
+    for (int y = 0; same  &&  y < mapped.getHeight(); ++y)
+      for (int x = 0; x < mapped.getWidth(); ++x)
+        same = same  &&  mapped(y, x) == imPGM(y, x);
+    require( same, "mapped PGM same as loaded" );
+  }
+
+  {
+    MappedGrayImage mapped;
+    mapped.open("pic1dx-1.pgm");
+    require( mapped.getHeight() == 3  &&  mapped(0, 0) == '2'  &&  mapped(2, 2) == 0,
+             "map PGM with CRLF header" );
+  }
+
+  {
+    struct File
+    {
+      static void write(const std::string& content)
+      {
+        std::ofstream ofs("format_test.pgm", std::ios::binary);
+        ofs << content;
+      }
+    };
+
+    GrayImage im1;
+    File::write("P5\n# by other tool\n3 # width\n2\n255\n" + std::string(3, '\xff') + std::string(3, '\0'));
+    require( im1.loadFromPGM("format_test.pgm") == 0  &&  im1 == GrayImage(2, 3, "xxxooo"),
+             "read PGM with comments" );
+    File::write("P2\n3 2\n# gray\n255\n255 0 7\n0   255\n\n 0\n");
+    require( im1.loadFromPGM("format_test.pgm") == 0  &&  im1(0, 2) == 7
+             &&  isBinary(GrayImageView(im1, 1, 0, 1, 3)), "read text PGM" );
+    File::write("P2 2 2 15 0 15 7 8");
+    require( im1.loadFromPGM("format_test.pgm") == 0  &&  im1(0, 0) == 0  &&  im1(0, 1) == 255
+             &&  im1(1, 0) == 119  &&  im1(1, 1) == 136, "read text PGM with max value 15" );
+    File::write("P5 2 2 15\n" + std::string("\x00\x0f\x07\x08", 4));
+    require( im1.loadFromPGM("format_test.pgm") == 0  &&  im1(0, 1) == 255  &&  im1(1, 0) == 119,
+             "read PGM with max value 15" );
+    File::write("P5 2 1 1000\n" + std::string("\x03\xe8\x01\xf4", 4));
+    require( im1.loadFromPGM("format_test.pgm") == 0  &&  im1(0, 0) == 255  &&  im1(0, 1) == 128,
+             "read 16-bit PGM with max value 1000" );
+
+    File::write("P2 2 2 15 0 16 7 8");
+    require( im1.loadFromPGM("format_test.pgm") != 0, "read text PGM with value above max" );
+    File::write("P5 2 1 1000\n" + std::string("\x03\xe9\x01\xf4", 4));
+    require( im1.loadFromPGM("format_test.pgm") != 0  &&  im1.getWidth() == 2  &&  im1(0, 1) == 128,
+             "read 16-bit PGM with value above max keeps image" );
+    File::write("P5 2 2 15\n" + std::string("\x00\x10\x07\x08", 4));
+    require( im1.loadFromPGM("format_test.pgm") != 0, "read PGM with value above max" );
+    File::write("P2 2 2 255 0 1 2");
+    require( im1.loadFromPGM("format_test.pgm") != 0, "read truncated text PGM" );
+    File::write("P5 2 2 65536\n" + std::string(8, '\0'));
+    require( im1.loadFromPGM("format_test.pgm") != 0, "read PGM with max value above 65535" );
+    File::write("P5 2 2 65535\n" + std::string(7, '\0'));
+    require( im1.loadFromPGM("format_test.pgm") != 0, "read truncated 16-bit PGM" );
+
+    // every 97th of 16-bit values, vector body and scalar tail
+    std::string data;
+    std::vector<uint8_t> expected;
+    for (int v = 0; v < 65536; v += 97)
+      {
+        data += static_cast<char>(v >> 8);
+        data += static_cast<char>(v & 0xff);
+        expected.push_back(static_cast<uint8_t>((v * 255 + 32767) / 65535));
+      }
+    data += "\xff\xff";
+    expected.push_back(255);
+    std::ostringstream header;
+    header << "P5\n" << expected.size() << " 1\n65535\n";
+    File::write(header.str() + data);
+
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_NEON };
+    bool ok = true;
+    for (int l = 0; l < 4; ++l)
+      {
+        if (setSimdLevel(levels[l]) != levels[l])
+          continue;
+        ok = ok  &&  im1.loadFromPGM("format_test.pgm") == 0
+            &&  std::equal(expected.begin(), expected.end(), im1.row(0));
+      }
+    setSimdLevel(supportedSimdLevel());
+    require( ok, "read 16-bit PGM SIMD same as scalar" );
+
+    PGMReader reader;
+    GrayImage band;
+    require( reader.open("format_test.pgm") == 0  &&  reader.readRows(band, 4) == 1
+             &&  std::equal(expected.begin(), expected.end(), band.row(0)), "stream 16-bit PGM" );
+    reader.close();
+    MappedGrayImage mapped;
+    require( mapped.open("format_test.pgm") != 0, "map 16-bit PGM fails" );
+    File::write("P2 1 1 255 0");
+    require( reader.open("format_test.pgm") != 0, "stream text PGM fails" );
+    std::remove("format_test.pgm");
+  }
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    GrayImageView roi(im1, 1, 1, 2, 2);
+    require( GrayImage(roi) == GrayImage(2,2,"oxxx"), "copy of 2*2 view" );
+    require( threshold(roi, 10) == GrayImage(2,2,"oxxx"), "threshold for view" );
+    require( translate(roi, 0, 1) == GrayImage(2,2,"ooox"), "move view for dx = 1" );
+    require( translate(roi, -1, 0) == GrayImage(2,2,"xxoo"), "move view for dy = -1" );
+  }
+
+  {
+    GrayImage im1(3,3,"xxxxxxxxx");
+    im1(0, 0) = 7;
+    require( !isBinary(im1), "NOT binary with gray pixel" );
+    require( isBinary(GrayImageView(im1, 1, 0, 2, 3)), "is binary for view without gray pixel" );
+    require( !isBinary(GrayImageView(im1).subView(0, 0, 1, 1)), "NOT binary for 1*1 view of gray pixel" );
+  }
+
+  {
+    GrayImage im1(2, 3, "xoxoox");
+    const GrayImage& cim1 = im1;
+    require( cim1.row(1) == &cim1(1, 0)  &&  cim1.row(1) == cim1.row(0) + 3, "row pointers are contiguous" );
+    require( cim1.data() == cim1.row(0)  &&  GrayImage().data() == 0, "data is first row, null for empty" );
+    require( isBinary(im1)  &&  cim1.row(0)[1] == 0  &&  isBinary(im1), "const row keeps binary flag" );
+    im1.row(1)[0] = 7;
+    require( !isBinary(im1), "mutable row forgets binary flag" );
+    im1.data()[0] = 255;
+    im1.row(1)[0] = 255;
+    require( isBinary(im1), "binary after writes through row" );
+    int count = 0;
+    for (int y = 0; y < im1.getHeight(); ++y)
+      for (GrayImage::const_iterator it = cim1.rowBegin(y); it != cim1.rowEnd(y); ++it)
+        count += *it == 255;
+    require( count == 4  &&  cim1.rowEnd(0) == cim1.rowBegin(1), "row iterators cover all pixels" );
+    im1(0, 1) = 7;
+    std::ostringstream out;
+    std::streambuf* old = std::cout.rdbuf(out.rdbuf());
+    im1.printBinary();
+    std::cout.rdbuf(old);
+    require( out.str() == "x?x\nxox\n", "print binary maps pixels to x, o and ?" );
+    GrayImage letters(2, 2);
+    letters(0, 0) = 'a';
+    letters(0, 1) = 'b';
+    letters(1, 0) = 'c';
+    letters(1, 1) = 'd';
+    out.str("");
+    old = std::cout.rdbuf(out.rdbuf());
+    letters.print();
+    std::cout.rdbuf(old);
+    require( out.str() == "ab\ncd\n", "print writes raw bytes" );
+  }
+
+  {
+    MappedGrayImage mapped;
+    mapped.open("pic1.pgm");
+    GrayImage im1(3, 3, "ooooooxxx");
+    require( threshold(mapped, 53) == im1, "threshold 53 for mapped PGM" );
+  }
+
+  {
+    // odd sizes exercise vector body and scalar tail of kernels
+    GrayImage im1(7, 101);
+    for (int y = 0; y < im1.getHeight(); ++y)
+      for (int x = 0; x < im1.getWidth(); ++x)
+        im1(y, x) = (y * 101 + x) * 7 % 256;
+
+    const int thresholds[] = { 0, 1, 53, 128, 200, 254, 255 };
+    const SimdLevel levels[] = { SIMD_SSE2, SIMD_AVX2, SIMD_NEON };
+    bool same = true;
+    for (int t = 0; t < 7; ++t)
+      {
+        setSimdLevel(SIMD_SCALAR);
+        GrayImage expected = threshold(im1, thresholds[t]);
+        GrayImage expectedRoi = threshold(GrayImageView(im1, 1, 3, 5, 67), thresholds[t]);
+
+        for (int l = 0; l < 3; ++l)
+          {
+            if (setSimdLevel(levels[l]) != levels[l])
+              continue;
+            same = same  &&  threshold(im1, thresholds[t]) == expected;
+            same = same  &&  threshold(GrayImageView(im1, 1, 3, 5, 67), thresholds[t]) == expectedRoi;
+          }
+      }
+    setSimdLevel(supportedSimdLevel());
+    require( same, "threshold SIMD same as scalar" );
+  }
+
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    require( isBinary(im1), "is binary before write" );
+    im1(1, 1) = 7;
+    require( !isBinary(im1), "NOT binary after write of gray pixel" );
+    im1(1, 1) = 255;
+    require( isBinary(im1), "is binary after write of white pixel" );
+    im1.fill(3);
+    require( !isBinary(im1), "NOT binary after fill with gray" );
+  }
+
+  {
+    // gray pixel in first block, in the middle and in scalar tail
+    const int positions[] = { 0, 70, 4000, 7 * 601 - 1 };
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_NEON };
+    bool ok = true;
+    for (int l = 0; l < 4; ++l)
+      {
+        if (setSimdLevel(levels[l]) != levels[l])
+          continue;
+
+        GrayImage im1(7, 601);
+        for (int x = 0; x < 601; x += 3)
+          im1(3, x) = 255;
+        ok = ok  &&  isBinary(GrayImageView(im1));
 
-  for(int cur_height = 0; cur_height < height; ++cur_height)
-    {
-      for (int cur_width = 0; cur_width < width; ++cur_width)
-        {
-          if(image(cur_height, cur_width) != 0 && image(cur_height, cur_width) != 255)
-            return false;
-        }
-    }
-  return true;
-}
+        for (int p = 0; p < 4; ++p)
+          {
+            GrayImage im2 = im1;
+            im2(positions[p] / 601, positions[p] % 601) = 128;
+            ok = ok  &&  !isBinary(GrayImageView(im2));
+            ok = ok  &&  !isBinary(im2);
+          }
+      }
+    setSimdLevel(supportedSimdLevel());
+    require( ok, "is binary SIMD same as scalar" );
+  }
 
-// Set pixels that are less than thr to zero, others to 255
-GrayImage threshold(const GrayImage& image, uint8_t thr)
-{
-  int height = image.getHeight();
-  int width = image.getWidth();
-  GrayImage result(height, width);
+  {
+    uint8_t lut[256];
+    makePosterizeLut(4, lut);
+    require( lut[0] == 0  &&  lut[63] == 0  &&  lut[64] == 85  &&  lut[191] == 170  &&  lut[255] == 255,
+             "posterize table" );
+    makeContrastLut(50, 100, lut);
+    require( lut[0] == 0  &&  lut[50] == 0  &&  lut[75] == 128  &&  lut[100] == 255  &&  lut[200] == 255,
+             "contrast table" );
+    makeGammaLut(2.0, lut);
+    require( lut[0] == 0  &&  lut[128] == 64  &&  lut[255] == 255, "gamma table" );
 
-  for(int cur_height = 0; cur_height < height; ++cur_height)
-    {
-      for (int cur_width = 0; cur_width < width; ++cur_width)
+    GrayImage im1(3, 3, "xooxxoxxx");
+    makeInvertLut(lut);
+    require( applyLut(im1, lut) == GrayImage(3, 3, "oxxooxooo"), "apply invert table" );
+    applyLutInplace(im1, lut);
+    require( im1 == GrayImage(3, 3, "oxxooxooo")  &&  isBinary(im1), "apply table in place" );
+  }
+
+  {
+    // every value in the image, view is not contiguous and rows end in scalar tail
+    GrayImage im1(20, 301);
+    fillWithPattern(im1);
+    GrayImageView view(im1, 1, 3, 17, 283);
+    uint8_t gamma[256], invert[256], fused[256];
+    makeGammaLut(0.45, gamma);
+    makeInvertLut(invert);
+    composeLut(gamma, invert, fused);
+
+    GrayImage expected(17, 283);
+    for (int y = 0; y < 17; ++y)
+      for (int x = 0; x < 283; ++x)
+        expected(y, x) = gamma[view(y, x)];
+
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_NEON };
+    bool same = true;
+    bool fuse = true;
+    for (int l = 0; l < 4; ++l)
+      {
+        if (setSimdLevel(levels[l]) != levels[l])
+          continue;
+        same = same  &&  applyLut(view, gamma) == expected;
+        fuse = fuse  &&  applyLut(view, fused) == applyLut(applyLut(view, gamma), invert);
+      }
+    setSimdLevel(supportedSimdLevel());
+    require( same, "apply table SIMD same as scalar" );
+    require( fuse, "composed table same as two passes" );
+    require( !isBinary(applyLut(view, gamma)), "gray table result NOT binary" );
+
+    uint8_t step[256];
+    makeThresholdLut(100, step);
+    require( applyLut(view, step) == threshold(view, 100), "threshold table" );
+    ThreadPool pool(3);
+    require( applyLut(view, gamma, pool) == expected, "parallel apply table" );
+  }
+
+  {
+    GrayImage im1(5, 8);
+    fillWithPattern(im1);
+    bool same = true;
+    for (int dy = -6; dy <= 6; ++dy)
+      for (int dx = -9; dx <= 9; ++dx)
         {
-          image(cur_height, cur_width) < thr ? result(cur_height, cur_width) = 0 : result(cur_height, cur_width) = 255;
+          GrayImage expected = translatePerPixel(im1, dy, dx);
+          same = same  &&  translate(im1, dy, dx) == expected;
+
+          GrayImage moved = im1;
+          moved.translateInplace(dy, dx);
+          same = same  &&  moved == expected;
+
+          GrayImageView roi(im1, 1, 2, 3, 5);
+          same = same  &&  translate(roi, dy, dx) == translatePerPixel(roi, dy, dx);
         }
-    }
-  return result;
-}
+    require( same, "row-wise translate same as per pixel" );
+  }
 
-// Should be applied only to binary image
-// Background is black (0), foreground is white (255).
-// Foreground, consisting of one or more connected components, may have one or more holes:
-// connected components of black, that doesn't touch image border (4-connectivity
-// is assumed).
-// The resulting image should have all holes filled with white.
-GrayImage binaryFillHoles(const GrayImage& image);
+  {
+    GrayImage im1(3,3,"xoxxoxxxx");
+    im1.rotateCw90();
+    require( im1 == GrayImage(3,3,"xxxxooxxx"), "rotate 3*3 clockwise" );
+    im1.rotateCcw90();
+    require( im1 == GrayImage(3,3,"xoxxoxxxx"), "rotate 3*3 counter clockwise" );
+  }
 
-// Let's call this image src and resulting image dst. src(y, x) - pixels of source
-// image with coordinates (y, x).
-// dst(y,x) = 255, iff src(y, x) = 0 and path exists in source image (4-connectivity
-// is assumed) from (y, x) to image border such that all pixels on this path are 0.
-GrayImage binaryBackground(const GrayImage& image);
+  {
+    GrayImage im1(2,3,"xooxxo");
+    im1.rotateCw90();
+    require( im1 == GrayImage(3,2,"xxxooo"), "rotate 2*3 clockwise" );
 
-std::string failedTests;
-void require(bool req, std::string unitName)
-{
-  if (!req)
-    failedTests += (unitName + "\n");
-}
+    GrayImage im2(2,3,"xooxxo");
+    im2.rotateCcw90();
+    require( im2 == GrayImage(3,2,"oooxxx"), "rotate 2*3 counter clockwise" );
+  }
 
-int main(int argc, char *argv[])
-{
-  // TODO: insert your code below
+  {
+    const int sizes[][2] = { {1, 1}, {1, 7}, {7, 1}, {2, 2}, {5, 5}, {6, 6}, {4, 9},
+                             {9, 4}, {130, 130}, {131, 131}, {67, 129}, {200, 3} };
+    bool same = true;
+    for (int i = 0; i < 12; ++i)
+      {
+        GrayImage im1(sizes[i][0], sizes[i][1]);
+        fillWithPattern(im1);
 
+        GrayImage im2 = im1;
+        im2.rotateCw90();
+        same = same  &&  im2 == rotateCw90Copy(im1);
+
+        im2.rotateCcw90();
+        same = same  &&  im2 == im1;
+
+        im2.rotateCcw90();
+        im2.rotateCcw90();
+        im2.rotateCcw90();
+        same = same  &&  im2 == rotateCw90Copy(im1);
+      }
+    require( same, "rotate in-place same as copy" );
+  }
+
+  {
+    GrayImage im1(5,5,"ooooo"
+                      "oxxxo"
+                      "oxoxo"
+                      "oxxxo"
+                      "ooooo");
+    require( binaryFillHoles(im1) == GrayImage(5,5,"ooooo"
+                                                   "oxxxo"
+                                                   "oxxxo"
+                                                   "oxxxo"
+                                                   "ooooo"), "fill hole inside ring" );
+    require( binaryBackground(im1) == GrayImage(5,5,"xxxxx"
+                                                    "xooox"
+                                                    "xooox"
+                                                    "xooox"
+                                                    "xxxxx"), "background around ring" );
+    require( isBinary(binaryFillHoles(im1)), "filled holes image is binary" );
+  }
 
   {
     GrayImage im1(3,3,"xoxxoxxxx");
-    require( isBinary(im1),   "is binary for created from string");
+    require( binaryFillHoles(im1) == im1, "fill holes for black touching border" );
+    require( binaryBackground(im1) == GrayImage(3,3,"oxooxoooo"), "background touching border" );
+
+    GrayImage im2(3,3,"xxxxoxxxx");
+    require( binaryFillHoles(im2) == GrayImage(3,3,"xxxxxxxxx"), "fill 1 pixel hole" );
+    require( binaryBackground(im2) == GrayImage(3,3,"ooooooooo"), "no background" );
   }
 
   {
-    GrayImage im1;
-    require( !isBinary(im1), "is binary for empty");
+    bool same = true;
+    for (int percent = 30; percent <= 70; percent += 10)
+      {
+        GrayImage im1(97, 131);
+        fillWithNoise(im1, percent, percent);
+        GrayImage expected = binaryBackgroundPerPixel(im1);
+        same = same  &&  binaryBackground(im1) == expected;
+
+        GrayImage filled = binaryFillHoles(im1);
+        for (int y = 0; same  &&  y < im1.getHeight(); ++y)
+          for (int x = 0; x < im1.getWidth(); ++x)
+            same = same  &&  filled(y, x) == 255 - expected(y, x);
+      }
+    require( same, "scanline background same as per pixel" );
   }
 
   {
-    GrayImage im1(3,3,"xoxxoxxxx");
-    require(threshold(im1, 10) == im1, "threshold for binary" );
+    // comb with single long path through it, recursion would overflow stack
+    GrayImage im1(2001, 2001);
+    im1.fill(255);
+    for (int y = 1; y < 2000; y += 2)
+      for (int x = 1; x < 2000; ++x)
+        im1(y, x) = 0;
+    for (int y = 2; y < 2000; y += 2)
+      im1(y, y % 4 == 0 ? 1 : 1999) = 0;
+    im1(1, 0) = 0;
+    require( binaryBackground(im1) == binaryBackgroundPerPixel(im1), "background of long path" );
+
+    // same serpentine at 10k x 10k filled in place, stack stays within
+    // perimeter of image
+    const int size = 10000;
+    GrayImage maze(size, size);
+    maze.fill(255);
+    GrayImage::pixel_t* pixels = maze.data();
+    for (int y = 1; y < size - 1; y += 2)
+      std::memset(pixels + static_cast<size_t>(y) * size + 1, 0, size - 2);
+    for (int y = 2; y < size - 1; y += 2)
+      pixels[static_cast<size_t>(y) * size + (y % 4 == 0 ? 1 : size - 2)] = 0;
+    pixels[size] = 0;
+    size_t peak = fillBackground(maze, pixels, 1);
+    bool filled = maze(size - 3, size / 2) == 1  &&  maze(size - 2, size / 2) == 255;
+
+    // vertical corridors, where every row of corridor is run of one pixel
+    maze.fill(255);
+    pixels = maze.data();
+    for (int y = 1; y < size - 1; ++y)
+      for (int x = 1; x < size - 1; x += 2)
+        pixels[static_cast<size_t>(y) * size + x] = 0;
+    for (int x = 2; x < size - 1; x += 2)
+      pixels[static_cast<size_t>(x % 4 == 0 ? 1 : size - 2) * size + x] = 0;
+    pixels[1] = 0;
+    peak = std::max(peak, fillBackground(maze, pixels, 1));
+    filled = filled  &&  maze(size / 2, size - 3) == 1  &&  maze(size / 2, size - 2) == 255;
+    require( peak <= 2 * (size + size)  &&  filled, "background of serpentine keeps stack within perimeter" );
   }
 
   {
     GrayImage im1(3,3,"xoxxoxxxx");
-    GrayImage im_trans = translate(im1, 0, 1);
-    require( im_trans == GrayImage(3,3,"oxooxooxx"), "move 3*3 for dx = 1" );
+    BinaryImage packed(im1);
+    require( packed.getHeight() == 3  &&  packed.getWidth() == 3  &&  packed.get(0, 0)  &&  !packed.get(0, 1),
+             "pack 3*3" );
+    require( packed.toGrayImage() == im1, "unpack 3*3" );
+    require( packed.count() == 7, "count white in packed 3*3" );
+
+    packed.invert();
+    require( packed.toGrayImage() == GrayImage(3,3,"oxooxoooo"), "invert packed 3*3" );
+    packed.set(2, 2, true);
+    require( packed.toGrayImage() == GrayImage(3,3,"oxooxooox"), "set packed pixel" );
   }
 
   {
-    GrayImage im1(3,3,"xoxxoxxxx");
-    GrayImage im_trans = translate(im1, 1, 0);
-    require( im_trans == GrayImage(3,3,"oooxoxxox") , "move 3*3 for dy = 1");
+    GrayImage im1(5, 200);
+    fillWithPattern(im1);
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2 };
+    bool same = true;
+    for (int l = 0; l < 3; ++l)
+      {
+        if (setSimdLevel(levels[l]) != levels[l])
+          continue;
+
+        for (int thr = 0; thr < 256; thr += 51)
+          {
+            BinaryImage packed;
+            threshold(im1, thr, packed);
+            same = same  &&  packed.toGrayImage() == threshold(im1, thr);
+            same = same  &&  packed == BinaryImage(threshold(im1, thr));
+          }
+      }
+    setSimdLevel(supportedSimdLevel());
+    require( same, "packed threshold same as threshold" );
   }
 
   {
-    GrayImage im1(3,3,"xoxxoxxxx");
-    GrayImage im_trans = translate(im1, 1, 1);
-    require( im_trans == GrayImage(3,3,"ooooxooxo") ,"move 3*3 for dx =1 dy = 1");
+    GrayImage im1(4, 130);
+    GrayImage im2(4, 130);
+    fillWithNoise(im1, 50, 1);
+    fillWithNoise(im2, 50, 2);
+    BinaryImage one(im1);
+    BinaryImage two(im2);
+
+    bool same = true;
+    GrayImage andImage = (one & two).toGrayImage();
+    GrayImage orImage = (one | two).toGrayImage();
+    GrayImage xorImage = (one ^ two).toGrayImage();
+    for (int y = 0; y < 4; ++y)
+      for (int x = 0; x < 130; ++x)
+        {
+          same = same  &&  andImage(y, x) == (im1(y, x) & im2(y, x));
+          same = same  &&  orImage(y, x) == (im1(y, x) | im2(y, x));
+          same = same  &&  xorImage(y, x) == (im1(y, x) ^ im2(y, x));
+        }
+    require( same, "bitwise operations on packed" );
+    require( one != two  &&  one == BinaryImage(im1), "compare packed" );
   }
 
   {
-    GrayImage im1(3,3,"xoxxoxxxx");
-    GrayImage im_trans = translate(im1, 0, -1);
-    require( im_trans == GrayImage(3,3,"oxooxoxxo"), "move 3*3 for dx = -1" );
+    bool same = true;
+    const int widths[] = { 1, 63, 64, 65, 131, 257 };
+    for (int w = 0; w < 6; ++w)
+      for (int percent = 30; percent <= 70; percent += 20)
+        {
+          GrayImage im1(61, widths[w]);
+          fillWithNoise(im1, percent, percent + w);
+          BinaryImage packed(im1);
+          same = same  &&  binaryBackground(packed).toGrayImage() == binaryBackground(im1);
+          same = same  &&  binaryFillHoles(packed).toGrayImage() == binaryFillHoles(im1);
+        }
+    require( same, "packed fill holes same as unpacked" );
   }
 
   {
-    GrayImage im1(3,3,"xoxxoxxxx");
-    GrayImage im_trans = translate(im1, -1, -1);
-    require( im_trans == GrayImage(3,3,"oxoxxoooo"), "move 3*3 for dx = -1 dy = -1" );
+    // more threads than CPUs still must give correct results
+    ThreadPool pool(4);
+    require( pool.getThreadCount() == 4, "thread pool size" );
+
+    class CountRows : public RowTask
+    {
+    public:
+      explicit CountRows(std::vector<int>& hits) : hits_(hits) {}
+      void run(int yBegin, int yEnd)
+      {
+        for (int y = yBegin; y < yEnd; ++y)
+          ++hits_[y];
+      }
+    private:
+      std::vector<int>& hits_;
+    };
+
+    bool once = true;
+    for (int height = 1; height < 300; height += 37)
+      {
+        std::vector<int> hits(height);
+        CountRows task(hits);
+        parallelForRows(pool, height, task, height % 5);
+        once = once  &&  std::count(hits.begin(), hits.end(), 1) == height;
+      }
+    require( once, "parallel for rows visits each row once" );
+
+    class MarkTiles : public TileTask
+    {
+    public:
+      explicit MarkTiles(GrayImage& image) : image_(image) {}
+      void run(const Tile& tile)
+      {
+        for (int y = tile.y; y < tile.y + tile.height; ++y)
+          for (int x = tile.x; x < tile.x + tile.width; ++x)
+            ++image_(y, x);
+      }
+    private:
+      GrayImage::RowWriter image_;
+    };
+
+    GrayImage tiles(45, 70);
+    MarkTiles markTask(tiles);
+    parallelForTiles(pool, 45, 70, 16, 32, markTask);
+    GrayImage ones(45, 70);
+    ones.fill(1);
+    require( tiles == ones, "parallel for tiles visits each pixel once" );
+
+    GrayImage im1(301, 517);
+    fillWithPattern(im1);
+    require( threshold(im1, 100, pool) == threshold(im1, 100), "parallel threshold" );
+    require( threshold(GrayImageView(im1, 3, 5, 200, 301), 100, pool)
+             == threshold(GrayImageView(im1, 3, 5, 200, 301), 100), "parallel threshold for view" );
+    require( translate(im1, -7, 12, pool) == translate(im1, -7, 12), "parallel translate" );
+    require( translate(im1, 400, 0, pool) == translate(im1, 400, 0), "parallel translate outside" );
+
+    GrayImage im2 = threshold(im1, 100);
+    require( isBinary(GrayImageView(im2), pool), "parallel is binary" );
+    im2(300, 516) = 1;
+    require( !isBinary(GrayImageView(im2), pool), "parallel NOT binary" );
+
+    GrayImage out;
+    threshold(im1, 100, out, pool);
+    require( out == threshold(im1, 100)  &&  isBinary(out), "parallel threshold into image" );
+    translate(im1, 5, -9, out, pool);
+    require( out == translate(im1, 5, -9), "parallel translate into image" );
   }
 
+  {
+    GrayImage im1(67, 45);
+    fillWithPattern(im1);
+    GrayImage out;
+    threshold(im1, 100, out);
+    const GrayImage::pixel_t* buffer = &out(0, 0);
+    require( out == threshold(im1, 100)  &&  isBinary(out), "threshold into image" );
+    bool same = true;
+    for (int dy = -70; dy <= 70; dy += 7)
+      for (int dx = -50; dx <= 50; dx += 5)
+        {
+          translate(im1, dy, dx, out);
+          same = same  &&  out == translatePerPixel(im1, dy, dx);
+        }
+    require( same, "translate into image same as per pixel" );
+    require( &out(0, 0) == buffer, "same size output keeps buffer" );
+    require( sharesPixels(GrayImageView(im1, 60, 40, 7, 5), im1)  &&  !sharesPixels(GrayImageView(im1), out)
+             &&  !sharesPixels(GrayImageView(im1), GrayImage()), "view sharing pixels with result" );
+
+    GrayImage mask = threshold(im1, 100);
+    binaryFillHoles(mask, out);
+    require( out == binaryFillHoles(mask)  &&  isBinary(out), "fill holes into image" );
+    binaryBackground(mask, out);
+    require( out == binaryBackground(mask), "background into image" );
+    threshold(GrayImageView(im1, 1, 2, 10, 20), 100, out);
+    require( out == threshold(GrayImageView(im1, 1, 2, 10, 20), 100)  &&  &out(0, 0) == buffer,
+             "smaller output keeps buffer" );
+    out.reshape(0, 0);
+    require( out.getHeight() == 0  &&  out.getWidth() == 0, "reshape to empty" );
+  }
 
   {
-    GrayImage im1(3,3,"xoxxoxxxx");
-    GrayImage im_trans = translate(im1, 0, 10);
-    require( im_trans == GrayImage(3,3,"ooooooooo"), "move 3*3 for dx = 10" );
+    GrayImagePool images(2);
+    GrayImage im1, im2, im3;
+    images.acquire(im1, 10, 20);
+    images.acquire(im2, 30, 40);
+    const GrayImage::pixel_t* buffer1 = &im1(0, 0);
+    const GrayImage::pixel_t* buffer2 = &im2(0, 0);
+    images.release(im1);
+    images.release(im2);
+    require( images.getBufferCount() == 2  &&  im1.getHeight() == 0  &&  im2.getWidth() == 0,
+             "pool keeps released buffers" );
+    images.acquire(im3, 30, 40);
+    require( &im3(0, 0) == buffer2  &&  im3.getHeight() == 30  &&  im3.getWidth() == 40,
+             "pool prefers exact size" );
+    images.acquire(im1, 5, 5);
+    require( &im1(0, 0) == buffer1  &&  images.getBufferCount() == 0, "pool reuses larger buffer" );
+    images.acquire(im3, 1, 1);
+    require( images.getBufferCount() == 1, "pool takes previous buffer of image" );
+    images.release(im1);
+    images.release(im3);
+    images.release(im2);
+    require( images.getBufferCount() == 2, "pool keeps at most max buffers" );
   }
 
   {
-    GrayImage im1(3,3,"xoxxoxxxx");
-    GrayImage im_trans = translate(im1, 10, 0);
-    require( im_trans == GrayImage(3,3,"ooooooooo"), "move 3*3 for dy = 10" );
+    GrayImage im1(4, 5, "xxoox"
+                        "oxoxo"
+                        "oxxxo"
+                        "xooox");
+    LabelImage labels = labelComponents(im1);
+    require( labels.getComponentCount() == 4  &&  countComponents(im1) == 4, "count components" );
+    require( labels(0, 0) == 1  &&  labels(0, 4) == 2  &&  labels(3, 0) == 3  &&  labels(3, 4) == 4
+             &&  labels(2, 3) == 1  &&  labels(1, 3) == 1  &&  labels(1, 2) == 0, "component labels" );
+    const ComponentStats& first = labels.getComponent(1);
+    require( first.area == 7  &&  first.box.y == 0  &&  first.box.x == 0
+             &&  first.box.height == 3  &&  first.box.width == 4, "component area and box" );
+    require( labelComponents(GrayImage()).getComponentCount() == 0, "no components in empty image" );
   }
 
   {
-    GrayImage imPGM;
-    require( imPGM.loadFromPGM("pic1.pgm") == 0, "read PGM" );
+    GrayImage im1(5, 6, "oooooo"
+                        "oxxxoo"
+                        "oxxxox"
+                        "oxxxoo"
+                        "oooooo");
+    require( erode(im1, 3, 3) == GrayImage(5, 6, "oooooo"
+                                                 "oooooo"
+                                                 "ooxooo"
+                                                 "oooooo"
+                                                 "oooooo"), "erode 3*3" );
+    require( opening(im1, 3, 3) == GrayImage(5, 6, "oooooo"
+                                                   "oxxxoo"
+                                                   "oxxxoo"
+                                                   "oxxxoo"
+                                                   "oooooo"), "open removes speck" );
+    require( dilate(im1, 1, 2) == GrayImage(5, 6, "oooooo"
+                                                  "oxxxxo"
+                                                  "oxxxxx"
+                                                  "oxxxxo"
+                                                  "oooooo"), "dilate 1*2" );
+
+    // window sizes cover single block, even sizes and window larger than image
+    const int sizes[][2] = { { 1, 1 }, { 1, 5 }, { 4, 1 }, { 3, 3 }, { 2, 6 }, { 7, 4 }, { 40, 90 }, { 5, 130 } };
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_NEON };
+    GrayImage im2(29, 141);
+    fillWithPattern(im2);
+    GrayImage im3(29, 141);
+    fillWithNoise(im3, 70, 5);
+    bool same = true;
+    bool packed = true;
+    for (int l = 0; l < 4; ++l)
+      {
+        if (setSimdLevel(levels[l]) != levels[l])
+          continue;
+        for (int i = 0; i < 8; ++i)
+          {
+            int h = sizes[i][0];
+            int w = sizes[i][1];
+            same = same  &&  erode(im2, h, w) == morphologyPerPixel(im2, h, w, false);
+            same = same  &&  dilate(im2, h, w) == morphologyPerPixel(im2, h, w, true);
+            same = same  &&  closing(im2, h, w)
+              == morphologyPerPixel(morphologyPerPixel(im2, h, w, true), h, w, false);
+            BinaryImage bits(im3);
+            packed = packed  &&  erode(bits, h, w).toGrayImage() == erode(im3, h, w);
+            packed = packed  &&  dilate(bits, h, w).toGrayImage() == dilate(im3, h, w);
+            packed = packed  &&  opening(bits, h, w).toGrayImage() == opening(im3, h, w);
+          }
+      }
+    setSimdLevel(supportedSimdLevel());
+    require( same, "morphology same as per pixel" );
+    require( packed, "packed morphology same as unpacked" );
+
+    GrayImageView view(im2, 3, 7, 20, 100);
+    GrayImage result;
+    erode(view, 5, 3, result);
+    require( result == morphologyPerPixel(GrayImage(view), 5, 3, false), "erode view" );
+    GrayImage opened = opening(im2, 4, 6);
+    require( opening(opened, 4, 6) == opened, "opening is idempotent" );
+    require( erode(GrayImage(), 3, 3).getHeight() == 0  &&  dilate(BinaryImage(), 3, 3).getHeight() == 0
+             &&  opening(BinaryImage(), 2, 5).getWidth() == 0  &&  closing(BinaryImage(), 5, 2).getHeight() == 0,
+             "morphology of empty image" );
   }
 
   {
-    GrayImage imPGM;
-    imPGM.loadFromPGM("pic1.pgm");
-    require( !isBinary(imPGM), "NOT binary PGM");
+    GrayImage im1(23, 31);
+    fillWithPattern(im1);
+    GrayImageView view(im1, 2, 3, 20, 27);
+    IntegralImage integral(view, true);
+    bool same = true;
+    for (int y = 0; y <= 20; y += 3)
+      for (int x = 0; x <= 27; x += 4)
+        for (int h = 0; y + h <= 20; h += 5)
+          for (int w = 0; x + w <= 27; w += 6)
+            {
+              uint64_t sum = 0;
+              uint64_t squares = 0;
+              for (int wy = y; wy < y + h; ++wy)
+                for (int wx = x; wx < x + w; ++wx)
+                  {
+                    sum += view(wy, wx);
+                    squares += view(wy, wx) * view(wy, wx);
+                  }
+              Tile box = { y, x, h, w };
+              same = same  &&  integral.sum(box) == sum  &&  integral.sumOfSquares(box) == squares;
+            }
+    require( same, "integral image sums" );
+    Tile box = { 1, 1, 2, 2 };
+    double mean = (view(1, 1) + view(1, 2) + view(2, 1) + view(2, 2)) / 4.0;
+    require( integral.mean(box) == mean, "integral image mean" );
+
+    // sum of squares of whole image overflows 32 bits
+    GrayImage im2(1100, 1100);
+    im2.fill(255);
+    IntegralImage large(im2, true);
+    Tile all = { 0, 0, 1100, 1100 };
+    require( large.sum(all) == uint64_t(255) * 1100 * 1100
+             &&  large.sumOfSquares(all) == uint64_t(255 * 255) * 1100 * 1100
+             &&  large.variance(all) == 0, "integral image of large image" );
+
+    // reference thresholds with brute force window statistics
+    GrayImage bradley(20, 27);
+    GrayImage sauvola(20, 27);
+    for (int y = 0; y < 20; ++y)
+      for (int x = 0; x < 27; ++x)
+        {
+          double sum = 0;
+          double squares = 0;
+          int area = 0;
+          for (int wy = std::max(0, y - 3); wy < std::min(20, y + 4); ++wy)
+            for (int wx = std::max(0, x - 3); wx < std::min(27, x + 4); ++wx)
+              {
+                sum += view(wy, wx);
+                squares += view(wy, wx) * view(wy, wx);
+                ++area;
+              }
+          double m = sum / area;
+          double deviation = std::sqrt(std::max(0.0, squares / area - m * m));
+          bradley(y, x) = view(y, x) * 100.0 < m * 85 ? 0 : 255;
+          sauvola(y, x) = view(y, x) < m * (1 + 0.3 * (deviation / 100 - 1)) ? 0 : 255;
+        }
+    require( thresholdBradley(view, 7) == bradley, "Bradley threshold" );
+    require( thresholdSauvola(view, 7, 0.3, 100) == sauvola, "Sauvola threshold" );
   }
 
+  {
+    GrayImage im1(37, 101);
+    fillWithPattern(im1);
+    im1(3, 4) = 255;
+    GrayImageView view(im1, 1, 2, 33, 97);
+    uint64_t expected[256] = { 0 };
+    for (int y = 0; y < 33; ++y)
+      for (int x = 0; x < 97; ++x)
+        ++expected[view(y, x)];
+    uint64_t counts[256];
+    histogram(view, counts);
+    require( std::equal(counts, counts + 256, expected), "histogram" );
+    ThreadPool pool(3);
+    histogram(view, counts, pool);
+    require( std::equal(counts, counts + 256, expected), "parallel histogram" );
+    histogram(im1, counts);
+    require( counts[255] > 0  &&  std::accumulate(counts, counts + 256, uint64_t(0)) == 37 * 101,
+             "histogram of contiguous image" );
+
+    // two levels with noise, threshold has to separate them
+    GrayImage im2(40, 50);
+    for (int y = 0; y < 40; ++y)
+      for (int x = 0; x < 50; ++x)
+        im2(y, x) = static_cast<GrayImage::pixel_t>((x < 20 ? 60 : 190) + (x * 7 + y * 3) % 11 - 5);
+    uint8_t thr = autoThreshold(im2);
+    require( thr > 65  &&  thr <= 185, "Otsu threshold between levels" );
+    GrayImage result;
+    thresholdOtsu(im2, result, pool);
+    require( result == threshold(im2, thr)  &&  thresholdOtsu(im2) == result
+             &&  result(0, 19) == 0  &&  result(0, 20) == 255, "Otsu binarization" );
+
+    GrayImage flat(3, 3);
+    flat.fill(77);
+    require( autoThreshold(flat) == 1, "Otsu threshold of flat image" );
+  }
 
   {
-    GrayImage imPGM;
-    imPGM.loadFromPGM("pic1.pgm");
+    ThreadPool pool(3);
+    const int widths[] = { 1, 63, 64, 65, 200 };
+    bool same = true;
+    for (int w = 0; w < 5; ++w)
+      for (int percent = 30; percent <= 90; percent += 30)
+        {
+          GrayImage im1(57, widths[w]);
+          fillWithNoise(im1, percent, w * 100 + percent);
+          int count = 0;
+          std::vector<int> expected = labelComponentsPerPixel(im1, count);
 
-    GrayImage im1(3,3, "ooooooooo");
-    require( threshold(imPGM, 255) == im1, "threshold 255 for NOT binary" );
+          LabelImage labels[3];
+          labels[0] = labelComponents(im1);
+          labelComponents(im1, labels[1], pool);
+          labels[2] = labelComponents(BinaryImage(im1));
+          for (int l = 0; l < 3; ++l)
+            {
+              same = same  &&  labels[l].getComponentCount() == count;
+              for (int y = 0; y < im1.getHeight(); ++y)
+                for (int x = 0; x < im1.getWidth(); ++x)
+                  same = same  &&  static_cast<int>(labels[l](y, x)) == expected[y * im1.getWidth() + x];
+            }
+          same = same  &&  countComponents(im1) == count;
+        }
+    require( same, "labels same as per pixel" );
+
+    // U shape is one component, its parts are merged late
+    GrayImage im2(3, 5, "xoxox"
+                        "xoxox"
+                        "xxxxx");
+    LabelImage labels;
+    labelComponents(im2, labels, pool);
+    require( labels.getComponentCount() == 1  &&  labels.getComponent(1).area == 11, "merge of U shape" );
   }
 
   {
-    GrayImage imPGM;
-    imPGM.loadFromPGM("pic1.pgm");
+    GrayImage im1(5, 5, "ooooo"
+                        "oxxxo"
+                        "oxoxo"
+                        "oxxxo"
+                        "ooooo");
+    require( GrayImagePipeline().fillHoles().run(im1) == binaryFillHoles(im1), "pipeline fill holes" );
+    require( GrayImagePipeline().background().run(im1) == binaryBackground(im1), "pipeline background" );
+    require( GrayImagePipeline().run(im1) == im1, "empty pipeline copies image" );
 
-    GrayImage im1(3,3, "xxxxxxxxx");
-    require( threshold(imPGM, 0) == im1, "threshold 0 for NOT binary" );
+    GrayImage im2(93, 71);
+    uint8_t invert[256];
+    makeInvertLut(invert);
+    uint8_t gamma[256];
+    makeGammaLut(2.2, gamma);
+    fillWithPattern(im2);
+    GrayImageView view(im2, 2, 1, 90, 67);
+    ThreadPool pool(3);
+
+    GrayImage expected = binaryFillHoles(translate(threshold(view, 120), 3, -5));
+    GrayImage result;
+    GrayImagePipeline standard;
+    standard.threshold(120).translate(3, -5).fillHoles();
+    standard.run(view, result);
+    require( result == expected  &&  isBinary(result), "pipeline threshold, translate, fill holes" );
+    standard.run(view, result, pool);
+    require( result == expected, "parallel pipeline" );
+
+    // pads have to be mapped by tables after each translate
+    GrayImage moved = applyLut(translate(applyLut(translate(view, -7, 4), gamma), 20, 30), invert);
+    expected = translate(applyLut(binaryBackground(threshold(moved, 100)), invert), 1, 1);
+    GrayImagePipeline chain;
+    chain.translate(-7, 4).applyLut(gamma).translate(20, 30).applyLut(invert).threshold(100)
+      .background().applyLut(invert).translate(1, 1);
+    require( chain.run(view) == expected, "pipeline of mixed steps" );
+
+    bool same = true;
+    for (int dy = -95; dy <= 95; dy += 19)
+      for (int dx = -70; dx <= 70; dx += 14)
+        {
+          GrayImagePipeline shifts;
+          shifts.translate(dy, dx).applyLut(invert).translate(-dx, dy / 2).fillHoles().fillHoles();
+          same = same  &&  shifts.run(threshold(view, 128))
+            == binaryFillHoles(translate(applyLut(translate(threshold(view, 128), dy, dx), invert), -dx, dy / 2));
+        }
+    require( same, "pipeline of translates" );
+
+    // not 0 pixels are foreground for fill, 1 is not confused with mark
+    GrayImage gray(5, 5);
+    fillWithPattern(gray);
+    gray(0, 0) = 1;
+    gray(2, 2) = 0;
+    uint8_t nonZero[256];
+    makeThresholdLut(1, nonZero);
+    require( GrayImagePipeline().fillHoles().run(gray) == binaryFillHoles(applyLut(gray, nonZero)),
+             "pipeline fill of not binary image" );
+
+    // pass after fill without translate is done in result buffer
+    result.reshape(view.getHeight(), view.getWidth());
+    const GrayImage::pixel_t* buffer = result.data();
+    GrayImagePipeline inPlace;
+    inPlace.threshold(120).background().applyLut(invert);
+    inPlace.run(view, result);
+    require( result == applyLut(binaryBackground(threshold(view, 120)), invert)  &&  result.data() == buffer,
+             "pipeline pass after fill in place" );
   }
 
   {
-    GrayImage imPGM;
-    imPGM.loadFromPGM("pic1.pgm");
+    GrayImage im1(2, 3, "xoxoxo");
+    GrayImage im2(4, 1);
+    im2(0, 0) = 7;
+    const GrayImage::pixel_t* buffer1 = &im1(0, 0);
+    const GrayImage::pixel_t* buffer2 = &im2(0, 0);
+    std::swap(im1, im2);
+    require( im1.getHeight() == 4  &&  im1.getWidth() == 1  &&  &im1(0, 0) == buffer2
+             &&  im2 == GrayImage(2, 3, "xoxoxo")  &&  &im2(0, 0) == buffer1, "swap without copying" );
+    require( isBinary(im2)  &&  !isBinary(im1), "swap exchanges binary flag" );
+#if __cplusplus >= 201103L
+    GrayImage im3(std::move(im2));
+    require( &im3(0, 0) == buffer1  &&  im2.getHeight() == 0  &&  im2.getWidth() == 0, "move image" );
+    im2 = std::move(im3);
+    require( &im2(0, 0) == buffer1  &&  im3.getHeight() == 0, "move assign image" );
+#endif
+  }
 
-    GrayImage im1(3,3, "ooooooxxx");
-    require( threshold(imPGM, 53) == im1, "threshold 53 for NOT binary" );
+  {
+    GrayImage im1(37, 53);
+    fillWithPattern(im1);
+    im1.saveToPGM("stream_test_in.pgm");
+
+    PGMReader reader;
+    GrayImage band;
+    require( reader.open("stream_test_in.pgm") == 0  &&  reader.getHeight() == 37
+             &&  reader.readRows(band, 10) == 10  &&  band == GrayImage(GrayImageView(im1, 0, 0, 10, 53)),
+             "stream read band" );
+    reader.close();
+
+    GrayImage result;
+    bool ok = true;
+    const int bandRows[] = { 1, 5, 36, 37, 100 };
+    for (int b = 0; b < 5; ++b)
+      {
+        ok = ok  &&  thresholdPGM("stream_test_in.pgm", "stream_test_out.pgm", 100, bandRows[b]) == 0;
+        ok = ok  &&  result.loadFromPGM("stream_test_out.pgm") == 0  &&  result == threshold(im1, 100);
+
+        const int shifts[][2] = { {3, -2}, {-4, 5}, {0, 0}, {37, 0}, {-40, 1} };
+        for (int i = 0; i < 5; ++i)
+          {
+            ok = ok  &&  translatePGM("stream_test_in.pgm", "stream_test_out.pgm",
+                                      shifts[i][0], shifts[i][1], bandRows[b]) == 0;
+            ok = ok  &&  result.loadFromPGM("stream_test_out.pgm") == 0
+                &&  result == translate(im1, shifts[i][0], shifts[i][1]);
+          }
+      }
+    require( ok, "stream threshold and translate" );
+
+    // caller's pool is kept between files, it may have fewer threads than stages
+    ThreadPool single(1);
+    ThreadPool pair(2);
+    ThresholdBand thresholdBand(100);
+    TranslateBand translateBand(4);
+    ok = processPGMStream("stream_test_in.pgm", "stream_test_out.pgm", thresholdBand, 5, single) == 0
+        &&  result.loadFromPGM("stream_test_out.pgm") == 0  &&  result == threshold(im1, 100);
+    ok = ok  &&  processPGMStream("stream_test_in.pgm", "stream_test_out.pgm", translateBand, 5, pair, -3) == 0
+        &&  result.loadFromPGM("stream_test_out.pgm") == 0  &&  result == translate(im1, -3, 4);
+    ok = ok  &&  processPGMStream("stream_test_in.pgm", "stream_test_out.pgm", thresholdBand, 7, pair) == 0
+        &&  result.loadFromPGM("stream_test_out.pgm") == 0  &&  result == threshold(im1, 100);
+    require( ok, "stream with caller's pool" );
+
+    bool binary = true;
+    require( isBinaryPGM("stream_test_in.pgm", binary, 8) == 0  &&  !binary, "stream NOT binary" );
+    thresholdPGM("stream_test_in.pgm", "stream_test_out.pgm", 100, 8);
+    require( isBinaryPGM("stream_test_out.pgm", binary, 8) == 0  &&  binary, "stream is binary" );
+
+    std::remove("stream_test_in.pgm");
+    std::remove("stream_test_out.pgm");
   }
 
   {
-    GrayImage im1(3, 3, "xoxxoxxxx");
-    im1.translateInplace(0, -1);
-    require( im1 == GrayImage(3,3,"oxooxoxxo") , "translate in place Binary, dx = -1");
+    GrayImagePipeline pipeline;
+    pipeline.threshold(100).translate(2, -3);
+    std::vector<std::string> inPaths, outPaths;
+    std::vector<GrayImage> expected;
+    for (int i = 0; i < 12; ++i)
+      {
+        std::ostringstream name;
+        name << "batch_test_" << i;
+        GrayImage im1(10 + i, 31 - i);
+        fillWithPattern(im1);
+        im1.saveToPGM(name.str() + "_in.pgm");
+        inPaths.push_back(name.str() + "_in.pgm");
+        outPaths.push_back(name.str() + "_out.pgm");
+        expected.push_back(pipeline.run(im1));
+      }
+    // missing input and file without output path
+    std::remove(inPaths[3].c_str());
+    inPaths[3] = "no_such_file.pgm";
+    outPaths[7].clear();
+
+    bool ok = true;
+    const int workers[] = { 1, 3 };
+    for (int w = 0; w < 2; ++w)
+      {
+        std::vector<int> statuses;
+        ok = ok  &&  processPGMBatch(inPaths, outPaths, pipeline, workers[w], &statuses) == -1;
+        for (size_t i = 0; i < inPaths.size(); ++i)
+          {
+            GrayImage result;
+            ok = ok  &&  statuses[i] == (i == 3 ? -1 : 0);
+            if (i != 3  &&  i != 7)
+              ok = ok  &&  result.loadFromPGM(outPaths[i]) == 0  &&  result == expected[i];
+            std::remove(outPaths[i].c_str());
+          }
+      }
+    require( ok, "batch runs pipeline on each file" );
+
+    inPaths.erase(inPaths.begin() + 3);
+    outPaths.erase(outPaths.begin() + 3);
+    require( processPGMBatch(inPaths, outPaths, pipeline) == 0, "batch succeeds for existing files");
+    for (size_t i = 0; i < inPaths.size(); ++i)
+      {
+        std::remove(inPaths[i].c_str());
+        std::remove(outPaths[i].c_str());
+      }
+  }
+  {
+    // pattern compresses with LZ, bottom rows are random, left columns uniform
+    GrayImage im1(300, 517);
+    fillWithPattern(im1);
+    uint32_t seed = 1;
+    for (int y = 260; y < 300; ++y)
+      for (int x = 0; x < 517; ++x)
+        {
+          seed = seed * 1103515245u + 12345u;
+          im1(y, x) = static_cast<GrayImage::pixel_t>(seed >> 16);
+        }
+    for (int y = 0; y < 128; ++y)
+      std::memset(im1.row(y), 9, 128);
+
+    TiledImageFile file;
+    GrayImage result;
+    ThreadPool pool(4);
+    require( saveTiled(im1, "tiled_test.gti", 64) == 0  &&  file.open("tiled_test.gti") == 0
+             &&  file.getHeight() == 300  &&  file.getWidth() == 517  &&  file.getTileSize() == 64
+             &&  file.read(result) == 0  &&  result == im1, "tiled save and read" );
+
+    bool ok = true;
+    const Tile regions[] = { {0, 0, 1, 1}, {63, 63, 2, 2}, {10, 100, 280, 300}, {299, 0, 1, 517},
+                             {250, 500, 50, 17}, {0, 0, 300, 517} };
+    for (int r = 0; r < 6; ++r)
+      {
+        const Tile& region = regions[r];
+        GrayImage expected(GrayImageView(im1, region.y, region.x, region.height, region.width));
+        ok = ok  &&  file.read(region, result) == 0  &&  result == expected;
+        ok = ok  &&  file.read(region, result, pool) == 0  &&  result == expected;
+      }
+    require( ok, "tiled read region" );
+
+    MappedFile raw;
+    require( saveTiled(GrayImageView(im1, 1, 2, 200, 300), "tiled_test.gti", 100, pool) == 0
+             &&  file.open("tiled_test.gti") == 0  &&  file.read(result) == 0
+             &&  result == GrayImage(GrayImageView(im1, 1, 2, 200, 300))
+             &&  raw.open("tiled_test.gti") == 0  &&  raw.size() < 200 * 300 / 5, "tiled save in parallel" );
+    raw.close();
+    file.close();
+
+    GrayImage mask(1000, 1000);
+    mask.fill(0);
+    for (int y = 100; y < 700; ++y)
+      std::memset(mask.row(y) + 250, 255, 333);
+    require( saveTiled(threshold(mask, 128), "tiled_test.gti") == 0  &&  raw.open("tiled_test.gti") == 0
+             &&  raw.size() < 1000 * 1000 / 1000, "tiled binary mask shrinks" );
+    raw.close();
+
+    // unknown codec of first tile and truncated file
+    std::string content;
+    {
+      std::ifstream ifs("tiled_test.gti", std::ios::binary);
+      std::ostringstream os;
+      os << ifs.rdbuf();
+      content = os.str();
+    }
+    {
+      std::ofstream ofs("tiled_test.gti", std::ios::binary);
+      ofs << content.substr(0, 32) << '\x07' << content.substr(33);
+    }
+    require( file.open("tiled_test.gti") == 0  &&  file.read(result) != 0, "tiled read corrupted tile" );
+    file.close();
+    {
+      std::ofstream ofs("tiled_test.gti", std::ios::binary);
+      ofs << content.substr(0, 40);
+    }
+    require( file.open("tiled_test.gti") != 0, "tiled open truncated index" );
+    std::remove("tiled_test.gti");
+    require( saveTiled(mask, "tiled_test.gti", 32769) != 0  &&  saveTiled(mask, "tiled_test.gti", 0) != 0,
+             "tiled save invalid tile size" );
   }
 
   {
-    GrayImage im1(3, 3, "xoxxoxxxx");
-    im1.translateInplace(0, -2);
-    require( im1 == GrayImage(3,3,"xooxooxoo"), "translate in place Binary, dx = -2" );
+    GrayImage im1(3, 5, "xxoxooxoxxoxxxo");
+    RleImage rle(im1);
+    require( rle.getRunCount() == 5  &&  rle.count() == 9  &&  rle.rowBegin(0)[0].x2 == 1
+             &&  rle.rowEnd(1) - rle.rowBegin(1) == 2  &&  rle.toGrayImage() == im1, "RLE from image" );
+    require( RleImage(BinaryImage(im1)) == rle  &&  rle != RleImage(3, 5)  &&  isBinary(rle),
+             "RLE equality" );
+    require( translate(rle, 1, -1).toGrayImage() == GrayImage(3, 5, "oooooxoxooxoxxo"),
+             "RLE translate" );
+
+    bool ok = true;
+    const int percents[] = { 3, 30, 55, 97 };
+    for (int p = 0; p < 4; ++p)
+      {
+        GrayImage noise(41, 77);
+        fillWithNoise(noise, percents[p], p + 1);
+        RleImage rleNoise(noise);
+        ok = ok  &&  rleNoise.toGrayImage() == noise;
+        ok = ok  &&  binaryFillHoles(rleNoise).toGrayImage() == binaryFillHoles(noise);
+        ok = ok  &&  binaryBackground(rleNoise).toGrayImage() == binaryBackground(noise);
+        const int shifts[][2] = { {0, 0}, {5, -3}, {-40, 76}, {41, 0}, {0, -77}, {-2, 9} };
+        for (int i = 0; i < 6; ++i)
+          ok = ok  &&  translate(rleNoise, shifts[i][0], shifts[i][1])
+              == RleImage(translate(noise, shifts[i][0], shifts[i][1]));
+      }
+    require( ok, "RLE same as byte per pixel operations" );
+    require( binaryFillHoles(RleImage()).getHeight() == 0  &&  RleImage().toGrayImage().getHeight() == 0,
+             "RLE of empty image" );
   }
 
   {
-    GrayImage im1(3, 3, "xoxxoxxxx");
-    im1.translateInplace(-2, 0);
-    require( im1 == GrayImage(3,3,"xxxoooooo"), "translate in place Binary, dy = -2" );
+    GrayImage im1(40, 70);
+    im1.trackChanges(16);
+    std::vector<Tile> tiles;
+    im1.getDirtyTiles(tiles);
+    require( im1.getDirtyTileSize() == 16  &&  tiles.size() == 15  &&  tiles[14].height == 8
+             &&  tiles[14].width == 6, "tracking starts with all tiles dirty" );
+    im1.clearDirty();
+    const GrayImage& cim1 = im1;
+    require( !im1.isDirty()  &&  cim1(39, 69) == 0  &&  !GrayImageView(im1).row(3)[0]  &&  !im1.isDirty(),
+             "reading keeps tiles clean" );
+    im1(20, 5) = 1;
+    require( !im1.isDirty(), "pixel access marks nothing" );
+    Tile pixel = { 20, 5, 1, 1 };
+    im1.markDirty(pixel);
+    im1.row(35)[2] = 1;
+    im1.getDirtyTiles(tiles);
+    require( tiles.size() == 6  &&  tiles[0].y == 16  &&  tiles[0].x == 0  &&  tiles[1].y == 32
+             &&  tiles[5].x == 64  &&  tiles[5].width == 6, "writes mark tiles" );
+    im1.clearDirty();
+    Tile region = { 10, 60, 100, 3 };
+    im1.markDirty(region);
+    im1.getDirtyTiles(tiles);
+    require( tiles.size() == 3  &&  tiles[0].x == 48  &&  tiles[2].y == 32, "mark region dirty" );
+    im1.clearDirty();
+    im1.data();
+    im1.getDirtyTiles(tiles);
+    require( tiles.size() == 15, "data marks all tiles" );
+    im1.clearDirty();
+    im1.rotateCw90();
+    im1.getDirtyTiles(tiles);
+    require( tiles.size() == 15  &&  tiles[14].height == 6, "rotation refits tiles" );
+    im1.trackChanges(0);
+    im1(0, 0) = 1;
+    require( !im1.isDirty()  &&  im1.getDirtyTileSize() == 0, "tracking off" );
   }
 
   {
-    GrayImage im1(3, 3, "xoxxoxxxx");
-    im1.translateInplace(-2, -2);
-    require( im1 == GrayImage(3,3,"xoooooooo"), "translate in place Binary, dx = -2, dy -2" );
+    // ring with gap closed and opened again, then big changes
+    GrayImage mask(30, 30);
+    for (int i = 5; i < 25; ++i)
+      mask(5, i) = mask(24, i) = mask(i, 5) = mask(i, 24) = 255;
+    mask(24, 12) = 0;
+    mask.trackChanges(8);
+    FillHolesUpdater updater;
+    GrayImage filled;
+    updater.update(mask, filled);
+    bool ok = filled == binaryFillHoles(mask)  &&  !mask.isDirty();
+    filled.trackChanges(8);
+    Tile gap = { 24, 12, 1, 1 };
+    mask(24, 12) = 255;
+    mask.markDirty(gap);
+    updater.update(mask, filled);
+    ok = ok  &&  filled == binaryFillHoles(mask)  &&  filled(15, 15) == 255  &&  filled.isDirty();
+    mask(24, 12) = 0;
+    mask.markDirty(gap);
+    updater.update(mask, filled);
+    ok = ok  &&  filled == binaryFillHoles(mask)  &&  filled(15, 15) == 0;
+    require( ok, "incremental fill closes and opens hole" );
+
+    // random rectangles and lines over noise
+    GrayImage frame(61, 83);
+    fillWithNoise(frame, 45, 7);
+    frame.trackChanges(16);
+    GrayImage thresholded, expectedFill;
+    FillHolesUpdater noiseUpdater;
+    uint32_t seed = 11;
+    for (int step = 0; step < 300; ++step)
+      {
+        seed = seed * 1103515245u + 12345u;
+        int y = (seed >> 8) % 61;
+        int x = (seed >> 16) % 83;
+        int size = (seed >> 24) % 12 + 1;
+        GrayImage::pixel_t value = (seed >> 4) % 2 ? 255 : 0;
+        if (step % 7 == 0)
+          std::fill(frame.rowBegin(y), frame.rowEnd(y), value);
+        else
+          {
+            for (int v = y; v < std::min(61, y + size); ++v)
+              for (int u = x; u < std::min(83, x + size); ++u)
+                frame(v, u) = value;
+            Tile square = { y, x, size, size };
+            frame.markDirty(square);
+          }
+
+        updateThreshold(frame, 128, thresholded);
+        if (step == 0)
+          thresholded.trackChanges(16);
+        noiseUpdater.update(thresholded, expectedFill);
+        ok = ok  &&  thresholded == threshold(frame, 128)
+            &&  expectedFill == binaryFillHoles(thresholded);
+      }
+    require( ok, "incremental threshold and fill same as full" );
+
+    // frame buffer filled through one saved pointer is not tracked by itself
+    GrayImage feed(40, 50);
+    feed.trackChanges(16);
+    GrayImage::pixel_t* pixels = feed.data();
+    GrayImage feedMask;
+    updateThreshold(feed, 128, feedMask);
+    std::memset(pixels + 20 * 50, 200, 50);
+    bool stale = !feed.isDirty();
+    Tile written = { 20, 0, 1, 50 };
+    feed.markDirty(written);
+    updateThreshold(feed, 128, feedMask);
+    require( stale  &&  feedMask == threshold(feed, 128), "incremental threshold of saved pointer writes" );
   }
 
   {
-    GrayImage im1(3, 3, "xoxxoxxxx");
-    im1.translateInplace(1, 0);
-    require( im1 == GrayImage(3,3,"oooxoxxox"), "translate in place Binary, dy = 1" );
+    GrayImage im1(3, 4);
+    fillWithPattern(im1);
+    GrayImage im2 = im1;
+    const GrayImage& cim1 = im1;
+    uint64_t hash = cim1.hash();
+    require( hash == im2.hash()  &&  im1 == im2  &&  GrayImage(4, 3).hash() != GrayImage(3, 4).hash()
+             &&  GrayImage().hash() == GrayImage().hash(), "hash depends on size and pixels" );
+    im1(2, 3) = 0;
+    require( cim1.hash() != hash  &&  im1 != im2, "write forgets hash" );
+    im1(2, 3) = im2(2, 3);
+    require( cim1.hash() == hash  &&  im1 == im2, "hash of restored image" );
+    im1.rotateCw90();
+    im1.rotateCcw90();
+    im1.fill(1);
+    require( cim1.hash() != hash  &&  im1 != im2, "fill forgets hash" );
+    im1 = im2;
+    require( hashEquals(im1, im2)  &&  !hashEquals(im1, GrayImage(3, 4))  &&  !hashEquals(im1, GrayImage(4, 3)),
+             "hash equals" );
+
+    // write through kept pointer is announced by markDirty(), then cached
+    // hash is not used by equality
+    GrayImage::pixel_t* kept = im1.data();
+    cim1.hash();
+    im2.hash();
+    kept[0] = 1;
+    im1.markDirty();
+    im2(0, 0) = 1;
+    im2.hash();
+    require( im1 == im2  &&  cim1.hash() == im2.hash(), "mark dirty forgets hash" );
+    GrayImage binary(2, 2);
+    binary.fill(255);
+    require( isBinary(binary), "filled image is binary" );
+    kept = binary.data();
+    kept[3] = 7;
+    Tile last = { 1, 1, 1, 1 };
+    binary.markDirty(last);
+    require( !isBinary(binary), "mark dirty forgets binary flag" );
+
+    GrayImage noise(37, 101);
+    fillWithNoise(noise, 50, 3);
+    const int points[][2] = { {0, 0}, {5, 31}, {5, 32}, {20, 100}, {36, 64}, {11, 95} };
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_NEON };
+    bool ok = true;
+    for (int l = 0; l < 4; ++l)
+      {
+        if (setSimdLevel(levels[l]) != levels[l])
+          continue;
+
+        GrayImage changed = noise;
+        ImageDiff none = diff(noise, changed);
+        ok = ok  &&  none.count == 0  &&  none.bounds.height == 0  &&  none.bounds.width == 0;
+        for (int p = 1; p < 6; ++p)
+          {
+            changed(points[p][0], points[p][1]) ^= 1;
+            ImageDiff difference = diff(noise, changed);
+            int top = 37, left = 101, bottom = -1, right = -1;
+            for (int i = 1; i <= p; ++i)
+              {
+                top = std::min(top, points[i][0]);
+                left = std::min(left, points[i][1]);
+                bottom = std::max(bottom, points[i][0]);
+                right = std::max(right, points[i][1]);
+              }
+            ok = ok  &&  difference.count == static_cast<size_t>(p)  &&  difference.bounds.y == top
+                &&  difference.bounds.x == left  &&  difference.bounds.height == bottom - top + 1
+                &&  difference.bounds.width == right - left + 1;
+          }
+        changed(0, 0) ^= 1;
+        ImageDiff corner = diff(GrayImageView(noise, 0, 0, 6, 33), GrayImageView(changed, 0, 0, 6, 33));
+        ok = ok  &&  corner.count == 3  &&  corner.bounds.y == 0  &&  corner.bounds.x == 0
+            &&  corner.bounds.height == 6  &&  corner.bounds.width == 33;
+      }
+    setSimdLevel(supportedSimdLevel());
+    require( ok, "diff SIMD same as scalar" );
+
+    std::string failed = failedTests;
+    requireEqual(GrayImage(2, 3, "xxxooo"), GrayImage(2, 3, "xxxoox"), "probe");
+    requireEqual(GrayImage(2, 3), GrayImage(3, 2), "probe");
+    bool reported = failedTests == failed + "probe: 1 pixels differ in 1x1 at (1, 2), first (1, 2) is 0,"
+        " expected 255\nprobe: size 2x3, expected 3x2\n";
+    failedTests = failed;
+    require( reported, "require equal reports difference" );
   }
 
   {
-    GrayImage im1(3, 3, "xoxxoxxxx");
-    im1.translateInplace(0, 1);
-    require(im1 == GrayImage(3, 3, "oxooxooxx"), "translate in place Binary, dx = 1");
+    GrayImage im1(1, 2);
+    im1(0, 1) = 255;
+    GrayImage shifted = translateSubpixel(im1, 0, 0.5);
+    require( shifted(0, 0) == 0  &&  shifted(0, 1) == 128, "subpixel translate blends neighbors" );
+    shifted = translateSubpixel(im1, 0, -0.25, BORDER_REPLICATE);
+    require( shifted(0, 0) == 64  &&  shifted(0, 1) == 255, "subpixel translate replicates border" );
+
+    GrayImage noise(23, 77);
+    fillWithPattern(noise);
+    bool ok = true;
+    const int whole[][2] = { {0, 0}, {3, -5}, {-22, 76}, {23, 0}, {-1, -80} };
+    for (int i = 0; i < 5; ++i)
+      ok = ok  &&  translateSubpixel(noise, whole[i][0], whole[i][1])
+          == translate(noise, whole[i][0], whole[i][1]);
+    ok = ok  &&  translateSubpixel(noise, 23, -154, BORDER_WRAP) == noise;
+    require( ok, "subpixel translate by whole pixels" );
+
+    ThreadPool pool(3);
+    const double shifts[][2] = { {0.5, -0.25}, {-3.75, 10.1}, {30, -100.5}, {0, 1.0 / 256},
+                                 {-0.9, 0}, {24.5, 200.3}, {-7.125, -76.5} };
+    const BorderMode modes[] = { BORDER_CONSTANT, BORDER_REPLICATE, BORDER_WRAP };
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_NEON };
+    for (int l = 0; l < 4; ++l)
+      {
+        if (setSimdLevel(levels[l]) != levels[l])
+          continue;
+
+        for (int m = 0; m < 3; ++m)
+          for (int i = 0; i < 7; ++i)
+            {
+              GrayImage expected = translateSubpixelPerPixel(noise, shifts[i][0], shifts[i][1],
+                                                             modes[m], 77);
+              GrayImage parallel;
+              translateSubpixel(noise, shifts[i][0], shifts[i][1], parallel, pool, modes[m], 77);
+              ok = ok  &&  translateSubpixel(noise, shifts[i][0], shifts[i][1], modes[m], 77) == expected
+                  &&  parallel == expected;
+            }
+      }
+    setSimdLevel(supportedSimdLevel());
+    require( ok, "subpixel translate SIMD same as per pixel" );
   }
 
   {
-    GrayImage im1(3, 3, "xoxxoxxxx");
-    im1.translateInplace(1, 1);
-    require(im1 == GrayImage(3, 3, "ooooxooxo"), "translate in place Binary, dx = 1, dy = 1");
+    GrayImage im1(5, 5);
+    fillWithPattern(im1);
+    GrayImage rotated = im1;
+    rotated.rotateCw90();
+    requireEqual(warpAffine(im1, rotation(90, 2, 2)), rotated, "warp rotation by 90 degrees");
+    requireEqual(warpAffine(im1, rotation(90, 2, 2), INTERPOLATION_NEAREST), rotated,
+                 "warp rotation by 90 degrees nearest");
+    AffineTransform inverse;
+    AffineTransform turn = rotation(33, 1, 2) * scaling(2, 0.5) * shear(0.25, 0);
+    require( invert(turn, inverse) == 0  &&  std::fabs((inverse * turn).yy - 1) < 1e-12
+             &&  std::fabs((turn * inverse).x0) < 1e-12  &&  invert(scaling(0, 1), inverse) != 0,
+             "invert affine transform" );
+    GrayImage flat(5, 5);
+    flat.fill(7);
+    GrayImage singular;
+    ThreadPool workers(2);
+    warpAffine(im1, scaling(0, 1), 5, 5, singular, workers, INTERPOLATION_BILINEAR, BORDER_CONSTANT, 7);
+    require( warpAffine(im1, scaling(0, 1)) == GrayImage(5, 5)  &&  singular == flat
+             &&  warpAffine(im1, scaling(1, 0), INTERPOLATION_NEAREST, BORDER_WRAP) == GrayImage(5, 5),
+             "warp by singular transform" );
+
+    GrayImage noise(45, 83);
+    fillWithNoise(noise, 50, 9);
+    requireEqual(warpAffine(noise, translation(2.25, -3.5), INTERPOLATION_BILINEAR, BORDER_WRAP),
+                 translateSubpixel(noise, 2.25, -3.5, BORDER_WRAP), "warp translation");
+
+    ThreadPool pool(3);
+    const AffineTransform transforms[] = { rotation(-1.7, 20, 40), rotation(140, 0, 0),
+                                           scaling(1.3, 0.7) * translation(-5.1, 70),
+                                           shear(0.1, -0.4) };
+    const BorderMode modes[] = { BORDER_CONSTANT, BORDER_REPLICATE, BORDER_WRAP };
+    const SimdLevel levels[] = { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_NEON };
+    bool ok = true;
+    for (int l = 0; l < 4; ++l)
+      {
+        if (setSimdLevel(levels[l]) != levels[l])
+          continue;
+
+        for (int t = 0; t < 4; ++t)
+          for (int m = 0; m < 3; ++m)
+            for (int i = 0; i < 2; ++i)
+              {
+                Interpolation interpolation = i ? INTERPOLATION_BILINEAR : INTERPOLATION_NEAREST;
+                GrayImage expected = warpAffinePerPixel(noise, transforms[t], interpolation, modes[m], 99);
+                GrayImage parallel;
+                warpAffine(noise, transforms[t], 45, 83, parallel, pool, interpolation, modes[m], 99);
+                ok = ok  &&  warpAffine(noise, transforms[t], interpolation, modes[m], 99) == expected
+                    &&  parallel == expected;
+              }
+      }
+    setSimdLevel(supportedSimdLevel());
+    require( ok, "warp SIMD and tiles same as per pixel" );
+
+    GrayImage larger;
+    warpAffine(im1, scaling(2, 3), 10, 15, larger, INTERPOLATION_NEAREST);
+    require( larger.getHeight() == 10  &&  larger(8, 12) == im1(4, 4)  &&  larger(9, 14) == 0  &&  larger(2, 4) == im1(1, 1),
+             "warp into larger image" );
   }
 
+
   {
-    GrayImage im1(3, 3, "xoxxoxxxx");
-    im1.translateInplace(2, 2);
-    require(im1 == GrayImage(3, 3, "oooooooox"), "translate in place Binary, dx = 2, dy = 2");
+    class ThresholdChunks : public ParallelTask
+    {
+    public:
+      explicit ThresholdChunks(const GrayImage& image)
+        : image_(image) {}
+
+      void run(int begin, int end)
+      {
+        for (int i = begin; i < end; ++i)
+          threshold(image_, 128);
+      }
+
+    private:
+      const GrayImage& image_;
+    };
+
+    GrayImage noise(40, 50);
+    fillWithNoise(noise, 30, 11);
+    resetInstrumentation();
+    GrayImage filled = binaryFillHoles(threshold(noise, 128));
+    OperationStats stats[OP_COUNT];
+    getInstrumentation(stats);
+    const OperationStats& thr = stats[OP_THRESHOLD];
+    const OperationStats& lut = stats[OP_APPLY_LUT];
+    const OperationStats& fill = stats[OP_FILL_HOLES];
+    const OperationStats& background = stats[OP_BACKGROUND];
+    if (!instrumentationEnabled())
+      require( !thr.calls  &&  !fill.calls  &&  !thr.nanoseconds, "instrumentation compiled out" );
+    else
+      {
+        require( thr.calls == 1  &&  thr.pixels == 2000  &&  thr.bytes == 4000  &&  lut.calls == 1
+                 &&  fill.calls == 1  &&  background.calls == 1  &&  !stats[OP_TRANSLATE].calls,
+                 "instrumentation counts" );
+        require( thr.selfNanoseconds + lut.nanoseconds == thr.nanoseconds
+                 &&  background.nanoseconds <= fill.nanoseconds  &&  fill.selfNanoseconds <= fill.nanoseconds,
+                 "instrumentation self time" );
+
+        ThreadPool workers(4);
+        GrayImage moved;
+        translate(noise, 0, 0, moved, workers);
+        ThresholdChunks task(noise);
+        workers.parallelFor(16, 1, task);
+        getInstrumentation(stats);
+        require( stats[OP_TRANSLATE].calls == 1  &&  thr.calls == 17  &&  thr.pixels == 17 * 2000,
+                 "instrumentation sums threads" );
+
+        std::ostringstream text, json;
+        writeInstrumentationText(text);
+        writeInstrumentationJson(json);
+        require( text.str().find("\nthreshold                    17         34000") != std::string::npos
+                 &&  json.str().find("{\"name\": \"threshold\", \"calls\": 17, \"pixels\": 34000, \"bytes\": 68000")
+                     != std::string::npos  &&  json.str().find("histogram") == std::string::npos,
+                 "instrumentation export" );
+
+        resetInstrumentation();
+        getInstrumentation(stats);
+        require( !thr.calls  &&  !thr.nanoseconds, "instrumentation reset" );
+      }
   }
 
   {
-    GrayImage im1, im2;
-    im1.loadFromPGM("pic1.pgm");
-    im2.loadFromPGM("pic1dx-1.pgm");
-    im1.translateInplace(0, -1);
-    require(im1 == im2, "translate in place PGM, dx = -1");
+    GrayImage pattern(32, 32);
+    fillWithPattern(pattern);
+    GrayImage mask = threshold(pattern, 128);
+    require( fixedMatchesGray<8, 8>(pattern, 100, 2, -3)  &&  fixedMatchesGray<16, 16>(pattern, 128, -5, 7)
+             &&  fixedMatchesGray<32, 32>(pattern, 200, 31, 0)  &&  fixedMatchesGray<8, 16>(pattern, 50, 0, 0)
+             &&  fixedMatchesGray<16, 16>(pattern, 128, 16, -16)  &&  fixedMatchesGray<16, 16>(mask, 128, 1, 1),
+             "fixed image kernels" );
+
+    FixedImage<float, 8, 8> patch;
+    patch(7, 7) = 0.75f;
+    FixedImage<float, 8, 8> moved = translate(threshold(patch, 0.5f), -7, -6);
+    require( !isBinary(patch)  &&  isBinary(moved)  &&  moved(0, 1) == 1.0f  &&  moved(0, 0) == 0.0f,
+             "fixed float image" );
+
+    GrayImage thresholded;
+    threshold(pattern, static_cast<uint8_t>(128), thresholded);
+    requireEqual(thresholded, mask, "gray image through template");
   }
 
   {
-    GrayImage im1, im2;
-    im1.loadFromPGM("pic1.pgm");
-    im2.loadFromPGM("pic1dx1dy2.pgm");
-    im1.translateInplace(2, 1);
-    require(im1 == im2, "translate in place PGM, dx = 1, dy = 2");
+    Image<uint16_t> deep(3, 4);
+    Image<float> real(3, 4);
+    for (int y = 0; y < 3; ++y)
+      for (int x = 0; x < 4; ++x)
+        {
+          deep(y, x) = static_cast<uint16_t>((y * 4 + x) * 5000);
+          real(y, x) = deep(y, x) / 65535.0f;
+        }
+
+    Image<uint16_t> deepMask = threshold(deep, 30000);
+    Image<float> realMask = threshold(real, 0.5f);
+    require( !isBinary(deep)  &&  isBinary(deepMask)  &&  deepMask(1, 1) == 0  &&  deepMask(1, 2) == 65535
+             &&  isBinary(realMask)  &&  realMask(1, 2) == 0.0f  &&  realMask(1, 3) == 1.0f,
+             "threshold 16-bit and float" );
+
+    Image<float> moved = translate(real, 1, -1);
+    require( moved(0, 0) == 0.0f  &&  moved(1, 0) == real(0, 1)  &&  moved(2, 2) == real(1, 3)
+             &&  moved(2, 3) == 0.0f  &&  !isBinary(Image<float>())  &&  !translate(deep, 3, 0)(2, 3),
+             "translate 16-bit and float" );
   }
 
 